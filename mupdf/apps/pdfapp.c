@@ -320,6 +320,7 @@ static int pdfapp_save(pdfapp_t *app)
 		opts.do_expand = 0;
 		opts.do_garbage = 1;
 		opts.do_linear = 0;
+		opts.do_incremental = 0;
 
 		if (strcmp(buf, app->docpath) == 0)
 		{
@@ -28,6 +28,7 @@ static void usage(void)
 		"\t-i\ttoggle decompression of image streams\n"
 		"\t-f\ttoggle decompression of font streams\n"
 		"\t-a\tascii hex encode binary streams\n"
+		"\t-u\tappend changes as incremental update\n"
 		"\tpages\tcomma separated list of ranges\n");
 	exit(1);
 }
@@ -167,8 +168,9 @@ int pdfclean_main(int argc, char **argv)
 	opts.do_expand = 0;
 	opts.do_ascii = 0;
 	opts.do_linear = 0;
+	opts.do_incremental = 0;
 
-	while ((c = fz_getopt(argc, argv, "adfgilp:")) != -1)
+	while ((c = fz_getopt(argc, argv, "adfgilp:u")) != -1)
 	{
 		switch (c)
 		{
@@ -179,6 +181,7 @@ int pdfclean_main(int argc, char **argv)
 		case 'i': opts.do_expand ^= fz_expand_images; break;
 		case 'l': opts.do_linear ++; break;
 		case 'a': opts.do_ascii ++; break;
+		case 'u': opts.do_incremental ++; break;
 		default: usage(); break;
 		}
 	}
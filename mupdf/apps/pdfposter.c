@@ -138,6 +138,8 @@ int pdfposter_main(int argc, char **argv)
 	opts.do_garbage = 0;
 	opts.do_expand = 0;
 	opts.do_ascii = 0;
+	opts.do_linear = 0;
+	opts.do_incremental = 0;
 
 	while ((c = fz_getopt(argc, argv, "x:y:")) != -1)
 	{
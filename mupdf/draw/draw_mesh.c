@@ -1,5 +1,11 @@
 #include "fitz-internal.h"
 
+/* SumatraPDF: SSE2 is always available on x64 and where the compiler targets it */
+#if defined(_M_X64) || defined(__x86_64__) || defined(__SSE2__) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define HAVE_SSE2
+#include <emmintrin.h>
+#endif
+
 /*
  * polygon clipping
  */
@@ -144,6 +150,68 @@ static void paint_scan(fz_pixmap *pix, int y, int x1, int x2, int *v1, int *v2,
 		dv[k] = (v2[k] - v1[k]) / w;
 	}
 
+	/* SumatraPDF: fast paths for RGB and gray destinations */
+	if (n == 3)
+	{
+#ifdef HAVE_SSE2
+		/* interpolate all four channels of four pixels at once */
+		__m128i dd = _mm_set_epi32(0, dv[2], dv[1], dv[0]);
+		__m128i dd4 = _mm_slli_epi32(dd, 2);
+		__m128i v0 = _mm_set_epi32(255 << 16, v[2], v[1], v[0]);
+		__m128i va = _mm_add_epi32(v0, dd);
+		__m128i vb = _mm_add_epi32(va, dd);
+		__m128i vc = _mm_add_epi32(vb, dd);
+		int px;
+
+		for (; w >= 4; w -= 4)
+		{
+			__m128i lo = _mm_packs_epi32(_mm_srai_epi32(v0, 16), _mm_srai_epi32(va, 16));
+			__m128i hi = _mm_packs_epi32(_mm_srai_epi32(vb, 16), _mm_srai_epi32(vc, 16));
+			_mm_storeu_si128((__m128i *)p, _mm_packus_epi16(lo, hi));
+			p += 16;
+			v0 = _mm_add_epi32(v0, dd4);
+			va = _mm_add_epi32(va, dd4);
+			vb = _mm_add_epi32(vb, dd4);
+			vc = _mm_add_epi32(vc, dd4);
+		}
+		while (w--)
+		{
+			__m128i c = _mm_packs_epi32(_mm_srai_epi32(v0, 16), v0);
+			px = _mm_cvtsi128_si32(_mm_packus_epi16(c, c));
+			memcpy(p, &px, 4);
+			p += 4;
+			v0 = _mm_add_epi32(v0, dd);
+		}
+#else
+		int r = v[0], g = v[1], b = v[2];
+		int dr = dv[0], dg = dv[1], db = dv[2];
+		while (w--)
+		{
+			p[0] = r >> 16;
+			p[1] = g >> 16;
+			p[2] = b >> 16;
+			p[3] = 255;
+			p += 4;
+			r += dr;
+			g += dg;
+			b += db;
+		}
+#endif
+		return;
+	}
+	if (n == 1)
+	{
+		int g = v[0], dg = dv[0];
+		while (w--)
+		{
+			p[0] = g >> 16;
+			p[1] = 255;
+			p += 2;
+			g += dg;
+		}
+		return;
+	}
+
 	while (w--)
 	{
 		for (k = 0; k < n; k++)
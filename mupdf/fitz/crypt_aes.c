@@ -173,6 +173,191 @@ static void aes_gen_tables( void )
 	}
 }
 
+/*
+ * Hardware accelerated code paths: AES-NI on x86/x64 (selected at
+ * runtime through CPUID) and the ARMv8 Crypto Extensions (selected at
+ * compile time when the target architecture guarantees them).
+ *
+ * Both use the same round keys as the table based code (the decryption
+ * key schedule above already is the "equivalent inverse cipher" one)
+ * only stored as 16 byte blocks in ctx->hwrk.
+ */
+#if defined(_MSC_VER) && _MSC_VER >= 1500 && (defined(_M_IX86) || defined(_M_X64))
+#include <intrin.h>
+#include <wmmintrin.h>
+#define AES_HW_AESNI
+#define AES_HW_TARGET
+#elif (defined(__clang__) || (defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)))) && \
+	(defined(__i386__) || defined(__x86_64__))
+#include <cpuid.h>
+#include <wmmintrin.h>
+#define AES_HW_AESNI
+#define AES_HW_TARGET __attribute__((target("aes,sse2")))
+#elif defined(__ARM_FEATURE_CRYPTO) && (defined(__aarch64__) || defined(__arm__))
+#include <arm_neon.h>
+#define AES_HW_ARMV8
+#endif
+
+static int aes_hw_available( void )
+{
+#if defined(AES_HW_AESNI)
+	/* -1: not yet determined (racing initializations are harmless) */
+	static int has_aesni = -1;
+	if( has_aesni < 0 )
+	{
+#if defined(_MSC_VER)
+		int info[4];
+		__cpuid( info, 1 );
+		has_aesni = ( info[2] & ( 1 << 25 ) ) != 0;
+#else
+		unsigned int eax, ebx, ecx, edx;
+		has_aesni = __get_cpuid( 1, &eax, &ebx, &ecx, &edx ) && ( ecx & ( 1 << 25 ) ) != 0;
+#endif
+	}
+	return has_aesni;
+#elif defined(AES_HW_ARMV8)
+	return 1;
+#else
+	return 0;
+#endif
+}
+
+static void aes_hw_setkey( aes_context *ctx )
+{
+	int i;
+
+	ctx->hw = aes_hw_available();
+	if( !ctx->hw )
+		return;
+
+	for( i = 0; i < ( ctx->nr + 1 ) * 4; i++ )
+	{
+		PUT_ULONG_LE( ctx->rk[i], ctx->hwrk, i << 2 );
+	}
+}
+
+#if defined(AES_HW_AESNI)
+
+static AES_HW_TARGET void aes_hw_crypt_cbc( aes_context *ctx,
+	int mode,
+	int length,
+	unsigned char iv[16],
+	const unsigned char *input,
+	unsigned char *output )
+{
+	__m128i rk[15], state, last, b0, b1, b2, b3, c0, c1, c2, c3;
+	int i, nr = ctx->nr;
+
+	for( i = 0; i <= nr; i++ )
+		rk[i] = _mm_loadu_si128( (const __m128i *)( ctx->hwrk + i * 16 ) );
+	last = _mm_loadu_si128( (const __m128i *)iv );
+
+	if( mode == AES_DECRYPT )
+	{
+		/* CBC decryption has no dependency between blocks, so keep
+		 * four of them in flight to hide the instruction latency */
+		for( ; length >= 64; length -= 64, input += 64, output += 64 )
+		{
+			c0 = _mm_loadu_si128( (const __m128i *)( input ) );
+			c1 = _mm_loadu_si128( (const __m128i *)( input + 16 ) );
+			c2 = _mm_loadu_si128( (const __m128i *)( input + 32 ) );
+			c3 = _mm_loadu_si128( (const __m128i *)( input + 48 ) );
+			b0 = _mm_xor_si128( c0, rk[0] );
+			b1 = _mm_xor_si128( c1, rk[0] );
+			b2 = _mm_xor_si128( c2, rk[0] );
+			b3 = _mm_xor_si128( c3, rk[0] );
+			for( i = 1; i < nr; i++ )
+			{
+				b0 = _mm_aesdec_si128( b0, rk[i] );
+				b1 = _mm_aesdec_si128( b1, rk[i] );
+				b2 = _mm_aesdec_si128( b2, rk[i] );
+				b3 = _mm_aesdec_si128( b3, rk[i] );
+			}
+			b0 = _mm_xor_si128( _mm_aesdeclast_si128( b0, rk[nr] ), last );
+			b1 = _mm_xor_si128( _mm_aesdeclast_si128( b1, rk[nr] ), c0 );
+			b2 = _mm_xor_si128( _mm_aesdeclast_si128( b2, rk[nr] ), c1 );
+			b3 = _mm_xor_si128( _mm_aesdeclast_si128( b3, rk[nr] ), c2 );
+			_mm_storeu_si128( (__m128i *)( output ), b0 );
+			_mm_storeu_si128( (__m128i *)( output + 16 ), b1 );
+			_mm_storeu_si128( (__m128i *)( output + 32 ), b2 );
+			_mm_storeu_si128( (__m128i *)( output + 48 ), b3 );
+			last = c3;
+		}
+		for( ; length > 0; length -= 16, input += 16, output += 16 )
+		{
+			c0 = _mm_loadu_si128( (const __m128i *)input );
+			state = _mm_xor_si128( c0, rk[0] );
+			for( i = 1; i < nr; i++ )
+				state = _mm_aesdec_si128( state, rk[i] );
+			state = _mm_xor_si128( _mm_aesdeclast_si128( state, rk[nr] ), last );
+			_mm_storeu_si128( (__m128i *)output, state );
+			last = c0;
+		}
+	}
+	else
+	{
+		for( ; length > 0; length -= 16, input += 16, output += 16 )
+		{
+			state = _mm_xor_si128( _mm_loadu_si128( (const __m128i *)input ), last );
+			state = _mm_xor_si128( state, rk[0] );
+			for( i = 1; i < nr; i++ )
+				state = _mm_aesenc_si128( state, rk[i] );
+			last = _mm_aesenclast_si128( state, rk[nr] );
+			_mm_storeu_si128( (__m128i *)output, last );
+		}
+	}
+
+	_mm_storeu_si128( (__m128i *)iv, last );
+}
+
+#elif defined(AES_HW_ARMV8)
+
+static void aes_hw_crypt_cbc( aes_context *ctx,
+	int mode,
+	int length,
+	unsigned char iv[16],
+	const unsigned char *input,
+	unsigned char *output )
+{
+	uint8x16_t rk[15], state, last, c;
+	int i, nr = ctx->nr;
+
+	for( i = 0; i <= nr; i++ )
+		rk[i] = vld1q_u8( ctx->hwrk + i * 16 );
+	last = vld1q_u8( iv );
+
+	/* AESE/AESD include the round key addition before (Inv)SubBytes,
+	 * so the key usage is shifted by one round compared to AES-NI */
+	if( mode == AES_DECRYPT )
+	{
+		for( ; length > 0; length -= 16, input += 16, output += 16 )
+		{
+			c = vld1q_u8( input );
+			state = c;
+			for( i = 0; i < nr - 1; i++ )
+				state = vaesimcq_u8( vaesdq_u8( state, rk[i] ) );
+			state = veorq_u8( vaesdq_u8( state, rk[nr - 1] ), rk[nr] );
+			vst1q_u8( output, veorq_u8( state, last ) );
+			last = c;
+		}
+	}
+	else
+	{
+		for( ; length > 0; length -= 16, input += 16, output += 16 )
+		{
+			state = veorq_u8( vld1q_u8( input ), last );
+			for( i = 0; i < nr - 1; i++ )
+				state = vaesmcq_u8( vaeseq_u8( state, rk[i] ) );
+			last = veorq_u8( vaeseq_u8( state, rk[nr - 1] ), rk[nr] );
+			vst1q_u8( output, last );
+		}
+	}
+
+	vst1q_u8( iv, last );
+}
+
+#endif
+
 /*
  * AES key schedule (encryption)
  */
@@ -274,6 +459,8 @@ int aes_setkey_enc( aes_context *ctx, const unsigned char *key, int keysize )
 
 		break;
 	}
+
+	aes_hw_setkey( ctx );
 	return 0;
 }
 
@@ -328,6 +515,8 @@ int aes_setkey_dec(aes_context *ctx, const unsigned char *key, int keysize)
 	*RK++ = *SK++;
 
 	memset( &cty, 0, sizeof( aes_context ) );
+
+	aes_hw_setkey( ctx );
 	return 0;
 }
 
@@ -491,6 +680,14 @@ void aes_crypt_cbc( aes_context *ctx,
 	}
 #endif
 
+#if defined(AES_HW_AESNI) || defined(AES_HW_ARMV8)
+	if( ctx->hw )
+	{
+		aes_hw_crypt_cbc( ctx, mode, length, iv, input, output );
+		return;
+	}
+#endif
+
 	if( mode == AES_DECRYPT )
 	{
 		while( length > 0 )
@@ -567,3 +764,98 @@ void aes_crypt_cfb( aes_context *ctx,
 
 	*iv_off = n;
 }
+
+/*
+ * SumatraPDF: known answer tests from NIST SP 800-38A (F.2.1 to F.2.6)
+ * for both the hardware accelerated and the table based code path
+ */
+static const unsigned char aes_test_plain[64] =
+{
+	0x6b, 0xc1, 0xbe, 0xe2, 0x2e, 0x40, 0x9f, 0x96, 0xe9, 0x3d, 0x7e, 0x11, 0x73, 0x93, 0x17, 0x2a,
+	0xae, 0x2d, 0x8a, 0x57, 0x1e, 0x03, 0xac, 0x9c, 0x9e, 0xb7, 0x6f, 0xac, 0x45, 0xaf, 0x8e, 0x51,
+	0x30, 0xc8, 0x1c, 0x46, 0xa3, 0x5c, 0xe4, 0x11, 0xe5, 0xfb, 0xc1, 0x19, 0x1a, 0x0a, 0x52, 0xef,
+	0xf6, 0x9f, 0x24, 0x45, 0xdf, 0x4f, 0x9b, 0x17, 0xad, 0x2b, 0x41, 0x7b, 0xe6, 0x6c, 0x37, 0x10
+};
+
+static const unsigned char aes_test_key128[16] =
+{
+	0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6, 0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c
+};
+
+static const unsigned char aes_test_cipher128[64] =
+{
+	0x76, 0x49, 0xab, 0xac, 0x81, 0x19, 0xb2, 0x46, 0xce, 0xe9, 0x8e, 0x9b, 0x12, 0xe9, 0x19, 0x7d,
+	0x50, 0x86, 0xcb, 0x9b, 0x50, 0x72, 0x19, 0xee, 0x95, 0xdb, 0x11, 0x3a, 0x91, 0x76, 0x78, 0xb2,
+	0x73, 0xbe, 0xd6, 0xb8, 0xe3, 0xc1, 0x74, 0x3b, 0x71, 0x16, 0xe6, 0x9e, 0x22, 0x22, 0x95, 0x16,
+	0x3f, 0xf1, 0xca, 0xa1, 0x68, 0x1f, 0xac, 0x09, 0x12, 0x0e, 0xca, 0x30, 0x75, 0x86, 0xe1, 0xa7
+};
+
+static const unsigned char aes_test_key256[32] =
+{
+	0x60, 0x3d, 0xeb, 0x10, 0x15, 0xca, 0x71, 0xbe, 0x2b, 0x73, 0xae, 0xf0, 0x85, 0x7d, 0x77, 0x81,
+	0x1f, 0x35, 0x2c, 0x07, 0x3b, 0x61, 0x08, 0xd7, 0x2d, 0x98, 0x10, 0xa3, 0x09, 0x14, 0xdf, 0xf4
+};
+
+static const unsigned char aes_test_cipher256[64] =
+{
+	0xf5, 0x8c, 0x4c, 0x04, 0xd6, 0xe5, 0xf1, 0xba, 0x77, 0x9e, 0xab, 0xfb, 0x5f, 0x7b, 0xfb, 0xd6,
+	0x9c, 0xfc, 0x4e, 0x96, 0x7e, 0xdb, 0x80, 0x8d, 0x67, 0x9f, 0x77, 0x7b, 0xc6, 0x70, 0x2c, 0x7d,
+	0x39, 0xf2, 0x33, 0x69, 0xa9, 0xd9, 0xba, 0xcf, 0xa5, 0x30, 0xe2, 0x63, 0x04, 0x23, 0x14, 0x61,
+	0xb2, 0xeb, 0x05, 0xe2, 0xc3, 0x9b, 0xe9, 0xfc, 0xda, 0x6c, 0x19, 0x07, 0x8c, 0x6a, 0x9d, 0x1b
+};
+
+/*
+ * Encrypts and decrypts the test vectors with the table based code (or with
+ * the hardware accelerated code, if use_hw is set and that's available) and
+ * returns the number of failed checks. Decryption is checked for four blocks
+ * at once and for the single block tail of the AES-NI code.
+ */
+static int aes_test_cbc( const unsigned char *key, int keysize,
+	const unsigned char *cipher, int use_hw )
+{
+	aes_context ctx;
+	unsigned char iv[16], out[64];
+	int i, len, failed = 0;
+
+	for( i = 0; i < 16; i++ )
+		iv[i] = (unsigned char) i;
+	aes_setkey_enc( &ctx, key, keysize );
+	ctx.hw = ctx.hw && use_hw;
+	aes_crypt_cbc( &ctx, AES_ENCRYPT, 64, iv, aes_test_plain, out );
+	if( memcmp( out, cipher, 64 ) != 0 )
+		failed++;
+
+	for( len = 64; len >= 48; len -= 16 )
+	{
+		for( i = 0; i < 16; i++ )
+			iv[i] = (unsigned char) i;
+		aes_setkey_dec( &ctx, key, keysize );
+		ctx.hw = ctx.hw && use_hw;
+		aes_crypt_cbc( &ctx, AES_DECRYPT, len, iv, cipher, out );
+		if( memcmp( out, aes_test_plain, len ) != 0 || memcmp( iv, cipher + len - 16, 16 ) != 0 )
+			failed++;
+	}
+
+	return failed;
+}
+
+/*
+ * Checks the table based code and, if the CPU supports it, the hardware
+ * accelerated code. Returns the number of failed checks and sets *hw_tested
+ * to whether the hardware accelerated code could be checked.
+ */
+int aes_self_test( int *hw_tested )
+{
+	int failed = 0;
+
+	*hw_tested = aes_hw_available();
+	failed += aes_test_cbc( aes_test_key128, 128, aes_test_cipher128, 0 );
+	failed += aes_test_cbc( aes_test_key256, 256, aes_test_cipher256, 0 );
+	if( *hw_tested )
+	{
+		failed += aes_test_cbc( aes_test_key128, 128, aes_test_cipher128, 1 );
+		failed += aes_test_cbc( aes_test_key256, 256, aes_test_cipher256, 1 );
+	}
+
+	return failed;
+}
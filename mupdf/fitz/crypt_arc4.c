@@ -61,38 +61,28 @@ fz_arc4_init(fz_arc4 *arc4, const unsigned char *key, unsigned keylen)
 	}
 }
 
-static unsigned char
-fz_arc4_next(fz_arc4 *arc4)
-{
-	unsigned int x;
-	unsigned int y;
-	unsigned int sx, sy;
-	unsigned char *state;
-
-	state = arc4->state;
-
-	x = (arc4->x + 1) & 0xff;
-	sx = state[x];
-	y = (sx + arc4->y) & 0xff;
-	sy = state[y];
-
-	arc4->x = x;
-	arc4->y = y;
-
-	state[y] = sx;
-	state[x] = sy;
-
-	return state[(sx + sy) & 0xff];
-}
-
 void
 fz_arc4_encrypt(fz_arc4 *arc4, unsigned char *dest, const unsigned char *src, unsigned len)
 {
+	/* keep the indices in registers for the whole run instead of
+	 * updating arc4->x and arc4->y for every single byte */
+	unsigned char *state = arc4->state;
+	unsigned int x = arc4->x;
+	unsigned int y = arc4->y;
+	unsigned int sx, sy;
 	unsigned int i;
+
 	for (i = 0; i < len; i++)
 	{
-		unsigned char x;
-		x = fz_arc4_next(arc4);
-		dest[i] = src[i] ^ x;
+		x = (x + 1) & 0xff;
+		sx = state[x];
+		y = (sx + y) & 0xff;
+		sy = state[y];
+		state[y] = sx;
+		state[x] = sy;
+		dest[i] = src[i] ^ state[(sx + sy) & 0xff];
 	}
+
+	arc4->x = x;
+	arc4->y = y;
 }
@@ -97,7 +97,7 @@ static const unsigned int SHA256_K[64] = {
 };
 
 static void
-transform256(unsigned int state[8], const unsigned int data_xe[16])
+transform256(unsigned int state[8], const unsigned char *block)
 {
 	const unsigned int *K = SHA256_K;
 	unsigned int data[16];
@@ -105,9 +105,10 @@ transform256(unsigned int state[8], const unsigned int data_xe[16])
 	unsigned int T[8];
 	unsigned int j;
 
-	/* ensure big-endian integers */
-	for (j = 0; j < 16; j++)
-		data[j] = bswap32(data_xe[j]);
+	/* read big-endian integers (works for unaligned input as well) */
+	for (j = 0; j < 16; j++, block += 4)
+		data[j] = ((unsigned int)block[0] << 24) | ((unsigned int)block[1] << 16) |
+			((unsigned int)block[2] << 8) | (unsigned int)block[3];
 
 	/* Copy state[] to working vars. */
 	memcpy(T, state, sizeof(T));
@@ -152,14 +153,26 @@ void fz_sha256_init(fz_sha256 *context)
 
 void fz_sha256_update(fz_sha256 *context, const unsigned char *input, unsigned int inlen)
 {
-	/* Copy the input data into a properly aligned temporary buffer.
-	 * This way we can be called with arbitrarily sized buffers
-	 * (no need to be multiple of 64 bytes), and the code works also
-	 * on architectures that don't allow unaligned memory access. */
+	/* Copy partial blocks into a temporary buffer so that we can be
+	 * called with arbitrarily sized buffers (no need to be multiple
+	 * of 64 bytes). Whole blocks are hashed directly from the input
+	 * since transform256 reads it byte by byte anyway. */
 	while (inlen > 0)
 	{
 		const unsigned int copy_start = context->count[0] & 0x3F;
 		unsigned int copy_size = 64 - copy_start;
+
+		if (copy_start == 0 && inlen >= 64)
+		{
+			copy_size = inlen & ~0x3F;
+			for (; inlen >= 64; input += 64, inlen -= 64)
+				transform256(context->state, input);
+			context->count[0] += copy_size;
+			/* carry overflow from low to high */
+			if (context->count[0] < copy_size)
+				context->count[1]++;
+			continue;
+		}
 		if (copy_size > inlen)
 			copy_size = inlen;
 
@@ -173,7 +186,7 @@ void fz_sha256_update(fz_sha256 *context, const unsigned char *input, unsigned i
 			context->count[1]++;
 
 		if ((context->count[0] & 0x3F) == 0)
-			transform256(context->state, context->buffer.u32);
+			transform256(context->state, context->buffer.u8);
 	}
 }
 
@@ -188,7 +201,7 @@ void fz_sha256_final(fz_sha256 *context, unsigned char digest[32])
 	{
 		if (j == 64)
 		{
-			transform256(context->state, context->buffer.u32);
+			transform256(context->state, context->buffer.u8);
 			j = 0;
 		}
 		context->buffer.u8[j++] = 0x00;
@@ -200,7 +213,7 @@ void fz_sha256_final(fz_sha256 *context, unsigned char digest[32])
 
 	context->buffer.u32[14] = bswap32(context->count[1]);
 	context->buffer.u32[15] = bswap32(context->count[0]);
-	transform256(context->state, context->buffer.u32);
+	transform256(context->state, context->buffer.u8);
 
 	for (j = 0; j < 8; j++)
 		((unsigned int *)digest)[j] = bswap32(context->state[j]);
@@ -258,7 +271,7 @@ static const uint64_t SHA512_K[80] = {
 };
 
 static void
-transform512(uint64_t state[8], const uint64_t data_xe[16])
+transform512(uint64_t state[8], const unsigned char *block)
 {
 	const uint64_t *K = SHA512_K;
 	uint64_t data[16];
@@ -266,9 +279,12 @@ transform512(uint64_t state[8], const uint64_t data_xe[16])
 	uint64_t T[8];
 	unsigned int j;
 
-	/* ensure big-endian integers */
-	for (j = 0; j < 16; j++)
-		data[j] = bswap64(data_xe[j]);
+	/* read big-endian integers (works for unaligned input as well) */
+	for (j = 0; j < 16; j++, block += 8)
+		data[j] = ((uint64_t)block[0] << 56) | ((uint64_t)block[1] << 48) |
+			((uint64_t)block[2] << 40) | ((uint64_t)block[3] << 32) |
+			((uint64_t)block[4] << 24) | ((uint64_t)block[5] << 16) |
+			((uint64_t)block[6] << 8) | (uint64_t)block[7];
 
 	/* Copy state[] to working vars. */
 	memcpy(T, state, sizeof(T));
@@ -313,14 +329,26 @@ void fz_sha512_init(fz_sha512 *context)
 
 void fz_sha512_update(fz_sha512 *context, const unsigned char *input, unsigned int inlen)
 {
-	/* Copy the input data into a properly aligned temporary buffer.
-	 * This way we can be called with arbitrarily sized buffers
-	 * (no need to be multiple of 128 bytes), and the code works also
-	 * on architectures that don't allow unaligned memory access. */
+	/* Copy partial blocks into a temporary buffer so that we can be
+	 * called with arbitrarily sized buffers (no need to be multiple
+	 * of 128 bytes). Whole blocks are hashed directly from the input
+	 * since transform512 reads it byte by byte anyway. */
 	while (inlen > 0)
 	{
 		const unsigned int copy_start = context->count[0] & 0x7F;
 		unsigned int copy_size = 128 - copy_start;
+
+		if (copy_start == 0 && inlen >= 128)
+		{
+			copy_size = inlen & ~0x7F;
+			for (; inlen >= 128; input += 128, inlen -= 128)
+				transform512(context->state, input);
+			context->count[0] += copy_size;
+			/* carry overflow from low to high */
+			if (context->count[0] < copy_size)
+				context->count[1]++;
+			continue;
+		}
 		if (copy_size > inlen)
 			copy_size = inlen;
 
@@ -334,7 +362,7 @@ void fz_sha512_update(fz_sha512 *context, const unsigned char *input, unsigned i
 			context->count[1]++;
 
 		if ((context->count[0] & 0x7F) == 0)
-			transform512(context->state, context->buffer.u64);
+			transform512(context->state, context->buffer.u8);
 	}
 }
 
@@ -349,7 +377,7 @@ void fz_sha512_final(fz_sha512 *context, unsigned char digest[64])
 	{
 		if (j == 128)
 		{
-			transform512(context->state, context->buffer.u64);
+			transform512(context->state, context->buffer.u8);
 			j = 0;
 		}
 		context->buffer.u8[j++] = 0x00;
@@ -361,7 +389,7 @@ void fz_sha512_final(fz_sha512 *context, unsigned char digest[64])
 
 	context->buffer.u64[14] = bswap64(context->count[1]);
 	context->buffer.u64[15] = bswap64(context->count[0]);
-	transform512(context->state, context->buffer.u64);
+	transform512(context->state, context->buffer.u8);
 
 	for (j = 0; j < 8; j++)
 		((uint64_t *)digest)[j] = bswap64(context->state[j]);
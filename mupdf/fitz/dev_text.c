@@ -777,7 +777,7 @@ fz_new_text_device(fz_context *ctx, fz_text_sheet *sheet, fz_text_page *page)
 	init_span(ctx, &tdev->cur_span, NULL);
 
 	dev = fz_new_device(ctx, tdev);
-	dev->hints = FZ_IGNORE_IMAGE | FZ_IGNORE_SHADE;
+	dev->hints = FZ_IGNORE_IMAGE | FZ_IGNORE_SHADE | FZ_IGNORE_PATH;
 	dev->free_user = fz_text_free_user;
 	dev->fill_text = fz_text_fill_text;
 	dev->stroke_text = fz_text_stroke_text;
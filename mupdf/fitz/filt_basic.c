@@ -604,7 +604,7 @@ struct fz_aesd_s
 	fz_aes aes;
 	unsigned char iv[16];
 	int ivcount;
-	unsigned char bp[16];
+	unsigned char bp[4096];
 	unsigned char *rp, *wp;
 };
 
@@ -623,32 +623,48 @@ read_aesd(fz_stream *stm, unsigned char *buf, int len)
 		state->iv[state->ivcount++] = c;
 	}
 
-	while (state->rp < state->wp && p < ep)
-		*p++ = *state->rp++;
+	if (state->rp < state->wp)
+	{
+		int n = fz_mini(ep - p, state->wp - state->rp);
+		memcpy(p, state->rp, n);
+		p += n;
+		state->rp += n;
+	}
 
 	while (p < ep)
 	{
-		int n = fz_read(state->chain, state->bp, 16);
+		/* decrypt as many blocks at once as the chain provides */
+		int n = fz_read(state->chain, state->bp, sizeof(state->bp));
 		if (n == 0)
 			return p - buf;
-		else if (n < 16)
-			fz_throw(stm->ctx, "partial block in aes filter");
+		while (n % 16 != 0)
+		{
+			int m = fz_read(state->chain, state->bp + n, 16 - n % 16);
+			if (m == 0)
+				fz_throw(stm->ctx, "partial block in aes filter");
+			n += m;
+		}
 
-		aes_crypt_cbc(&state->aes, AES_DECRYPT, 16, state->iv, state->bp, state->bp);
+		aes_crypt_cbc(&state->aes, AES_DECRYPT, n, state->iv, state->bp, state->bp);
 		state->rp = state->bp;
-		state->wp = state->bp + 16;
+		state->wp = state->bp + n;
 
 		/* strip padding at end of file */
 		if (fz_is_eof(state->chain))
 		{
-			int pad = state->bp[15];
+			int pad = state->bp[n - 1];
 			if (pad < 1 || pad > 16)
 				fz_throw(stm->ctx, "aes padding out of range: %d", pad);
 			state->wp -= pad;
 		}
 
-		while (state->rp < state->wp && p < ep)
-			*p++ = *state->rp++;
+		if (state->rp < state->wp)
+		{
+			n = fz_mini(ep - p, state->wp - state->rp);
+			memcpy(p, state->rp, n);
+			p += n;
+			state->rp += n;
+		}
 	}
 
 	return p - buf;
@@ -396,6 +396,8 @@ struct fz_aes_s
 	int nr; /* number of rounds */
 	unsigned long *rk; /* AES round keys */
 	unsigned long buf[68]; /* unaligned data */
+	int hw; /* use AES-NI/ARMv8 instructions with the round keys in hwrk */
+	unsigned char hwrk[15 * 16]; /* round keys as byte blocks */
 };
 
 int aes_setkey_enc( fz_aes *ctx, const unsigned char *key, int keysize );
@@ -405,6 +407,10 @@ void aes_crypt_cbc( fz_aes *ctx, int mode, int length,
 	const unsigned char *input,
 	unsigned char *output );
 
+/* SumatraPDF: known answer tests for the table based and (where available)
+ * the AES-NI/ARMv8 code; returns the number of failed checks */
+int aes_self_test( int *hw_tested );
+
 /*
 	Resource store
 
@@ -1060,6 +1066,10 @@ struct fz_font_s
 	/* substitute metrics */
 	int width_count;
 	int *width_table; /* in 1000 units */
+	int *width_real; /* SumatraPDF: cached advances of the substituted glyphs */
+
+	/* SumatraPDF: the face is shared with other fonts using the same font program */
+	void *ft_shared;
 };
 
 void fz_new_font_context(fz_context *ctx);
@@ -1070,6 +1080,11 @@ fz_font *fz_new_type3_font(fz_context *ctx, char *name, fz_matrix matrix);
 
 fz_font *fz_new_font_from_memory(fz_context *ctx, char *name, unsigned char *data, int len, int index, int use_glyph_bbox);
 fz_font *fz_new_font_from_file(fz_context *ctx, char *name, char *path, int index, int use_glyph_bbox);
+/* SumatraPDF: takes ownership of data (allocated with fz_malloc) and shares the
+   FreeType face with all other fonts created from the same font program */
+fz_font *fz_new_font_from_shared_memory(fz_context *ctx, char *name, unsigned char *data, int len, int index, int use_glyph_bbox);
+/* SumatraPDF: maximum size of unused font programs kept for reuse (negative disables sharing) */
+void fz_set_shared_font_cache_size(fz_context *ctx, int size);
 
 fz_font *fz_keep_font(fz_context *ctx, fz_font *font);
 void fz_drop_font(fz_context *ctx, fz_font *font);
@@ -1371,6 +1386,8 @@ enum
 	/* Hints */
 	FZ_IGNORE_IMAGE = 1,
 	FZ_IGNORE_SHADE = 2,
+	/* SumatraPDF: don't build paths unless they're needed for clipping */
+	FZ_IGNORE_PATH = 4,
 
 	/* Flags */
 	FZ_DEVFLAG_MASK = 1,
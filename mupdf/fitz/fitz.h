@@ -2973,6 +2973,9 @@ struct fz_write_options_s
 	int do_garbage; /* If non-zero then attempt (where possible) to
 				garbage collect the file before writing. */
 	int do_linear; /* If non-zero then write linearised. */
+	int do_incremental; /* SumatraPDF: If non-zero then write a copy of
+				the original file followed by an incremental
+				update containing only the changed objects. */
 };
 
 /*	An enumeration of bitflags to use in the above 'do_expand' field of
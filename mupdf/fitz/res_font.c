@@ -10,6 +10,7 @@
 #define SHEAR 0.36397f
 
 static void fz_drop_freetype(fz_context *ctx);
+static void fz_release_shared_face(fz_context *ctx, void *shared);
 
 static fz_font *
 fz_new_font(fz_context *ctx, char *name, int use_glyph_bbox, int glyph_count)
@@ -67,6 +68,9 @@ fz_new_font(fz_context *ctx, char *name, int use_glyph_bbox, int glyph_count)
 
 	font->width_count = 0;
 	font->width_table = NULL;
+	font->width_real = NULL;
+
+	font->ft_shared = NULL;
 
 	return font;
 }
@@ -111,7 +115,11 @@ fz_drop_font(fz_context *ctx, fz_font *font)
 		fz_free(ctx, font->t3flags);
 	}
 
-	if (font->ft_face)
+	if (font->ft_shared)
+	{
+		fz_release_shared_face(ctx, font->ft_shared);
+	}
+	else if (font->ft_face)
 	{
 		fz_lock(ctx, FZ_LOCK_FREETYPE);
 		fterr = FT_Done_Face((FT_Face)font->ft_face);
@@ -125,6 +133,7 @@ fz_drop_font(fz_context *ctx, fz_font *font)
 	fz_free(ctx, font->ft_data);
 	fz_free(ctx, font->bbox_table);
 	fz_free(ctx, font->width_table);
+	fz_free(ctx, font->width_real);
 	fz_free(ctx, font);
 }
 
@@ -144,10 +153,33 @@ fz_set_font_bbox(fz_context *ctx, fz_font *font, float xmin, float ymin, float x
  * Freetype hooks
  */
 
+typedef struct fz_shared_face_s fz_shared_face;
+
+/* SumatraPDF: a FreeType face shared by all fonts loaded from the same font program */
+struct fz_shared_face_s
+{
+	FT_Face face;
+	unsigned char digest[16];
+	int index;
+	unsigned char *data;
+	int len;
+	int refs;
+	int last_use;
+	fz_shared_face *next;
+};
+
+/* maximum size of font programs kept around after their last font has been dropped */
+#define FZ_SHARED_FONT_CACHE_SIZE (4 << 20)
+
 struct fz_font_context_s {
 	int ctx_refs;
 	FT_Library ftlib;
 	int ftlib_refs;
+	/* SumatraPDF: shared faces are protected by the freetype lock */
+	fz_shared_face *shared;
+	int shared_unused_size;
+	int shared_max_unused_size;
+	int shared_clock;
 };
 
 #undef __FTERRORS_H__
@@ -167,6 +199,10 @@ void fz_new_font_context(fz_context *ctx)
 	ctx->font->ctx_refs = 1;
 	ctx->font->ftlib = NULL;
 	ctx->font->ftlib_refs = 0;
+	ctx->font->shared = NULL;
+	ctx->font->shared_unused_size = 0;
+	ctx->font->shared_max_unused_size = FZ_SHARED_FONT_CACHE_SIZE;
+	ctx->font->shared_clock = 0;
 }
 
 fz_font_context *
@@ -189,7 +225,11 @@ void fz_drop_font_context(fz_context *ctx)
 	drop = --ctx->font->ctx_refs;
 	fz_unlock(ctx, FZ_LOCK_ALLOC);
 	if (drop == 0)
+	{
+		/* release all cached font programs (fonts still in use are leaked) */
+		fz_set_shared_font_cache_size(ctx, 0);
 		fz_free(ctx, ctx->font);
+	}
 }
 
 static const struct ft_error ft_errors[] =
@@ -291,6 +331,24 @@ fz_check_font_dimensions(FT_Face face)
 	}
 }
 
+static fz_font *
+fz_new_font_from_face(fz_context *ctx, char *name, FT_Face face, int use_glyph_bbox)
+{
+	fz_font *font;
+
+	if (!name)
+		name = face->family_name;
+
+	font = fz_new_font(ctx, name, use_glyph_bbox, face->num_glyphs);
+	font->ft_face = face;
+	font->bbox.x0 = (float) face->bbox.xMin / face->units_per_EM;
+	font->bbox.y0 = (float) face->bbox.yMin / face->units_per_EM;
+	font->bbox.x1 = (float) face->bbox.xMax / face->units_per_EM;
+	font->bbox.y1 = (float) face->bbox.yMax / face->units_per_EM;
+
+	return font;
+}
+
 fz_font *
 fz_new_font_from_file(fz_context *ctx, char *name, char *path, int index, int use_glyph_bbox)
 {
@@ -310,17 +368,7 @@ fz_new_font_from_file(fz_context *ctx, char *name, char *path, int index, int us
 	}
 	fz_check_font_dimensions(face);
 
-	if (!name)
-		name = face->family_name;
-
-	font = fz_new_font(ctx, name, use_glyph_bbox, face->num_glyphs);
-	font->ft_face = face;
-	font->bbox.x0 = (float) face->bbox.xMin / face->units_per_EM;
-	font->bbox.y0 = (float) face->bbox.yMin / face->units_per_EM;
-	font->bbox.x1 = (float) face->bbox.xMax / face->units_per_EM;
-	font->bbox.y1 = (float) face->bbox.yMax / face->units_per_EM;
-
-	return font;
+	return fz_new_font_from_face(ctx, name, face, use_glyph_bbox);
 }
 
 fz_font *
@@ -342,15 +390,170 @@ fz_new_font_from_memory(fz_context *ctx, char *name, unsigned char *data, int le
 	}
 	fz_check_font_dimensions(face);
 
-	if (!name)
-		name = face->family_name;
+	return fz_new_font_from_face(ctx, name, face, use_glyph_bbox);
+}
 
-	font = fz_new_font(ctx, name, use_glyph_bbox, face->num_glyphs);
-	font->ft_face = face;
-	font->bbox.x0 = (float) face->bbox.xMin / face->units_per_EM;
-	font->bbox.y0 = (float) face->bbox.yMin / face->units_per_EM;
-	font->bbox.x1 = (float) face->bbox.xMax / face->units_per_EM;
-	font->bbox.y1 = (float) face->bbox.yMax / face->units_per_EM;
+/*
+ * SumatraPDF: Documents often embed the same font program several times
+ * (e.g. once per page) and related documents tend to embed identical
+ * subsets. Such fonts share a single FreeType face (the face's size and
+ * transform are only ever changed under the freetype lock right before
+ * they're used) and recently dropped font programs are kept around for
+ * a while, so that loading the next document doesn't parse them again.
+ */
+
+static void
+fz_free_shared_faces(fz_context *ctx, fz_shared_face *list)
+{
+	fz_shared_face *next;
+	int fterr;
+
+	for (; list; list = next)
+	{
+		next = list->next;
+		fz_lock(ctx, FZ_LOCK_FREETYPE);
+		fterr = FT_Done_Face(list->face);
+		fz_unlock(ctx, FZ_LOCK_FREETYPE);
+		if (fterr)
+			fz_warn(ctx, "freetype finalizing face: %s", ft_error_string(fterr));
+		fz_drop_freetype(ctx);
+		fz_free(ctx, list->data);
+		fz_free(ctx, list);
+	}
+}
+
+/* The freetype lock is always held when this function is called. */
+static fz_shared_face *
+fz_evict_shared_faces(fz_font_context *fct, int max_size)
+{
+	fz_shared_face *evicted = NULL;
+	fz_shared_face **entry, **oldest, *victim;
+
+	while (fct->shared_unused_size > max_size)
+	{
+		oldest = NULL;
+		for (entry = &fct->shared; *entry; entry = &(*entry)->next)
+			if ((*entry)->refs == 0 && (!oldest || (*entry)->last_use < (*oldest)->last_use))
+				oldest = entry;
+		if (!oldest)
+			break;
+
+		victim = *oldest;
+		*oldest = victim->next;
+		fct->shared_unused_size -= victim->len;
+		victim->next = evicted;
+		evicted = victim;
+	}
+
+	return evicted;
+}
+
+static void
+fz_release_shared_face(fz_context *ctx, void *shared)
+{
+	fz_font_context *fct = ctx->font;
+	fz_shared_face *entry = shared;
+	fz_shared_face *evicted = NULL;
+
+	fz_lock(ctx, FZ_LOCK_FREETYPE);
+	if (--entry->refs == 0)
+	{
+		entry->last_use = ++fct->shared_clock;
+		fct->shared_unused_size += entry->len;
+		evicted = fz_evict_shared_faces(fct, fz_maxi(fct->shared_max_unused_size, 0));
+	}
+	fz_unlock(ctx, FZ_LOCK_FREETYPE);
+
+	fz_free_shared_faces(ctx, evicted);
+}
+
+void
+fz_set_shared_font_cache_size(fz_context *ctx, int size)
+{
+	fz_font_context *fct = ctx->font;
+	fz_shared_face *evicted;
+
+	fz_lock(ctx, FZ_LOCK_FREETYPE);
+	fct->shared_max_unused_size = size;
+	evicted = fz_evict_shared_faces(fct, fz_maxi(size, 0));
+	fz_unlock(ctx, FZ_LOCK_FREETYPE);
+
+	fz_free_shared_faces(ctx, evicted);
+}
+
+fz_font *
+fz_new_font_from_shared_memory(fz_context *ctx, char *name, unsigned char *data, int len, int index, int use_glyph_bbox)
+{
+	fz_font_context *fct = ctx->font;
+	fz_shared_face *entry;
+	fz_font *font;
+	fz_md5 md5;
+	unsigned char digest[16];
+
+	if (fct->shared_max_unused_size < 0)
+	{
+		font = fz_new_font_from_memory(ctx, name, data, len, index, use_glyph_bbox);
+		font->ft_data = data;
+		font->ft_size = len;
+		return font;
+	}
+
+	fz_md5_init(&md5);
+	fz_md5_update(&md5, data, len);
+	fz_md5_final(&md5, digest);
+
+	fz_lock(ctx, FZ_LOCK_FREETYPE);
+	for (entry = fct->shared; entry; entry = entry->next)
+	{
+		if (entry->len == len && entry->index == index && !memcmp(entry->digest, digest, 16))
+		{
+			if (entry->refs++ == 0)
+				fct->shared_unused_size -= entry->len;
+			break;
+		}
+	}
+	fz_unlock(ctx, FZ_LOCK_FREETYPE);
+
+	if (entry)
+	{
+		fz_try(ctx)
+		{
+			font = fz_new_font_from_face(ctx, name, entry->face, use_glyph_bbox);
+		}
+		fz_catch(ctx)
+		{
+			fz_release_shared_face(ctx, entry);
+			fz_rethrow(ctx);
+		}
+		font->ft_shared = entry;
+		fz_free(ctx, data);
+		return font;
+	}
+
+	entry = fz_malloc_struct(ctx, fz_shared_face);
+	fz_try(ctx)
+	{
+		font = fz_new_font_from_memory(ctx, name, data, len, index, use_glyph_bbox);
+	}
+	fz_catch(ctx)
+	{
+		fz_free(ctx, entry);
+		fz_rethrow(ctx);
+	}
+
+	/* the entry takes over the data and the font's reference to the freetype library */
+	entry->face = font->ft_face;
+	memcpy(entry->digest, digest, 16);
+	entry->index = index;
+	entry->data = data;
+	entry->len = len;
+	entry->refs = 1;
+	font->ft_shared = entry;
+
+	fz_lock(ctx, FZ_LOCK_FREETYPE);
+	entry->next = fct->shared;
+	fct->shared = entry;
+	fz_unlock(ctx, FZ_LOCK_FREETYPE);
 
 	return font;
 }
@@ -366,18 +569,26 @@ fz_adjust_ft_glyph_width(fz_context *ctx, fz_font *font, int gid, fz_matrix trm)
 		int realw;
 		float scale;
 
+		/* SumatraPDF: only ask FreeType once per glyph (the cache is
+		   accessed under the same lock as the possibly shared face) */
 		fz_lock(ctx, FZ_LOCK_FREETYPE);
-		/* TODO: use FT_Get_Advance */
-		fterr = FT_Set_Char_Size(font->ft_face, 1000, 1000, 72, 72);
-		if (fterr)
-			fz_warn(ctx, "freetype setting character size: %s", ft_error_string(fterr));
-
-		fterr = FT_Load_Glyph(font->ft_face, gid,
-			FT_LOAD_NO_HINTING | FT_LOAD_NO_BITMAP | FT_LOAD_IGNORE_TRANSFORM);
-		if (fterr)
-			fz_warn(ctx, "freetype failed to load glyph: %s", ft_error_string(fterr));
-
-		realw = ((FT_Face)font->ft_face)->glyph->metrics.horiAdvance;
+		realw = font->width_real ? font->width_real[gid] : -1;
+		if (realw < 0)
+		{
+			/* TODO: use FT_Get_Advance */
+			fterr = FT_Set_Char_Size(font->ft_face, 1000, 1000, 72, 72);
+			if (fterr)
+				fz_warn(ctx, "freetype setting character size: %s", ft_error_string(fterr));
+
+			fterr = FT_Load_Glyph(font->ft_face, gid,
+				FT_LOAD_NO_HINTING | FT_LOAD_NO_BITMAP | FT_LOAD_IGNORE_TRANSFORM);
+			if (fterr)
+				fz_warn(ctx, "freetype failed to load glyph: %s", ft_error_string(fterr));
+
+			realw = ((FT_Face)font->ft_face)->glyph->metrics.horiAdvance;
+			if (font->width_real)
+				font->width_real[gid] = realw;
+		}
 		fz_unlock(ctx, FZ_LOCK_FREETYPE);
 		subw = font->width_table[gid];
 		if (realw)
@@ -482,29 +482,6 @@ split_stripe(tensor_patch *p, tensor_patch *s0, tensor_patch *s1)
 	memcpy(s1->color[3], p->color[3], sizeof(s1->color[3]));
 }
 
-static void
-draw_stripe(fz_mesh_processor *painter, tensor_patch *p, int depth)
-{
-	tensor_patch s0, s1;
-
-	/* split patch into two half-height patches */
-	split_stripe(p, &s0, &s1);
-
-	depth--;
-	if (depth == 0)
-	{
-		/* if no more subdividing, draw two new patches... */
-		triangulate_patch(painter, s1);
-		triangulate_patch(painter, s0);
-	}
-	else
-	{
-		/* ...otherwise, continue subdividing. */
-		draw_stripe(painter, &s1, depth);
-		draw_stripe(painter, &s0, depth);
-	}
-}
-
 static void
 split_patch(tensor_patch *p, tensor_patch *s0, tensor_patch *s1)
 {
@@ -529,26 +506,163 @@ split_patch(tensor_patch *p, tensor_patch *s0, tensor_patch *s1)
 	memcpy(s1->color[3], s0->color[2], sizeof(s1->color[3]));
 }
 
+/*
+ * SumatraPDF: Subdivide patches depending on their size on the device, on
+ * how far they're from being flat and on how far their colors are from
+ * being bilinear, instead of always to a fixed depth (which overshoots for
+ * tiny patches and isn't enough for large ones).
+ */
+
+#define SUBDIV_MAX 12 /* at most 2^12 sub-patches (e.g. 64x64) */
+#define SUBDIV_MIN_SIZE 2.0f /* in device pixels */
+#define SUBDIV_FLATNESS 0.5f /* in device pixels */
+#define SUBDIV_COLOR_ERROR (2.0f / 255) /* of two triangles vs. bilinear at the center */
+
+static inline float
+point_dist(fz_point a, fz_point b)
+{
+	return fz_max(fz_abs(a.x - b.x), fz_abs(a.y - b.y));
+}
+
+static inline float
+curve_dev(fz_point a, fz_point b, fz_point c, fz_point d)
+{
+	/* distance of the inner control points from the chord at 1/3 and 2/3 */
+	fz_point b1, c1;
+	b1.x = (2 * a.x + d.x) / 3; b1.y = (2 * a.y + d.y) / 3;
+	c1.x = (a.x + 2 * d.x) / 3; c1.y = (a.y + 2 * d.y) / 3;
+	return fz_max(point_dist(b, b1), point_dist(c, c1));
+}
+
+static inline float *
+shade_function_color(fz_shade *shade, float t)
+{
+	/* the same lookup as when painting (cf. fz_paint_shade) */
+	int i = (int)(t * 255);
+	return shade->function[fz_clampi(i, 0, 255)];
+}
+
+/* how far the colors at the patch's center are off when drawing it as two
+   triangles instead of interpolating bilinearly. With a function, the
+   parameter t is interpolated instead of the colors and the function is
+   evaluated for every pixel, so the error in t is mapped through it */
+static float
+patch_color_error(fz_shade *shade, tensor_patch *p)
+{
+	float err = 0;
+	int k;
+
+	if (shade->use_function)
+	{
+		float bilinear = (p->color[0][0] + p->color[1][0] + p->color[2][0] + p->color[3][0]) / 4;
+		float *c = shade_function_color(shade, bilinear);
+		float *c0 = shade_function_color(shade, (p->color[0][0] + p->color[2][0]) / 2);
+		float *c1 = shade_function_color(shade, (p->color[1][0] + p->color[3][0]) / 2);
+		for (k = 0; k < shade->colorspace->n; k++)
+			err = fz_max(err, fz_max(fz_abs(c[k] - c0[k]), fz_abs(c[k] - c1[k])));
+		return err;
+	}
+
+	for (k = 0; k < shade->colorspace->n; k++)
+		err = fz_max(err, fz_abs(p->color[0][k] - p->color[1][k] + p->color[2][k] - p->color[3][k]) / 4);
+	return err;
+}
+
+/* returns 0 if the patch can be drawn as is, 1 for splitting it with
+   split_patch and 2 for splitting it with split_stripe */
+static int
+patch_split_direction(fz_shade *shade, tensor_patch *p)
+{
+	float x0, y0, x1, y1, dev_j, dev_i;
+	int i, j;
+
+	x0 = x1 = p->pole[0][0].x;
+	y0 = y1 = p->pole[0][0].y;
+	for (i = 0; i < 4; i++)
+	{
+		for (j = 0; j < 4; j++)
+		{
+			x0 = fz_min(x0, p->pole[i][j].x);
+			y0 = fz_min(y0, p->pole[i][j].y);
+			x1 = fz_max(x1, p->pole[i][j].x);
+			y1 = fz_max(y1, p->pole[i][j].y);
+		}
+	}
+	if (x1 - x0 < SUBDIV_MIN_SIZE && y1 - y0 < SUBDIV_MIN_SIZE)
+		return 0;
+
+	/* how far the rows resp. columns of control points are from being straight */
+	dev_j = dev_i = 0;
+	for (i = 0; i < 4; i++)
+	{
+		dev_j = fz_max(dev_j, curve_dev(p->pole[i][0], p->pole[i][1], p->pole[i][2], p->pole[i][3]));
+		dev_i = fz_max(dev_i, curve_dev(p->pole[0][i], p->pole[1][i], p->pole[2][i], p->pole[3][i]));
+	}
+	if (dev_j >= SUBDIV_FLATNESS || dev_i >= SUBDIV_FLATNESS)
+		return dev_j >= dev_i ? 1 : 2;
+
+	if (patch_color_error(shade, p) < SUBDIV_COLOR_ERROR)
+		return 0;
+
+	/* split across the longer side */
+	if (fz_max(point_dist(p->pole[0][0], p->pole[0][3]), point_dist(p->pole[3][0], p->pole[3][3])) >=
+		fz_max(point_dist(p->pole[0][0], p->pole[3][0]), point_dist(p->pole[0][3], p->pole[3][3])))
+		return 1;
+	return 2;
+}
+
+static void bound_tri(void *arg, fz_vertex *v1, fz_vertex *v2, fz_vertex *v3);
+
+static void
+bound_patch(fz_mesh_processor *painter, tensor_patch *p)
+{
+	/* a patch lies within the convex hull of its control points */
+	fz_vertex v0, v1, v2;
+	int i, j;
+
+	v0.p = p->pole[0][0];
+	v1.p = p->pole[0][1];
+	for (i = 0; i < 4; i++)
+	{
+		for (j = 0; j < 4; j++)
+		{
+			v2.p = p->pole[i][j];
+			painter->process(painter->process_arg, &v0, &v1, &v2);
+		}
+	}
+}
+
 static void
-draw_patch(fz_mesh_processor *painter, tensor_patch *p, int depth, int origdepth)
+draw_patch(fz_mesh_processor *painter, tensor_patch *p, int depth)
 {
 	tensor_patch s0, s1;
+	int dir;
 
-	/* split patch into two half-width patches */
-	split_patch(p, &s0, &s1);
+	/* SumatraPDF: don't subdivide patches when only computing the bounds */
+	if (painter->process == bound_tri)
+	{
+		bound_patch(painter, p);
+		return;
+	}
 
-	depth--;
-	if (depth == 0)
+	dir = depth > 0 ? patch_split_direction(painter->shade, p) : 0;
+	if (dir == 1)
 	{
-		/* if no more subdividing, draw two new patches... */
-		draw_stripe(painter, &s0, origdepth);
-		draw_stripe(painter, &s1, origdepth);
+		/* split patch into two half-width patches */
+		split_patch(p, &s0, &s1);
+		draw_patch(painter, &s0, depth - 1);
+		draw_patch(painter, &s1, depth - 1);
+	}
+	else if (dir == 2)
+	{
+		/* split patch into two half-height patches */
+		split_stripe(p, &s0, &s1);
+		draw_patch(painter, &s1, depth - 1);
+		draw_patch(painter, &s0, depth - 1);
 	}
 	else
 	{
-		/* ...otherwise, continue subdividing. */
-		draw_patch(painter, &s0, depth, origdepth);
-		draw_patch(painter, &s1, depth, origdepth);
+		triangulate_patch(painter, *p);
 	}
 }
 
@@ -639,9 +753,6 @@ make_tensor_patch(tensor_patch *p, int type, fz_point *pt)
 	}
 }
 
-/* FIXME: Nasty */
-#define SUBDIV 3 /* how many levels to subdivide patches */
-
 static void
 fz_mesh_type6_process(fz_context *ctx, fz_shade *shade, fz_matrix ctm, fz_mesh_processor *painter)
 {
@@ -748,7 +859,7 @@ fz_mesh_type6_process(fz_context *ctx, fz_shade *shade, fz_matrix ctm, fz_mesh_p
 				for (i = 0; i < 4; i++)
 					memcpy(patch.color[i], c[i], ncomp * sizeof(float));
 
-				draw_patch(painter, &patch, SUBDIV, SUBDIV);
+				draw_patch(painter, &patch, SUBDIV_MAX);
 
 				for (i = 0; i < 12; i++)
 					prevp[i] = v[i];
@@ -876,7 +987,7 @@ fz_mesh_type7_process(fz_context *ctx, fz_shade *shade, fz_matrix ctm, fz_mesh_p
 				for (i = 0; i < 4; i++)
 					memcpy(patch.color[i], c[i], ncomp * sizeof(float));
 
-				draw_patch(painter, &patch, SUBDIV, SUBDIV);
+				draw_patch(painter, &patch, SUBDIV_MAX);
 
 				for (i = 0; i < 16; i++)
 					prevp[i] = v[i];
@@ -7,6 +7,14 @@
 void pdf_set_str_len(pdf_obj *obj, int newlen);
 void *pdf_get_indirect_document(pdf_obj *obj);
 void pdf_set_int(pdf_obj *obj, int i);
+/* SumatraPDF: track modifications to parsed objects for incremental updates */
+int pdf_obj_is_dirty(pdf_obj *obj);
+void pdf_clean_obj(pdf_obj *obj);
+/* also cleans all direct objects nested inside obj */
+void pdf_clean_obj_deep(pdf_obj *obj);
+void pdf_dirty_obj(pdf_obj *obj);
+/* SumatraPDF: replace a dictionary value without looking up its key */
+void pdf_dict_put_val(pdf_obj *dict, int idx, pdf_obj *val);
 
 /*
  * PDF Images
@@ -171,6 +179,15 @@ struct pdf_document_s
 	int recalculating;
 	int dirty;
 
+	/* SumatraPDF: the file the last incremental update was written to
+	 * and the offset of that update's xref section */
+	char *incremental_file;
+	int incremental_startxref;
+	/* SumatraPDF: set once a full save has renumbered the objects or has
+	 * replaced a previous incremental update (whose objects are no longer
+	 * marked as modified), so that no base file matches the objects anymore */
+	int incremental_impossible;
+
 	fz_doc_event_cb *event_cb;
 	void *event_cb_data;
 };
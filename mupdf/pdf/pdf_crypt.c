@@ -480,8 +480,8 @@ pdf_compute_hardened_hash_r6(fz_context *ctx, unsigned char *password, int pwlen
 		memcpy(data + pwlen, block, block_size);
 		memcpy(data + pwlen + block_size, ownerkey, ownerkey ? 48 : 0);
 		data_len = pwlen + block_size + (ownerkey ? 48 : 0);
-		for (j = 1; j < 64; j++)
-			memcpy(data + j * data_len, data, data_len);
+		for (j = 1; j < 64; j *= 2)
+			memcpy(data + j * data_len, data, j * data_len);
 
 		/* Step 3: encrypt data using data block as key and iv */
 		if (aes_setkey_enc(&aes, block, 128))
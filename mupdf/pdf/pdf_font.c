@@ -345,9 +345,10 @@ pdf_load_embedded_font(pdf_document *xref, pdf_font_desc *fontdesc, char *fontna
 		fz_throw(ctx, "cannot load font stream (%d %d R)", pdf_to_num(stmref), pdf_to_gen(stmref));
 	}
 
+	/* SumatraPDF: share the face with identical fonts embedded elsewhere */
 	fz_try(ctx)
 	{
-		fontdesc->font = fz_new_font_from_memory(ctx, fontname, buf->data, buf->len, 0, 1);
+		fontdesc->font = fz_new_font_from_shared_memory(ctx, fontname, buf->data, buf->len, 0, 1);
 	}
 	fz_catch(ctx)
 	{
@@ -356,9 +357,7 @@ pdf_load_embedded_font(pdf_document *xref, pdf_font_desc *fontdesc, char *fontna
 	}
 	fontdesc->size += buf->len;
 
-	/* save the buffer so we can free it later */
-	fontdesc->font->ft_data = buf->data;
-	fontdesc->font->ft_size = buf->len;
+	/* the font now owns the buffer's data */
 	fz_free(ctx, buf); /* only free the fz_buffer struct, not the contained data */
 
 	fontdesc->is_embedded = 1;
@@ -584,48 +583,8 @@ pdf_load_simple_font(pdf_document *xref, pdf_obj *dict)
 
 		symbolic = fontdesc->flags & 4;
 
-		if (face->num_charmaps > 0)
-			cmap = face->charmaps[0];
-		else
-			cmap = NULL;
-
-		for (i = 0; i < face->num_charmaps; i++)
-		{
-			FT_CharMap test = face->charmaps[i];
-
-			if (kind == TYPE1)
-			{
-				if (test->platform_id == 7)
-					cmap = test;
-			}
-
-			if (kind == TRUETYPE)
-			{
-				if (test->platform_id == 1 && test->encoding_id == 0)
-					cmap = test;
-				if (test->platform_id == 3 && test->encoding_id == 1)
-					cmap = test;
-				if (symbolic && test->platform_id == 3 && test->encoding_id == 0)
-					cmap = test;
-			}
-		}
-
-		if (cmap)
-		{
-			fterr = FT_Set_Charmap(face, cmap);
-			if (fterr)
-				fz_warn(ctx, "freetype could not set cmap: %s", ft_error_string(fterr));
-		}
-		else
-			fz_warn(ctx, "freetype could not find any cmaps");
-
-		etable = fz_malloc_array(ctx, 256, sizeof(unsigned short));
-		fontdesc->size += 256 * sizeof(unsigned short);
 		for (i = 0; i < 256; i++)
-		{
 			estrings[i] = NULL;
-			etable[i] = 0;
-		}
 
 		encoding = pdf_dict_gets(dict, "Encoding");
 		if (encoding)
@@ -660,12 +619,51 @@ pdf_load_simple_font(pdf_document *xref, pdf_obj *dict)
 			}
 		}
 
+		etable = fz_malloc_array(ctx, 256, sizeof(unsigned short));
+		fontdesc->size += 256 * sizeof(unsigned short);
+
+		/* SumatraPDF: the selected cmap is shared with all fonts using the same face */
+		fz_lock(ctx, FZ_LOCK_FREETYPE);
+
+		if (face->num_charmaps > 0)
+			cmap = face->charmaps[0];
+		else
+			cmap = NULL;
+
+		for (i = 0; i < face->num_charmaps; i++)
+		{
+			FT_CharMap test = face->charmaps[i];
+
+			if (kind == TYPE1)
+			{
+				if (test->platform_id == 7)
+					cmap = test;
+			}
+
+			if (kind == TRUETYPE)
+			{
+				if (test->platform_id == 1 && test->encoding_id == 0)
+					cmap = test;
+				if (test->platform_id == 3 && test->encoding_id == 1)
+					cmap = test;
+				if (symbolic && test->platform_id == 3 && test->encoding_id == 0)
+					cmap = test;
+			}
+		}
+
+		if (cmap)
+		{
+			fterr = FT_Set_Charmap(face, cmap);
+			if (fterr)
+				fz_warn(ctx, "freetype could not set cmap: %s", ft_error_string(fterr));
+		}
+		else
+			fz_warn(ctx, "freetype could not find any cmaps");
+
 		/* start with the builtin encoding */
 		for (i = 0; i < 256; i++)
 			etable[i] = ft_char_index(face, i);
 
-		fz_lock(ctx, FZ_LOCK_FREETYPE);
-
 		/* built-in and substitute fonts may be a different type than what the document expects */
 		subtype = pdf_to_name(pdf_dict_gets(dict, "Subtype"));
 		if (!strcmp(subtype, "Type1"))
@@ -843,8 +841,10 @@ pdf_load_simple_font(pdf_document *xref, pdf_obj *dict)
 				if (!wid && i >= pdf_array_len(widths))
 				{
 					fz_warn(ctx, "font width missing for glyph %d (%d %d R)", i + first, pdf_to_num(dict), pdf_to_gen(dict));
+					fz_lock(ctx, FZ_LOCK_FREETYPE);
 					FT_Set_Char_Size(face, 1000, 1000, 72, 72);
 					wid = ft_width(ctx, fontdesc, i + first);
+					fz_unlock(ctx, FZ_LOCK_FREETYPE);
 				}
 				pdf_add_hmtx(ctx, fontdesc, i + first, i + first, wid);
 			}
@@ -1242,6 +1242,10 @@ pdf_make_width_table(fz_context *ctx, pdf_font_desc *fontdesc)
 	font->width_table = fz_malloc_array(ctx, font->width_count, sizeof(int));
 	memset(font->width_table, 0, font->width_count * sizeof(int));
 	fontdesc->size += font->width_count * sizeof(int);
+	/* SumatraPDF: cache for the real advances (-1 if not yet known) */
+	font->width_real = fz_malloc_array(ctx, font->width_count, sizeof(int));
+	memset(font->width_real, -1, font->width_count * sizeof(int));
+	fontdesc->size += font->width_count * sizeof(int);
 
 	for (i = 0; i < fontdesc->hmtx_len; i++)
 	{
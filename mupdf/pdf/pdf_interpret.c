@@ -545,6 +545,21 @@ pdf_show_path(pdf_csi *csi, int doclose, int dofill, int dostroke, int even_odd)
 			csi->dev->flags |= FZ_DEVFLAG_UNCACHEABLE;
 	}
 
+	/* SumatraPDF: devices ignoring paths (e.g. for text extraction) don't need
+	   them to be built and bounded, only the clip depth has to be tracked */
+	if (csi->dev->hints & FZ_IGNORE_PATH)
+	{
+		if (csi->clip)
+		{
+			gstate->clip_depth++;
+			fz_clip_path(csi->dev, csi->path, NULL, csi->clip_even_odd, gstate->ctm);
+			csi->clip = 0;
+		}
+		csi->path->len = 0;
+		csi->path->last = -1;
+		return;
+	}
+
 	path = csi->path;
 	csi->path = fz_new_path(ctx);
 
@@ -2278,6 +2293,10 @@ static void pdf_run_bstar(pdf_csi *csi)
 static void pdf_run_c(pdf_csi *csi)
 {
 	float a, b, c, d, e, f;
+
+	if (csi->dev->hints & FZ_IGNORE_PATH)
+		return;
+
 	a = csi->stack[0];
 	b = csi->stack[1];
 	c = csi->stack[2];
@@ -2372,6 +2391,8 @@ static void pdf_run_gs(pdf_csi *csi, pdf_obj *rdb)
 
 static void pdf_run_h(pdf_csi *csi)
 {
+	if (csi->dev->hints & FZ_IGNORE_PATH)
+		return;
 	fz_closepath(csi->dev->ctx, csi->path);
 }
 
@@ -2397,6 +2418,10 @@ static void pdf_run_k(pdf_csi *csi)
 static void pdf_run_l(pdf_csi *csi)
 {
 	float a, b;
+
+	if (csi->dev->hints & FZ_IGNORE_PATH)
+		return;
+
 	a = csi->stack[0];
 	b = csi->stack[1];
 	fz_lineto(csi->dev->ctx, csi->path, a, b);
@@ -2405,6 +2430,10 @@ static void pdf_run_l(pdf_csi *csi)
 static void pdf_run_m(pdf_csi *csi)
 {
 	float a, b;
+
+	if (csi->dev->hints & FZ_IGNORE_PATH)
+		return;
+
 	a = csi->stack[0];
 	b = csi->stack[1];
 	fz_moveto(csi->dev->ctx, csi->path, a, b);
@@ -2425,6 +2454,9 @@ static void pdf_run_re(pdf_csi *csi)
 	fz_context *ctx = csi->dev->ctx;
 	float x, y, w, h;
 
+	if (csi->dev->hints & FZ_IGNORE_PATH)
+		return;
+
 	x = csi->stack[0];
 	y = csi->stack[1];
 	w = csi->stack[2];
@@ -2490,6 +2522,10 @@ static void pdf_run_sh(pdf_csi *csi, pdf_obj *rdb)
 static void pdf_run_v(pdf_csi *csi)
 {
 	float a, b, c, d;
+
+	if (csi->dev->hints & FZ_IGNORE_PATH)
+		return;
+
 	a = csi->stack[0];
 	b = csi->stack[1];
 	c = csi->stack[2];
@@ -2509,6 +2545,10 @@ static void pdf_run_w(pdf_csi *csi)
 static void pdf_run_y(pdf_csi *csi)
 {
 	float a, b, c, d;
+
+	if (csi->dev->hints & FZ_IGNORE_PATH)
+		return;
+
 	a = csi->stack[0];
 	b = csi->stack[1];
 	c = csi->stack[2];
@@ -24,6 +24,7 @@ struct pdf_obj_s
 {
 	int refs;
 	pdf_objkind kind;
+	char dirty; /* modified since it was created or parsed */
 	fz_context *ctx;
 	union
 	{
@@ -62,6 +63,7 @@ pdf_new_null(fz_context *ctx)
 	obj = Memento_label(fz_malloc(ctx, sizeof(pdf_obj)), "pdf_obj(null)");
 	obj->ctx = ctx;
 	obj->refs = 1;
+	obj->dirty = 0;
 	obj->kind = PDF_NULL;
 	return obj;
 }
@@ -73,6 +75,7 @@ pdf_new_bool(fz_context *ctx, int b)
 	obj = Memento_label(fz_malloc(ctx, sizeof(pdf_obj)), "pdf_obj(bool)");
 	obj->ctx = ctx;
 	obj->refs = 1;
+	obj->dirty = 0;
 	obj->kind = PDF_BOOL;
 	obj->u.b = b;
 	return obj;
@@ -85,6 +88,7 @@ pdf_new_int(fz_context *ctx, int i)
 	obj = Memento_label(fz_malloc(ctx, sizeof(pdf_obj)), "pdf_obj(int)");
 	obj->ctx = ctx;
 	obj->refs = 1;
+	obj->dirty = 0;
 	obj->kind = PDF_INT;
 	obj->u.i = i;
 	return obj;
@@ -97,6 +101,7 @@ pdf_new_real(fz_context *ctx, float f)
 	obj = Memento_label(fz_malloc(ctx, sizeof(pdf_obj)), "pdf_obj(real)");
 	obj->ctx = ctx;
 	obj->refs = 1;
+	obj->dirty = 0;
 	obj->kind = PDF_REAL;
 	obj->u.f = f;
 	return obj;
@@ -109,6 +114,7 @@ pdf_new_string(fz_context *ctx, const char *str, int len)
 	obj = Memento_label(fz_malloc(ctx, offsetof(pdf_obj, u.s.buf) + len + 1), "pdf_obj(string)");
 	obj->ctx = ctx;
 	obj->refs = 1;
+	obj->dirty = 0;
 	obj->kind = PDF_STRING;
 	obj->u.s.len = len;
 	memcpy(obj->u.s.buf, str, len);
@@ -123,6 +129,7 @@ pdf_new_name(fz_context *ctx, const char *str)
 	obj = Memento_label(fz_malloc(ctx, offsetof(pdf_obj, u.n) + strlen(str) + 1), "pdf_obj(name)");
 	obj->ctx = ctx;
 	obj->refs = 1;
+	obj->dirty = 0;
 	obj->kind = PDF_NAME;
 	strcpy(obj->u.n, str);
 	return obj;
@@ -135,6 +142,7 @@ pdf_new_indirect(fz_context *ctx, int num, int gen, void *xref)
 	obj = Memento_label(fz_malloc(ctx, sizeof(pdf_obj)), "pdf_obj(indirect)");
 	obj->ctx = ctx;
 	obj->refs = 1;
+	obj->dirty = 0;
 	obj->kind = PDF_INDIRECT;
 	obj->u.r.num = num;
 	obj->u.r.gen = gen;
@@ -272,6 +280,7 @@ void pdf_set_int(pdf_obj *obj, int i)
 	if (!obj || obj->kind != PDF_INT)
 		return;
 	obj->u.i = i;
+	obj->dirty = 1;
 }
 
 /* for use by pdf_crypt_obj_imp to decrypt AES string in place */
@@ -391,6 +400,67 @@ pdf_objcmp(pdf_obj *a, pdf_obj *b)
 	return 1;
 }
 
+int
+pdf_obj_is_dirty(pdf_obj *obj)
+{
+	int i;
+
+	if (!obj)
+		return 0;
+	if (obj->dirty)
+		return 1;
+
+	/* direct objects nested inside this one count as part of it */
+	if (obj->kind == PDF_ARRAY)
+	{
+		for (i = 0; i < obj->u.a.len; i++)
+			if (pdf_obj_is_dirty(obj->u.a.items[i]))
+				return 1;
+	}
+	else if (obj->kind == PDF_DICT)
+	{
+		for (i = 0; i < obj->u.d.len; i++)
+			if (pdf_obj_is_dirty(obj->u.d.items[i].v))
+				return 1;
+	}
+	return 0;
+}
+
+void
+pdf_clean_obj(pdf_obj *obj)
+{
+	if (obj)
+		obj->dirty = 0;
+}
+
+void
+pdf_clean_obj_deep(pdf_obj *obj)
+{
+	int i;
+
+	if (!obj)
+		return;
+	obj->dirty = 0;
+
+	if (obj->kind == PDF_ARRAY)
+	{
+		for (i = 0; i < obj->u.a.len; i++)
+			pdf_clean_obj_deep(obj->u.a.items[i]);
+	}
+	else if (obj->kind == PDF_DICT)
+	{
+		for (i = 0; i < obj->u.d.len; i++)
+			pdf_clean_obj_deep(obj->u.d.items[i].v);
+	}
+}
+
+void
+pdf_dirty_obj(pdf_obj *obj)
+{
+	if (obj)
+		obj->dirty = 1;
+}
+
 static char *
 pdf_objkindstr(pdf_obj *obj)
 {
@@ -420,6 +490,7 @@ pdf_new_array(fz_context *ctx, int initialcap)
 	obj = Memento_label(fz_malloc(ctx, sizeof(pdf_obj)), "pdf_obj(array)");
 	obj->ctx = ctx;
 	obj->refs = 1;
+	obj->dirty = 0;
 	obj->kind = PDF_ARRAY;
 
 	obj->u.a.len = 0;
@@ -514,6 +585,7 @@ pdf_array_put(pdf_obj *obj, int i, pdf_obj *item)
 	{
 		pdf_drop_obj(obj->u.a.items[i]);
 		obj->u.a.items[i] = pdf_keep_obj(item);
+		obj->dirty = 1;
 	}
 }
 
@@ -532,6 +604,7 @@ pdf_array_push(pdf_obj *obj, pdf_obj *item)
 			pdf_array_grow(obj);
 		obj->u.a.items[obj->u.a.len] = pdf_keep_obj(item);
 		obj->u.a.len++;
+		obj->dirty = 1;
 	}
 }
 
@@ -551,6 +624,7 @@ pdf_array_insert(pdf_obj *obj, pdf_obj *item)
 		memmove(obj->u.a.items + 1, obj->u.a.items, obj->u.a.len * sizeof(pdf_obj*));
 		obj->u.a.items[0] = pdf_keep_obj(item);
 		obj->u.a.len++;
+		obj->dirty = 1;
 	}
 }
 
@@ -677,6 +751,7 @@ pdf_new_dict(fz_context *ctx, int initialcap)
 	obj = Memento_label(fz_malloc(ctx, sizeof(pdf_obj)), "pdf_obj(dict)");
 	obj->ctx = ctx;
 	obj->refs = 1;
+	obj->dirty = 0;
 	obj->kind = PDF_DICT;
 
 	obj->u.d.sorted = 0;
@@ -773,6 +848,24 @@ pdf_dict_get_val(pdf_obj *obj, int i)
 	return obj->u.d.items[i].v;
 }
 
+void
+pdf_dict_put_val(pdf_obj *obj, int i, pdf_obj *val)
+{
+	RESOLVE(obj);
+	if (!obj || obj->kind != PDF_DICT)
+		return;
+
+	if (i < 0 || i >= obj->u.d.len || !val)
+		return;
+
+	if (obj->u.d.items[i].v != val)
+	{
+		pdf_drop_obj(obj->u.d.items[i].v);
+		obj->u.d.items[i].v = pdf_keep_obj(val);
+		obj->dirty = 1;
+	}
+}
+
 static int
 pdf_dict_finds(pdf_obj *obj, const char *key, int *location)
 {
@@ -940,6 +1033,7 @@ pdf_dict_put(pdf_obj *obj, pdf_obj *key, pdf_obj *val)
 		obj->u.d.items[i].v = pdf_keep_obj(val);
 		obj->u.d.len ++;
 	}
+	obj->dirty = 1;
 }
 
 void
@@ -1066,6 +1160,7 @@ pdf_dict_dels(pdf_obj *obj, const char *key)
 			obj->u.d.sorted = 0;
 			obj->u.d.items[i] = obj->u.d.items[obj->u.d.len-1];
 			obj->u.d.len --;
+			obj->dirty = 1;
 		}
 	}
 }
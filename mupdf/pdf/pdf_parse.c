@@ -282,6 +282,7 @@ pdf_parse_array(pdf_document *xref, fz_stream *file, pdf_lexbuf *buf)
 			switch (tok)
 			{
 			case PDF_TOK_CLOSE_ARRAY:
+				pdf_clean_obj(ary);
 				op = ary;
 				goto end;
 
@@ -486,6 +487,7 @@ pdf_parse_dict(pdf_document *xref, fz_stream *file, pdf_lexbuf *buf)
 		pdf_drop_obj(val);
 		fz_throw(ctx, "cannot parse dict");
 	}
+	pdf_clean_obj(dict);
 	return dict;
 }
 
@@ -52,6 +52,7 @@ struct pdf_write_options_s
 	int do_expand;
 	int do_garbage;
 	int do_linear;
+	int do_incremental;
 	int *use_list;
 	int *ofs_list;
 	int *gen_list;
@@ -550,63 +551,162 @@ static void sweepobj(pdf_document *xref, pdf_write_options *opts, pdf_obj *obj)
 }
 
 /*
- * Scan for and remove duplicate objects (slow)
+ * Scan for and remove duplicate objects
  */
 
+/* SumatraPDF: hash objects so that only likely duplicates are compared
+ * instead of comparing every object against all preceding ones */
+static unsigned int hashobj(pdf_obj *obj)
+{
+	unsigned int h = 5381;
+	char *s;
+	int i, n;
+
+	if (!obj)
+		return h;
+
+	if (pdf_is_indirect(obj))
+		return (pdf_to_num(obj) * 31 + pdf_to_gen(obj)) ^ 0x1D;
+	if (pdf_is_null(obj))
+		return 0x2E;
+	if (pdf_is_bool(obj))
+		return pdf_to_bool(obj) ? 0x3F : 0x40;
+	if (pdf_is_int(obj))
+		return (unsigned int)pdf_to_int(obj) * 2654435761u;
+	if (pdf_is_real(obj))
+	{
+		/* hash the bit pattern (0 and -0 compare equal, though) */
+		union { float f; unsigned int u; } real;
+		real.f = pdf_to_real(obj);
+		if (real.f == 0)
+			real.f = 0;
+		return real.u * 2246822519u;
+	}
+
+	if (pdf_is_string(obj))
+	{
+		s = pdf_to_str_buf(obj);
+		n = pdf_to_str_len(obj);
+		for (i = 0; i < n; i++)
+			h = h * 33 + (unsigned char)s[i];
+		return h;
+	}
+	if (pdf_is_name(obj))
+	{
+		for (s = pdf_to_name(obj); *s; s++)
+			h = h * 33 + (unsigned char)*s;
+		return h ^ 0x5A;
+	}
+
+	if (pdf_is_array(obj))
+	{
+		n = pdf_array_len(obj);
+		h ^= n;
+		for (i = 0; i < n; i++)
+			h = h * 31 + hashobj(pdf_array_get(obj, i));
+		return h;
+	}
+	if (pdf_is_dict(obj))
+	{
+		n = pdf_dict_len(obj);
+		h ^= n << 16;
+		for (i = 0; i < n; i++)
+			h = (h * 31 + hashobj(pdf_dict_get_key(obj, i))) * 31 + hashobj(pdf_dict_get_val(obj, i));
+		return h;
+	}
+
+	return h;
+}
+
+typedef struct
+{
+	unsigned int hash;
+	int num;
+} objhash;
+
+static int cmpobjhash(const void *a, const void *b)
+{
+	const objhash *x = a, *y = b;
+	if (x->hash != y->hash)
+		return x->hash < y->hash ? -1 : 1;
+	return x->num - y->num;
+}
+
 static void removeduplicateobjs(pdf_document *xref, pdf_write_options *opts)
 {
-	int num, other;
+	int num, i, j, start, count;
+	objhash *list;
 	fz_context *ctx = xref->ctx;
 
+	list = fz_malloc_array(ctx, xref->len, sizeof(objhash));
+
+	count = 0;
 	for (num = 1; num < xref->len; num++)
 	{
-		/* Only compare an object to objects preceding it */
-		for (other = 1; other < num; other++)
-		{
-			pdf_obj *a, *b;
-			int differ, newnum;
+		int differ;
 
-			if (num == other || !opts->use_list[num] || !opts->use_list[other])
-				continue;
+		if (!opts->use_list[num])
+			continue;
 
-			/*
-			 * Comparing stream objects data contents would take too long.
-			 *
-			 * pdf_is_stream calls pdf_cache_object and ensures
-			 * that the xref table has the objects loaded.
-			 */
-			fz_try(ctx)
-			{
-				differ = (pdf_is_stream(xref, num, 0) || pdf_is_stream(xref, other, 0));
-			}
-			fz_catch(ctx)
-			{
-				/* Assume different */
-				differ = 1;
-			}
-			if (differ)
-				continue;
-
-			a = xref->table[num].obj;
-			b = xref->table[other].obj;
+		/*
+		 * Comparing stream objects data contents would take too long.
+		 *
+		 * pdf_is_stream calls pdf_cache_object and ensures
+		 * that the xref table has the objects loaded.
+		 */
+		fz_try(ctx)
+		{
+			differ = pdf_is_stream(xref, num, 0);
+		}
+		fz_catch(ctx)
+		{
+			/* Assume different */
+			differ = 1;
+		}
+		if (differ)
+			continue;
 
-			a = pdf_resolve_indirect(a);
-			b = pdf_resolve_indirect(b);
+		list[count].hash = hashobj(pdf_resolve_indirect(xref->table[num].obj));
+		list[count].num = num;
+		count++;
+	}
 
-			if (pdf_objcmp(a, b))
-				continue;
+	/* Sort by hash and then by number, so that within a run of equal
+	 * hashes the lowest numbered object of each kind comes first */
+	qsort(list, count, sizeof(objhash), cmpobjhash);
 
-			/* Keep the lowest numbered object */
-			newnum = fz_mini(num, other);
-			opts->renumber_map[num] = newnum;
-			opts->renumber_map[other] = newnum;
-			opts->rev_renumber_map[newnum] = num; /* Either will do */
-			opts->use_list[fz_maxi(num, other)] = 0;
+	for (start = 0; start < count; start = i)
+	{
+		for (i = start + 1; i < count && list[i].hash == list[start].hash; i++)
+		{
+			pdf_obj *a = pdf_resolve_indirect(xref->table[list[i].num].obj);
 
-			/* One duplicate was found, do not look for another */
-			break;
+			/* Only compare an object to objects preceding it */
+			for (j = start; j < i; j++)
+			{
+				int other = list[j].num;
+				int newnum;
+
+				if (!opts->use_list[other])
+					continue;
+				if (pdf_objcmp(a, pdf_resolve_indirect(xref->table[other].obj)))
+					continue;
+
+				/* Keep the lowest numbered object */
+				num = list[i].num;
+				newnum = other;
+				opts->renumber_map[num] = newnum;
+				opts->renumber_map[other] = newnum;
+				opts->rev_renumber_map[newnum] = num; /* Either will do */
+				opts->use_list[num] = 0;
+
+				/* One duplicate was found, do not look for another */
+				break;
+			}
 		}
 	}
+
+	fz_free(ctx, list);
 }
 
 /*
@@ -666,12 +766,15 @@ static void renumberobj(pdf_document *xref, pdf_write_options *opts, pdf_obj *ob
 		int n = pdf_dict_len(obj);
 		for (i = 0; i < n; i++)
 		{
-			pdf_obj *key = pdf_dict_get_key(obj, i);
 			pdf_obj *val = pdf_dict_get_val(obj, i);
 			if (pdf_is_indirect(val))
 			{
-				val = pdf_new_indirect(ctx, opts->renumber_map[pdf_to_num(val)], 0, xref);
-				pdf_dict_put(obj, key, val);
+				/* SumatraPDF: leave references which don't change alone */
+				int num = pdf_to_num(val);
+				if (opts->renumber_map[num] == num && pdf_to_gen(val) == 0)
+					continue;
+				val = pdf_new_indirect(ctx, opts->renumber_map[num], 0, xref);
+				pdf_dict_put_val(obj, i, val);
 				pdf_drop_obj(val);
 			}
 			else
@@ -689,7 +792,10 @@ static void renumberobj(pdf_document *xref, pdf_write_options *opts, pdf_obj *ob
 			pdf_obj *val = pdf_array_get(obj, i);
 			if (pdf_is_indirect(val))
 			{
-				val = pdf_new_indirect(ctx, opts->renumber_map[pdf_to_num(val)], 0, xref);
+				int num = pdf_to_num(val);
+				if (opts->renumber_map[num] == num && pdf_to_gen(val) == 0)
+					continue;
+				val = pdf_new_indirect(ctx, opts->renumber_map[num], 0, xref);
 				pdf_array_put(obj, i, val);
 				pdf_drop_obj(val);
 			}
@@ -2116,10 +2222,308 @@ static void dump_object_details(pdf_document *xref, pdf_write_options *opts)
 #endif
 
 
+/*
+ * SumatraPDF: Incremental updates
+ *
+ * Copy the original file unchanged and append only those objects which
+ * have been created or modified since it was loaded, followed by a new
+ * xref section chained to the previous one through /Prev. Objects which
+ * have been deleted are not recorded and thus remain in the document.
+ *
+ * The first update is appended to a copy of the original file. Later
+ * updates are appended to the file written by the previous update (or to
+ * a copy of it), so that they only have to contain the objects modified
+ * since then.
+ */
+
+static int isdirtyobj(pdf_document *xref, int num)
+{
+	pdf_xref_entry *x = &xref->table[num];
+
+	/* streams can be replaced without loading their dictionary */
+	if (x->stm_buf && !x->obj)
+		return 1;
+	return x->obj && pdf_obj_is_dirty(x->obj);
+}
+
+/* whether the original file's xref section is a cross-reference stream
+ * (in which case its updates must use cross-reference streams as well) */
+static int usesxrefstream(pdf_document *xref)
+{
+	unsigned char buf[16];
+	int n, i = 0;
+
+	fz_seek(xref->file, xref->startxref, 0);
+	n = fz_read(xref->file, buf, sizeof(buf));
+	while (i < n && (buf[i] == ' ' || buf[i] == '\t' || buf[i] == '\r' || buf[i] == '\n' || buf[i] == '\f'))
+		i++;
+	if (n - i < 4)
+		return 0;
+	return memcmp(buf + i, "xref", 4) != 0;
+}
+
+static void copybase(pdf_document *xref, pdf_write_options *opts)
+{
+	unsigned char buf[65536];
+	unsigned char last = '\n';
+	FILE *base = NULL;
+	int n;
+
+	if (xref->incremental_file)
+	{
+		base = fopen(xref->incremental_file, "rb");
+		if (!base)
+			fz_throw(xref->ctx, "cannot open '%s'", xref->incremental_file);
+	}
+	else
+		fz_seek(xref->file, 0, 0);
+	while ((n = base ? (int)fread(buf, 1, sizeof(buf), base) : fz_read(xref->file, buf, sizeof(buf))) > 0)
+	{
+		if (fwrite(buf, 1, n, opts->out) != (size_t)n)
+		{
+			if (base)
+				fclose(base);
+			fz_throw(xref->ctx, "cannot write to output file");
+		}
+		last = buf[n - 1];
+	}
+	if (base)
+	{
+		if (ferror(base))
+			n = -1;
+		fclose(base);
+	}
+	if (n < 0)
+		fz_throw(xref->ctx, "cannot read original file");
+	if (last != '\n' && last != '\r')
+		fputc('\n', opts->out);
+}
+
+static pdf_obj *newincrementaltrailer(pdf_document *xref, int size, int prev)
+{
+	fz_context *ctx = xref->ctx;
+	pdf_obj *trailer = pdf_new_dict(ctx, 10);
+	pdf_obj *obj;
+
+	fz_try(ctx)
+	{
+		pdf_dict_puts_drop(trailer, "Size", pdf_new_int(ctx, size));
+		pdf_dict_puts_drop(trailer, "Prev", pdf_new_int(ctx, prev));
+
+		obj = pdf_dict_gets(xref->trailer, "Info");
+		if (obj)
+			pdf_dict_puts(trailer, "Info", obj);
+
+		obj = pdf_dict_gets(xref->trailer, "Root");
+		if (obj)
+			pdf_dict_puts(trailer, "Root", obj);
+
+		obj = pdf_dict_gets(xref->trailer, "ID");
+		if (obj)
+			pdf_dict_puts(trailer, "ID", obj);
+	}
+	fz_catch(ctx)
+	{
+		pdf_drop_obj(trailer);
+		fz_rethrow(ctx);
+	}
+	return trailer;
+}
+
+/* An xref section with one subsection per run of updated objects */
+static void writeincrementalxref(pdf_document *xref, pdf_write_options *opts, int prev)
+{
+	int num, from, to;
+	pdf_obj *trailer = NULL;
+	fz_context *ctx = xref->ctx;
+
+	fprintf(opts->out, "xref\n");
+	fprintf(opts->out, "0 1\n%010d %05d f \n", 0, 65535);
+	for (from = 1; from < xref->len; from = to)
+	{
+		for (; from < xref->len && !opts->use_list[from]; from++)
+			;
+		for (to = from; to < xref->len && opts->use_list[to]; to++)
+			;
+		if (from == to)
+			break;
+		fprintf(opts->out, "%d %d\n", from, to - from);
+		for (num = from; num < to; num++)
+			fprintf(opts->out, "%010d %05d n \n", opts->ofs_list[num], opts->gen_list[num]);
+	}
+	fprintf(opts->out, "\n");
+
+	fz_var(trailer);
+
+	fz_try(ctx)
+	{
+		trailer = newincrementaltrailer(xref, xref->len, prev);
+		fprintf(opts->out, "trailer\n");
+		pdf_fprint_obj(opts->out, trailer, opts->do_expand == 0);
+		fprintf(opts->out, "\n");
+	}
+	fz_always(ctx)
+	{
+		pdf_drop_obj(trailer);
+	}
+	fz_catch(ctx)
+	{
+		fz_rethrow(ctx);
+	}
+}
+
+static void pushint(fz_context *ctx, pdf_obj *arr, int i)
+{
+	pdf_obj *obj = pdf_new_int(ctx, i);
+	fz_try(ctx)
+	{
+		pdf_array_push(arr, obj);
+	}
+	fz_always(ctx)
+	{
+		pdf_drop_obj(obj);
+	}
+	fz_catch(ctx)
+	{
+		fz_rethrow(ctx);
+	}
+}
+
+/* The same as writeincrementalxref, but as an (uncompressed) cross-reference
+ * stream. The stream itself uses the first object number after all others */
+static void writeincrementalxrefstream(pdf_document *xref, pdf_write_options *opts, int prev)
+{
+	int num, from, to, count = 0;
+	int stmnum = xref->len;
+	pdf_obj *trailer = NULL;
+	pdf_obj *arr = NULL;
+	fz_context *ctx = xref->ctx;
+
+	opts->ofs_list[stmnum] = ftell(opts->out);
+	opts->gen_list[stmnum] = 0;
+	opts->use_list[stmnum] = 1;
+
+	fz_var(trailer);
+	fz_var(arr);
+
+	fz_try(ctx)
+	{
+		trailer = newincrementaltrailer(xref, stmnum + 1, prev);
+		pdf_dict_puts_drop(trailer, "Type", pdf_new_name(ctx, "XRef"));
+
+		arr = pdf_new_array(ctx, 3);
+		pushint(ctx, arr, 1);
+		pushint(ctx, arr, 4);
+		pushint(ctx, arr, 2);
+		pdf_dict_puts(trailer, "W", arr);
+		pdf_drop_obj(arr);
+		arr = NULL;
+
+		arr = pdf_new_array(ctx, 10);
+		for (from = 1; from <= stmnum; from = to)
+		{
+			for (; from <= stmnum && !opts->use_list[from]; from++)
+				;
+			for (to = from; to <= stmnum && opts->use_list[to]; to++)
+				;
+			if (from == to)
+				break;
+			pushint(ctx, arr, from);
+			pushint(ctx, arr, to - from);
+			count += to - from;
+		}
+		pdf_dict_puts(trailer, "Index", arr);
+		pdf_dict_puts_drop(trailer, "Length", pdf_new_int(ctx, count * 7));
+
+		fprintf(opts->out, "%d 0 obj\n", stmnum);
+		pdf_fprint_obj(opts->out, trailer, opts->do_expand == 0);
+		fprintf(opts->out, "\nstream\n");
+		for (num = 1; num <= stmnum; num++)
+		{
+			if (!opts->use_list[num])
+				continue;
+			fputc(1, opts->out);
+			fputc((opts->ofs_list[num] >> 24) & 0xff, opts->out);
+			fputc((opts->ofs_list[num] >> 16) & 0xff, opts->out);
+			fputc((opts->ofs_list[num] >> 8) & 0xff, opts->out);
+			fputc(opts->ofs_list[num] & 0xff, opts->out);
+			fputc((opts->gen_list[num] >> 8) & 0xff, opts->out);
+			fputc(opts->gen_list[num] & 0xff, opts->out);
+		}
+		fprintf(opts->out, "\nendstream\nendobj\n\n");
+	}
+	fz_always(ctx)
+	{
+		pdf_drop_obj(arr);
+		pdf_drop_obj(trailer);
+	}
+	fz_catch(ctx)
+	{
+		fz_rethrow(ctx);
+	}
+}
+
+/* returns the offset of the update's xref section */
+static int writeincremental(pdf_document *xref, pdf_write_options *opts, int append)
+{
+	int num, startxref, xrefstream, prev;
+	fz_context *ctx = xref->ctx;
+
+	if (xref->crypt)
+		fz_throw(ctx, "incremental updates of encrypted documents are not supported");
+	if (xref->incremental_impossible)
+		fz_throw(ctx, "incremental updates are impossible after saving with renumbering");
+
+	xrefstream = usesxrefstream(xref);
+	prev = xref->incremental_file ? xref->incremental_startxref : xref->startxref;
+	if (!append)
+		copybase(xref, opts);
+
+	for (num = 1; num < xref->len; num++)
+	{
+		/* free slots are either deleted or were never filled in */
+		if (xref->table[num].type == 'f' || !isdirtyobj(xref, num))
+			continue;
+		opts->gen_list[num] = xref->table[num].type == 'n' ? xref->table[num].gen : 0;
+		opts->ofs_list[num] = ftell(opts->out);
+		opts->use_list[num] = 1;
+		writeobject(xref, opts, num, opts->gen_list[num]);
+	}
+
+	startxref = ftell(opts->out);
+	if (xrefstream)
+		writeincrementalxrefstream(xref, opts, prev);
+	else
+		writeincrementalxref(xref, opts, prev);
+
+	fprintf(opts->out, "startxref\n%d\n%%%%EOF\n", startxref);
+	return startxref;
+}
+
+/* SumatraPDF: closes the output file and moves the temporary file (if any)
+ * over the target */
+static void closeoutput(fz_context *ctx, pdf_write_options *opts, char *tmpname, char *filename)
+{
+	int error = fflush(opts->out) != 0 || ferror(opts->out);
+	error = fclose(opts->out) != 0 || error;
+	opts->out = NULL;
+	if (error)
+		fz_throw(ctx, "cannot write to output file '%s'", filename);
+	if (tmpname)
+	{
+		remove(filename);
+		if (rename(tmpname, filename) != 0)
+			fz_throw(ctx, "cannot replace '%s'", filename);
+	}
+}
+
+
 void pdf_write_document(pdf_document *xref, char *filename, fz_write_options *fz_opts)
 {
 	int lastfree;
 	int num;
+	int append;
+	char *tmpname = NULL;
 	pdf_write_options opts = { 0 };
 	fz_context *ctx;
 
@@ -2128,9 +2532,25 @@ void pdf_write_document(pdf_document *xref, char *filename, fz_write_options *fz
 
 	ctx = xref->ctx;
 
-	opts.out = fopen(filename, "wb");
+	/* SumatraPDF: append further incremental updates to the same file */
+	append = fz_opts && fz_opts->do_incremental && xref->incremental_file && !strcmp(xref->incremental_file, filename);
+	if (append)
+		opts.out = fopen(filename, "r+b");
+	else
+	{
+		/* SumatraPDF: write to a temporary file first, so that saving over
+		 * the document's own file doesn't truncate it before it's read */
+		tmpname = fz_malloc(ctx, strlen(filename) + 5);
+		sprintf(tmpname, "%s.tmp", filename);
+		opts.out = fopen(tmpname, "wb");
+	}
 	if (!opts.out)
+	{
+		fz_free(ctx, tmpname);
 		fz_throw(ctx, "cannot open output file '%s'", filename);
+	}
+	if (append)
+		fseek(opts.out, 0, SEEK_END);
 
 	fz_try(ctx)
 	{
@@ -2138,6 +2558,7 @@ void pdf_write_document(pdf_document *xref, char *filename, fz_write_options *fz
 		opts.do_garbage = fz_opts ? fz_opts->do_garbage : 0;
 		opts.do_ascii = fz_opts ? fz_opts->do_ascii: 0;
 		opts.do_linear = fz_opts ? fz_opts->do_linear: 0;
+		opts.do_incremental = fz_opts ? fz_opts->do_incremental : 0;
 		opts.start = 0;
 		opts.main_xref_offset = INT_MIN;
 		/* We deliberately make these arrays long enough to cope with
@@ -2159,6 +2580,27 @@ void pdf_write_document(pdf_document *xref, char *filename, fz_write_options *fz
 			opts.rev_gen_list[num] = xref->table[num].gen;
 		}
 
+		if (opts.do_incremental)
+		{
+			int startxref = writeincremental(xref, &opts, append);
+			closeoutput(ctx, &opts, tmpname, filename);
+			/* the next update only has to contain objects modified from now on */
+			for (num = 1; num < xref->len; num++)
+			{
+				if (opts.use_list[num])
+					pdf_clean_obj_deep(xref->table[num].obj);
+			}
+			if (!append)
+			{
+				fz_free(ctx, xref->incremental_file);
+				xref->incremental_file = NULL;
+				xref->incremental_file = fz_strdup(ctx, filename);
+			}
+			xref->incremental_startxref = startxref;
+			xref->dirty = 0;
+			break;
+		}
+
 		/* Make sure any objects hidden in compressed streams have been loaded */
 		preloadobjstms(xref);
 
@@ -2226,6 +2668,18 @@ void pdf_write_document(pdf_document *xref, char *filename, fz_write_options *fz
 			writexref(xref, &opts, 0, xref->len, 1, 0, opts.first_xref_offset);
 		}
 
+		closeoutput(ctx, &opts, tmpname, filename);
+
+		/* SumatraPDF: further incremental updates can't be based on a
+		 * previous update (which may just have been overwritten) nor on the
+		 * original file if objects were renumbered or a previous update
+		 * has already cleared their modification flags */
+		if (xref->incremental_file || opts.do_garbage >= 2 || opts.do_linear)
+			xref->incremental_impossible = 1;
+		fz_free(ctx, xref->incremental_file);
+		xref->incremental_file = NULL;
+		xref->incremental_startxref = 0;
+
 		xref->dirty = 0;
 	}
 	fz_always(ctx)
@@ -2250,10 +2704,15 @@ void pdf_write_document(pdf_document *xref, char *filename, fz_write_options *fz
 		pdf_drop_obj(opts.hints_s);
 		pdf_drop_obj(opts.hints_length);
 		page_objects_list_destroy(ctx, opts.page_object_lists);
-		fclose(opts.out);
+		if (opts.out)
+			fclose(opts.out);
 	}
 	fz_catch(ctx)
 	{
+		if (tmpname)
+			remove(tmpname);
+		fz_free(ctx, tmpname);
 		fz_rethrow(ctx);
 	}
+	fz_free(ctx, tmpname);
 }
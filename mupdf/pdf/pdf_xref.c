@@ -875,6 +875,7 @@ pdf_close_document(pdf_document *xref)
 	ctx = xref->ctx;
 
 	pdf_drop_js(xref->js);
+	fz_free(ctx, xref->incremental_file);
 
 	if (xref->table)
 	{
@@ -1229,6 +1230,8 @@ pdf_update_object(pdf_document *xref, int num, pdf_obj *newobj)
 	x->type = 'n';
 	x->ofs = 0;
 	x->obj = pdf_keep_obj(newobj);
+	/* SumatraPDF: include the object in the next incremental update */
+	pdf_dirty_obj(newobj);
 }
 
 void
@@ -1246,6 +1249,8 @@ pdf_update_stream(pdf_document *xref, int num, fz_buffer *newbuf)
 
 	fz_drop_buffer(xref->ctx, x->stm_buf);
 	x->stm_buf = fz_keep_buffer(xref->ctx, newbuf);
+	/* SumatraPDF: include the object in the next incremental update */
+	pdf_dirty_obj(x->obj);
 }
 
 int
@@ -196,6 +196,10 @@ xps_parse_image_brush(xps_document *doc, fz_matrix ctm, fz_rect area,
 	xps_image_key *key = NULL;
 	fz_var(key);
 
+	/* SumatraPDF: don't load images for devices which ignore them */
+	if (doc->dev->hints & FZ_IGNORE_IMAGE)
+		return;
+
 	fz_try(doc->ctx)
 	{
 		part = xps_find_image_brush_source_part(doc, base_uri, root);
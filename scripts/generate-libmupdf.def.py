@@ -68,6 +68,17 @@ EXPORTS
 	compress
 	compressBound
 	crc32
+
+; freetype exports
+
+	FT_Init_FreeType
+	FT_Done_FreeType
+	FT_New_Memory_Face
+	FT_Done_Face
+	FT_Set_Char_Size
+	FT_Get_Char_Index
+	FT_Load_Glyph
+	FT_Get_Sfnt_Table
 """
 
 def main():
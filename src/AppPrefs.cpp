@@ -194,59 +194,76 @@ static BencDict* SerializeGlobalPrefs(SerializableGlobalPrefs& globalPrefs)
     return prefs;
 }
 
-static BencDict *DisplayState_Serialize(DisplayState *ds, bool globalPrefsOnly)
+static void AppendInt(str::Str<char>& data, const char *key, int64_t value)
 {
-    BencDict *prefs = new BencDict();
-    if (!prefs)
-        return NULL;
+    benc::AppendString(data, key);
+    benc::AppendInt(data, value);
+}
 
-    prefs->Add(FILE_STR, ds->filePath);
-    if (ds->decryptionKey)
-        prefs->AddRaw(DECRYPTION_KEY_STR, ds->decryptionKey);
+static void AppendString(str::Str<char>& data, const char *key, const WCHAR *value)
+{
+    ScopedMem<char> valueUtf8(str::conv::ToUtf8(value));
+    benc::AppendString(data, key);
+    benc::AppendString(data, valueUtf8);
+}
 
-    prefs->Add(OPEN_COUNT_STR, ds->openCount);
-    prefs->Add(IS_PINNED_STR, ds->isPinned);
+static void AppendRaw(str::Str<char>& data, const char *key, const char *value)
+{
+    benc::AppendString(data, key);
+    benc::AppendString(data, value);
+}
+
+// file history entries are appended in place (instead of being built up
+// as BencDicts first), as there can be a thousand of them (note: the keys
+// must be appended in sorted order, as BencDict::Encode would produce them)
+static void DisplayState_Serialize(str::Str<char>& data, DisplayState *ds, bool globalPrefsOnly)
+{
+    data.Append('d');
     if (globalPrefsOnly || ds->useGlobalValues) {
-        prefs->Add(USE_GLOBAL_VALUES_STR, TRUE);
-        return prefs;
+        if (ds->decryptionKey)
+            AppendRaw(data, DECRYPTION_KEY_STR, ds->decryptionKey);
+        AppendString(data, FILE_STR, ds->filePath);
+        AppendInt(data, OPEN_COUNT_STR, ds->openCount);
+        AppendInt(data, IS_PINNED_STR, ds->isPinned);
+        AppendInt(data, USE_GLOBAL_VALUES_STR, TRUE);
+        data.Append('e');
+        return;
     }
 
-    const WCHAR *mode = DisplayModeConv::NameFromEnum(ds->displayMode);
-    prefs->Add(DISPLAY_MODE_STR, mode);
-    prefs->Add(PAGE_NO_STR, ds->pageNo);
-    prefs->Add(REPARSE_IDX_STR, ds->reparseIdx);
-    prefs->Add(ROTATION_STR, ds->rotation);
-    prefs->Add(SCROLL_X_STR, ds->scrollPos.x);
-    prefs->Add(SCROLL_Y_STR, ds->scrollPos.y);
-    prefs->Add(WINDOW_STATE_STR, ds->windowState);
-    prefs->Add(WINDOW_X_STR, ds->windowPos.x);
-    prefs->Add(WINDOW_Y_STR, ds->windowPos.y);
-    prefs->Add(WINDOW_DX_STR, ds->windowPos.dx);
-    prefs->Add(WINDOW_DY_STR, ds->windowPos.dy);
-
-    prefs->Add(TOC_VISIBLE_STR, ds->tocVisible);
-    prefs->Add(SIDEBAR_DX_STR, ds->sidebarDx);
-
-    CrashIf(!IsValidZoom(ds->zoomVirtual));
-    ScopedMem<char> zoom(str::Format("%.4f", ds->zoomVirtual));
-    prefs->AddRaw(ZOOM_VIRTUAL_STR, zoom);
-
+    if (ds->decryptionKey)
+        AppendRaw(data, DECRYPTION_KEY_STR, ds->decryptionKey);
+    AppendString(data, DISPLAY_MODE_STR, DisplayModeConv::NameFromEnum(ds->displayMode));
+    AppendString(data, FILE_STR, ds->filePath);
+    AppendInt(data, OPEN_COUNT_STR, ds->openCount);
+    AppendInt(data, PAGE_NO_STR, ds->pageNo);
+    AppendInt(data, IS_PINNED_STR, ds->isPinned);
+    AppendInt(data, REPARSE_IDX_STR, ds->reparseIdx);
+    AppendInt(data, ROTATION_STR, ds->rotation);
+    AppendInt(data, SCROLL_X_STR, ds->scrollPos.x);
+    AppendInt(data, SCROLL_Y_STR, ds->scrollPos.y);
+    AppendInt(data, TOC_VISIBLE_STR, ds->tocVisible);
+    AppendInt(data, SIDEBAR_DX_STR, ds->sidebarDx);
     if (ds->tocState && ds->tocState->Count() > 0) {
-        BencArray *tocState = new BencArray();
-        if (tocState) {
-            for (size_t i = 0; i < ds->tocState->Count(); i++)
-                tocState->Add(ds->tocState->At(i));
-            prefs->Add(TOC_STATE_STR, tocState);
-        }
+        benc::AppendString(data, TOC_STATE_STR);
+        data.Append('l');
+        for (size_t i = 0; i < ds->tocState->Count(); i++)
+            benc::AppendInt(data, ds->tocState->At(i));
+        data.Append('e');
     }
+    AppendInt(data, WINDOW_DX_STR, ds->windowPos.dx);
+    AppendInt(data, WINDOW_DY_STR, ds->windowPos.dy);
+    AppendInt(data, WINDOW_STATE_STR, ds->windowState);
+    AppendInt(data, WINDOW_X_STR, ds->windowPos.x);
+    AppendInt(data, WINDOW_Y_STR, ds->windowPos.y);
 
-    return prefs;
+    CrashIf(!IsValidZoom(ds->zoomVirtual));
+    ScopedMem<char> zoom(str::Format("%.4f", ds->zoomVirtual));
+    AppendRaw(data, ZOOM_VIRTUAL_STR, zoom);
+    data.Append('e');
 }
 
-static BencArray *SerializeFileHistory(FileHistory& fileHistory, bool globalPrefsOnly)
+static void SerializeFileHistory(str::Str<char>& data, FileHistory& fileHistory, bool globalPrefsOnly)
 {
-    BencArray *arr = new BencArray();
-
     // Don't save more file entries than will be useful
     int minOpenCount = 0;
     if (globalPrefsOnly) {
@@ -256,6 +273,7 @@ static BencArray *SerializeFileHistory(FileHistory& fileHistory, bool globalPref
             minOpenCount = frequencyList.At(FILE_HISTORY_MAX_FREQUENT)->openCount / 2;
     }
 
+    data.Append('l');
     DisplayState *state;
     for (int index = 0; (state = fileHistory.Get(index)); index++) {
         // never forget pinned documents and documents we've remembered a password for
@@ -264,16 +282,9 @@ static BencArray *SerializeFileHistory(FileHistory& fileHistory, bool globalPref
             continue;
         if (state->openCount < minOpenCount && index > FILE_HISTORY_MAX_RECENT && !forceSave)
             continue;
-        BencDict *obj = DisplayState_Serialize(state, globalPrefsOnly);
-        if (!obj)
-            goto Error;
-        arr->Add(obj);
+        DisplayState_Serialize(data, state, globalPrefsOnly);
     }
-    return arr;
-
-Error:
-    delete arr;
-    return NULL;
+    data.Append('e');
 }
 
 static inline const WCHAR *NullToEmpty(const WCHAR *s)
@@ -313,33 +324,34 @@ static BencArray *SerializeFavorites(Favorites *favs)
 
 static char *SerializePrefs(SerializableGlobalPrefs& globalPrefs, FileHistory& root, Favorites *favs, size_t* lenOut)
 {
-    char *data = NULL;
-
-    BencDict *prefs = new BencDict();
-    if (!prefs)
-        goto Error;
-
     BencDict* global = SerializeGlobalPrefs(globalPrefs);
     if (!global)
-        goto Error;
-    prefs->Add(GLOBAL_PREFS_STR, global);
-
-    BencArray *fileHistory = SerializeFileHistory(root, globalPrefs.globalPrefsOnly);
-    if (!fileHistory)
-        goto Error;
-    prefs->Add(FILE_HISTORY_STR, fileHistory);
+        return NULL;
+    ScopedMem<char> globalData(global->Encode());
+    delete global;
 
     BencArray *favsArr = SerializeFavorites(favs);
     if (!favsArr)
-        goto Error;
-    prefs->Add(FAVS_STR, favsArr);
+        return NULL;
+    ScopedMem<char> favsData(favsArr->Encode());
+    delete favsArr;
 
-    data = prefs->Encode();
-    *lenOut = str::Len(data);
+    if (!globalData || !favsData)
+        return NULL;
 
-Error:
-    delete prefs;
-    return data;
+    // keys in sorted order (cf. BencDict::Add)
+    str::Str<char> data(64 * 1024);
+    data.Append('d');
+    benc::AppendString(data, FAVS_STR);
+    data.Append(favsData);
+    benc::AppendString(data, FILE_HISTORY_STR);
+    SerializeFileHistory(data, root, globalPrefs.globalPrefsOnly);
+    benc::AppendString(data, GLOBAL_PREFS_STR);
+    data.Append(globalData);
+    data.Append('e');
+
+    *lenOut = data.Size();
+    return data.StealData();
 }
 
 static void Retrieve(BencDict *dict, const char *key, int& value)
@@ -409,68 +421,179 @@ static void Retrieve(BencDict *dict, const char *key, DisplayMode& value)
     }
 }
 
-static DisplayState * DeserializeDisplayState(BencDict *dict, bool globalPrefsOnly)
+static bool IsKey(const char *key, size_t keyLen, const char *name)
 {
-    DisplayState *ds = new DisplayState();
-    if (!ds)
-        return NULL;
+    return keyLen == str::Len(name) && str::EqN(key, name, keyLen);
+}
 
-    Retrieve(dict, FILE_STR, ds->filePath);
-    if (!ds->filePath) {
-        delete ds;
-        return NULL;
+// the following ReadValue functions only modify value if the data is of the expected type
+// (as the Retrieve functions do for BencDicts)
+
+static void ReadValue(const char *data, int& value)
+{
+    int64_t num;
+    if (benc::ParseInt(data, &num))
+        value = (int)num;
+}
+
+static void ReadValue(const char *data, bool& value)
+{
+    int64_t num;
+    if (benc::ParseInt(data, &num))
+        value = num != 0;
+}
+
+static void ReadValue(const char *data, WCHAR *& value)
+{
+    const char *string;
+    size_t len;
+    if (benc::ParseString(data, &string, &len)) {
+        ScopedMem<char> stringUtf8(str::DupN(string, len));
+        WCHAR *str = str::conv::FromUtf8(stringUtf8);
+        if (str) {
+            free(value);
+            value = str;
+        }
     }
+}
 
-    RetrieveRaw(dict, DECRYPTION_KEY_STR, ds->decryptionKey);
-    Retrieve(dict, OPEN_COUNT_STR, ds->openCount);
-    Retrieve(dict, IS_PINNED_STR, ds->isPinned);
-    if (globalPrefsOnly) {
-        ds->useGlobalValues = TRUE;
-        return ds;
+static void ReadRawValue(const char *data, char *& value)
+{
+    const char *string;
+    size_t len;
+    if (benc::ParseString(data, &string, &len)) {
+        char *str = str::DupN(string, len);
+        if (str) {
+            free(value);
+            value = str;
+        }
+    }
+}
+
+static void ReadValue(const char *data, float& value)
+{
+    const char *string;
+    size_t len;
+    if (benc::ParseString(data, &string, &len)) {
+        ScopedMem<char> number(str::DupN(string, len));
+        value = (float)atof(number);
     }
+}
+
+static void ReadValue(const char *data, DisplayMode& value)
+{
+    WCHAR *mode = NULL;
+    ReadValue(data, mode);
+    if (mode)
+        DisplayModeConv::EnumFromName(mode, &value);
+    free(mode);
+}
 
-    Retrieve(dict, DISPLAY_MODE_STR, ds->displayMode);
-    Retrieve(dict, PAGE_NO_STR, ds->pageNo);
-    Retrieve(dict, REPARSE_IDX_STR, ds->reparseIdx);
-    Retrieve(dict, ROTATION_STR, ds->rotation);
-    Retrieve(dict, SCROLL_X_STR, ds->scrollPos.x);
-    Retrieve(dict, SCROLL_Y_STR, ds->scrollPos.y);
-    Retrieve(dict, WINDOW_STATE_STR, ds->windowState);
-    Retrieve(dict, WINDOW_X_STR, ds->windowPos.x);
-    Retrieve(dict, WINDOW_Y_STR, ds->windowPos.y);
-    Retrieve(dict, WINDOW_DX_STR, ds->windowPos.dx);
-    Retrieve(dict, WINDOW_DY_STR, ds->windowPos.dy);
-    Retrieve(dict, TOC_VISIBLE_STR, ds->tocVisible);
-    Retrieve(dict, SIDEBAR_DX_STR, ds->sidebarDx);
-    Retrieve(dict, ZOOM_VIRTUAL_STR, ds->zoomVirtual);
-    Retrieve(dict, USE_GLOBAL_VALUES_STR, ds->useGlobalValues);
-
-    BencArray *tocState = dict->GetArray(TOC_STATE_STR);
-    if (tocState) {
-        size_t len = tocState->Length();
-        ds->tocState = new Vec<int>(len);
-        if (ds->tocState) {
-            for (size_t i = 0; i < len; i++) {
-                BencInt *intObj = tocState->GetInt(i);
-                if (intObj)
-                    ds->tocState->Append((int)intObj->Value());
+// reads a file history entry in place (i.e. without decoding it into a BencDict first)
+// note: data must have been validated with benc::Skip
+static DisplayState * DeserializeDisplayState(const char *data, bool globalPrefsOnly)
+{
+    if (*data != 'd')
+        return NULL;
+    DisplayState *ds = new DisplayState();
+    if (!ds)
+        return NULL;
+
+    const char *key;
+    size_t keyLen;
+    for (data = benc::ParseString(data + 1, &key, &keyLen); data; data = benc::ParseString(benc::Skip(data), &key, &keyLen)) {
+        if (IsKey(key, keyLen, FILE_STR))
+            ReadValue(data, ds->filePath);
+        else if (IsKey(key, keyLen, DECRYPTION_KEY_STR))
+            ReadRawValue(data, ds->decryptionKey);
+        else if (IsKey(key, keyLen, OPEN_COUNT_STR))
+            ReadValue(data, ds->openCount);
+        else if (IsKey(key, keyLen, IS_PINNED_STR))
+            ReadValue(data, ds->isPinned);
+        else if (globalPrefsOnly)
+            continue;
+        else if (IsKey(key, keyLen, DISPLAY_MODE_STR))
+            ReadValue(data, ds->displayMode);
+        else if (IsKey(key, keyLen, PAGE_NO_STR))
+            ReadValue(data, ds->pageNo);
+        else if (IsKey(key, keyLen, REPARSE_IDX_STR))
+            ReadValue(data, ds->reparseIdx);
+        else if (IsKey(key, keyLen, ROTATION_STR))
+            ReadValue(data, ds->rotation);
+        else if (IsKey(key, keyLen, SCROLL_X_STR))
+            ReadValue(data, ds->scrollPos.x);
+        else if (IsKey(key, keyLen, SCROLL_Y_STR))
+            ReadValue(data, ds->scrollPos.y);
+        else if (IsKey(key, keyLen, WINDOW_STATE_STR))
+            ReadValue(data, ds->windowState);
+        else if (IsKey(key, keyLen, WINDOW_X_STR))
+            ReadValue(data, ds->windowPos.x);
+        else if (IsKey(key, keyLen, WINDOW_Y_STR))
+            ReadValue(data, ds->windowPos.y);
+        else if (IsKey(key, keyLen, WINDOW_DX_STR))
+            ReadValue(data, ds->windowPos.dx);
+        else if (IsKey(key, keyLen, WINDOW_DY_STR))
+            ReadValue(data, ds->windowPos.dy);
+        else if (IsKey(key, keyLen, TOC_VISIBLE_STR))
+            ReadValue(data, ds->tocVisible);
+        else if (IsKey(key, keyLen, SIDEBAR_DX_STR))
+            ReadValue(data, ds->sidebarDx);
+        else if (IsKey(key, keyLen, ZOOM_VIRTUAL_STR))
+            ReadValue(data, ds->zoomVirtual);
+        else if (IsKey(key, keyLen, USE_GLOBAL_VALUES_STR))
+            ReadValue(data, ds->useGlobalValues);
+        else if (IsKey(key, keyLen, TOC_STATE_STR) && *data == 'l') {
+            delete ds->tocState;
+            ds->tocState = new Vec<int>();
+            int64_t value;
+            for (const char *item = data + 1; *item != 'e'; item = benc::Skip(item)) {
+                if (benc::ParseInt(item, &value))
+                    ds->tocState->Append((int)value);
             }
         }
     }
 
+    if (!ds->filePath) {
+        delete ds;
+        return NULL;
+    }
+    if (globalPrefsOnly)
+        ds->useGlobalValues = TRUE;
     return ds;
 }
 
 static void DeserializePrefs(const char *prefsTxt, SerializableGlobalPrefs& globalPrefs,
     FileHistory& fh, Favorites **favsOut)
 {
-    BencObj *obj = BencObj::Decode(prefsTxt);
-    if (!obj || obj->Type() != BT_DICT)
-        goto Exit;
-    BencDict *prefs = static_cast<BencDict *>(obj);
-    BencDict *global = prefs->GetDict(GLOBAL_PREFS_STR);
-    if (!global)
+    // only the global preferences and the favorites are decoded into BencObjs,
+    // while the (potentially large) file history is read in place
+    const char *globalData = NULL, *historyData = NULL, *favsData = NULL;
+    const char *data = prefsTxt;
+    if (*data != 'd')
+        return;
+    for (data++; data && *data != 'e'; data = benc::Skip(data)) {
+        const char *key;
+        size_t keyLen;
+        data = benc::ParseString(data, &key, &keyLen);
+        if (!data)
+            break;
+        if (IsKey(key, keyLen, GLOBAL_PREFS_STR))
+            globalData = data;
+        else if (IsKey(key, keyLen, FILE_HISTORY_STR))
+            historyData = data;
+        else if (IsKey(key, keyLen, FAVS_STR))
+            favsData = data;
+    }
+    // ignore the preferences completely, if they aren't entirely valid
+    if (!data || !str::Eq(data, "e"))
+        return;
+
+    size_t len;
+    BencObj *globalObj = globalData ? BencObj::Decode(globalData, &len) : NULL;
+    BencObj *favsObj = NULL;
+    if (!globalObj || globalObj->Type() != BT_DICT)
         goto Exit;
+    BencDict *global = static_cast<BencDict *>(globalObj);
 
     Retrieve(global, TOOLBAR_VISIBLE_STR, globalPrefs.toolbarVisible);
     Retrieve(global, TOC_VISIBLE_STR, globalPrefs.tocVisible);
@@ -518,15 +641,10 @@ static void DeserializePrefs(const char *prefsTxt, SerializableGlobalPrefs& glob
     int weekDiff = GetWeekCount() - globalPrefs.openCountWeek;
     globalPrefs.openCountWeek = GetWeekCount();
 
-    BencArray *fileHistory = prefs->GetArray(FILE_HISTORY_STR);
-    if (!fileHistory)
+    if (!historyData || *historyData != 'l')
         goto Exit;
-    size_t dlen = fileHistory->Length();
-    for (size_t i = 0; i < dlen; i++) {
-        BencDict *dict = fileHistory->GetDict(i);
-        assert(dict);
-        if (!dict) continue;
-        DisplayState *state = DeserializeDisplayState(dict, globalPrefs.globalPrefsOnly);
+    for (data = historyData + 1; *data != 'e'; data = benc::Skip(data)) {
+        DisplayState *state = DeserializeDisplayState(data, globalPrefs.globalPrefsOnly);
         if (state) {
             // "age" openCount statistics (cut in in half after every week)
             state->openCount >>= weekDiff;
@@ -537,9 +655,10 @@ static void DeserializePrefs(const char *prefsTxt, SerializableGlobalPrefs& glob
     Favorites *favs = new Favorites();
     *favsOut = favs;
 
-    BencArray *favsArr = prefs->GetArray(FAVS_STR);
-    if (!favsArr)
+    favsObj = favsData ? BencObj::Decode(favsData, &len) : NULL;
+    if (!favsObj || favsObj->Type() != BT_ARRAY)
         goto Exit;
+    BencArray *favsArr = static_cast<BencArray *>(favsObj);
     for (size_t i = 0; i < favsArr->Length(); i += 2) {
         BencString *filePathBenc = favsArr->GetString(i);
         BencArray *favData = favsArr->GetArray(i+1);
@@ -559,7 +678,8 @@ static void DeserializePrefs(const char *prefsTxt, SerializableGlobalPrefs& glob
     }
 
 Exit:
-    delete obj;
+    delete globalObj;
+    delete favsObj;
 }
 
 namespace Prefs {
@@ -5,18 +5,76 @@
 #include "ChmDoc.h"
 
 #include "ByteReader.h"
+#include "Dict.h"
 #include "FileUtil.h"
+#include "ThreadUtil.h"
 #include "TrivialHtmlParser.h"
 
 #define CHM_MT
 #define PPC_BSTR
 #include <chm_lib.h>
 
+// CHMLib only caches 5 blocks (of usually 32 KB) by default, which means that
+// consecutive topics often have to be decompressed from the previous reset
+// point again (blocks within a reset interval depend on each other)
+#define DEFAULT_CHM_CACHE_BLOCKS 64
+
+ChmDoc::ChmDoc() : chmHandle(NULL), codepage(0),
+    cacheBlocks(DEFAULT_CHM_CACHE_BLOCKS), objectIndex(NULL) { }
+
 ChmDoc::~ChmDoc()
 {
+    delete objectIndex;
     chm_close(chmHandle);
 }
 
+void ChmDoc::SetCacheBlocks(int count)
+{
+    cacheBlocks = count;
+    if (chmHandle)
+        chm_set_param(chmHandle, CHM_PARAM_MAX_BLOCKS_CACHED, cacheBlocks);
+}
+
+void ChmDoc::BuildObjectIndex()
+{
+    objectIndex = new dict::MapStrToInt(1024);
+    chm_enumerate(chmHandle, CHM_ENUMERATE_ALL, AddToObjectIndex, this);
+}
+
+int ChmDoc::AddToObjectIndex(struct chmFile *h, struct chmUnitInfo *info, void *data)
+{
+    ChmDoc *doc = (ChmDoc *)data;
+    ScopedMem<char> key(str::Dup(info->path));
+    if (!key)
+        return CHM_ENUMERATOR_FAILURE;
+    str::ToLower(key);
+    ObjectInfo obj = { info->start, info->length, info->space };
+    // for duplicate paths, the first object wins (as for chm_resolve_object)
+    if (doc->objectIndex->Insert(key, (int)doc->objects.Count(), NULL))
+        doc->objects.Append(obj);
+    return CHM_ENUMERATOR_CONTINUE;
+}
+
+// same as chm_resolve_object (info->path isn't set, though)
+bool ChmDoc::ResolveObject(const char *fileName, struct chmUnitInfo *info)
+{
+    ScopedMem<char> key(str::Dup(fileName));
+    if (key)
+        str::ToLower(key);
+    int idx;
+    if (key && objectIndex && objectIndex->Get(key, &idx)) {
+        ObjectInfo *obj = &objects.At(idx);
+        info->start = obj->start;
+        info->length = obj->length;
+        info->space = obj->space;
+        info->flags = 0;
+        info->path[0] = '\0';
+        return true;
+    }
+    // in case the directory couldn't be enumerated completely
+    return chm_resolve_object(chmHandle, fileName, info) == CHM_RESOLVE_SUCCESS;
+}
+
 bool ChmDoc::HasData(const char *fileName)
 {
     if (!fileName)
@@ -31,10 +89,16 @@ bool ChmDoc::HasData(const char *fileName)
         fileName += 2;
 
     struct chmUnitInfo info;
-    return chm_resolve_object(chmHandle, fileName, &info) == CHM_RESOLVE_SUCCESS;
+    return ResolveObject(fileName, &info);
 }
 
 unsigned char *ChmDoc::GetData(const char *fileName, size_t *lenOut)
+{
+    return GetData(chmHandle, fileName, lenOut);
+}
+
+// h can be a different handle for the same file (for concurrent reading)
+unsigned char *ChmDoc::GetData(struct chmFile *h, const char *fileName, size_t *lenOut)
 {
     ScopedMem<char> fileNameTmp;
     if (!str::StartsWith(fileName, "/")) {
@@ -45,8 +109,7 @@ unsigned char *ChmDoc::GetData(const char *fileName, size_t *lenOut)
     }
 
     struct chmUnitInfo info;
-    int res = chm_resolve_object(chmHandle, fileName, &info);
-    if (CHM_RESOLVE_SUCCESS != res)
+    if (!ResolveObject(fileName, &info))
         return NULL;
     size_t len = (size_t)info.length;
     if (len > 128 * 1024 * 1024) {
@@ -58,7 +121,7 @@ unsigned char *ChmDoc::GetData(const char *fileName, size_t *lenOut)
     ScopedMem<unsigned char> data((unsigned char *)malloc(len + 1));
     if (!data)
         return NULL;
-    if (!chm_retrieve_object(chmHandle, &info, data.Get(), 0, len))
+    if (!chm_retrieve_object(h, &info, data.Get(), 0, len))
         return NULL;
     data[len] = '\0';
 
@@ -67,6 +130,116 @@ unsigned char *ChmDoc::GetData(const char *fileName, size_t *lenOut)
     return data.StealData();
 }
 
+struct ChmDataBatch {
+    const char **       fileNames;
+    unsigned char **    data;
+    size_t *            lens;
+    // indices into fileNames, ordered by the objects' position
+    Vec<size_t>         order;
+};
+
+// retrieves a range of objects which are stored next to each other, so that
+// different threads mostly decompress different LZX reset intervals
+class ChmDataThread : public ThreadBase {
+    ChmDoc *        doc;
+    ChmDataBatch *  batch;
+    size_t          start, end;
+
+public:
+    ChmDataThread(ChmDoc *doc, ChmDataBatch *batch, size_t start, size_t end) :
+        ThreadBase("ChmDataThread"), doc(doc), batch(batch), start(start), end(end) { }
+
+    virtual void Run() {
+        struct chmFile *h = chm_open((WCHAR *)doc->fileName.Get());
+        if (h)
+            chm_set_param(h, CHM_PARAM_MAX_BLOCKS_CACHED, doc->cacheBlocks);
+        // fall back to the shared handle, if the file can't be opened again
+        doc->GetDataRange(h ? h : doc->chmHandle, batch, start, end);
+        if (h)
+            chm_close(h);
+    }
+};
+
+void ChmDoc::GetDataRange(struct chmFile *h, ChmDataBatch *batch, size_t start, size_t end)
+{
+    for (size_t i = start; i < end; i++) {
+        size_t idx = batch->order.At(i);
+        batch->data[idx] = GetData(h, batch->fileNames[idx], &batch->lens[idx]);
+    }
+}
+
+struct ChmObjectPos {
+    int     space;
+    uint64  start;
+    size_t  idx;
+};
+
+static int cmpObjectPos(const void *a, const void *b)
+{
+    const ChmObjectPos *p1 = (const ChmObjectPos *)a;
+    const ChmObjectPos *p2 = (const ChmObjectPos *)b;
+    if (p1->space != p2->space)
+        return p1->space - p2->space;
+    if (p1->start != p2->start)
+        return p1->start < p2->start ? -1 : 1;
+    return p1->idx < p2->idx ? -1 : p1->idx > p2->idx ? 1 : 0;
+}
+
+void ChmDoc::GetDataBatch(const char **fileNames, size_t count, unsigned char **data, size_t *lens, int threadCount)
+{
+    ChmDataBatch batch;
+    batch.fileNames = fileNames;
+    batch.data = data;
+    batch.lens = lens;
+
+    Vec<ChmObjectPos> positions;
+    for (size_t i = 0; i < count; i++) {
+        data[i] = NULL;
+        lens[i] = 0;
+        ChmObjectPos pos = { 0, 0, i };
+        // the path is normalized the same way as in GetData
+        const char *path = fileNames[i];
+        ScopedMem<char> pathTmp;
+        if (!str::StartsWith(path, "/"))
+            path = pathTmp.Set(str::Join("/", path));
+        else if (str::StartsWith(path, "///"))
+            path += 2;
+        struct chmUnitInfo info;
+        if (ResolveObject(path, &info)) {
+            pos.space = info.space;
+            pos.start = info.start;
+        }
+        positions.Append(pos);
+    }
+    positions.Sort(cmpObjectPos);
+    for (size_t i = 0; i < count; i++) {
+        batch.order.Append(positions.At(i).idx);
+    }
+
+    if (threadCount <= 0) {
+        SYSTEM_INFO si;
+        GetSystemInfo(&si);
+        threadCount = (int)si.dwNumberOfProcessors;
+    }
+    if ((size_t)threadCount > count)
+        threadCount = (int)count;
+    if (threadCount < 1)
+        threadCount = 1;
+    // the calling thread retrieves the first range (through the main handle)
+    Vec<ChmDataThread *> threads;
+    for (int i = 1; i < threadCount; i++) {
+        ChmDataThread *thread = new ChmDataThread(this, &batch, count * i / threadCount, count * (i + 1) / threadCount);
+        threads.Append(thread);
+        thread->Start();
+    }
+    GetDataRange(chmHandle, &batch, 0, count / threadCount);
+    for (size_t i = 0; i < threads.Count(); i++) {
+        // Run() doesn't check for cancellation, so this waits for it to finish
+        threads.At(i)->RequestCancelAndWaitToStop();
+        threads.At(i)->Release();
+    }
+}
+
 char *ChmDoc::ToUtf8(const unsigned char *text, UINT overrideCP)
 {
     const char *s = (char *)text;
@@ -213,9 +386,12 @@ bool ChmDoc::ParseSystemData()
 
 bool ChmDoc::Load(const WCHAR *fileName)
 {
+    this->fileName.Set(str::Dup(fileName));
     chmHandle = chm_open((WCHAR *)fileName);
     if (!chmHandle)
         return false;
+    chm_set_param(chmHandle, CHM_PARAM_MAX_BLOCKS_CACHED, cacheBlocks);
+    BuildObjectIndex();
 
     ParseWindowsData();
     if (!ParseSystemData())
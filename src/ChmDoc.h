@@ -6,8 +6,25 @@
 
 #include "EbookBase.h"
 
+namespace dict {
+class MapStrToInt;
+}
+
+struct ChmDataBatch;
+
 class ChmDoc {
     struct chmFile *chmHandle;
+    ScopedMem<WCHAR> fileName;
+    int cacheBlocks;
+
+    // all objects by their lower-cased path, so that paths don't
+    // have to be resolved through the CHM's directory every time
+    struct ObjectInfo {
+        uint64 start, length;
+        int space;
+    };
+    Vec<ObjectInfo> objects;
+    dict::MapStrToInt *objectIndex;
 
     // Data parsed from /#WINDOWS, /#STRINGS, /#SYSTEM files inside CHM file
     ScopedMem<char> title;
@@ -22,13 +39,26 @@ class ChmDoc {
     bool ParseTocOrIndex(EbookTocVisitor *visitor, const char *path, bool isIndex);
 
     bool Load(const WCHAR *fileName);
+    void BuildObjectIndex();
+    static int AddToObjectIndex(struct chmFile *h, struct chmUnitInfo *info, void *data);
+    bool ResolveObject(const char *fileName, struct chmUnitInfo *info);
+    unsigned char *GetData(struct chmFile *h, const char *fileName, size_t *lenOut);
+    void GetDataRange(struct chmFile *h, ChmDataBatch *batch, size_t start, size_t end);
+
+    friend class ChmDataThread;
 
 public:
-    ChmDoc() : codepage(0) { }
+    ChmDoc();
     ~ChmDoc();
 
     bool HasData(const char *fileName);
     unsigned char *GetData(const char *fileName, size_t *lenOut);
+    // retrieves several objects at once on up to threadCount threads (0 for
+    // as many threads as there are processors). data[i] and lens[i] are set
+    // the same way GetData(fileNames[i], &lens[i]) would set them
+    void GetDataBatch(const char **fileNames, size_t count, unsigned char **data, size_t *lens, int threadCount=0);
+    // number of decompressed LZX blocks to cache per reading thread
+    void SetCacheBlocks(int count);
 
     char *ToUtf8(const unsigned char *text, UINT overrideCP=0);
     WCHAR *ToStr(const char *text);
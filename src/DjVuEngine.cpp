@@ -148,46 +148,75 @@ public:
     virtual void Abort() { abort = true; }
 };
 
+// libdjvu decodes in its own threads and is otherwise thread-safe, except for
+// miniexp (whose garbage collector and symbol table are process-wide) and
+// ddjvu_context_create (which sets up global message state), so only
+// calls involving these have to be serialized across all documents
+class DjVuGlobalLock {
+public:
+    CRITICAL_SECTION lock;
+
+    DjVuGlobalLock() { InitializeCriticalSection(&lock); }
+    ~DjVuGlobalLock() {
+        DeleteCriticalSection(&lock);
+        minilisp_finish();
+    }
+};
+
+static DjVuGlobalLock gDjVuLock;
+
+// how long to wait for a message before checking the job status again
+// (only matters if another thread has popped the relevant message already)
+#define DJVU_MESSAGE_WAIT_MS 20
+
+// every document gets its own context (and thus its own message queue), so
+// that waiting for one document's job doesn't block on all other documents
 class DjVuContext {
-    bool initialized;
     ddjvu_context_t *ctx;
+    // manual-reset event which is set whenever a message is posted
+    HANDLE msgEvent;
+    CRITICAL_SECTION msgLock;
 
-public:
-    CRITICAL_SECTION lock;
+    static void MessagePosted(ddjvu_context_t *ctx, void *closure) {
+        SetEvent(((DjVuContext *)closure)->msgEvent);
+    }
 
-    DjVuContext() : ctx(NULL), initialized(false) { }
+public:
+    DjVuContext() : ctx(NULL) {
+        msgEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+        InitializeCriticalSection(&msgLock);
+    }
     ~DjVuContext() {
-        if (initialized) {
-            EnterCriticalSection(&lock);
-            if (ctx)
-                ddjvu_context_release(ctx);
-            LeaveCriticalSection(&lock);
-            DeleteCriticalSection(&lock);
-        }
-        minilisp_finish();
+        if (ctx)
+            ddjvu_context_release(ctx);
+        CloseHandle(msgEvent);
+        DeleteCriticalSection(&msgLock);
     }
 
     bool Initialize() {
-        if (!initialized) {
-            initialized = true;
-            InitializeCriticalSection(&lock);
-            ctx = ddjvu_context_create("DjVuEngine");
-            // reset the locale to "C" as most other code expects
-            setlocale(LC_ALL, "C");
-        }
-
+        if (!msgEvent)
+            return false;
+        ScopedCritSec scope(&gDjVuLock.lock);
+        ctx = ddjvu_context_create("DjVuEngine");
+        // reset the locale to "C" as most other code expects
+        setlocale(LC_ALL, "C");
+        if (ctx)
+            ddjvu_message_set_callback(ctx, MessagePosted, this);
         return ctx != NULL;
     }
 
+    // can be called from several threads at once (unlike ddjvu_message_wait
+    // which could block forever, if another thread popped the last message)
     void SpinMessageLoop(bool wait=true) {
         if (wait)
-            ddjvu_message_wait(ctx);
+            WaitForSingleObject(msgEvent, DJVU_MESSAGE_WAIT_MS);
+        ScopedCritSec scope(&msgLock);
+        ResetEvent(msgEvent);
         while (ddjvu_message_peek(ctx))
             ddjvu_message_pop(ctx);
     }
 
     ddjvu_document_t *OpenFile(const WCHAR *fileName) {
-        ScopedCritSec scope(&lock);
         ScopedMem<char> fileNameUtf8(str::conv::ToUtf8(fileName));
         // TODO: libdjvu sooner or later crashes inside its caching code; cf.
         //       http://code.google.com/p/sumatrapdf/issues/detail?id=1434
@@ -195,7 +224,22 @@ public:
     }
 };
 
-static DjVuContext gDjVuContext;
+// libdjvu's own cache has to remain disabled (cf. DjVuContext::OpenFile),
+// so decoded pages are cached per document instead (so that rendering
+// another tile or zoom level of a recent page doesn't decode it again)
+#define DJVU_PAGE_CACHE_MAX_SIZE (64 * 1024 * 1024)
+
+struct CachedDjVuPage {
+    ddjvu_page_t *page;
+    int pageNo;
+    int rotation;
+    // rough estimate of the memory used by the decoded page
+    size_t size;
+    // entries are only evicted once no longer in use
+    int refs;
+    // rendering the same page from several threads isn't safe
+    CRITICAL_SECTION renderAccess;
+};
 
 class DjVuEngineImpl : public DjVuEngine {
     friend DjVuEngine;
@@ -210,10 +254,7 @@ public:
     virtual const WCHAR *FileName() const { return fileName; };
     virtual int PageCount() const { return pageCount; }
 
-    virtual RectD PageMediabox(int pageNo) {
-        assert(1 <= pageNo && pageNo <= PageCount());
-        return mediaboxes[pageNo-1];
-    }
+    virtual RectD PageMediabox(int pageNo);
     virtual RectD PageContentBox(int pageNo, RenderTarget target=Target_View);
 
     virtual RenderedBitmap *RenderBitmap(int pageNo, float zoom, int rotation,
@@ -235,8 +276,8 @@ public:
     virtual float GetFileDPI() const { return 300.0f; }
     virtual const WCHAR *GetDefaultFileExt() const { return L".djvu"; }
 
-    // we currently don't load pages lazily, so there's nothing to do here
-    virtual bool BenchLoadPage(int pageNo) { return true; }
+    // pages are decoded when rendered, so only the mediabox is loaded lazily
+    virtual bool BenchLoadPage(int pageNo) { return !PageMediabox(pageNo).IsEmpty(); }
 
     virtual Vec<PageElement *> *GetElements(int pageNo);
     virtual PageElement *GetElementAtPos(int pageNo, PointD pt);
@@ -247,9 +288,15 @@ public:
 
 protected:
     WCHAR *fileName;
+    DjVuContext djvu;
 
     int pageCount;
     RectD *mediaboxes;
+    bool *mediaboxKnown;
+    // file offsets of the pages' FORM:DJVU chunks (0 if unknown)
+    int *pageOffsets;
+    HANDLE hFile;
+    CRITICAL_SECTION mediaboxAccess;
 
     ddjvu_document_t *doc;
     miniexp_t outline;
@@ -257,22 +304,48 @@ protected:
 
     Vec<ddjvu_fileinfo_t> fileInfo;
 
+    // most recently used pages come last
+    Vec<CachedDjVuPage *> pageCache;
+    size_t pageCacheSize;
+    CRITICAL_SECTION pageCacheAccess;
+
+    CachedDjVuPage *GetPage(int pageNo, int rotation);
+    void DropPage(CachedDjVuPage *entry);
+    void FreePage(CachedDjVuPage *entry);
+
     bool ExtractPageText(miniexp_t item, const WCHAR *lineSep,
                          str::Str<WCHAR>& extracted, Vec<RectI>& coords);
     char *ResolveNamedDest(const char *name);
     DjVuTocItem *BuildTocTree(miniexp_t entry, int& idCounter, bool topLevel);
     bool Load(const WCHAR *fileName);
-    bool LoadMediaboxes();
+    bool LoadPageOffsets(Vec<int>& pageFileNos);
+    bool ReadMediabox(int pageNo, RectD& mediabox);
 };
 
 DjVuEngineImpl::DjVuEngineImpl() : fileName(NULL), pageCount(0), mediaboxes(NULL),
-    doc(NULL), outline(miniexp_nil), annos(NULL)
+    mediaboxKnown(NULL), pageOffsets(NULL), hFile(INVALID_HANDLE_VALUE),
+    doc(NULL), outline(miniexp_nil), annos(NULL), pageCacheSize(0)
 {
+    InitializeCriticalSection(&mediaboxAccess);
+    InitializeCriticalSection(&pageCacheAccess);
 }
 
 DjVuEngineImpl::~DjVuEngineImpl()
 {
-    ScopedCritSec scope(&gDjVuContext.lock);
+    if (hFile != INVALID_HANDLE_VALUE)
+        CloseHandle(hFile);
+    free(pageOffsets);
+    free(mediaboxKnown);
+    DeleteCriticalSection(&mediaboxAccess);
+
+    for (size_t i = 0; i < pageCache.Count(); i++) {
+        CrashIf(pageCache.At(i)->refs > 0);
+        FreePage(pageCache.At(i));
+    }
+    DeleteCriticalSection(&pageCacheAccess);
+
+    // releasing the document releases all miniexps it still protects
+    ScopedCritSec scope(&gDjVuLock.lock);
 
     delete[] mediaboxes;
     free(fileName);
@@ -292,7 +365,7 @@ DjVuEngineImpl::~DjVuEngineImpl()
 // Most functions of the ddjvu API such as ddjvu_document_get_pageinfo
 // are quite inefficient when used for all pages of a document in a row,
 // so try to either only use them when actually needed or replace them
-// with a function that extracts all the data at once:
+// with a function that reads just the data needed straight from the file:
 
 static bool ReadBytes(HANDLE h, int offset, void *buffer, int count)
 {
@@ -308,6 +381,7 @@ static bool ReadBytes(HANDLE h, int offset, void *buffer, int count)
 #define DJVU_MARK_DJVM  0x444A564DL /* DJVM */
 #define DJVU_MARK_DJVU  0x444A5655L /* DJVU */
 #define DJVU_MARK_INFO  0x494E464FL /* INFO */
+#define DJVU_MARK_DIRM  0x4449524DL /* DIRM */
 
 #pragma pack(push)
 #pragma pack(1)
@@ -321,61 +395,112 @@ struct DjVuInfoChunk {
 
 STATIC_ASSERT(sizeof(DjVuInfoChunk) == 10, djvuInfoChunkSize);
 
-bool DjVuEngineImpl::LoadMediaboxes()
+// determines the file offsets of all pages' FORM:DJVU chunks from the
+// bundled directory (DIRM chunk), so that every page's INFO chunk can
+// later be read with a single read (cf. ReadMediabox)
+bool DjVuEngineImpl::LoadPageOffsets(Vec<int>& pageFileNos)
 {
-    ScopedHandle h(CreateFile(fileName, GENERIC_READ, FILE_SHARE_READ, NULL,
-                              OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL));
-    if (h == INVALID_HANDLE_VALUE)
-        return false;
     char buffer[16];
     ByteReader r(buffer, sizeof(buffer));
-    if (!ReadBytes(h, 0, buffer, 16) || r.DWordBE(0) != DJVU_MARK_MAGIC || r.DWordBE(4) != DJVU_MARK_FORM)
+    if (!ReadBytes(hFile, 0, buffer, 16) || r.DWordBE(0) != DJVU_MARK_MAGIC || r.DWordBE(4) != DJVU_MARK_FORM)
+        return false;
+    if (r.DWordBE(12) == DJVU_MARK_DJVU) {
+        // a single page document
+        pageOffsets[0] = 4;
+        return 1 == pageCount;
+    }
+    if (r.DWordBE(12) != DJVU_MARK_DJVM)
         return false;
 
-    int offset = r.DWordBE(12) == DJVU_MARK_DJVM ? 16 : 4;
-    for (int pages = 0; pages < pageCount; ) {
-        if (!ReadBytes(h, offset, buffer, 16))
-            return false;
-        int partLen = r.DWordBE(4);
-        if (partLen < 0)
+    // DIRM: version (high bit set for bundled documents), count, offsets
+    if (!ReadBytes(hFile, 16, buffer, 11) || r.DWordBE(0) != DJVU_MARK_DIRM || !(r.Byte(8) & 0x80))
+        return false;
+    int version = r.Byte(8) & 0x7F;
+    int fileCount = r.WordBE(9);
+    // version 0 directories also contain a 3-byte size per file
+    int stride = 0 == version ? 7 : 4;
+    if (fileCount != ddjvu_document_get_filenum(doc))
+        return false;
+    ScopedMem<char> offsets(AllocArray<char>(fileCount * stride));
+    if (!offsets || !ReadBytes(hFile, 27, offsets, fileCount * stride))
+        return false;
+    ByteReader ro(offsets, fileCount * stride);
+    for (int i = 0; i < pageCount; i++) {
+        int fileNo = pageFileNos.At(i);
+        if (fileNo < 0 || fileNo >= fileCount)
             return false;
-        if (r.DWordBE(0) == DJVU_MARK_FORM && r.DWordBE(8) == DJVU_MARK_DJVU &&
-            r.DWordBE(12) == DJVU_MARK_INFO) {
-            if (!ReadBytes(h, offset + 16, buffer, 14))
-                return false;
-            DjVuInfoChunk info;
-            bool ok = r.UnpackBE(&info, sizeof(info), "2w6b", 4);
-            CrashIf(!ok);
-            int dpi = MAKEWORD(info.dpiLo, info.dpiHi); // dpi is little-endian
-            // DjVuLibre ignores DPI values outside 25 to 6000 in DjVuInfo::decode
-            if (dpi < 25 || 6000 < dpi)
-                dpi = 300;
-            mediaboxes[pages].dx = GetFileDPI() * info.width / dpi;
-            mediaboxes[pages].dy = GetFileDPI() * info.height / dpi;
-            if ((info.flags & 4))
-                swap(mediaboxes[pages].dx, mediaboxes[pages].dy);
-            pages++;
-        }
-        offset += 8 + partLen + (partLen & 1);
+        pageOffsets[i] = (int)ro.DWordBE(fileNo * stride);
     }
+    return true;
+}
 
+// reads a page's size from its INFO chunk (which is expected to come first)
+bool DjVuEngineImpl::ReadMediabox(int pageNo, RectD& mediabox)
+{
+    int offset = pageOffsets[pageNo-1];
+    char buffer[30];
+    ByteReader r(buffer, sizeof(buffer));
+    if (offset <= 0 || !ReadBytes(hFile, offset, buffer, sizeof(buffer)) ||
+        r.DWordBE(0) != DJVU_MARK_FORM || r.DWordBE(8) != DJVU_MARK_DJVU ||
+        r.DWordBE(12) != DJVU_MARK_INFO) {
+        return false;
+    }
+    DjVuInfoChunk info;
+    bool ok = r.UnpackBE(&info, sizeof(info), "2w6b", 20);
+    CrashIf(!ok);
+    int dpi = MAKEWORD(info.dpiLo, info.dpiHi); // dpi is little-endian
+    // DjVuLibre ignores DPI values outside 25 to 6000 in DjVuInfo::decode
+    if (dpi < 25 || 6000 < dpi)
+        dpi = 300;
+    mediabox = RectD(0, 0, GetFileDPI() * info.width / dpi, GetFileDPI() * info.height / dpi);
+    if ((info.flags & 4))
+        swap(mediabox.dx, mediabox.dy);
     return true;
 }
 
+RectD DjVuEngineImpl::PageMediabox(int pageNo)
+{
+    assert(1 <= pageNo && pageNo <= PageCount());
+    {
+        // mediaboxAccess also serializes the reads from hFile
+        ScopedCritSec scope(&mediaboxAccess);
+        if (mediaboxKnown[pageNo-1])
+            return mediaboxes[pageNo-1];
+        if (ReadMediabox(pageNo, mediaboxes[pageNo-1])) {
+            mediaboxKnown[pageNo-1] = true;
+            return mediaboxes[pageNo-1];
+        }
+    }
+
+    // fall back to the slower but safer way to extract page mediaboxes
+    // (without blocking other threads asking for already known mediaboxes)
+    RectD mediabox;
+    ddjvu_status_t status;
+    ddjvu_pageinfo_t info;
+    while ((status = ddjvu_document_get_pageinfo(doc, pageNo-1, &info)) < DDJVU_JOB_OK)
+        djvu.SpinMessageLoop();
+    if (DDJVU_JOB_OK == status)
+        mediabox = RectD(0, 0, info.width * GetFileDPI() / info.dpi,
+                               info.height * GetFileDPI() / info.dpi);
+
+    ScopedCritSec scope(&mediaboxAccess);
+    mediaboxes[pageNo-1] = mediabox;
+    mediaboxKnown[pageNo-1] = true;
+    return mediabox;
+}
+
 bool DjVuEngineImpl::Load(const WCHAR *fileName)
 {
-    if (!gDjVuContext.Initialize())
+    if (!djvu.Initialize())
         return false;
 
     this->fileName = str::Dup(fileName);
-    doc = gDjVuContext.OpenFile(fileName);
+    doc = djvu.OpenFile(fileName);
     if (!doc)
         return false;
 
-    ScopedCritSec scope(&gDjVuContext.lock);
-
     while (!ddjvu_document_decoding_done(doc))
-        gDjVuContext.SpinMessageLoop();
+        djvu.SpinMessageLoop();
     if (ddjvu_document_decoding_error(doc))
         return false;
 
@@ -384,63 +509,161 @@ bool DjVuEngineImpl::Load(const WCHAR *fileName)
         return false;
 
     mediaboxes = new RectD[pageCount];
-    bool ok = LoadMediaboxes();
-    if (!ok) {
-        // fall back to the slower but safer way to extract page mediaboxes
-        for (int i = 0; i < pageCount; i++) {
-            ddjvu_status_t status;
-            ddjvu_pageinfo_t info;
-            while ((status = ddjvu_document_get_pageinfo(doc, i, &info)) < DDJVU_JOB_OK)
-                gDjVuContext.SpinMessageLoop();
-            if (DDJVU_JOB_OK == status)
-                mediaboxes[i] = RectD(0, 0, info.width * GetFileDPI() / info.dpi,
-                                            info.height * GetFileDPI() / info.dpi);
-        }
-    }
+    mediaboxKnown = AllocArray<bool>(pageCount);
+    pageOffsets = AllocArray<int>(pageCount);
+    if (!mediaboxKnown || !pageOffsets)
+        return false;
 
     annos = AllocArray<miniexp_t>(pageCount);
     for (int i = 0; i < pageCount; i++)
         annos[i] = miniexp_dummy;
 
-    while ((outline = ddjvu_document_get_outline(doc)) == miniexp_dummy)
-        gDjVuContext.SpinMessageLoop();
-    if (!miniexp_consp(outline) || miniexp_car(outline) != miniexp_symbol("bookmarks")) {
-        ddjvu_miniexp_release(doc, outline);
-        outline = miniexp_nil;
+    // gDjVuLock protects the (global) miniexp heap, so it mustn't be held
+    // while waiting for data to be decoded (that would block all documents)
+    for (;;) {
+        {
+            ScopedCritSec scope(&gDjVuLock.lock);
+            outline = ddjvu_document_get_outline(doc);
+        }
+        if (outline != miniexp_dummy)
+            break;
+        djvu.SpinMessageLoop();
+    }
+    {
+        ScopedCritSec scope(&gDjVuLock.lock);
+        if (!miniexp_consp(outline) || miniexp_car(outline) != miniexp_symbol("bookmarks")) {
+            ddjvu_miniexp_release(doc, outline);
+            outline = miniexp_nil;
+        }
     }
 
+    // the directory has already been parsed, so this doesn't access the file
+    Vec<int> pageFileNos;
+    pageFileNos.AppendBlanks(pageCount);
+    for (int i = 0; i < pageCount; i++)
+        pageFileNos.At(i) = -1;
     int fileCount = ddjvu_document_get_filenum(doc);
     for (int i = 0; i < fileCount; i++) {
         ddjvu_status_t status;
         ddjvu_fileinfo_s info;
         while ((status = ddjvu_document_get_fileinfo(doc, i, &info)) < DDJVU_JOB_OK)
-            gDjVuContext.SpinMessageLoop();
-        if (DDJVU_JOB_OK == status && info.type == 'P')
+            djvu.SpinMessageLoop();
+        if (DDJVU_JOB_OK == status && info.type == 'P') {
             fileInfo.Append(info);
+            if (0 <= info.pageno && info.pageno < pageCount)
+                pageFileNos.At(info.pageno) = i;
+        }
     }
 
+    // mediaboxes are only read when needed, as reading them all through
+    // libdjvu would delay opening large documents noticeably
+    hFile = CreateFile(fileName, GENERIC_READ, FILE_SHARE_READ, NULL,
+                       OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (INVALID_HANDLE_VALUE == hFile || !LoadPageOffsets(pageFileNos)) {
+        // e.g. for indirect documents (consisting of one file per page)
+        for (int i = 0; i < pageCount; i++)
+            pageOffsets[i] = 0;
+    }
     return true;
 }
 
-RenderedBitmap *DjVuEngineImpl::RenderBitmap(int pageNo, float zoom, int rotation, RectD *pageRect, RenderTarget target, AbortCookie **cookie_out)
+// returns a decoded page (or NULL on failure) which must be returned
+// to the cache through DropPage once it's no longer needed
+CachedDjVuPage *DjVuEngineImpl::GetPage(int pageNo, int rotation)
 {
-    ScopedCritSec scope(&gDjVuContext.lock);
+    EnterCriticalSection(&pageCacheAccess);
+    for (size_t i = 0; i < pageCache.Count(); i++) {
+        CachedDjVuPage *entry = pageCache.At(i);
+        if (entry->pageNo == pageNo && entry->rotation == rotation) {
+            entry->refs++;
+            pageCache.RemoveAt(i);
+            pageCache.Append(entry);
+            LeaveCriticalSection(&pageCacheAccess);
+            return entry;
+        }
+    }
+    LeaveCriticalSection(&pageCacheAccess);
+
+    // decode the page without holding the cache lock, so that cached
+    // pages remain available in the meantime
+    ddjvu_page_t *page = ddjvu_page_create_by_pageno(doc, pageNo-1);
+    if (!page)
+        return NULL;
+    ddjvu_page_set_rotation(page, (ddjvu_page_rotation_t)rotation);
+    while (!ddjvu_page_decoding_done(page))
+        djvu.SpinMessageLoop();
+    if (ddjvu_page_decoding_error(page)) {
+        ddjvu_page_release(page);
+        return NULL;
+    }
 
+    CachedDjVuPage *entry = new CachedDjVuPage();
+    entry->page = page;
+    entry->pageNo = pageNo;
+    entry->rotation = rotation;
+    entry->size = (size_t)ddjvu_page_get_width(page) * ddjvu_page_get_height(page);
+    // JB2 shapes need about a bit per pixel, IW44 wavelets about three bytes
+    if (DDJVU_PAGETYPE_BITONAL == ddjvu_page_get_type(page))
+        entry->size /= 8;
+    else
+        entry->size *= 3;
+    entry->refs = 1;
+    InitializeCriticalSection(&entry->renderAccess);
+
+    ScopedCritSec scope(&pageCacheAccess);
+    // another thread might have decoded the same page in the meantime
+    for (size_t i = 0; i < pageCache.Count(); i++) {
+        CachedDjVuPage *other = pageCache.At(i);
+        if (other->pageNo == pageNo && other->rotation == rotation) {
+            other->refs++;
+            FreePage(entry);
+            return other;
+        }
+    }
+    pageCache.Append(entry);
+    pageCacheSize += entry->size;
+    // evict the least recently used pages (but always keep the current one)
+    for (size_t i = 0; i < pageCache.Count() - 1 && pageCacheSize > DJVU_PAGE_CACHE_MAX_SIZE; ) {
+        CachedDjVuPage *old = pageCache.At(i);
+        if (old->refs > 0) {
+            i++;
+            continue;
+        }
+        pageCache.RemoveAt(i);
+        pageCacheSize -= old->size;
+        FreePage(old);
+    }
+    return entry;
+}
+
+void DjVuEngineImpl::DropPage(CachedDjVuPage *entry)
+{
+    ScopedCritSec scope(&pageCacheAccess);
+    entry->refs--;
+    CrashIf(entry->refs < 0);
+}
+
+void DjVuEngineImpl::FreePage(CachedDjVuPage *entry)
+{
+    ddjvu_page_release(entry->page);
+    DeleteCriticalSection(&entry->renderAccess);
+    delete entry;
+}
+
+// pages are decoded and rendered without any global lock, so that several
+// pages (of the same or of different documents) can be rendered concurrently
+RenderedBitmap *DjVuEngineImpl::RenderBitmap(int pageNo, float zoom, int rotation, RectD *pageRect, RenderTarget target, AbortCookie **cookie_out)
+{
     RectD pageRc = pageRect ? *pageRect : PageMediabox(pageNo);
     RectI screen = Transform(pageRc, pageNo, zoom, rotation).Round();
     RectI full = Transform(PageMediabox(pageNo), pageNo, zoom, rotation).Round();
     screen = full.Intersect(screen);
 
-    ddjvu_page_t *page = ddjvu_page_create_by_pageno(doc, pageNo-1);
-    if (!page)
-        return NULL;
     int rotation4 = (((-rotation / 90) % 4) + 4) % 4;
-    ddjvu_page_set_rotation(page, (ddjvu_page_rotation_t)rotation4);
-
-    while (!ddjvu_page_decoding_done(page))
-        gDjVuContext.SpinMessageLoop();
-    if (ddjvu_page_decoding_error(page))
+    CachedDjVuPage *entry = GetPage(pageNo, rotation4);
+    if (!entry)
         return NULL;
+    ddjvu_page_t *page = entry->page;
 
     bool isBitonal = DDJVU_PAGETYPE_BITONAL == ddjvu_page_get_type(page);
     ddjvu_format_t *fmt = ddjvu_format_create(isBitonal ? DDJVU_FORMAT_GREY8 : DDJVU_FORMAT_BGR24, 0, NULL);
@@ -459,12 +682,13 @@ RenderedBitmap *DjVuEngineImpl::RenderBitmap(int pageNo, float zoom, int rotatio
         //       in debug builds when passing in DDJVU_RENDER_COLOR
         ddjvu_render_mode_t mode = DDJVU_RENDER_MASKONLY;
 #endif
+        ScopedCritSec scope(&entry->renderAccess);
         if (ddjvu_page_render(page, mode, &prect, &rrect, fmt, stride, bmpData.Get()))
             bmp = new RenderedDjVuPixmap(bmpData, screen.Size(), isBitonal);
     }
 
     ddjvu_format_release(fmt);
-    ddjvu_page_release(page);
+    DropPage(entry);
     return bmp;
 }
 
@@ -509,18 +733,11 @@ bool DjVuEngineImpl::RenderPage(HDC hDC, RectI screenRect, int pageNo, float zoo
 
 RectD DjVuEngineImpl::PageContentBox(int pageNo, RenderTarget target)
 {
-    ScopedCritSec scope(&gDjVuContext.lock);
-
     RectD pageRc = PageMediabox(pageNo);
-    ddjvu_page_t *page = ddjvu_page_create_by_pageno(doc, pageNo-1);
-    if (!page)
-        return pageRc;
-    ddjvu_page_set_rotation(page, DDJVU_ROTATE_0);
-
-    while (!ddjvu_page_decoding_done(page))
-        gDjVuContext.SpinMessageLoop();
-    if (ddjvu_page_decoding_error(page))
+    CachedDjVuPage *entry = GetPage(pageNo, DDJVU_ROTATE_0);
+    if (!entry)
         return pageRc;
+    ddjvu_page_t *page = entry->page;
 
     // render the page in 8-bit grayscale up to 250x250 px in size
     ddjvu_format_t *fmt = ddjvu_format_create(DDJVU_FORMAT_GREY8, 0, NULL);
@@ -530,7 +747,12 @@ RectD DjVuEngineImpl::PageContentBox(int pageNo, RenderTarget target)
     ddjvu_rect_t prect = { full.x, full.y, full.dx, full.dy }, rrect = prect;
 
     ScopedMem<char> bmpData(AllocArray<char>(full.dx * full.dy + 1));
-    if (bmpData && ddjvu_page_render(page, DDJVU_RENDER_MASKONLY, &prect, &rrect, fmt, full.dx, bmpData.Get())) {
+    bool ok = false;
+    if (bmpData) {
+        ScopedCritSec scope(&entry->renderAccess);
+        ok = ddjvu_page_render(page, DDJVU_RENDER_MASKONLY, &prect, &rrect, fmt, full.dx, bmpData.Get()) != 0;
+    }
+    if (ok) {
         // determine the content box by counting white pixels from the edges
         RectD content(full.dx, -1, 0, 0);
         for (int y = 0; y < full.dy; y++) {
@@ -560,7 +782,7 @@ RectD DjVuEngineImpl::PageContentBox(int pageNo, RenderTarget target)
     }
 
     ddjvu_format_release(fmt);
-    ddjvu_page_release(page);
+    DropPage(entry);
 
     return pageRc;
 }
@@ -660,18 +882,27 @@ bool DjVuEngineImpl::ExtractPageText(miniexp_t item, const WCHAR *lineSep, str::
 
 WCHAR *DjVuEngineImpl::ExtractPageText(int pageNo, WCHAR *lineSep, RectI **coords_out, RenderTarget target)
 {
-    ScopedCritSec scope(&gDjVuContext.lock);
-
     miniexp_t pagetext;
-    while ((pagetext = ddjvu_document_get_pagetext(doc, pageNo-1, NULL)) == miniexp_dummy)
-        gDjVuContext.SpinMessageLoop();
+    for (;;) {
+        {
+            ScopedCritSec scope(&gDjVuLock.lock);
+            pagetext = ddjvu_document_get_pagetext(doc, pageNo-1, NULL);
+        }
+        if (pagetext != miniexp_dummy)
+            break;
+        djvu.SpinMessageLoop();
+    }
     if (miniexp_nil == pagetext)
         return NULL;
 
     str::Str<WCHAR> extracted;
     Vec<RectI> coords;
-    bool success = ExtractPageText(pagetext, lineSep, extracted, coords);
-    ddjvu_miniexp_release(doc, pagetext);
+    bool success;
+    {
+        ScopedCritSec scope(&gDjVuLock.lock);
+        success = ExtractPageText(pagetext, lineSep, extracted, coords);
+        ddjvu_miniexp_release(doc, pagetext);
+    }
     if (!success)
         return NULL;
 
@@ -680,7 +911,7 @@ WCHAR *DjVuEngineImpl::ExtractPageText(int pageNo, WCHAR *lineSep, RectI **coord
         ddjvu_status_t status;
         ddjvu_pageinfo_t info;
         while ((status = ddjvu_document_get_pageinfo(doc, pageNo-1, &info)) < DDJVU_JOB_OK)
-            gDjVuContext.SpinMessageLoop();
+            djvu.SpinMessageLoop();
         float dpiFactor = 1.0;
         if (DDJVU_JOB_OK == status)
             dpiFactor = GetFileDPI() / info.dpi;
@@ -707,23 +938,33 @@ WCHAR *DjVuEngineImpl::ExtractPageText(int pageNo, WCHAR *lineSep, RectI **coord
 Vec<PageElement *> *DjVuEngineImpl::GetElements(int pageNo)
 {
     assert(1 <= pageNo && pageNo <= PageCount());
-    if (annos && miniexp_dummy == annos[pageNo-1]) {
-        ScopedCritSec scope(&gDjVuContext.lock);
-        while ((annos[pageNo-1] = ddjvu_document_get_pageanno(doc, pageNo-1)) == miniexp_dummy)
-            gDjVuContext.SpinMessageLoop();
-    }
-    if (!annos || !annos[pageNo-1])
+    if (!annos)
         return NULL;
 
-    ScopedCritSec scope(&gDjVuContext.lock);
-
-    Vec<PageElement *> *els = new Vec<PageElement *>();
-    RectI page = PageMediabox(pageNo).Round();
-
     ddjvu_status_t status;
     ddjvu_pageinfo_t info;
     while ((status = ddjvu_document_get_pageinfo(doc, pageNo-1, &info)) < DDJVU_JOB_OK)
-        gDjVuContext.SpinMessageLoop();
+        djvu.SpinMessageLoop();
+
+    RectI page = PageMediabox(pageNo).Round();
+
+    for (;;) {
+        {
+            ScopedCritSec scope(&gDjVuLock.lock);
+            if (miniexp_dummy == annos[pageNo-1])
+                annos[pageNo-1] = ddjvu_document_get_pageanno(doc, pageNo-1);
+            if (annos[pageNo-1] != miniexp_dummy)
+                break;
+        }
+        djvu.SpinMessageLoop();
+    }
+
+    ScopedCritSec scope(&gDjVuLock.lock);
+    if (!annos[pageNo-1])
+        return NULL;
+
+    Vec<PageElement *> *els = new Vec<PageElement *>();
+
     float dpiFactor = 1.0;
     if (DDJVU_JOB_OK == status)
         dpiFactor = GetFileDPI() / info.dpi;
@@ -868,7 +1109,7 @@ DocTocItem *DjVuEngineImpl::GetTocTree()
     if (!HasTocTree())
         return NULL;
 
-    ScopedCritSec scope(&gDjVuContext.lock);
+    ScopedCritSec scope(&gDjVuLock.lock);
     int idCounter = 0;
     return BuildTocTree(outline, idCounter, true);
 }
@@ -4,7 +4,9 @@
 #include "BaseUtil.h"
 #include "EbookController.h"
 
+#include "AppPrefs.h"
 #include "EbookControls.h"
+#include "EbookLayoutCache.h"
 #include "MobiDoc.h"
 #include "EbookFormatter.h"
 #include "EbookWindow.h"
@@ -155,7 +157,7 @@ bool EbookFormattingThread::Format(int reparseIdx)
     int totalPageCount = 0;
     Timer t(true);
     formatterArgs->reparseIdx = reparseIdx;
-    HtmlFormatter *formatter = CreateFormatter(doc, formatterArgs);
+    ChapterFormatter *formatter = new ChapterFormatter(doc, formatterArgs);
     int lastReparseIdx = reparseIdx;
     for (HtmlPage *pd = formatter->Next(); pd; pd = formatter->Next()) {
         CrashIf(pd->reparseIdx < lastReparseIdx);
@@ -201,7 +203,8 @@ void EbookFormattingThread::Run()
 
 EbookController::EbookController(EbookControls *ctrls) : ctrls(ctrls),
     fileBeingLoaded(NULL), pagesFromBeginning(NULL), pagesFromPage(NULL),
-    currPageNo(0), pageShown(NULL), deletePageShown(false),
+    cachedLayout(NULL), wordBoxes(NULL), currPageNo(0), pageShown(NULL), deletePageShown(false),
+    pageShownAllocator(NULL),
     pageSize(0, 0), formattingThread(NULL), formattingThreadNo(-1),
     startReparseIdx(-1)
 {
@@ -226,9 +229,12 @@ EbookController::~EbookController()
 
 void EbookController::DeletePageShown()
 {
-    if (deletePageShown)
+    if (deletePageShown) {
         delete pageShown;
+        delete pageShownAllocator;
+    }
     pageShown = NULL;
+    pageShownAllocator = NULL;
 }
 
 // stop layout thread (if we're closing a document we'll delete
@@ -252,6 +258,10 @@ void EbookController::CloseCurrentDocument()
     DeletePageShown();
     DeletePages(&pagesFromBeginning);
     DeletePages(&pagesFromPage);
+    ::DeletePages(cachedLayout);
+    cachedLayout = NULL;
+    delete wordBoxes;
+    wordBoxes = NULL;
     doc.Delete();
     formattingTemp.reparseIdx = 0; // mark as being laid out from the beginning
     pageSize = SizeI(0, 0);
@@ -319,13 +329,16 @@ void EbookController::UpdateCurrPageNoForPage(HtmlPage *pd)
         }
     }
     currPageNo = PageForReparsePoint(GetPagesFromBeginning(), pd->reparseIdx);
+    if (0 == currPageNo)
+        currPageNo = PageForReparsePoint(cachedLayout, pd->reparseIdx);
 }
 
-void EbookController::ShowPage(HtmlPage *pd, bool deleteWhenDone)
+void EbookController::ShowPage(HtmlPage *pd, bool deleteWhenDone, PoolAllocator *pageAllocator)
 {
     DeletePageShown();
     pageShown = pd;
     deletePageShown = deleteWhenDone;
+    pageShownAllocator = pageAllocator;
     ctrls->page->SetPage(pageShown);
 
     UpdateCurrPageNoForPage(pageShown);
@@ -431,6 +444,15 @@ void EbookController::HandleMobiLayoutDone(EbookFormattingTask *ld)
             formattingTemp.pagesFromPage.Reset();
         }
         StopFormattingThread();
+
+        // the cached layout is superseded by the one we've just completed
+        ::DeletePages(cachedLayout);
+        cachedLayout = NULL;
+        if (gGlobalPrefs.rememberOpenedFiles) {
+            HtmlFormatterArgs *args = CreateFormatterArgsDoc(doc, pageSize.dx, pageSize.dy, NULL);
+            SaveLayoutCache(doc.GetFilePath(), args, pagesFromBeginning);
+            delete args;
+        }
     }
     UpdateStatus();
 }
@@ -443,9 +465,8 @@ HtmlPage *EbookController::PreserveTempPageShown()
     if (!pageShown)
         return NULL;
     if (deletePageShown) {
-        // TODO: this can happen due to a race condition
-        //       (if there are too many WM_PAINT messages?)
-        CrashIf(true); // not sure if this should ever happen
+        // this is a page formatted from cachedLayout which isn't part of
+        // any collection (the caller also takes over pageShownAllocator)
         deletePageShown = false;
         return pageShown;
     }
@@ -501,14 +522,27 @@ void EbookController::TriggerBookFormatting()
     CrashIf(formattingTemp.pagesFromBeginning.Count() > 0);
     CrashIf(formattingTemp.pagesFromPage.Count() > 0);
 
-    ShowPage(newPage, newPage != NULL);
+    ShowPage(newPage, newPage != NULL, newPage ? pageShownAllocator : NULL);
     HtmlFormatterArgs *args = CreateFormatterArgsDoc(doc, size.dx, size.dy, &textAllocator);
+    args->wordBoxes = wordBoxes;
+    ::DeletePages(cachedLayout);
+    cachedLayout = NULL;
+    if (0 == formattingTemp.reparseIdx)
+        cachedLayout = LoadLayoutCache(doc.GetFilePath(), args);
     formattingThread = new EbookFormattingThread(doc, args, this);
     formattingThreadNo = formattingThread->GetNo();
     CrashIf(formattingTemp.reparseIdx < 0);
     CrashIf(formattingTemp.reparseIdx > (int)args->htmlStrLen);
     formattingThread->reparseIdx = formattingTemp.reparseIdx;
     formattingThread->Start();
+
+    // if we know the layout, show the page from the previous session
+    // right away instead of waiting for formatting to reach it
+    if (cachedLayout && !pageShown && (-1 != startReparseIdx)) {
+        size_t pageNo = PageForReparsePoint(cachedLayout, startReparseIdx);
+        if (pageNo > 0)
+            GoToPage((int)pageNo);
+    }
     UpdateStatus();
 }
 
@@ -547,9 +581,9 @@ void EbookController::ClickedProgress(Control *c, int x, int y)
     float perc = ctrls->progress->GetPercAt(x);
     // TODO: shouldn't be active if we don't have pages from
     // beginnign, but happened in real life, crash 1096004
-    if (!GetPagesFromBeginning())
+    int pageCount = (int)GetPageCountFromBeginning();
+    if (0 == pageCount)
         return;
-    int pageCount = GetPagesFromBeginning()->Count();
     int newPageNo = IntFromPerc(pageCount, perc) + 1;
     GoToPage(newPageNo);
 }
@@ -568,6 +602,17 @@ size_t EbookController::GetMaxPageCount()
         n = pages1->Count();
     if (pages2 && pages2->Count() > n)
         n = pages2->Count();
+    if (cachedLayout && cachedLayout->Count() > n)
+        n = cachedLayout->Count();
+    return n;
+}
+
+// the number of pages when formatted from the beginning, as far as we know it
+size_t EbookController::GetPageCountFromBeginning()
+{
+    size_t n = GetPagesFromBeginning() ? GetPagesFromBeginning()->Count() : 0;
+    if (cachedLayout && cachedLayout->Count() > n)
+        n = cachedLayout->Count();
     return n;
 }
 
@@ -584,7 +629,7 @@ void EbookController::UpdateStatus()
         return;
     }
 
-    if (FormattingInProgress()) {
+    if (FormattingInProgress() && !cachedLayout) {
         ScopedMem<WCHAR> s(str::Format(_TR("Formatting the book... %d pages"), pageCount));
         ctrls->status->SetText(s);
         ctrls->progress->SetFilled(0.f);
@@ -593,21 +638,49 @@ void EbookController::UpdateStatus()
 
     ScopedMem<WCHAR> s(str::Format(L"%s %d / %d", _TR("Page:"), currPageNo, pageCount));
     ctrls->status->SetText(s);
-    if (GetPagesFromBeginning())
-        ctrls->progress->SetFilled(PercFromInt(GetPagesFromBeginning()->Count(), currPageNo));
+    if (GetPageCountFromBeginning() > 0)
+        ctrls->progress->SetFilled(PercFromInt(GetPageCountFromBeginning(), currPageNo));
     else
         ctrls->progress->SetFilled(0.f);
 }
 
+// formats a single page (in 1..$pageCount range) starting from
+// the reparse point and style state we know from cachedLayout
+// (the page's text is allocated from pageAllocator)
+HtmlPage *EbookController::FormatCachedPage(size_t pageNo, PoolAllocator *pageAllocator)
+{
+    HtmlPage *cached = cachedLayout->At(pageNo - 1);
+    HtmlFormatterArgs *args = CreateFormatterArgsDoc(doc, pageSize.dx, pageSize.dy, pageAllocator);
+    args->reparseIdx = cached->reparseIdx;
+    args->reparseState = cached;
+    args->wordBoxes = wordBoxes;
+    // use the same chapter boundaries as formatting from the beginning
+    ChapterFormatter *formatter = new ChapterFormatter(doc, args, true, 1);
+    HtmlPage *pd = formatter->Next();
+    delete formatter;
+    delete args;
+    return pd;
+}
+
 void EbookController::GoToPage(int newPageNo)
 {
     if ((newPageNo < 1) || (newPageNo == currPageNo))
         return;
-    if (!GetPagesFromBeginning())
-        return;
-    if ((size_t)newPageNo > GetPagesFromBeginning()->Count())
+    Vec<HtmlPage*> *pages = GetPagesFromBeginning();
+    if (pages && (size_t)newPageNo <= pages->Count()) {
+        ShowPage(pages->At(newPageNo - 1), false);
+    } else if (cachedLayout && (size_t)newPageNo <= cachedLayout->Count()) {
+        // we haven't formatted that far yet
+        PoolAllocator *pageAllocator = new PoolAllocator();
+        HtmlPage *pd = FormatCachedPage(newPageNo, pageAllocator);
+        if (!pd) {
+            delete pageAllocator;
+            return;
+        }
+        ShowPage(pd, true, pageAllocator);
+    } else {
         return;
-    ShowPage(GetPagesFromBeginning()->At(newPageNo - 1), false);
+    }
     // even if we were showing a page from pagesFromPage before, we've
     // transitioned to using pagesFromBeginning so we no longer need pagesFromPage
     DeletePages(&pagesFromPage);
@@ -616,8 +689,8 @@ void EbookController::GoToPage(int newPageNo)
 
 void EbookController::GoToLastPage()
 {
-    if (GetPagesFromBeginning())
-        GoToPage(GetPagesFromBeginning()->Count());
+    if (GetPageCountFromBeginning() > 0)
+        GoToPage((int)GetPageCountFromBeginning());
 }
 
 bool EbookController::GoOnePageForward(Vec<HtmlPage*> *pages)
@@ -645,7 +718,7 @@ void EbookController::GoOnePageForward()
         return;
     if (GoOnePageForward(&formattingTemp.pagesFromPage))
         return;
-    if (!GetPagesFromBeginning() || (0 == currPageNo))
+    if (0 == currPageNo)
         return;
     GoToPage(currPageNo + 1);
 }
@@ -673,6 +746,7 @@ void EbookController::SetDoc(Doc newDoc, int startReparseIdxArg)
         startReparseIdx = -1;
     CloseCurrentDocument();
     doc = newDoc;
+    wordBoxes = new WordBoxCache();
     TriggerBookFormatting();
 }
 
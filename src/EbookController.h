@@ -15,6 +15,7 @@ class   PoolAllocator;
 class   EbookFormattingThread;
 class   EbookFormattingTask;
 struct  HtmlFormatterArgs;
+class   WordBoxCache;
 namespace mui { class Control; }
 using namespace mui;
 
@@ -43,6 +44,9 @@ class EbookController : public sigslot::has_slots
     // TODO: this should be recycled along with pages so that its
     // memory use doesn't grow without bounds
     PoolAllocator   textAllocator;
+    // measured words, kept so that re-formatting after a resize
+    // doesn't have to measure all text again
+    WordBoxCache *  wordBoxes;
 
     // we're in one of 3 states:
     // 1. showing pages as laid out from the beginning
@@ -53,6 +57,11 @@ class EbookController : public sigslot::has_slots
     Vec<HtmlPage*>* pagesFromBeginning;
     Vec<HtmlPage*>* pagesFromPage;
 
+    // pagination from the layout cache (pages without instructions), only
+    // set while we're formatting from the beginning. It allows to show the
+    // total page count and to jump to pages we haven't formatted yet
+    Vec<HtmlPage*>* cachedLayout;
+
     // currPageNo is in range 1..$numberOfPages. It's always a page number
     // as if the pages were formatted from the begginging. We don't always
     // know this (when we're showing a page from pagesFromPage and we
@@ -67,6 +76,10 @@ class EbookController : public sigslot::has_slots
     HtmlPage *      pageShown;
     // if true, we need to delete pageShown if we no longer need it
     bool            deletePageShown;
+    // the text of pageShown, if it was formatted from cachedLayout
+    // (deleted along with pageShown, so that paging through the
+    // cached layout doesn't accumulate text)
+    PoolAllocator * pageShownAllocator;
 
     // size of the page for which pages were generated
     SizeI           pageSize;
@@ -84,13 +97,15 @@ class EbookController : public sigslot::has_slots
     void        UpdateStatus();
     void        DeletePages(Vec<HtmlPage*>** pages);
     void        DeletePageShown();
-    void        ShowPage(HtmlPage *pd, bool deleteWhenDone);
+    void        ShowPage(HtmlPage *pd, bool deleteWhenDone, PoolAllocator *pageAllocator=NULL);
     void        UpdateCurrPageNoForPage(HtmlPage *pd);
     void        TriggerBookFormatting();
     bool        FormattingInProgress() const { return formattingThread != NULL; }
     bool        GoOnePageForward(Vec<HtmlPage*> *pages);
     void        GoOnePageForward();
     size_t      GetMaxPageCount();
+    size_t      GetPageCountFromBeginning();
+    HtmlPage *  FormatCachedPage(size_t pageNo, PoolAllocator *pageAllocator);
     void        StopFormattingThread();
     void        CloseCurrentDocument();
 
@@ -165,13 +165,24 @@ const char *EPUB_OPF_NS = "http://www.idpf.org/2007/opf";
 const char *EPUB_NCX_NS = "http://www.daisy.org/z3986/2005/ncx/";
 
 EpubDoc::EpubDoc(const WCHAR *fileName) :
-    zip(fileName), fileName(str::Dup(fileName)), isNcxToc(false), isRtlDoc(false) { }
+    zip(fileName), fileName(str::Dup(fileName)), htmlData(NULL), htmlDataLen(0),
+    isNcxToc(false), isRtlDoc(false)
+{
+    InitializeCriticalSection(&zipAccess);
+}
 
 EpubDoc::EpubDoc(IStream *stream) :
-    zip(stream), fileName(NULL), isNcxToc(false), isRtlDoc(false) { }
+    zip(stream), fileName(NULL), htmlData(NULL), htmlDataLen(0),
+    isNcxToc(false), isRtlDoc(false)
+{
+    InitializeCriticalSection(&zipAccess);
+}
 
 EpubDoc::~EpubDoc()
 {
+    if (htmlData)
+        VirtualFree(htmlData, 0, MEM_RELEASE);
+    DeleteCriticalSection(&zipAccess);
     for (size_t i = 0; i < images.Count(); i++) {
         free(images.At(i).base.data);
         free(images.At(i).id);
@@ -267,6 +278,10 @@ bool EpubDoc::Load()
     if (readingDir)
         isRtlDoc = str::EqI(readingDir, L"rtl");
 
+    // only determine where each chapter will go, as
+    // decompressing all of them takes a while for large books
+    str::Str<char> markers;
+    size_t contentLen = 0;
     for (node = node->down; node; node = node->next) {
         if (!node->NameIsNS("itemref", EPUB_OPF_NS))
             continue;
@@ -277,16 +292,36 @@ bool EpubDoc::Load()
         ScopedMem<WCHAR> fullPath(str::Join(contentPath, pathList.At(idList.Find(idref))));
         ScopedMem<char> utf8_path(str::conv::ToUtf8(fullPath));
         str::UrlDecodeInPlace(fullPath);
-        ScopedMem<char> html(zip.GetFileData(fullPath));
-        if (!html)
+        Chapter ch;
+        ch.zipIdx = zip.GetFileIndex(fullPath);
+        if (ch.zipIdx >= zip.GetFileCount())
             continue;
+        ch.len = zip.GetFileSize(ch.zipIdx);
+        ch.loaded = false;
         // insert explicit page-breaks between sections including
         // an anchor with the file name at the top (for internal links)
-        htmlData.AppendFmt("<pagebreak page_path=\"%s\" page_marker />", utf8_path);
-        htmlData.Append(html);
+        ch.start = markers.Size() + contentLen;
+        markers.AppendFmt("<pagebreak page_path=\"%s\" page_marker />", utf8_path);
+        ch.dataStart = markers.Size() + contentLen;
+        contentLen += ch.len;
+        chapters.Append(ch);
+    }
+
+    // allocate htmlData at once but only write the markers, so that the
+    // chapters' pages (zero-filled by the OS on first access) don't use any
+    // memory until they're loaded (this includes the terminating zero)
+    htmlDataLen = markers.Size() + contentLen;
+    htmlData = (char *)VirtualAlloc(NULL, htmlDataLen + 1, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+    if (!htmlData)
+        return false;
+    size_t markerPos = 0;
+    for (Chapter *ch = chapters.IterStart(); ch; ch = chapters.IterNext()) {
+        size_t markerLen = ch->dataStart - ch->start;
+        memcpy(htmlData + ch->start, markers.Get() + markerPos, markerLen);
+        markerPos += markerLen;
     }
 
-    return htmlData.Count() > 0;
+    return chapters.Count() > 0;
 }
 
 void EpubDoc::ParseMetadata(const char *content)
@@ -333,17 +368,55 @@ void EpubDoc::ParseMetadata(const char *content)
 
 const char *EpubDoc::GetTextData(size_t *lenOut)
 {
-    *lenOut = htmlData.Size();
-    return htmlData.Get();
+    *lenOut = htmlDataLen;
+    return htmlData;
 }
 
 size_t EpubDoc::GetTextDataSize()
 {
-    return htmlData.Size();
+    return htmlDataLen;
+}
+
+size_t EpubDoc::GetChapterCount()
+{
+    return chapters.Count();
+}
+
+size_t EpubDoc::GetChapterStart(size_t idx)
+{
+    return chapters.At(idx).start;
+}
+
+void EpubDoc::LoadChapterAt(size_t offset)
+{
+    // find the last chapter starting at or before offset
+    size_t lo = 0, hi = chapters.Count();
+    while (hi - lo > 1) {
+        size_t mid = (lo + hi) / 2;
+        if (chapters.At(mid).start <= offset)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    if (lo >= chapters.Count())
+        return;
+
+    ScopedCritSec scope(&zipAccess);
+    Chapter *ch = &chapters.At(lo);
+    if (ch->loaded)
+        return;
+    ch->loaded = true;
+    char *data = htmlData + ch->dataStart;
+    if (!zip.ReadFileData(ch->zipIdx, data, ch->len)) {
+        // skip the content of damaged files
+        memset(data, ' ', ch->len);
+    }
 }
 
 ImageData *EpubDoc::GetImageData(const char *id, const char *pagePath)
 {
+    ScopedCritSec scope(&zipAccess);
+
     if (!pagePath) {
         // if we're reparsing, we might not have pagePath, which is needed to
         // build the exact url so try to find a partial match
@@ -498,7 +571,11 @@ bool EpubDoc::ParseToc(EbookTocVisitor *visitor)
     if (!tocPath)
         return false;
     size_t tocDataLen;
-    ScopedMem<char> tocData(zip.GetFileData(tocPath, &tocDataLen));
+    ScopedMem<char> tocData;
+    {
+        ScopedCritSec scope(&zipAccess);
+        tocData.Set(zip.GetFileData(tocPath, &tocDataLen));
+    }
     if (!tocData)
         return false;
 
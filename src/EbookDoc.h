@@ -23,8 +23,25 @@ class EpubDoc {
         char *value;
     };
 
+    // spine items are only decompressed into htmlData when they're
+    // about to be formatted (until then their content is zeroed out)
+    struct Chapter {
+        size_t zipIdx;
+        // offsets into htmlData of the <pagebreak> marker and of the content
+        size_t start;
+        size_t dataStart;
+        size_t len;
+        bool loaded;
+    };
+
     ZipFile zip;
-    str::Str<char> htmlData;
+    // zip is also accessed from formatting threads (for chapters and images)
+    CRITICAL_SECTION zipAccess;
+    // allocated at once (pages point into it) through VirtualAlloc, so that
+    // memory is only used for the parts that have actually been written to
+    char *htmlData;
+    size_t htmlDataLen;
+    Vec<Chapter> chapters;
     Vec<ImageData2> images;
     Vec<Metadata> props;
     ScopedMem<WCHAR> tocPath;
@@ -46,6 +63,13 @@ public:
     size_t GetTextDataSize();
     ImageData *GetImageData(const char *id, const char *pagePath);
 
+    // chapters always start with a <pagebreak page_path="..." page_marker />
+    size_t GetChapterCount();
+    size_t GetChapterStart(size_t idx);
+    // decompresses the chapter containing the given offset into GetTextData
+    // (formatters must call this before parsing a chapter)
+    void LoadChapterAt(size_t offset);
+
     WCHAR *GetProperty(DocumentProperty prop);
     const WCHAR *GetFileName() const;
     bool IsRTL() const;
@@ -10,6 +10,7 @@
 #include "EbookDoc.h"
 #include "EbookFormatter.h"
 #include "FileUtil.h"
+#include "FreeTypeMeasure.h"
 using namespace Gdiplus;
 #include "GdiPlusUtil.h"
 #include "HtmlPullParser.h"
@@ -306,6 +307,7 @@ void EbookEngine::FixFontSizeForResolution(HDC hDC)
         return;
 
     ScopedCritSec scope(&pagesAccess);
+    mui::ScopedMuiCritSec muiCs;
 
     float dpiFactor = 1.0f * currFontDpi / dpi;
     Graphics g(hDC);
@@ -669,9 +671,9 @@ bool EpubEngineImpl::FinishLoading()
     args.fontName = DEFAULT_FONT_NAME;
     args.fontSize = DEFAULT_FONT_SIZE;
     args.textAllocator = &allocator;
-    args.measureAlgo = MeasureTextQuick;
+    args.measureAlgo = MeasureTextFreeType;
 
-    pages = EpubFormatter(&args, doc).FormatAllPages(false);
+    pages = ChapterFormatter(doc, &args, false).FormatAllPages();
     if (!ExtractPageAnchors())
         return false;
 
@@ -758,7 +760,7 @@ bool Fb2EngineImpl::Load(const WCHAR *fileName)
     args.fontName = DEFAULT_FONT_NAME;
     args.fontSize = DEFAULT_FONT_SIZE;
     args.textAllocator = &allocator;
-    args.measureAlgo = MeasureTextQuick;
+    args.measureAlgo = MeasureTextFreeType;
 
     pages = Fb2Formatter(&args, doc).FormatAllPages(false);
     if (!ExtractPageAnchors())
@@ -883,7 +885,7 @@ bool MobiEngineImpl::Load(const WCHAR *fileName)
     args.fontName = DEFAULT_FONT_NAME;
     args.fontSize = DEFAULT_FONT_SIZE;
     args.textAllocator = &allocator;
-    args.measureAlgo = MeasureTextQuick;
+    args.measureAlgo = MeasureTextFreeType;
 
     pages = MobiFormatter(&args, doc).FormatAllPages();
     if (!ExtractPageAnchors())
@@ -1063,7 +1065,7 @@ bool PdbEngineImpl::Load(const WCHAR *fileName)
     args.fontName = DEFAULT_FONT_NAME;
     args.fontSize = DEFAULT_FONT_SIZE;
     args.textAllocator = &allocator;
-    args.measureAlgo = MeasureTextQuick;
+    args.measureAlgo = MeasureTextFreeType;
 
     pages = PdbFormatter(&args, doc).FormatAllPages();
     if (!ExtractPageAnchors())
@@ -1097,6 +1099,7 @@ PdbEngine *PdbEngine::CreateFromFile(const WCHAR *fileName)
 /* formatting extensions for CHM */
 
 #include "ChmDoc.h"
+#include "Dict.h"
 
 class ChmDataCache {
     ChmDoc *doc; // owned by creator
@@ -1249,13 +1252,19 @@ static UINT ExtractHttpCharset(const char *html, size_t htmlLen)
     return 0;
 }
 
+// number of pages decompressed at once by ChmHtmlCollector::GetHtml
+#define CHM_HTML_BATCH_SIZE 64
+
 class ChmHtmlCollector : public EbookTocVisitor {
     ChmDoc *doc;
-    WStrList added;
+    // lower-cased URLs of all pages to collect (for quickly skipping duplicates)
+    dict::MapWStrToInt added;
+    Vec<char *> urls;
     str::Str<char> html;
 
 public:
-    ChmHtmlCollector(ChmDoc *doc) : doc(doc) { }
+    ChmHtmlCollector(ChmDoc *doc) : doc(doc), added(1024) { }
+    ~ChmHtmlCollector() { FreeVecMembers(urls); }
 
     char *GetHtml() {
         // first add the homepage
@@ -1280,6 +1289,24 @@ public:
         FreeVecMembers(*paths);
         delete paths;
 
+        // decompress the pages in batches (each in parallel) and then put them together in order
+        // (batches limit how many decompressed pages are kept in memory at once)
+        ScopedMem<unsigned char *> data(AllocArray<unsigned char *>(CHM_HTML_BATCH_SIZE));
+        ScopedMem<size_t> lens(AllocArray<size_t>(CHM_HTML_BATCH_SIZE));
+        if (!data || !lens)
+            return NULL;
+        for (size_t start = 0; start < urls.Count(); start += CHM_HTML_BATCH_SIZE) {
+            size_t count = min(urls.Count() - start, (size_t)CHM_HTML_BATCH_SIZE);
+            doc->GetDataBatch((const char **)urls.LendData() + start, count, data, lens);
+            for (size_t i = 0; i < count; i++) {
+                ScopedMem<unsigned char> pageHtml(data[i]);
+                if (!pageHtml)
+                    continue;
+                html.AppendFmt("<pagebreak page_path=\"%s\" page_marker />", urls.At(start + i));
+                html.AppendAndFree(doc->ToUtf8(pageHtml, ExtractHttpCharset((const char *)pageHtml.Get(), lens[i])));
+            }
+        }
+
         return html.StealData();
     }
 
@@ -1287,16 +1314,13 @@ public:
         if (!url || IsExternalUrl(url))
             return;
         ScopedMem<WCHAR> plainUrl(str::ToPlainUrl(url));
-        if (added.FindI(plainUrl) != -1)
-            return;
-        ScopedMem<char> urlUtf8(str::conv::ToUtf8(plainUrl));
-        size_t pageHtmlLen;
-        ScopedMem<unsigned char> pageHtml(doc->GetData(urlUtf8, &pageHtmlLen));
-        if (!pageHtml)
+        char *plainUrlUtf8 = str::conv::ToUtf8(plainUrl);
+        str::ToLower(plainUrl);
+        if (!added.Insert(plainUrl, 0, NULL)) {
+            free(plainUrlUtf8);
             return;
-        html.AppendFmt("<pagebreak page_path=\"%s\" page_marker />", urlUtf8);
-        html.AppendAndFree(doc->ToUtf8(pageHtml, ExtractHttpCharset((const char *)pageHtml.Get(), pageHtmlLen)));
-        added.Append(plainUrl.StealData());
+        }
+        urls.Append(plainUrlUtf8);
     }
 };
 
@@ -1317,7 +1341,7 @@ bool Chm2EngineImpl::Load(const WCHAR *fileName)
     args.fontName = DEFAULT_FONT_NAME;
     args.fontSize = DEFAULT_FONT_SIZE;
     args.textAllocator = &allocator;
-    args.measureAlgo = MeasureTextQuick;
+    args.measureAlgo = MeasureTextFreeType;
 
     pages = ChmFormatter(&args, dataCache).FormatAllPages(false);
     if (!ExtractPageAnchors())
@@ -1395,7 +1419,7 @@ bool TcrEngineImpl::Load(const WCHAR *fileName)
     args.fontName = DEFAULT_FONT_NAME;
     args.fontSize = DEFAULT_FONT_SIZE;
     args.textAllocator = &allocator;
-    args.measureAlgo = MeasureTextQuick;
+    args.measureAlgo = MeasureTextFreeType;
 
     pages = HtmlFormatter(&args).FormatAllPages(false);
 
@@ -8,6 +8,7 @@ using namespace Gdiplus;
 #include "GdiPlusUtil.h"
 #include "HtmlPullParser.h"
 #include "MobiDoc.h"
+#include "ThreadUtil.h"
 
 #define FONT_NAME              L"Georgia"
 #define FONT_SIZE              12.5f
@@ -92,7 +93,7 @@ void MobiFormatter::HandleSpacing_Mobi(HtmlToken *t)
     // 3pt top padding (the same seems to apply for <blockquote>)
     AttrInfo *attr = t->GetAttrByName("width");
     if (attr) {
-        float lineIndent = ParseSizeAsPixels(attr->val, attr->valLen, CurrFont()->GetSize());
+        float lineIndent = ParseSizeAsPixels(attr->val, attr->valLen, CurrFontSize());
         // there are files with negative width which produces partially invisible
         // text, so don't allow that
         if (lineIndent > 0) {
@@ -103,7 +104,7 @@ void MobiFormatter::HandleSpacing_Mobi(HtmlToken *t)
     attr = t->GetAttrByName("height");
     if (attr) {
         // for use it in FlushCurrLine()
-        currLineTopPadding = ParseSizeAsPixels(attr->val, attr->valLen, CurrFont()->GetSize());
+        currLineTopPadding = ParseSizeAsPixels(attr->val, attr->valLen, CurrFontSize());
     }
 }
 
@@ -163,6 +164,13 @@ void MobiFormatter::HandleHtmlTag(HtmlToken *t)
 
 /* EPUB-specific formatting methods */
 
+EpubFormatter::EpubFormatter(HtmlFormatterArgs *args, EpubDoc *doc) :
+    HtmlFormatter(args), epubDoc(doc), hiddenDepth(0)
+{
+    // chapters are decompressed on demand (cf. HandleHtmlTag)
+    epubDoc->LoadChapterAt(args->reparseIdx);
+}
+
 void EpubFormatter::HandleTagImg(HtmlToken *t)
 {
     CrashIf(!epubDoc);
@@ -208,6 +216,9 @@ void EpubFormatter::HandleTagSvgImage(HtmlToken *t)
 void EpubFormatter::HandleHtmlTag(HtmlToken *t)
 {
     CrashIf(!t->IsTag());
+    // a chapter begins, so make sure that its content is available
+    if (Tag_Pagebreak == t->tag)
+        epubDoc->LoadChapterAt(currReparseIdx);
     if (hiddenDepth && t->IsEndTag() && tagNesting.Count() == hiddenDepth &&
         t->tag == tagNesting.Last()) {
         hiddenDepth = 0;
@@ -336,3 +347,172 @@ void HtmlFileFormatter::HandleTagImg(HtmlToken *t)
     if (img)
         EmitImage(img);
 }
+
+/* concurrent layout of chapters */
+
+// allows several formatting threads to share the caller's textAllocator
+class SyncAllocator : public Allocator {
+    Allocator *         allocator;
+    CRITICAL_SECTION    cs;
+
+public:
+    SyncAllocator(Allocator *allocator) : allocator(allocator) { InitializeCriticalSection(&cs); }
+    virtual ~SyncAllocator() { DeleteCriticalSection(&cs); }
+
+    virtual void *Alloc(size_t size) {
+        ScopedCritSec scope(&cs);
+        return Allocator::Alloc(allocator, size);
+    }
+    virtual void *Realloc(void *mem, size_t size) {
+        ScopedCritSec scope(&cs);
+        return Allocator::Realloc(allocator, mem, size);
+    }
+    virtual void Free(void *mem) {
+        ScopedCritSec scope(&cs);
+        Allocator::Free(allocator, mem);
+    }
+};
+
+class ChapterFormattingThread : public ThreadBase {
+    ChapterFormatter *  formatter;
+
+public:
+    ChapterFormattingThread(ChapterFormatter *formatter) :
+        ThreadBase("ChapterFormattingThread"), formatter(formatter) { }
+
+    virtual void Run() { formatter->FormatChapters(); }
+};
+
+ChapterFormatter::ChapterFormatter(Doc doc, HtmlFormatterArgs *args, bool skipEmptyPages, int threadCount) :
+    doc(doc), args(*args), skipEmptyPages(skipEmptyPages), nextChapter(0),
+    currChapter(0), currPageIdx(0), formatter(NULL), textAllocator(NULL),
+    chapterDone(NULL), cancelled(false)
+{
+    size_t reparseIdx = (size_t)args->reparseIdx;
+    EpubDoc *epubDoc = doc.AsEpub();
+    size_t count = epubDoc ? epubDoc->GetChapterCount() : 0;
+    for (size_t i = 0; i < count; i++) {
+        size_t end = i + 1 < count ? epubDoc->GetChapterStart(i + 1) : args->htmlStrLen;
+        // start with the chapter containing the reparse point
+        if (end <= reparseIdx)
+            continue;
+        Chapter ch = { max(epubDoc->GetChapterStart(i), reparseIdx), end, NULL, 0 };
+        chapters.Append(ch);
+    }
+    if (0 == chapters.Count()) {
+        Chapter ch = { reparseIdx, args->htmlStrLen, NULL, 0 };
+        chapters.Append(ch);
+    }
+
+    if (threadCount <= 0) {
+        SYSTEM_INFO si;
+        GetSystemInfo(&si);
+        threadCount = (int)si.dwNumberOfProcessors;
+    }
+    if ((size_t)threadCount > chapters.Count())
+        threadCount = (int)chapters.Count();
+    if (threadCount < 2)
+        return;
+
+    textAllocator = new SyncAllocator(args->textAllocator);
+    chapterDone = CreateEvent(NULL, FALSE, FALSE, NULL);
+    for (int i = 0; i < threadCount; i++) {
+        ChapterFormattingThread *thread = new ChapterFormattingThread(this);
+        threads.Append(thread);
+        thread->Start();
+    }
+}
+
+ChapterFormatter::~ChapterFormatter()
+{
+    cancelled = true;
+    for (size_t i = 0; i < threads.Count(); i++) {
+        threads.At(i)->RequestCancelAndWaitToStop();
+        threads.At(i)->Release();
+    }
+    // delete all pages that were not consumed by the caller
+    for (Chapter *ch = chapters.IterStart(); ch; ch = chapters.IterNext()) {
+        if (ch->pages)
+            DeleteVecMembers(*ch->pages);
+        delete ch->pages;
+    }
+    delete formatter;
+    if (chapterDone)
+        CloseHandle(chapterDone);
+    delete textAllocator;
+}
+
+// called concurrently by all ChapterFormattingThreads
+void ChapterFormatter::FormatChapters()
+{
+    for (;;) {
+        LONG idx = InterlockedIncrement(&nextChapter) - 1;
+        if (idx >= (LONG)chapters.Count())
+            return;
+        Chapter *ch = &chapters.At(idx);
+        ch->pages = new Vec<HtmlPage*>();
+        if (!cancelled) {
+            HtmlFormatterArgs chapterArgs = args;
+            chapterArgs.reparseIdx = (int)ch->start;
+            if (ch->start != (size_t)args.reparseIdx)
+                chapterArgs.reparseState = NULL;
+            chapterArgs.htmlStrLen = ch->end;
+            chapterArgs.textAllocator = textAllocator;
+            HtmlFormatter *chapterFormatter = CreateFormatter(doc, &chapterArgs);
+            for (HtmlPage *pd = chapterFormatter->Next(skipEmptyPages); pd && !cancelled; pd = chapterFormatter->Next(skipEmptyPages)) {
+                ch->pages->Append(pd);
+            }
+            delete chapterFormatter;
+        }
+        InterlockedExchange(&ch->done, 1);
+        SetEvent(chapterDone);
+    }
+}
+
+HtmlPage *ChapterFormatter::Next()
+{
+    for (; currChapter < chapters.Count(); currChapter++) {
+        Chapter *ch = &chapters.At(currChapter);
+        if (0 == threads.Count()) {
+            // format the chapter on this thread, page by page
+            if (!formatter) {
+                HtmlFormatterArgs chapterArgs = args;
+                chapterArgs.reparseIdx = (int)ch->start;
+                if (ch->start != (size_t)args.reparseIdx)
+                    chapterArgs.reparseState = NULL;
+                chapterArgs.htmlStrLen = ch->end;
+                formatter = CreateFormatter(doc, &chapterArgs);
+            }
+            HtmlPage *pd = formatter->Next(skipEmptyPages);
+            if (pd)
+                return pd;
+            delete formatter;
+            formatter = NULL;
+            continue;
+        }
+
+        while (!ch->done) {
+            WaitForSingleObject(chapterDone, INFINITE);
+        }
+        if (currPageIdx < ch->pages->Count()) {
+            HtmlPage *pd = ch->pages->At(currPageIdx);
+            // the caller owns the page from now on
+            ch->pages->At(currPageIdx++) = NULL;
+            return pd;
+        }
+        delete ch->pages;
+        ch->pages = NULL;
+        currPageIdx = 0;
+    }
+    return NULL;
+}
+
+// convenience method to format the whole document
+Vec<HtmlPage*> *ChapterFormatter::FormatAllPages()
+{
+    Vec<HtmlPage *> *pages = new Vec<HtmlPage *>();
+    for (HtmlPage *pd = Next(); pd; pd = Next()) {
+        pages->Append(pd);
+    }
+    return pages;
+}
@@ -48,8 +48,7 @@ class EpubFormatter : public HtmlFormatter {
     size_t hiddenDepth;
 
 public:
-    EpubFormatter(HtmlFormatterArgs *args, EpubDoc *doc) :
-        HtmlFormatter(args), epubDoc(doc), hiddenDepth(0) { }
+    EpubFormatter(HtmlFormatterArgs *args, EpubDoc *doc);
 };
 
 /* formatting extensions for FictionBook */
@@ -111,4 +110,55 @@ public:
     TxtFormatter(HtmlFormatterArgs *args) : HtmlFormatter(args) { }
 };
 
+/* concurrent layout of chapters */
+
+class ChapterFormattingThread;
+class SyncAllocator;
+
+// EPUB chapters always start on a new page and don't share any layout state,
+// so they can be formatted independently of each other on several threads.
+// Pages are still returned in order and the first chapters are formatted first.
+// Other documents are formatted on the calling thread, same as with CreateFormatter
+class ChapterFormatter {
+    friend class ChapterFormattingThread;
+
+    struct Chapter {
+        size_t              start;
+        size_t              end;
+        Vec<HtmlPage*> *    pages;
+        volatile LONG       done;
+    };
+
+    Doc                 doc;
+    HtmlFormatterArgs   args;
+    bool                skipEmptyPages;
+    Vec<Chapter>        chapters;
+    // index of the next chapter to be formatted by a thread
+    volatile LONG       nextChapter;
+    // index of the chapter which Next() returns pages from
+    size_t              currChapter;
+    size_t              currPageIdx;
+    // formatter for the current chapter, if not using threads
+    HtmlFormatter *     formatter;
+
+    Vec<ChapterFormattingThread *> threads;
+    SyncAllocator *     textAllocator;
+    // signaled whenever a thread has finished formatting a chapter
+    HANDLE              chapterDone;
+    bool                cancelled;
+
+    void FormatChapters();
+
+public:
+    // threadCount is the number of processors by default
+    ChapterFormatter(Doc doc, HtmlFormatterArgs *args, bool skipEmptyPages=true, int threadCount=0);
+    ~ChapterFormatter();
+
+    // returns NULL once all pages have been returned
+    HtmlPage *Next();
+    Vec<HtmlPage*> *FormatAllPages();
+    // makes all threads stop as soon as possible
+    void Cancel() { cancelled = true; }
+};
+
 #endif
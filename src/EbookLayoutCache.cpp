@@ -0,0 +1,288 @@
+/* Copyright 2012 the SumatraPDF project authors (see AUTHORS file).
+   License: GPLv3 */
+
+#include "BaseUtil.h"
+#include "EbookLayoutCache.h"
+
+#include "AppTools.h"
+#include "ByteReader.h"
+#include "FileHistory.h"
+#include "FileUtil.h"
+#include "HtmlFormatter.h"
+#include "Mui.h"
+#include "PdfEngine.h"
+#include "SumatraAbout.h"
+
+/* The cache file consists of little-endian DWORDs:
+   header: "SLC" magic, LAYOUT_CACHE_VERSION, HTML_FORMATTER_VERSION,
+           document size and modification time, html data size, page dx/dy,
+           screen DPI, font size * 100, font name
+   fonts:  count, then name, size and style for every font used in a style stack
+   pages:  count, then reparseIdx, listDepth, flags and the style stack
+           (font index, alignment and direction) for every page
+   Strings are stored as their length followed by as many WCHARs. */
+
+#define LAYOUT_CACHE_MAGIC      "SLC"
+// must be increased whenever the file format changes
+#define LAYOUT_CACHE_VERSION    1
+
+#define PAGE_PREFORMATTED       0x1
+#define PAGE_DIR_RTL            0x2
+
+// style stacks are only as deep as the html tags are nested
+#define MAX_STYLE_STACK_DEPTH   1024
+
+static WCHAR *GetLayoutCachePath(const WCHAR *filePath)
+{
+    // use the same fingerprint as thumbnails do (cf. CalcPathDigest in ThumbnailCache.cpp)
+    unsigned char digest[16];
+    ScopedMem<char> pathU(str::conv::ToUtf8(filePath));
+    if (path::HasVariableDriveLetter(filePath))
+        pathU[0] = '?'; // ignore the drive letter, if it might change
+    CalcMD5Digest((unsigned char *)pathU.Get(), str::Len(pathU), digest);
+    ScopedMem<char> fingerPrint(str::MemToHex(digest, 16));
+
+    ScopedMem<WCHAR> cachePath(AppGenDataFilename(THUMBNAILS_DIR_NAME));
+    if (!cachePath)
+        return NULL;
+    ScopedMem<WCHAR> fname(str::conv::FromAnsi(fingerPrint));
+
+    return str::Format(L"%s\\%s.layout", cachePath, fname);
+}
+
+static void AppendDWord(str::Str<char>& data, uint32_t value)
+{
+    // all supported platforms are little-endian
+    data.Append((char *)&value, sizeof(value));
+}
+
+static void AppendFloat(str::Str<char>& data, float value)
+{
+    data.Append((char *)&value, sizeof(value));
+}
+
+static void AppendString(str::Str<char>& data, const WCHAR *s)
+{
+    size_t len = str::Len(s);
+    AppendDWord(data, (uint32_t)len);
+    data.Append((char *)s, len * sizeof(WCHAR));
+}
+
+// everything a layout depends on, so that the cache is only
+// valid if its header matches the expected header exactly
+static bool AppendHeader(str::Str<char>& data, const WCHAR *filePath, HtmlFormatterArgs *args)
+{
+    size_t fileSize = file::GetSize(filePath);
+    if (INVALID_FILE_SIZE == fileSize)
+        return false;
+    FILETIME modTime = file::GetModificationTime(filePath);
+    Graphics *gfx = mui::AllocGraphicsForMeasureText();
+    REAL dpi = gfx->GetDpiY();
+    mui::FreeGraphicsForMeasureText(gfx);
+
+    data.Append(LAYOUT_CACHE_MAGIC, 4);
+    AppendDWord(data, LAYOUT_CACHE_VERSION);
+    AppendDWord(data, HTML_FORMATTER_VERSION);
+    AppendDWord(data, (uint32_t)fileSize);
+    AppendDWord(data, modTime.dwLowDateTime);
+    AppendDWord(data, modTime.dwHighDateTime);
+    AppendDWord(data, (uint32_t)args->htmlStrLen);
+    AppendDWord(data, (uint32_t)args->pageDx);
+    AppendDWord(data, (uint32_t)args->pageDy);
+    AppendDWord(data, (uint32_t)dpi);
+    AppendDWord(data, (uint32_t)(args->fontSize * 100));
+    AppendString(data, args->fontName);
+    return true;
+}
+
+class LayoutCacheReader {
+    ByteReader  r;
+    size_t      len;
+    size_t      off;
+
+public:
+    bool        ok;
+
+    LayoutCacheReader(const char *data, size_t len, size_t off) :
+        r(data, len), len(len), off(off), ok(true) { }
+
+    uint32_t DWord() {
+        if (off + 4 > len)
+            ok = false;
+        uint32_t value = r.DWordLE(off);
+        off += 4;
+        return value;
+    }
+
+    float Float() {
+        uint32_t value = DWord();
+        return *(float *)&value;
+    }
+
+    WCHAR *String() {
+        uint32_t count = DWord();
+        if (!ok || count > (len - off) / sizeof(WCHAR)) {
+            ok = false;
+            return NULL;
+        }
+        WCHAR *s = AllocArray<WCHAR>(count + 1);
+        for (uint32_t i = 0; i < count; i++) {
+            s[i] = r.WordLE(off + i * 2);
+        }
+        off += count * 2;
+        return s;
+    }
+};
+
+Vec<HtmlPage *> *LoadLayoutCache(const WCHAR *filePath, HtmlFormatterArgs *args)
+{
+    if (!filePath)
+        return NULL;
+    ScopedMem<WCHAR> cachePath(GetLayoutCachePath(filePath));
+    if (!cachePath)
+        return NULL;
+    str::Str<char> header;
+    if (!AppendHeader(header, filePath, args))
+        return NULL;
+    size_t len;
+    ScopedMem<char> data(file::ReadAll(cachePath, &len));
+    if (!data || len < header.Size() || memcmp(data, header.Get(), header.Size()) != 0)
+        return NULL;
+
+    LayoutCacheReader r(data, len, header.Size());
+    Vec<Font *> fonts;
+    uint32_t fontCount = r.DWord();
+    for (uint32_t i = 0; i < fontCount && r.ok; i++) {
+        ScopedMem<WCHAR> name(r.String());
+        float size = r.Float();
+        FontStyle style = (FontStyle)r.DWord();
+        if (r.ok)
+            fonts.Append(mui::GetCachedFont(name, size, style));
+    }
+
+    Vec<HtmlPage *> *pages = new Vec<HtmlPage *>();
+    uint32_t pageCount = r.DWord();
+    int lastReparseIdx = 0;
+    for (uint32_t i = 0; i < pageCount && r.ok; i++) {
+        HtmlPage *page = new HtmlPage();
+        pages->Append(page);
+        page->reparseIdx = (int)r.DWord();
+        page->listDepth = (int)r.DWord();
+        uint32_t flags = r.DWord();
+        page->preFormatted = (flags & PAGE_PREFORMATTED) != 0;
+        page->dirRtl = (flags & PAGE_DIR_RTL) != 0;
+        uint32_t depth = r.DWord();
+        if (page->reparseIdx < lastReparseIdx || (size_t)page->reparseIdx > args->htmlStrLen ||
+            0 == depth || depth > MAX_STYLE_STACK_DEPTH) {
+            r.ok = false;
+        }
+        lastReparseIdx = page->reparseIdx;
+        for (uint32_t j = 0; j < depth && r.ok; j++) {
+            DrawStyle style;
+            uint32_t fontIdx = r.DWord();
+            uint32_t attrs = r.DWord();
+            style.font = fontIdx < fonts.Count() ? fonts.At(fontIdx) : NULL;
+            style.align = (AlignAttr)(attrs & 0xFFFF);
+            style.dirRtl = (attrs >> 16) != 0;
+            if (!style.font || style.align >= Align_NotFound)
+                r.ok = false;
+            page->styleStack.Append(style);
+        }
+    }
+    if (!r.ok || 0 == pages->Count()) {
+        DeleteVecMembers(*pages);
+        delete pages;
+        return NULL;
+    }
+    return pages;
+}
+
+bool SaveLayoutCache(const WCHAR *filePath, HtmlFormatterArgs *args, Vec<HtmlPage *> *pages)
+{
+    if (!filePath)
+        return false;
+    ScopedMem<WCHAR> cachePath(GetLayoutCachePath(filePath));
+    if (!cachePath)
+        return false;
+    str::Str<char> data;
+    if (!AppendHeader(data, filePath, args))
+        return false;
+
+    Vec<Font *> fonts;
+    str::Str<char> pageData;
+    AppendDWord(pageData, (uint32_t)pages->Count());
+    for (size_t i = 0; i < pages->Count(); i++) {
+        HtmlPage *page = pages->At(i);
+        AppendDWord(pageData, (uint32_t)page->reparseIdx);
+        AppendDWord(pageData, (uint32_t)page->listDepth);
+        AppendDWord(pageData, (page->preFormatted ? PAGE_PREFORMATTED : 0) |
+                              (page->dirRtl ? PAGE_DIR_RTL : 0));
+        AppendDWord(pageData, (uint32_t)page->styleStack.Count());
+        for (DrawStyle *style = page->styleStack.IterStart(); style; style = page->styleStack.IterNext()) {
+            int fontIdx = fonts.Find(style->font);
+            if (-1 == fontIdx) {
+                fontIdx = (int)fonts.Count();
+                fonts.Append(style->font);
+            }
+            AppendDWord(pageData, (uint32_t)fontIdx);
+            AppendDWord(pageData, (uint32_t)style->align | (style->dirRtl ? 1 << 16 : 0));
+        }
+    }
+
+    AppendDWord(data, (uint32_t)fonts.Count());
+    for (size_t i = 0; i < fonts.Count(); i++) {
+        Font *font = fonts.At(i);
+        FontFamily family;
+        WCHAR familyName[LF_FACESIZE];
+        if (font->GetFamily(&family) != Ok || family.GetFamilyName(familyName) != Ok)
+            return false;
+        AppendString(data, familyName);
+        AppendFloat(data, font->GetSize());
+        AppendDWord(data, (uint32_t)font->GetStyle());
+    }
+    data.Append(pageData.Get(), pageData.Size());
+
+    ScopedMem<WCHAR> cacheDir(path::GetDir(cachePath));
+    if (!dir::Create(cacheDir))
+        return false;
+    return file::WriteAll(cachePath, data.Get(), data.Size());
+}
+
+void CleanUpLayoutCache(FileHistory& fileHistory)
+{
+    ScopedMem<WCHAR> cachePath(AppGenDataFilename(THUMBNAILS_DIR_NAME));
+    if (!cachePath)
+        return;
+    ScopedMem<WCHAR> pattern(path::Join(cachePath, L"*.layout"));
+
+    WStrVec files;
+    WIN32_FIND_DATA fdata;
+
+    HANDLE hfind = FindFirstFile(pattern, &fdata);
+    if (INVALID_HANDLE_VALUE == hfind)
+        return;
+    do {
+        if (!(fdata.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+            files.Append(str::Dup(fdata.cFileName));
+    } while (FindNextFile(hfind, &fdata));
+    FindClose(hfind);
+
+    // unlike thumbnails, layouts are kept for all documents in file history
+    DisplayState *state;
+    for (size_t i = 0; (state = fileHistory.Get(i)) != NULL; i++) {
+        ScopedMem<WCHAR> layoutPath(GetLayoutCachePath(state->filePath));
+        if (!layoutPath)
+            continue;
+        int idx = files.Find(path::GetBaseName(layoutPath));
+        if (idx != -1) {
+            WCHAR *fileName = files.At(idx);
+            files.RemoveAt(idx);
+            free(fileName);
+        }
+    }
+
+    for (size_t i = 0; i < files.Count(); i++) {
+        ScopedMem<WCHAR> layoutPath(path::Join(cachePath, files.At(i)));
+        file::Delete(layoutPath);
+    }
+}
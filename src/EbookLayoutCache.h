@@ -0,0 +1,27 @@
+/* Copyright 2012 the SumatraPDF project authors (see AUTHORS file).
+   License: GPLv3 */
+
+#ifndef EbookLayoutCache_h
+#define EbookLayoutCache_h
+
+class HtmlPage;
+struct HtmlFormatterArgs;
+class FileHistory;
+
+// The layout cache persists the pagination of an ebook (i.e. the reparse
+// point and the style state at the top of every page), so that a book
+// reopened with the same page size and font knows its page count right away
+// and can format any page on its own, without formatting all pages before it.
+//
+// There's one cache file per document. It's ignored (and overwritten once the
+// book has been formatted again) if the document's size or modification time,
+// its html data, the page size, the font or HTML_FORMATTER_VERSION differ.
+
+// returns pages without any instructions (to be used as HtmlFormatterArgs::reparseState)
+// or NULL if there's no valid layout cached for these formatting arguments
+Vec<HtmlPage *> *   LoadLayoutCache(const WCHAR *filePath, HtmlFormatterArgs *args);
+bool                SaveLayoutCache(const WCHAR *filePath, HtmlFormatterArgs *args, Vec<HtmlPage *> *pages);
+// removes cached layouts for documents no longer in file history
+void                CleanUpLayoutCache(FileHistory& fileHistory);
+
+#endif
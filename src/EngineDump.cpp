@@ -9,9 +9,13 @@
 #include "FileUtil.h"
 #include "PdfEngine.h"
 #include "TgaReader.h"
+#include "ThreadUtil.h"
+#include "Timer.h"
 #include "WinUtil.h"
+#include <psapi.h>
 
 #define Out(msg, ...) printf(msg, __VA_ARGS__)
+#define ErrOut(msg, ...) fwprintf(stderr, TEXT(msg), __VA_ARGS__)
 
 // caller must free() the result
 char *Escape(WCHAR *string, bool keepString=false)
@@ -313,6 +317,146 @@ void RenderDocument(BaseEngine *engine, const WCHAR *renderPath)
     }
 }
 
+enum BenchMetric { Bench_Load, Bench_Render, Bench_Text, Bench_MetricCount };
+static const char *gBenchMetricNames[] = { "load", "render", "text" };
+
+struct BenchJob {
+    int         pageCount;
+    // per page (and metric) timings in ms
+    Vec<double> timings[Bench_MetricCount];
+    LONG        nextPage;
+    LONG        failures;
+};
+
+// loads, renders (at 100%) and extracts the text of a single page
+void BenchPage(BaseEngine *engine, int pageNo, BenchJob *job)
+{
+    Timer t(true);
+    bool ok = engine->BenchLoadPage(pageNo);
+    job->timings[Bench_Load].At(pageNo - 1) = t.GetTimeInMs();
+
+    t.Start();
+    RenderedBitmap *bmp = ok ? engine->RenderBitmap(pageNo, 1.0, 0) : NULL;
+    job->timings[Bench_Render].At(pageNo - 1) = t.GetTimeInMs();
+    delete bmp;
+
+    t.Start();
+    free(ok ? engine->ExtractPageText(pageNo, L"\n") : NULL);
+    job->timings[Bench_Text].At(pageNo - 1) = t.GetTimeInMs();
+
+    if (!ok || !bmp)
+        InterlockedIncrement(&job->failures);
+}
+
+class BenchThread : public ThreadBase {
+    BenchJob *job;
+    BaseEngine *engine;
+
+public:
+    BenchThread(BenchJob *job, BaseEngine *engine) : ThreadBase("BenchThread"), job(job), engine(engine) { }
+
+    virtual void Run() {
+        for (;;) {
+            LONG pageNo = InterlockedIncrement(&job->nextPage);
+            if (pageNo > job->pageCount)
+                break;
+            BenchPage(engine, pageNo, job);
+        }
+    }
+};
+
+static int cmpDouble(const void *a, const void *b)
+{
+    double diff = *(double *)a - *(double *)b;
+    return diff < 0 ? -1 : diff > 0 ? 1 : 0;
+}
+
+void AppendJsonString(str::Str<char>& json, const WCHAR *value)
+{
+    ScopedMem<char> valueUtf8(str::conv::ToUtf8(value));
+    json.Append('"');
+    for (const char *c = valueUtf8; *c; c++) {
+        if ('"' == *c || '\\' == *c)
+            json.Append('\\');
+        json.Append(*c);
+    }
+    json.Append('"');
+}
+
+void AppendJsonStats(str::Str<char>& json, const char *name, Vec<double>& timings)
+{
+    Vec<double> sorted(timings);
+    sorted.Sort(cmpDouble);
+    double total = 0;
+    for (size_t i = 0; i < sorted.Count(); i++) {
+        total += sorted.At(i);
+    }
+    size_t last = sorted.Count() - 1;
+    json.AppendFmt("\t\"%s_ms\": { \"p50\": %.3f, \"p95\": %.3f, \"max\": %.3f, \"total\": %.3f },\n", name,
+                   sorted.At(last * 50 / 100), sorted.At(last * 95 / 100), sorted.At(last), total);
+}
+
+// loads, renders and extracts the text of all pages on threadCount threads
+// (each with its own clone of the engine) and prints the latencies as JSON
+bool BenchDocument(BaseEngine *engine, const WCHAR *filePath, double openMs, int threadCount)
+{
+    BenchJob job;
+    job.pageCount = engine->PageCount();
+    job.nextPage = 0;
+    job.failures = 0;
+    if (job.pageCount < 1) {
+        ErrOut("Error: %s has no pages!\n", path::GetBaseName(filePath));
+        return false;
+    }
+    for (int i = 0; i < Bench_MetricCount; i++) {
+        job.timings[i].AppendBlanks(job.pageCount);
+    }
+
+    Vec<BaseEngine *> clones;
+    for (int i = 1; i < threadCount; i++) {
+        BaseEngine *clone = engine->Clone();
+        if (!clone) {
+            ErrOut("Error: Couldn't clone the engine for %s!\n", path::GetBaseName(filePath));
+            DeleteVecMembers(clones);
+            return false;
+        }
+        clones.Append(clone);
+    }
+
+    Timer t(true);
+    Vec<BenchThread *> threads;
+    for (int i = 0; i < threadCount; i++) {
+        BenchThread *thread = new BenchThread(&job, i > 0 ? clones.At(i - 1) : engine);
+        threads.Append(thread);
+        thread->Start();
+    }
+    for (size_t i = 0; i < threads.Count(); i++) {
+        // Run() doesn't check for cancellation, so this waits for it to finish
+        threads.At(i)->RequestCancelAndWaitToStop();
+        threads.At(i)->Release();
+    }
+    double wallMs = t.GetTimeInMs();
+    DeleteVecMembers(clones);
+
+    PROCESS_MEMORY_COUNTERS pmc = { 0 };
+    GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc));
+
+    str::Str<char> json;
+    json.Append("{\n\t\"file\": ");
+    AppendJsonString(json, filePath);
+    json.AppendFmt(",\n\t\"pages\": %d,\n\t\"threads\": %d,\n\t\"failures\": %d,\n",
+                   job.pageCount, threadCount, (int)job.failures);
+    json.AppendFmt("\t\"open_ms\": %.3f,\n\t\"wall_ms\": %.3f,\n", openMs, wallMs);
+    for (int i = 0; i < Bench_MetricCount; i++) {
+        AppendJsonStats(json, gBenchMetricNames[i], job.timings[i]);
+    }
+    json.AppendFmt("\t\"peak_working_set\": %Iu,\n\t\"peak_pagefile_usage\": %Iu\n}\n",
+                   pmc.PeakWorkingSetSize, pmc.PeakPagefileUsage);
+    Out("%s", json.Get());
+
+    return 0 == job.failures;
+}
+
 class PasswordHolder : public PasswordUI {
     const WCHAR *password;
 public:
@@ -323,8 +467,6 @@ public:
     }
 };
 
-#define ErrOut(msg, ...) fwprintf(stderr, TEXT(msg), __VA_ARGS__)
-
 int main(int argc, char **argv)
 {
 #ifdef DEBUG
@@ -338,7 +480,7 @@ int main(int argc, char **argv)
     ParseCmdLine(GetCommandLine(), argList);
     if (argList.Count() < 2) {
 Usage:
-        ErrOut("%s <filename> [-pwd <password>][-full][-alt][-render <path-%%d.tga>]\n",
+        ErrOut("%s <filename> [-pwd <password>][-full][-alt][-render <path-%%d.tga>][-bench [-threads <n>]]\n",
             path::GetBaseName(argList.At(0)));
         return 0;
     }
@@ -362,6 +504,8 @@ Usage:
     WCHAR *renderPath = NULL;
     bool useAlternateHandlers = false;
     bool loadOnly = false;
+    bool bench = false;
+    int threadCount = 1;
 
     for (size_t i = 2; i < argList.Count(); i++) {
         if (str::Eq(argList.At(i), L"-full"))
@@ -374,6 +518,11 @@ Usage:
             useAlternateHandlers = true;
         else if (str::Eq(argList.At(i), L"-loadonly"))
             loadOnly = true;
+        else if (str::Eq(argList.At(i), L"-bench"))
+            bench = true;
+        else if (str::Eq(argList.At(i), L"-threads") && i + 1 < argList.Count() &&
+                 str::Parse(argList.At(i + 1), L"%d%$", &threadCount) && threadCount > 0)
+            i++;
         else
             goto Usage;
     }
@@ -385,11 +534,18 @@ Usage:
     ScopedGdiPlus gdiPlus;
     DocType engineType;
     PasswordHolder pwdUI(password);
+    Timer t(true);
     BaseEngine *engine = EngineManager::CreateEngine(true, filePath, &pwdUI, &engineType);
+    double openMs = t.GetTimeInMs();
     if (!engine) {
         ErrOut("Error: Couldn't create an engine for %s!\n", path::GetBaseName(filePath));
         return 1;
     }
+    if (bench) {
+        bool ok = BenchDocument(engine, filePath, openMs, threadCount);
+        delete engine;
+        return ok ? 0 : 1;
+    }
     if (!loadOnly)
         DumpData(engine, fullDump);
     if (renderPath)
@@ -127,11 +127,8 @@ public:
 
     // appends history to this one, leaving the other history emptied
     void ExtendWith(FileHistory& other) {
-        while (!other.IsEmpty()) {
-            DisplayState *state = other.Get(0);
-            Append(state);
-            other.Remove(state);
-        }
+        states.Append(other.states.LendData(), other.states.Count());
+        other.states.Reset();
     }
 
     // returns a shallow copy of the file history list, sorted
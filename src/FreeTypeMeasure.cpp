@@ -0,0 +1,207 @@
+/* Copyright 2012 the SumatraPDF project authors (see AUTHORS file).
+   License: GPLv3 */
+
+// measures text through FreeType (which comes with MuPDF) instead of through
+// GDI+, which is slow enough to dominate the layout time of ebooks
+
+#include "BaseUtil.h"
+#include <ft2build.h>
+#include FT_FREETYPE_H
+#include FT_TRUETYPE_TABLES_H
+using namespace Gdiplus;
+#include "FreeTypeMeasure.h"
+
+#include "FileUtil.h"
+#include "GdiPlusUtil.h"
+#include "WinUtil.h"
+
+// cf. MeasureTextAccurate: GDI+ draws text a bit wider than the sum of its advances
+#define PER_CHAR_DX_ADJUST .2f
+#define PER_STR_DX_ADJUST  1.f
+
+#define REG_KEY_FONTS L"SOFTWARE\\Microsoft\\Windows NT\\CurrentVersion\\Fonts"
+
+struct FtFontFile {
+    WCHAR *     name;   // family name plus " Bold"/" Italic"
+    char *      data;   // NULL if no font file was found
+    size_t      len;
+};
+
+struct FtFont {
+    Font *      font;
+    FT_Face     face;   // NULL if MeasureTextQuick is to be used instead
+    float       emSize; // in pixels
+    float       height;
+    // advances for the first 256 characters (negative if not yet known)
+    float       advances[256];
+};
+
+class FtMeasureCache {
+    CRITICAL_SECTION    cs;
+    FT_Library          lib;
+    Vec<FtFontFile>     files;
+    Vec<FtFont>         fonts;
+
+    FtFontFile *GetFontFile(const WCHAR *family, bool bold, bool italic);
+    FtFont *LoadFont(Graphics *g, Font *f);
+    float GetAdvance(FtFont *ff, WCHAR c);
+
+public:
+    FtMeasureCache() : lib(NULL) { InitializeCriticalSection(&cs); }
+    ~FtMeasureCache() { Free(); DeleteCriticalSection(&cs); }
+
+    bool Measure(Graphics *g, Font *f, const WCHAR *s, size_t len, RectF& bbox);
+    void Free();
+};
+
+static FtMeasureCache gFtMeasureCache;
+
+// finds the file for a given font in the registry (the same way as for GDI
+// with a fallback to the regular style) and loads it into memory
+FtFontFile *FtMeasureCache::GetFontFile(const WCHAR *family, bool bold, bool italic)
+{
+    ScopedMem<WCHAR> name(str::Format(L"%s%s%s", family, bold ? L" Bold" : L"", italic ? L" Italic" : L""));
+    for (FtFontFile *ff = files.IterStart(); ff; ff = files.IterNext()) {
+        if (str::EqI(ff->name, name))
+            return ff;
+    }
+
+    FtFontFile file = { name.StealData(), NULL, 0 };
+    ScopedMem<WCHAR> fileName;
+    const WCHAR *suffixes[] = { L" (TrueType)", L" (OpenType)" };
+    for (size_t i = 0; i < dimof(suffixes) && !fileName; i++) {
+        ScopedMem<WCHAR> valName(str::Join(file.name, suffixes[i]));
+        fileName.Set(ReadRegStr(HKEY_LOCAL_MACHINE, REG_KEY_FONTS, valName));
+        if (!fileName)
+            fileName.Set(ReadRegStr(HKEY_CURRENT_USER, REG_KEY_FONTS, valName));
+    }
+    if (fileName && !str::FindChar(fileName, '\\')) {
+        WCHAR winDir[MAX_PATH];
+        UINT len = GetWindowsDirectory(winDir, dimof(winDir));
+        if (0 < len && len < dimof(winDir)) {
+            ScopedMem<WCHAR> fontsDir(path::Join(winDir, L"Fonts"));
+            fileName.Set(path::Join(fontsDir, fileName));
+        }
+    }
+    if (fileName)
+        file.data = file::ReadAll(fileName, &file.len);
+    if (!file.data && (bold || italic)) {
+        // use the regular style's metrics instead
+        FtFontFile *regular = GetFontFile(family, false, false);
+        if (regular->data) {
+            file.data = (char *)memdup(regular->data, regular->len);
+            file.len = file.data ? regular->len : 0;
+        }
+    }
+    files.Append(file);
+    return &files.Last();
+}
+
+FtFont *FtMeasureCache::LoadFont(Graphics *g, Font *f)
+{
+    FtFont ff = { f, NULL, 0, 0 };
+    for (size_t i = 0; i < dimof(ff.advances); i++) {
+        ff.advances[i] = -1;
+    }
+
+    FontFamily family;
+    WCHAR familyName[LF_FACESIZE];
+    INT style = f->GetStyle();
+    if (!lib && FT_Init_FreeType(&lib))
+        lib = NULL;
+    if (!lib || f->GetFamily(&family) != Ok || family.GetFamilyName(familyName) != Ok) {
+        fonts.Append(ff);
+        return &fonts.Last();
+    }
+
+    FtFontFile *file = GetFontFile(familyName, (style & FontStyleBold) != 0, (style & FontStyleItalic) != 0);
+    ff.emSize = f->GetSize();
+    if (UnitPoint == f->GetUnit())
+        ff.emSize *= g->GetDpiY() / 72.f;
+    if (file->data && !FT_New_Memory_Face(lib, (FT_Byte *)file->data, (FT_Long)file->len, 0, &ff.face)) {
+        if (FT_Set_Char_Size(ff.face, 0, (FT_F26Dot6)(ff.emSize * 64 + 0.5f), 72, 72)) {
+            FT_Done_Face(ff.face);
+            ff.face = NULL;
+        }
+    }
+    if (ff.face) {
+        // GDI+ uses the Windows metrics for the line height
+        TT_OS2 *os2 = (TT_OS2 *)FT_Get_Sfnt_Table(ff.face, ft_sfnt_os2);
+        if (os2 && os2->usWinAscent + os2->usWinDescent > 0)
+            ff.height = (os2->usWinAscent + os2->usWinDescent) * ff.emSize / ff.face->units_per_EM;
+        else
+            ff.height = ff.face->size->metrics.height / 64.f;
+    }
+    fonts.Append(ff);
+    return &fonts.Last();
+}
+
+float FtMeasureCache::GetAdvance(FtFont *ff, WCHAR c)
+{
+    if (c < dimof(ff->advances) && ff->advances[c] >= 0)
+        return ff->advances[c];
+
+    float advance = 0;
+    FT_UInt gid = FT_Get_Char_Index(ff->face, c);
+    // use the grid-fitted advances, as GDI+ measures with TextRenderingHintClearTypeGridFit
+    if (gid && !FT_Load_Glyph(ff->face, gid, FT_LOAD_NO_BITMAP))
+        advance = ff->face->glyph->advance.x / 64.f;
+    else if (!gid)
+        advance = ff->emSize / 2; // missing glyphs are usually replaced with boxes
+    if (c < dimof(ff->advances))
+        ff->advances[c] = advance;
+    return advance;
+}
+
+bool FtMeasureCache::Measure(Graphics *g, Font *f, const WCHAR *s, size_t len, RectF& bbox)
+{
+    ScopedCritSec scope(&cs);
+
+    FtFont *ff = NULL;
+    for (FtFont *ffi = fonts.IterStart(); ffi; ffi = fonts.IterNext()) {
+        if (ffi->font == f) {
+            ff = ffi;
+            break;
+        }
+    }
+    if (!ff)
+        ff = LoadFont(g, f);
+    if (!ff->face)
+        return false;
+
+    float dx = 0;
+    for (size_t i = 0; i < len; i++) {
+        dx += GetAdvance(ff, s[i]);
+    }
+    if (dx != 0)
+        dx += PER_STR_DX_ADJUST + (PER_CHAR_DX_ADJUST * (float)len);
+    bbox = RectF(0, 0, dx, ff->height);
+    return true;
+}
+
+void FtMeasureCache::Free()
+{
+    ScopedCritSec scope(&cs);
+
+    for (FtFont *ff = fonts.IterStart(); ff; ff = fonts.IterNext()) {
+        if (ff->face)
+            FT_Done_Face(ff->face);
+    }
+    fonts.Reset();
+    for (FtFontFile *ff = files.IterStart(); ff; ff = files.IterNext()) {
+        free(ff->name);
+        free(ff->data);
+    }
+    files.Reset();
+    if (lib)
+        FT_Done_FreeType(lib);
+    lib = NULL;
+}
+
+RectF MeasureTextFreeType(Graphics *g, Font *f, const WCHAR *s, size_t len)
+{
+    RectF bbox;
+    if (!gFtMeasureCache.Measure(g, f, s, len, bbox))
+        bbox = MeasureTextQuick(g, f, s, len);
+    return bbox;
+}
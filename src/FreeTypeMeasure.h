@@ -0,0 +1,14 @@
+/* Copyright 2012 the SumatraPDF project authors (see AUTHORS file).
+   License: GPLv3 */
+
+#ifndef FreeTypeMeasure_h
+#define FreeTypeMeasure_h
+
+// note: must write "using namespace Gdiplus;" before #include "FreeTypeMeasure.h"
+
+// a TextMeasureAlgorithm (cf. GdiPlusUtil.h) which adds up glyph advances
+// as reported by FreeType instead of asking GDI+. This is considerably faster
+// and falls back to MeasureTextQuick for fonts without an installed font file
+RectF   MeasureTextFreeType(Graphics *g, Font *f, const WCHAR *s, size_t len);
+
+#endif
@@ -5,6 +5,7 @@
 #include "HtmlFormatter.h"
 
 using namespace Gdiplus;
+#include "Dict.h"
 #include "GdiPlusUtil.h"
 #include "HtmlPullParser.h"
 #include "Mui.h"
@@ -45,9 +46,6 @@ The information that we need to remember:
 * text color (when/if we support changing text color)
 * more ?
 
-TODO: reuse styleStack, listDepth, preFormatted, dirRtl from HtmlPage when restarting
-layout from a reparseIdx
-
 TODO: HtmlFormatter could be split into DrawInstrBuilder which knows pageDx, pageDy
 and generates DrawInstr and splits them into pages and a better named class that
 does the parsing of the document builds pages by invoking methods on DrawInstrBuilders.
@@ -117,9 +115,161 @@ DrawInstr DrawInstr::Anchor(const char *s, size_t len, RectF bbox)
     return di;
 }
 
+/* Measuring text is expensive (especially through GDI+), so we remember the
+measurements of all text runs (mostly single words) per font and measurement
+algorithm. Fonts are cached by mui and never freed, so the cache can be shared
+by all formatters and survives relayouts (e.g. after resizing the window). */
+class TextMeasureCache {
+    // the measurements for a single font and measurement algorithm
+    // (there are rarely more than a dozen of them)
+    struct FontCache {
+        Font *                  font;
+        TextMeasureAlgorithm    algo;
+        // maps measured text runs to indices into bboxes
+        dict::MapWStrToInt *    indices;
+    };
+
+    enum { MAX_ENTRIES = 64 * 1024 };
+
+    CRITICAL_SECTION    cs;
+    Vec<FontCache>      fonts;
+    Vec<RectF>          bboxes;
+
+    void Reset() {
+        for (size_t i = 0; i < fonts.Count(); i++) {
+            delete fonts.At(i).indices;
+        }
+        fonts.Reset();
+        bboxes.Reset();
+    }
+
+    FontCache *GetFontCache(Font *f, TextMeasureAlgorithm algo) {
+        for (size_t i = 0; i < fonts.Count(); i++) {
+            FontCache& fc = fonts.At(i);
+            if (fc.font == f && fc.algo == algo)
+                return &fc;
+        }
+        return NULL;
+    }
+
+public:
+    TextMeasureCache() { InitializeCriticalSection(&cs); }
+    ~TextMeasureCache() {
+        Reset();
+        DeleteCriticalSection(&cs);
+    }
+
+    // f is the shared font the measurement is cached for and measureFont
+    // the formatter's own copy of it used for measuring
+    RectF Measure(Graphics *g, Font *f, Font *measureFont, const WCHAR *s, size_t len, TextMeasureAlgorithm algo) {
+        {
+            ScopedCritSec scope(&cs);
+            FontCache *fc = GetFontCache(f, algo);
+            int idx;
+            if (fc && fc->indices->Get(s, len, &idx))
+                return bboxes.At(idx);
+        }
+
+        // don't block other threads while measuring
+        RectF bbox = MeasureText(g, measureFont, s, len, algo);
+
+        ScopedCritSec scope(&cs);
+        if (bboxes.Count() >= MAX_ENTRIES) {
+            // start over instead of growing indefinitely
+            Reset();
+        }
+        FontCache *fc = GetFontCache(f, algo);
+        if (!fc) {
+            FontCache newCache = { f, algo, new dict::MapWStrToInt(1024) };
+            fonts.Append(newCache);
+            fc = &fonts.Last();
+        }
+        // Insert fails if another thread has measured the same text in the meantime
+        int prevIdx;
+        if (fc->indices->Insert(s, len, (int)bboxes.Count(), &prevIdx))
+            bboxes.Append(bbox);
+        return bbox;
+    }
+};
+
+static TextMeasureCache gTextMeasureCache;
+
+WordBoxCache::WordBoxCache() : indices(new dict::MapWStrToInt(1024)), boxCount(0)
+{
+    InitializeCriticalSection(&cs);
+}
+
+WordBoxCache::~WordBoxCache()
+{
+    delete indices;
+    DeleteCriticalSection(&cs);
+}
+
+void WordBoxCache::Reset()
+{
+    delete indices;
+    indices = new dict::MapWStrToInt(1024);
+    entries.Reset();
+    allocator.FreeAll();
+    boxCount = 0;
+}
+
+// the binary values of reparseIdx and font serve as a MapWStrToInt key
+struct WordBoxKey {
+    size_t data[2];
+
+    WordBoxKey(int reparseIdx, Font *font) {
+        data[0] = (size_t)reparseIdx;
+        data[1] = (size_t)font;
+    }
+    const WCHAR *Get() const { return (const WCHAR *)data; }
+    size_t Len() const { return sizeof(data) / sizeof(WCHAR); }
+};
+
+bool WordBoxCache::Lookup(int reparseIdx, Font *font, Vec<WordBox>& boxesOut, Allocator *textAllocator)
+{
+    WordBoxKey key(reparseIdx, font);
+    ScopedCritSec scope(&cs);
+    int idx;
+    if (!indices->Get(key.Get(), key.Len(), &idx))
+        return false;
+    Entry& e = entries.At(idx);
+    for (size_t i = 0; i < e.count; i++) {
+        WordBox box = e.boxes[i];
+        if (box.resolved)
+            box.resolved = (const char *)Allocator::Dup(textAllocator, (void *)box.resolved, str::Len(box.resolved) + 1);
+        boxesOut.Append(box);
+    }
+    return true;
+}
+
+void WordBoxCache::Add(int reparseIdx, Font *font, Vec<WordBox>& boxes)
+{
+    WordBoxKey key(reparseIdx, font);
+    ScopedCritSec scope(&cs);
+    int idx;
+    if (indices->Get(key.Get(), key.Len(), &idx))
+        return;
+    if (boxCount + boxes.Count() > MAX_BOXES) {
+        // start over instead of growing indefinitely
+        Reset();
+    }
+    Entry newEntry = { NULL, boxes.Count() };
+    newEntry.boxes = (WordBox *)allocator.Alloc(boxes.Count() * sizeof(WordBox));
+    for (size_t i = 0; i < boxes.Count(); i++) {
+        WordBox box = boxes.At(i);
+        if (box.resolved)
+            box.resolved = (const char *)Allocator::Dup(&allocator, (void *)box.resolved, str::Len(box.resolved) + 1);
+        newEntry.boxes[i] = box;
+    }
+    indices->Insert(key.Get(), key.Len(), (int)entries.Count(), &idx);
+    entries.Append(newEntry);
+    boxCount += boxes.Count();
+}
+
 HtmlFormatter::HtmlFormatter(HtmlFormatterArgs *args) :
     pageDx(args->pageDx), pageDy(args->pageDy),
-    textAllocator(args->textAllocator), currLineReparseIdx(NULL),
+    textAllocator(args->textAllocator), wordBoxes(args->wordBoxes), currLineReparseIdx(NULL),
     currX(0), currY(0), currLineTopPadding(0), currLinkIdx(0),
     listDepth(0), preFormatted(false), dirRtl(false), currPage(NULL),
     finishedParsing(false), pageCount(0), measureAlgo(args->measureAlgo),
@@ -140,12 +290,23 @@ HtmlFormatter::HtmlFormatter(HtmlFormatterArgs *args) :
     currLineStyleStack.Append(style);
     styleStack = currLineStyleStack;
 
-    lineSpacing = CurrFont()->GetHeight(gfx);
-    spaceDx = CurrFont()->GetSize() / 2.5f; // note: a heuristic
-    float spaceDx2 = GetSpaceDx(gfx, CurrFont(), measureAlgo);
+    Font *font = MeasureFont(CurrFont());
+    lineSpacing = font->GetHeight(gfx);
+    spaceDx = font->GetSize() / 2.5f; // note: a heuristic
+    float spaceDx2 = GetSpaceDx(gfx, font, measureAlgo);
     if (spaceDx2 < spaceDx)
         spaceDx = spaceDx2;
 
+    const HtmlPage *state = args->reparseState;
+    if (state && state->styleStack.Count() > 0) {
+        CrashIf(state->reparseIdx != currReparseIdx);
+        currLineStyleStack = state->styleStack;
+        styleStack = currLineStyleStack;
+        listDepth = state->listDepth;
+        preFormatted = state->preFormatted;
+        dirRtl = state->dirRtl;
+    }
+
     EmitNewPage();
 }
 
@@ -155,6 +316,10 @@ HtmlFormatter::~HtmlFormatter()
     DeleteVecMembers(pagesToSend);
     delete currPage;
     delete htmlParser;
+    for (size_t i = 0; i < fontCopies.Count(); i++) {
+        if (fontCopies.At(i).copy != fontCopies.At(i).font)
+            delete fontCopies.At(i).copy;
+    }
     mui::FreeGraphicsForMeasureText(gfx);
 }
 
@@ -167,10 +332,41 @@ void HtmlFormatter::AppendInstr(DrawInstr di)
     }
 }
 
+// returns this formatter's copy of a shared font (only copying
+// requires holding ScopedMuiCritSec)
+Font *HtmlFormatter::MeasureFont(Font *font)
+{
+    // there are rarely more than a dozen fonts per formatter
+    for (size_t i = 0; i < fontCopies.Count(); i++) {
+        if (fontCopies.At(i).font == font)
+            return fontCopies.At(i).copy;
+    }
+    FontCopy fc = { font, NULL };
+    {
+        mui::ScopedMuiCritSec muiCs;
+        fc.copy = font->Clone();
+    }
+    // fall back to the shared font, if it can't be copied
+    if (!fc.copy)
+        fc.copy = font;
+    fontCopies.Append(fc);
+    return fc.copy;
+}
+
+float HtmlFormatter::CurrFontSize()
+{
+    return MeasureFont(CurrFont())->GetSize();
+}
+
+FontStyle HtmlFormatter::CurrFontStyle()
+{
+    return (FontStyle)MeasureFont(CurrFont())->GetStyle();
+}
+
 void HtmlFormatter::SetFont(const WCHAR *fontName, FontStyle fs, float fontSize)
 {
     if (fontSize < 0)
-        fontSize = CurrFont()->GetSize();
+        fontSize = CurrFontSize();
     Font *newFont = mui::GetCachedFont(fontName, fontSize, fs);
     if (CurrFont() != newFont)
         AppendInstr(DrawInstr::SetFont(newFont));
@@ -182,7 +378,7 @@ void HtmlFormatter::SetFont(const WCHAR *fontName, FontStyle fs, float fontSize)
 void HtmlFormatter::SetFont(Font *font, FontStyle fs, float fontSize)
 {
     LOGFONTW lfw;
-    Status ok = CurrFont()->GetLogFontW(gfx, &lfw);
+    Status ok = MeasureFont(CurrFont())->GetLogFontW(gfx, &lfw);
     const WCHAR *fontName = ok == Ok ? lfw.lfFaceName : defaultFontName;
     SetFont(fontName, fs, fontSize);
 }
@@ -206,7 +402,7 @@ void HtmlFormatter::ChangeFontStyle(FontStyle fs, bool addStyle)
 {
     CrashIf(!ValidStyleForChangeFontStyle(fs));
     if (addStyle)
-        SetFont(CurrFont(), (FontStyle)(fs | CurrFont()->GetStyle()));
+        SetFont(CurrFont(), (FontStyle)(fs | CurrFontStyle()));
     else
         RevertStyleChange();
 }
@@ -502,6 +698,7 @@ void HtmlFormatter::EmitNewPage()
     currPage->styleStack = styleStack;
     currPage->listDepth = listDepth;
     currPage->preFormatted = preFormatted;
+    currPage->dirRtl = dirRtl;
     currPage->instructions.Append(DrawInstr::SetFont(currPage->styleStack.Last().font));
     currY = 0.f;
 }
@@ -652,15 +849,12 @@ void HtmlFormatter::EmitTextRun(const char *s, const char *end)
             currReparseIdx = s - htmlParser->Start();
 
         size_t strLen = str::Utf8ToWcharBuf(s, end - s, buf, dimof(buf));
-        RectF bbox = MeasureText(gfx, CurrFont(), buf, strLen, measureAlgo);
-        EnsureDx(bbox.Width);
-        if (bbox.Width <= pageDx - currX) {
-            AppendInstr(DrawInstr::Str(s, end - s, bbox, dirRtl));
-            currX += bbox.Width;
+        Font *font = MeasureFont(CurrFont());
+        RectF bbox = gTextMeasureCache.Measure(gfx, CurrFont(), font, buf, strLen, measureAlgo);
+        if (EmitWord(s, end - s, bbox))
             break;
-        }
 
-        int lenThatFits = StringLenForWidth(gfx, CurrFont(), buf, strLen, pageDx - NewLineX(), measureAlgo);
+        int lenThatFits = StringLenForWidth(gfx, font, buf, strLen, pageDx - NewLineX(), measureAlgo);
         // try to prevent a break in the middle of a word
         if (iswalnum(buf[lenThatFits])) {
             for (int len = lenThatFits; len > 0; len--) {
@@ -670,7 +864,7 @@ void HtmlFormatter::EmitTextRun(const char *s, const char *end)
                 }
             }
         }
-        bbox = MeasureText(gfx, CurrFont(), buf, lenThatFits, measureAlgo);
+        bbox = MeasureText(gfx, font, buf, lenThatFits, measureAlgo);
         CrashIf(bbox.Width > pageDx);
         // s is UTF-8 and buf is UTF-16, so one
         // WCHAR doesn't always equal one char
@@ -684,6 +878,17 @@ void HtmlFormatter::EmitTextRun(const char *s, const char *end)
     }
 }
 
+// emits a measured word, if it fits on a line (starting a new line, if needed)
+bool HtmlFormatter::EmitWord(const char *s, size_t len, RectF bbox)
+{
+    EnsureDx(bbox.Width);
+    if (bbox.Width > pageDx - currX)
+        return false;
+    AppendInstr(DrawInstr::Str(s, len, bbox, dirRtl));
+    currX += bbox.Width;
+    return true;
+}
+
 void HtmlFormatter::HandleAnchorAttr(HtmlToken *t, bool idsOnly)
 {
     if (t->IsEndTag())
@@ -748,7 +953,7 @@ void HtmlFormatter::HandleTagFont(HtmlToken *t)
 
     AttrInfo *attr = t->GetAttrByName("face");
     LOGFONTW lfw;
-    CurrFont()->GetLogFontW(gfx, &lfw);
+    MeasureFont(CurrFont())->GetLogFontW(gfx, &lfw);
     const WCHAR *faceName = lfw.lfFaceName;
     if (attr) {
         size_t strLen = str::Utf8ToWcharBuf(t->s, t->sLen, buf, dimof(buf));
@@ -759,7 +964,7 @@ void HtmlFormatter::HandleTagFont(HtmlToken *t)
         }
     }
 
-    float fontSize = CurrFont()->GetSize();
+    float fontSize = CurrFontSize();
     attr = t->GetAttrByName("size");
     if (attr) {
         // the sizes are in the range from 1 (tiny) to 7 (huge)
@@ -773,7 +978,7 @@ void HtmlFormatter::HandleTagFont(HtmlToken *t)
         fontSize = defaultFontSize * scale;
     }
 
-    SetFont(faceName, (FontStyle)CurrFont()->GetStyle(), fontSize);
+    SetFont(faceName, CurrFontStyle(), fontSize);
 }
 
 bool HtmlFormatter::HandleTagA(HtmlToken *t, const char *linkAttr, const char *attrNS)
@@ -812,7 +1017,7 @@ void HtmlFormatter::HandleTagHx(HtmlToken *t)
 {
     if (t->IsEndTag()) {
         FlushCurrLine(true);
-        currY += CurrFont()->GetSize() / 2;
+        currY += CurrFontSize() / 2;
         RevertStyleChange();
     }
     else {
@@ -839,7 +1044,7 @@ void HtmlFormatter::HandleTagPre(HtmlToken *t)
 {
     FlushCurrLine(true);
     if (t->IsStartTag()) {
-        SetFont(L"Courier New", (FontStyle)CurrFont()->GetStyle());
+        SetFont(L"Courier New", CurrFontStyle());
         CurrStyle()->align = Align_Left;
         preFormatted = true;
     }
@@ -998,7 +1203,7 @@ void HtmlFormatter::HandleHtmlTag(HtmlToken *t)
             RevertStyleChange();
     } else if (Tag_Code == tag || Tag_Tt == tag) {
         if (t->IsStartTag())
-            SetFont(L"Courier New", (FontStyle)CurrFont()->GetStyle());
+            SetFont(L"Courier New", CurrFontStyle());
         else if (t->IsEndTag())
             RevertStyleChange();
     } else if (Tag_Pre == tag) {
@@ -1045,6 +1250,11 @@ void HtmlFormatter::HandleText(HtmlToken *t)
         return;
     }
 
+    if (wordBoxes) {
+        HandleTextWithWordBoxes(curr, end);
+        return;
+    }
+
     // break text into runs i.e. chunks that are either all
     // whitespace or all non-whitespace
     while (curr < end) {
@@ -1062,6 +1272,61 @@ void HtmlFormatter::HandleText(HtmlToken *t)
     }
 }
 
+// does the same as HandleText (for text that isn't preformatted) but only
+// breaks up and measures the text the first time it's formatted in a font
+void HtmlFormatter::HandleTextWithWordBoxes(const char *s, const char *end)
+{
+    const char *start = htmlParser->Start();
+    int reparseIdx = (int)(s - start);
+    Vec<WordBoxCache::WordBox> boxes;
+    if (!wordBoxes->Lookup(reparseIdx, CurrFont(), boxes, textAllocator)) {
+        for (const char *curr = s; curr < end; ) {
+            WordBoxCache::WordBox box = { (int)(curr - start), 0, NULL, RectF() };
+            if (SkipWs(curr, end))
+                boxes.Append(box);
+            const char *text = curr;
+            if (!SkipNonWs(curr, end))
+                continue;
+            box.reparseIdx = (int)(text - start);
+            box.srcLen = (int)(curr - text);
+            // measure the same way as EmitTextRun does
+            // pages point to the resolved text, so it's allocated the same way as
+            // in EmitTextRun (and copied by the cache, which might be reset)
+            const char *resolved = ResolveHtmlEntities(text, curr, textAllocator);
+            if (resolved != text) {
+                box.resolved = resolved;
+                size_t strLen = str::Utf8ToWcharBuf(resolved, str::Len(resolved), buf, dimof(buf));
+                box.bbox = gTextMeasureCache.Measure(gfx, CurrFont(), MeasureFont(CurrFont()), buf, strLen, measureAlgo);
+            } else {
+                size_t strLen = str::Utf8ToWcharBuf(text, curr - text, buf, dimof(buf));
+                box.bbox = gTextMeasureCache.Measure(gfx, CurrFont(), MeasureFont(CurrFont()), buf, strLen, measureAlgo);
+            }
+            boxes.Append(box);
+        }
+        wordBoxes->Add(reparseIdx, CurrFont(), boxes);
+    }
+
+    for (size_t i = 0; i < boxes.Count(); i++) {
+        WordBoxCache::WordBox *box = &boxes.At(i);
+        currReparseIdx = box->reparseIdx;
+        if (0 == box->srcLen) {
+            EmitElasticSpace();
+            continue;
+        }
+        const char *text = start + box->reparseIdx;
+        size_t len = box->srcLen;
+        if (box->resolved) {
+            text = box->resolved;
+            len = str::Len(text);
+            if (0 == len)
+                continue;
+        }
+        // words that don't fit on a line at all are broken up by EmitTextRun
+        if (!EmitWord(text, len, box->bbox))
+            EmitTextRun(start + box->reparseIdx, start + box->reparseIdx + box->srcLen);
+    }
+}
+
 // we ignore the content of <head>, <style> and <title> tags
 bool HtmlFormatter::IgnoreText()
 {
@@ -1186,6 +1451,7 @@ void DrawHtmlPage(Graphics *g, Vec<DrawInstr> *drawInstructions, REAL offX, REAL
             bbox.GetLocation(&pos);
             if (showBbox)
                 g->DrawRectangle(&debugPen, bbox);
+            mui::ScopedMuiCritSec muiCs;
             g->DrawString(buf, strLen, font, pos, NULL, &brText);
         } else if (InstrSetFont == i->type) {
             font = i->font;
@@ -1216,6 +1482,7 @@ void DrawHtmlPage(Graphics *g, Vec<DrawInstr> *drawInstructions, REAL offX, REAL
             StringFormat rtl;
             rtl.SetFormatFlags(StringFormatFlagsDirectionRightToLeft);
             pos.X += bbox.Width;
+            mui::ScopedMuiCritSec muiCs;
             g->DrawString(buf, strLen, font, pos, &rtl, &brText);
         } else {
             CrashIf(true);
@@ -9,6 +9,10 @@
 
 using namespace Gdiplus;
 
+namespace dict {
+class MapWStrToInt;
+}
+
 // Layout information for a given page is a list of
 // draw instructions that define what to draw and where.
 enum DrawInstrType {
@@ -70,7 +74,7 @@ struct DrawStyle {
 
 class HtmlPage {
 public:
-    HtmlPage() : reparseIdx(0), listDepth(0), preFormatted(false) { }
+    HtmlPage() : reparseIdx(0), listDepth(0), preFormatted(false), dirRtl(false) { }
 
     Vec<DrawInstr>  instructions;
     // if we start parsing html again from reparseIdx, we should
@@ -86,12 +90,63 @@ public:
     bool dirRtl;
 };
 
+/* Remembers the measured words and spaces of text tokens (i.e. mostly of whole
+paragraphs) per font, so that formatting the same html again for a different
+page size (e.g. after resizing the window) only has to redo line breaking and
+pagination. The cache can be shared between threads (cf. ChapterFormatter) but
+must only be used for a single html text and measurement algorithm. It starts
+over once it contains too many boxes, so callers always get copies. */
+class WordBoxCache {
+public:
+    struct WordBox {
+        // offset of the word's source text in the html
+        int         reparseIdx;
+        // length of the source text (0 for a space)
+        int         srcLen;
+        // the text with resolved html entities (or NULL if it's the same)
+        const char *resolved;
+        RectF       bbox;
+    };
+
+    WordBoxCache();
+    ~WordBoxCache();
+
+    // appends copies of the boxes to boxesOut (their resolved text is
+    // allocated from textAllocator)
+    bool Lookup(int reparseIdx, Font *font, Vec<WordBox>& boxesOut, Allocator *textAllocator);
+    // copies the boxes and their resolved text
+    void Add(int reparseIdx, Font *font, Vec<WordBox>& boxes);
+
+private:
+    struct Entry {
+        WordBox *   boxes;
+        size_t      count;
+    };
+
+    enum { MAX_BOXES = 256 * 1024 };
+
+    CRITICAL_SECTION    cs;
+    PoolAllocator       allocator;
+    // maps (reparseIdx, font) to indices into entries
+    dict::MapWStrToInt *indices;
+    Vec<Entry>          entries;
+    size_t              boxCount;
+
+    void Reset();
+};
+
+// must be increased whenever a change to HtmlFormatter (or to one of its
+// subclasses) can move page breaks, as this invalidates persisted layouts
+// (cf. EbookLayoutCache.h)
+#define HTML_FORMATTER_VERSION 1
+
 // just to pack args to HtmlFormatter
 struct HtmlFormatterArgs {
     HtmlFormatterArgs() :
       pageDx(0), pageDy(0), fontName(NULL), fontSize(0),
       textAllocator(NULL), htmlStr(0), htmlStrLen(0),
-      reparseIdx(0), measureAlgo(NULL)
+      reparseIdx(0), reparseState(NULL), measureAlgo(NULL),
+      wordBoxes(NULL)
     { }
 
     REAL            pageDx;
@@ -115,6 +170,12 @@ struct HtmlFormatterArgs {
 
     // we start parsing from htmlStr + reparseIdx
     int             reparseIdx;
+    // if set, styling continues from the state stored for a page
+    // starting at reparseIdx (instead of starting with the default font)
+    const HtmlPage *reparseState;
+
+    // if set, measured words are reused from (and added to) this cache
+    WordBoxCache *  wordBoxes;
 };
 
 class HtmlPullParser;
@@ -138,6 +199,7 @@ protected:
     void UpdateTagNesting(HtmlToken *t);
     virtual void HandleHtmlTag(HtmlToken *t);
     void HandleText(HtmlToken *t);
+    void HandleTextWithWordBoxes(const char *s, const char *end);
     // blank convenience methods to override
     virtual void HandleTagImg(HtmlToken *t) { }
     virtual void HandleTagPagebreak(HtmlToken *t) { }
@@ -154,6 +216,7 @@ protected:
     void  EmitImage(ImageData *img);
     void  EmitHr();
     void  EmitTextRun(const char *s, const char *end);
+    bool  EmitWord(const char *s, size_t len, RectF bbox);
     void  EmitElasticSpace();
     void  EmitParagraph(float indent);
     void  EmitEmptyLine(float lineDy);
@@ -163,6 +226,9 @@ protected:
 
     DrawStyle *CurrStyle() { return &currLineStyleStack.Last(); }
     Font *CurrFont() { return CurrStyle()->font; }
+    Font *MeasureFont(Font *font);
+    float CurrFontSize();
+    FontStyle CurrFontStyle();
     void  SetFont(const WCHAR *fontName, FontStyle fs, float fontSize=-1);
     void  SetFont(Font *origFont, FontStyle fs, float fontSize=-1);
     void  ChangeFontStyle(FontStyle fs, bool isStart);
@@ -179,10 +245,19 @@ protected:
     float               lineSpacing;
     float               spaceDx;
     Graphics *          gfx; // for measuring text
+    // fonts are shared by all formatters, which can run on several threads
+    // at once (cf. ChapterFormatter), and GDI+ objects mustn't be used
+    // concurrently, so text is measured with private copies of them
+    struct FontCopy {
+        Font *          font;
+        Font *          copy;
+    };
+    Vec<FontCopy>       fontCopies;
     ScopedMem<WCHAR>    defaultFontName;
     float               defaultFontSize;
     Allocator *         textAllocator;
     RectF            (* measureAlgo)(Graphics *g, Font *f, const WCHAR *s, size_t len);
+    WordBoxCache *      wordBoxes;
 
     Vec<DrawStyle>      styleStack;
     // style stack of the current line
@@ -1,6 +1,10 @@
 /* Copyright 2012 the SumatraPDF project authors (see AUTHORS file).
    License: GPLv3 */
 
+extern "C" {
+#include <fitz-internal.h>
+}
+
 #include "BaseUtil.h"
 #include "ImagesEngine.h"
 
@@ -9,6 +13,7 @@ using namespace Gdiplus;
 #include "GdiPlusUtil.h"
 #include "HtmlPullParser.h"
 #include "JsonParser.h"
+#include "ThreadUtil.h"
 #include "WinUtil.h"
 #include "ZipUtil.h"
 
@@ -146,9 +151,16 @@ public:
     virtual Vec<PageElement *> *GetElements(int pageNo);
     virtual PageElement *GetElementAtPos(int pageNo, PointD pt);
 
-    virtual bool BenchLoadPage(int pageNo) { return LoadImage(pageNo) != NULL; }
+    virtual bool BenchLoadPage(int pageNo) {
+        Bitmap *bmp = LoadImage(pageNo);
+        if (bmp)
+            DropImage(pageNo);
+        return bmp != NULL;
+    }
 
 protected:
+    friend class ImageElement;
+
     WCHAR *fileName;
     const WCHAR *fileExt;
     ScopedComPtr<IStream> fileStream;
@@ -162,6 +174,9 @@ protected:
         assert(1 <= pageNo && pageNo <= PageCount());
         return pages.At(pageNo - 1);
     }
+    // called for every non-NULL image returned by LoadImage as soon as
+    // it's no longer used (override for dropping lazily loaded images)
+    virtual void DropImage(int pageNo) { }
 };
 
 RenderedBitmap *ImagesEngine::RenderBitmap(int pageNo, float zoom, int rotation, RectD *pageRect, RenderTarget target, AbortCookie **cookie_out)
@@ -214,6 +229,7 @@ bool ImagesEngine::RenderPage(HDC hDC, RectI screenRect, int pageNo, float zoom,
     ImageAttributes imgAttrs;
     imgAttrs.SetWrapMode(WrapModeTileFlipXY);
     Status ok = g.DrawImage(bmp, Rect(0, 0, pageRcI.dx, pageRcI.dy), 0, 0, pageRcI.dx, pageRcI.dy, UnitPixel, &imgAttrs);
+    DropImage(pageNo);
     return ok == Ok;
 }
 
@@ -248,34 +264,96 @@ RectD ImagesEngine::Transform(RectD rect, int pageNo, float zoom, int rotation,
     return rect;
 }
 
+// GDI+ only decodes JPEG and PNG images when they're first drawn (i.e. on the
+// rendering thread), so comic book pages are decoded completely through the
+// same decoders as MuPDF uses. Returns NULL for all other image formats
+static Bitmap *DecodeImageWithFitz(fz_context *ctx, const char *data, size_t len)
+{
+    ImgFormat format = GfxFormatFromData(data, len);
+    if ((format != Img_JPEG && format != Img_PNG) || len != (int)len)
+        return NULL;
+
+    fz_pixmap *pix = NULL, *bgr = NULL;
+    fz_var(pix);
+    fz_var(bgr);
+    fz_try(ctx) {
+        if (Img_JPEG == format)
+            pix = fz_load_jpeg(ctx, (unsigned char *)data, (int)len);
+        else
+            pix = fz_load_png(ctx, (unsigned char *)data, (int)len);
+        bgr = fz_new_pixmap_with_bbox(ctx, fz_find_device_colorspace(ctx, "DeviceBGR"), fz_pixmap_bbox(ctx, pix));
+        fz_convert_pixmap(ctx, bgr, pix);
+    }
+    fz_catch(ctx) {
+        fz_drop_pixmap(ctx, pix);
+        fz_drop_pixmap(ctx, bgr);
+        return NULL;
+    }
+    fz_drop_pixmap(ctx, pix);
+
+    // the samples are premultiplied BGRA (with opaque alpha for JPEG images)
+    PixelFormat pixelFormat = Img_JPEG == format ? PixelFormat32bppRGB : PixelFormat32bppPARGB;
+    Bitmap *bmp = new Bitmap(bgr->w, bgr->h, pixelFormat);
+    BitmapData bmpData;
+    Rect rc(0, 0, bgr->w, bgr->h);
+    if (bmp->GetLastStatus() != Ok || bmp->LockBits(&rc, ImageLockModeWrite, pixelFormat, &bmpData) != Ok) {
+        delete bmp;
+        fz_drop_pixmap(ctx, bgr);
+        return NULL;
+    }
+    for (int y = 0; y < bgr->h; y++) {
+        memcpy((char *)bmpData.Scan0 + y * bmpData.Stride, bgr->samples + y * bgr->w * 4, bgr->w * 4);
+    }
+    bmp->UnlockBits(&bmpData);
+    fz_drop_pixmap(ctx, bgr);
+    return bmp;
+}
+
+static Bitmap *DecodePageImage(fz_context *ctx, const char *data, size_t len)
+{
+    Bitmap *bmp = ctx ? DecodeImageWithFitz(ctx, data, len) : NULL;
+    if (!bmp)
+        bmp = BitmapFromData(data, len);
+    return bmp;
+}
+
+// the image is loaded again when it's needed, since
+// lazily loaded images might have been dropped by then
 class ImageElement : public PageElement {
-    Bitmap *bmp;
+    ImagesEngine *engine;
     int pageNo;
+    RectD rect;
 
 public:
-    ImageElement(int pageNo, Bitmap *bmp) : pageNo(pageNo), bmp(bmp) { }
+    ImageElement(ImagesEngine *engine, int pageNo) :
+        engine(engine), pageNo(pageNo), rect(engine->PageMediabox(pageNo)) { }
 
     virtual PageElementType GetType() const { return Element_Image; }
     virtual int GetPageNo() const { return pageNo; }
-    virtual RectD GetRect() const { return RectD(0, 0, bmp->GetWidth(), bmp->GetHeight()); }
+    virtual RectD GetRect() const { return rect; }
     virtual WCHAR *GetValue() const { return NULL; }
 
     virtual RenderedBitmap *GetImage() {
-        HBITMAP hbmp;
-        if (bmp->GetHBITMAP(Color::White, &hbmp) != Ok)
+        Bitmap *bmp = engine->LoadImage(pageNo);
+        if (!bmp)
             return NULL;
-        return new RenderedBitmap(hbmp, SizeI(bmp->GetWidth(), bmp->GetHeight()));
+        HBITMAP hbmp;
+        RenderedBitmap *rendered = NULL;
+        if (bmp->GetHBITMAP(Color::White, &hbmp) == Ok)
+            rendered = new RenderedBitmap(hbmp, SizeI(bmp->GetWidth(), bmp->GetHeight()));
+        engine->DropImage(pageNo);
+        return rendered;
     }
 };
 
 Vec<PageElement *> *ImagesEngine::GetElements(int pageNo)
 {
-    Bitmap *bmp = LoadImage(pageNo);
-    if (!bmp)
+    if (!LoadImage(pageNo))
         return NULL;
+    DropImage(pageNo);
 
     Vec<PageElement *> *els = new Vec<PageElement *>();
-    els->Append(new ImageElement(pageNo, bmp));
+    els->Append(new ImageElement(this, pageNo));
     return els;
 }
 
@@ -283,10 +361,10 @@ PageElement *ImagesEngine::GetElementAtPos(int pageNo, PointD pt)
 {
     if (!PageMediabox(pageNo).Contains(pt))
         return NULL;
-    Bitmap *bmp = LoadImage(pageNo);
-    if (!bmp)
+    if (!LoadImage(pageNo))
         return NULL;
-    return new ImageElement(pageNo, bmp);
+    DropImage(pageNo);
+    return new ImageElement(this, pageNo);
 }
 
 unsigned char *ImagesEngine::GetFileData(size_t *cbCount)
@@ -631,12 +709,25 @@ ImageDirEngine *ImageDirEngine::CreateFromFile(const WCHAR *fileName)
 
 ///// CbxEngine handles comic book files (either .cbz or .cbr) /////
 
+// number of pages decoded in the background ahead of and behind
+// the most recently loaded page (in reading direction)
+#define CBX_READ_AHEAD_PAGES    3
+#define CBX_READ_BEHIND_PAGES   1
+// maximum number of decoded pages to keep (unless they're still in use)
+#define CBX_MAX_DECODED_PAGES   8
+
+class CbxReadAheadThread;
+
 class CbxEngineImpl : public ImagesEngine, public CbxEngine, public json::ValueVisitor {
     friend CbxEngine;
+    friend CbxReadAheadThread;
 
 public:
-    CbxEngineImpl() : cbzFile(NULL) {
+    CbxEngineImpl() : cbzFile(NULL), readAheadThread(NULL), readAheadEvent(NULL),
+        currPageNo(0), readingDir(1), ctx(NULL) {
         InitializeCriticalSection(&fileAccess);
+        InitializeCriticalSection(&pagesAccess);
+        InitializeCriticalSection(&ctxAccess);
     }
     virtual ~CbxEngineImpl();
 
@@ -666,6 +757,7 @@ protected:
     bool LoadCbrFile(const WCHAR *fileName);
 
     virtual Bitmap *LoadImage(int pageNo);
+    virtual void DropImage(int pageNo);
     char *GetImageData(int pageNo, size_t& len);
 
     Vec<RectD> mediaboxes;
@@ -684,48 +776,263 @@ protected:
     CRITICAL_SECTION fileAccess;
     ZipFile *cbzFile;
     Vec<size_t> fileIdxs;
+
+    // used for decoding the pages around the current one in the background
+    // and for dropping the least recently used pages (protects pages,
+    // mediaboxes and all the fields below)
+    CRITICAL_SECTION pagesAccess;
+    CbxReadAheadThread *readAheadThread;
+    HANDLE readAheadEvent;
+    int currPageNo;
+    int readingDir;
+    // number of callers currently using a page's image
+    Vec<int> pageRefs;
+    // numbers of all decoded pages (least recently used first)
+    Vec<int> decodedPages;
+
+    // used for decoding pages on demand
+    CRITICAL_SECTION ctxAccess;
+    fz_context *ctx;
+
+    void StartReadAhead();
+    ZipFile *OpenCbzFile();
+    bool IsCurrPage(int pageNo);
+    size_t GetPagesToReadAhead(int *pageNos, size_t maxCount, int *forPageNo);
+    bool SetPageImage(int pageNo, Bitmap *bmp);
+    void TouchPage(int pageNo);
+    void DropPages();
 };
 
+// decodes the pages around the current page, so that they're ready when
+// the user flips to them; only the compressed data of these pages is
+// read at a time (through a separate ZipFile, so that pages can still
+// be loaded on demand in the meantime)
+class CbxReadAheadThread : public ThreadBase {
+    CbxEngineImpl * engine;
+
+public:
+    CbxReadAheadThread(CbxEngineImpl *engine) :
+        ThreadBase("CbxReadAheadThread"), engine(engine) { }
+
+    virtual void Run();
+};
+
+void CbxReadAheadThread::Run()
+{
+    fz_context *ctx = fz_new_context(NULL, NULL, FZ_STORE_DEFAULT);
+    ZipFile *zip = engine->OpenCbzFile();
+    while (zip) {
+        WaitForSingleObject(engine->readAheadEvent, INFINITE);
+        if (WasCancelRequested())
+            break;
+
+        int pageNos[CBX_READ_AHEAD_PAGES + CBX_READ_BEHIND_PAGES];
+        int forPageNo;
+        size_t count = engine->GetPagesToReadAhead(pageNos, dimof(pageNos), &forPageNo);
+        if (0 == count)
+            continue;
+        size_t fileIdxs[dimof(pageNos)];
+        char *data[dimof(pageNos)];
+        size_t lens[dimof(pageNos)];
+        for (size_t i = 0; i < count; i++) {
+            fileIdxs[i] = engine->fileIdxs.At(pageNos[i] - 1);
+        }
+        zip->GetFilesData(fileIdxs, count, data, lens);
+
+        for (size_t i = 0; i < count; i++) {
+            // stop early, if the user has already moved on to another page
+            // (in which case the event is set again)
+            bool moveOn = WasCancelRequested() || !engine->IsCurrPage(forPageNo);
+            if (data[i] && !moveOn) {
+                Bitmap *bmp = DecodePageImage(ctx, data[i], lens[i]);
+                if (bmp && !engine->SetPageImage(pageNos[i], bmp))
+                    delete bmp;
+            }
+            free(data[i]);
+        }
+    }
+    delete zip;
+    if (ctx)
+        fz_free_context(ctx);
+}
+
 CbxEngineImpl::~CbxEngineImpl()
 {
+    if (readAheadThread) {
+        readAheadThread->RequestCancel();
+        SetEvent(readAheadEvent);
+        readAheadThread->RequestCancelAndWaitToStop();
+        readAheadThread->Release();
+    }
+    if (readAheadEvent)
+        CloseHandle(readAheadEvent);
     delete cbzFile;
+    if (ctx)
+        fz_free_context(ctx);
 
+    DeleteCriticalSection(&ctxAccess);
+    DeleteCriticalSection(&pagesAccess);
     DeleteCriticalSection(&fileAccess);
 }
 
+void CbxEngineImpl::StartReadAhead()
+{
+    // .cbr files are loaded completely upfront
+    if (!cbzFile)
+        return;
+    if (!readAheadThread) {
+        readAheadEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+        if (!readAheadEvent)
+            return;
+        readAheadThread = new CbxReadAheadThread(this);
+        readAheadThread->Start();
+    }
+    SetEvent(readAheadEvent);
+}
+
+// opens the same archive again, for reading independently of cbzFile
+ZipFile *CbxEngineImpl::OpenCbzFile()
+{
+    if (fileStream) {
+        ScopedComPtr<IStream> stm;
+        HRESULT res = fileStream->Clone(&stm);
+        if (FAILED(res))
+            return NULL;
+        return new ZipFile(stm);
+    }
+    if (fileName)
+        return new ZipFile(fileName);
+    return NULL;
+}
+
+bool CbxEngineImpl::IsCurrPage(int pageNo)
+{
+    ScopedCritSec scope(&pagesAccess);
+    return pageNo == currPageNo;
+}
+
+// returns the pages next to currPageNo which haven't been decoded yet
+// (the next pages in reading direction first)
+size_t CbxEngineImpl::GetPagesToReadAhead(int *pageNos, size_t maxCount, int *forPageNo)
+{
+    ScopedCritSec scope(&pagesAccess);
+    *forPageNo = currPageNo;
+    size_t count = 0;
+    for (int i = 1; i <= CBX_READ_AHEAD_PAGES + CBX_READ_BEHIND_PAGES && count < maxCount; i++) {
+        int pageNo = i <= CBX_READ_AHEAD_PAGES ? currPageNo + i * readingDir
+                                               : currPageNo - (i - CBX_READ_AHEAD_PAGES) * readingDir;
+        if (1 <= pageNo && pageNo <= PageCount() && !pages.At(pageNo - 1))
+            pageNos[count++] = pageNo;
+    }
+    return count;
+}
+
+// returns false if the page has been decoded in the meantime
+bool CbxEngineImpl::SetPageImage(int pageNo, Bitmap *bmp)
+{
+    ScopedCritSec scope(&pagesAccess);
+    if (pages.At(pageNo - 1))
+        return false;
+    pages.At(pageNo - 1) = bmp;
+    mediaboxes.At(pageNo - 1) = RectD(0, 0, bmp->GetWidth(), bmp->GetHeight());
+    TouchPage(pageNo);
+    DropPages();
+    return true;
+}
+
+// marks a decoded page as the most recently used one
+// (caller must hold pagesAccess)
+void CbxEngineImpl::TouchPage(int pageNo)
+{
+    decodedPages.Remove(pageNo);
+    decodedPages.Append(pageNo);
+}
+
+// drops the least recently used pages which are no longer in use,
+// if there are more than CBX_MAX_DECODED_PAGES of them
+// (caller must hold pagesAccess)
+void CbxEngineImpl::DropPages()
+{
+    for (size_t i = 0; i < decodedPages.Count() && decodedPages.Count() > CBX_MAX_DECODED_PAGES; ) {
+        int pageNo = decodedPages.At(i);
+        if (pageRefs.At(pageNo - 1) > 0) {
+            i++;
+            continue;
+        }
+        delete pages.At(pageNo - 1);
+        pages.At(pageNo - 1) = NULL;
+        decodedPages.RemoveAt(i);
+    }
+}
+
 RectD CbxEngineImpl::PageMediabox(int pageNo)
 {
     assert(1 <= pageNo && pageNo <= PageCount());
-    if (!mediaboxes.At(pageNo - 1).IsEmpty())
-        return mediaboxes.At(pageNo - 1);
-
-    if (pages.At(pageNo - 1)) {
+    {
+        ScopedCritSec scope(&pagesAccess);
         Bitmap *bmp = pages.At(pageNo - 1);
-        mediaboxes.At(pageNo - 1) = RectD(0, 0, bmp->GetWidth(), bmp->GetHeight());
-        return mediaboxes.At(pageNo - 1);
+        if (mediaboxes.At(pageNo - 1).IsEmpty() && bmp)
+            mediaboxes.At(pageNo - 1) = RectD(0, 0, bmp->GetWidth(), bmp->GetHeight());
+        if (!mediaboxes.At(pageNo - 1).IsEmpty())
+            return mediaboxes.At(pageNo - 1);
     }
 
+    RectD mediabox;
     size_t len;
     ScopedMem<char> bmpData(GetImageData(pageNo, len));
     if (bmpData) {
         Size size = BitmapSizeFromData(bmpData, len);
-        mediaboxes.At(pageNo - 1) = RectD(0, 0, size.Width, size.Height);
+        mediabox = RectD(0, 0, size.Width, size.Height);
     }
+    ScopedCritSec scope(&pagesAccess);
+    if (mediaboxes.At(pageNo - 1).IsEmpty())
+        mediaboxes.At(pageNo - 1) = mediabox;
     return mediaboxes.At(pageNo - 1);
 }
 
 Bitmap *CbxEngineImpl::LoadImage(int pageNo)
 {
     assert(1 <= pageNo && pageNo <= PageCount());
-    if (pages.At(pageNo - 1))
-        return pages.At(pageNo - 1);
+    EnterCriticalSection(&pagesAccess);
+    if (pageNo != currPageNo) {
+        if (currPageNo != 0)
+            readingDir = pageNo > currPageNo ? 1 : -1;
+        currPageNo = pageNo;
+    }
+    Bitmap *bmp = pages.At(pageNo - 1);
+    LeaveCriticalSection(&pagesAccess);
+    StartReadAhead();
 
-    size_t len;
-    ScopedMem<char> bmpData(GetImageData(pageNo, len));
-    if (bmpData)
-        pages.At(pageNo - 1) = BitmapFromData(bmpData, len);
+    if (!bmp) {
+        size_t len;
+        ScopedMem<char> bmpData(GetImageData(pageNo, len));
+        if (bmpData) {
+            ScopedCritSec scope(&ctxAccess);
+            if (!ctx)
+                ctx = fz_new_context(NULL, NULL, FZ_STORE_DEFAULT);
+            bmp = DecodePageImage(ctx, bmpData, len);
+        }
+        if (bmp && !SetPageImage(pageNo, bmp))
+            delete bmp;
+    }
 
-    return pages.At(pageNo - 1);
+    // the page can't be dropped until the caller calls DropImage
+    ScopedCritSec scope(&pagesAccess);
+    bmp = pages.At(pageNo - 1);
+    if (bmp) {
+        pageRefs.At(pageNo - 1)++;
+        if (cbzFile)
+            TouchPage(pageNo);
+    }
+    return bmp;
+}
+
+void CbxEngineImpl::DropImage(int pageNo)
+{
+    ScopedCritSec scope(&pagesAccess);
+    CrashIf(pageRefs.At(pageNo - 1) <= 0);
+    pageRefs.At(pageNo - 1)--;
+    DropPages();
 }
 
 bool CbxEngineImpl::LoadCbzFile(const WCHAR *file)
@@ -800,6 +1107,7 @@ bool CbxEngineImpl::FinishLoadingCbz()
 
     pages.AppendBlanks(fileIdxs.Count());
     mediaboxes.AppendBlanks(fileIdxs.Count());
+    pageRefs.AppendBlanks(fileIdxs.Count());
 
     return true;
 }
@@ -1045,6 +1353,7 @@ bool CbxEngineImpl::LoadCbrFile(const WCHAR *file)
         found.At(i)->bmp = NULL;
     }
     mediaboxes.AppendBlanks(pages.Count());
+    pageRefs.AppendBlanks(pages.Count());
 
     DeleteVecMembers(found);
     return true;
@@ -6,6 +6,7 @@
 
 #include "AppPrefs.h"
 #include "DisplayModel.h"
+#include "EbookLayoutCache.h"
 #include "EbookWindow.h"
 #include "ExternalPdfViewer.h"
 #include "Favorites.h"
@@ -455,6 +456,7 @@ void OnAboutContextMenu(WindowInfo* win, int x, int y)
         gFileHistory.Remove(state);
         delete state;
         CleanUpThumbnailCache(gFileHistory);
+        CleanUpLayoutCache(gFileHistory);
         win->DeleteInfotip();
         win->RedrawAll(true);
         break;
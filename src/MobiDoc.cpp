@@ -4,12 +4,12 @@
 #include "BaseUtil.h"
 #include "MobiDoc.h"
 
-#include "BitReader.h"
 #include "ByteOrderDecoder.h"
 #include "FileUtil.h"
 using namespace Gdiplus;
 #include "GdiPlusUtil.h"
 #include "PdbReader.h"
+#include "ThreadUtil.h"
 #include "DebugLog.h"
 
 // Parse mobi format http://wiki.mobileread.com/wiki/MOBI
@@ -202,6 +202,14 @@ STATIC_ASSERT(kCdicHeaderLen == sizeof(CdicHeader), validCdicHeader);
 
 #define kCdicsMax 32
 
+// non-terminal dictionary entries are themselves compressed and would have
+// to be decompressed (recursively) every time they're used, so the result
+// of the first expansion is kept around
+struct HuffDicExpansion {
+    size_t      len;
+    char        data[1]; // the actual length is len + 1
+};
+
 class HuffDicDecompressor
 {
     uint32      cacheTable[kCacheItemCount];
@@ -216,16 +224,70 @@ class HuffDicDecompressor
 
     Vec<uint32> recursionGuard;
 
+    // the decompressor owning the expansions (this one, unless it's a clone)
+    HuffDicDecompressor *owner;
+    // indexed by code (dict index and offset), allocated on first use and
+    // shared by all clones. Entries are NULL until they've been expanded and
+    // are published with InterlockedCompareExchangePointer, so that the
+    // (immutable) expansions can be read without locking
+    HuffDicExpansion ** expansions;
+    // expansionData is only accessed under expansionAccess
+    PoolAllocator       expansionData;
+    CRITICAL_SECTION    expansionAccess;
+
+    HuffDicExpansion ** GetExpansions();
+
 public:
     HuffDicDecompressor();
+    ~HuffDicDecompressor();
 
     bool SetHuffData(uint8 *huffData, size_t huffDataLen);
     bool AddCdicData(uint8 *cdicData, uint32 cdicDataLen);
     bool Decompress(uint8 *src, size_t octets, str::Str<char>& dst);
     bool DecodeOne(uint32 code, str::Str<char>& dst);
+
+    // returns a decompressor sharing the same tables, dictionaries and
+    // expansions but with its own state, so that records can be decompressed
+    // concurrently (the clone must not outlive this decompressor)
+    HuffDicDecompressor *Clone();
 };
 
-HuffDicDecompressor::HuffDicDecompressor() : codeLength(0), dictsCount(0) { }
+HuffDicDecompressor::HuffDicDecompressor() :
+    codeLength(0), dictsCount(0), owner(this), expansions(NULL) {
+    InitializeCriticalSection(&expansionAccess);
+}
+
+HuffDicDecompressor::~HuffDicDecompressor()
+{
+    if (owner == this)
+        free(expansions);
+    DeleteCriticalSection(&expansionAccess);
+}
+
+HuffDicExpansion **HuffDicDecompressor::GetExpansions()
+{
+    ScopedCritSec scope(&owner->expansionAccess);
+    if (!owner->expansions)
+        owner->expansions = AllocArray<HuffDicExpansion *>(dictsCount << codeLength);
+    return owner->expansions;
+}
+
+HuffDicDecompressor *HuffDicDecompressor::Clone()
+{
+    // allocate the shared table before it's needed by several threads
+    if (!GetExpansions())
+        return NULL;
+    HuffDicDecompressor *clone = new HuffDicDecompressor();
+    clone->owner = owner;
+    clone->expansions = owner->expansions;
+    memcpy(clone->cacheTable, cacheTable, sizeof(cacheTable));
+    memcpy(clone->baseTable, baseTable, sizeof(baseTable));
+    memcpy(clone->dicts, dicts, sizeof(dicts));
+    memcpy(clone->dictSize, dictSize, sizeof(dictSize));
+    clone->dictsCount = dictsCount;
+    clone->codeLength = codeLength;
+    return clone;
+}
 
 bool HuffDicDecompressor::DecodeOne(uint32 code, str::Str<char>& dst)
 {
@@ -234,6 +296,7 @@ bool HuffDicDecompressor::DecodeOne(uint32 code, str::Str<char>& dst)
         lf("invalid dict value");
         return false;
     }
+    uint32 fullCode = code;
     code &= ((1 << (codeLength)) - 1);
     uint16 offset = UInt16BE(dicts[dict] + code * 2);
 
@@ -249,14 +312,37 @@ bool HuffDicDecompressor::DecodeOne(uint32 code, str::Str<char>& dst)
     }
 
     if (!(symLen & 0x8000)) {
-        if (recursionGuard.Find(code) != -1) {
+        if (!expansions) {
+            expansions = GetExpansions();
+            if (!expansions)
+                return false;
+        }
+        HuffDicExpansion *exp = *(HuffDicExpansion * volatile *)&expansions[fullCode];
+        if (exp) {
+            dst.Append(exp->data, exp->len);
+            return true;
+        }
+        if (recursionGuard.Find(fullCode) != -1) {
             lf("infinite recursion");
             return false;
         }
-        recursionGuard.Push(code);
+        recursionGuard.Push(fullCode);
+        size_t start = dst.Size();
         if (!Decompress(p, symLen, dst))
             return false;
         recursionGuard.Pop();
+        size_t len = dst.Size() - start;
+        {
+            ScopedCritSec scope(&owner->expansionAccess);
+            exp = (HuffDicExpansion *)Allocator::Alloc(&owner->expansionData, sizeof(HuffDicExpansion) + len);
+        }
+        if (!exp)
+            return false;
+        exp->len = len;
+        memcpy(exp->data, dst.Get() + start, len + 1);
+        // if another thread has expanded the same entry in the meantime,
+        // its (identical) expansion is kept and this one is wasted
+        InterlockedCompareExchangePointer((void **)&expansions[fullCode], exp, NULL);
     } else {
         symLen &= 0x7fff;
         if (symLen > 127) {
@@ -268,24 +354,42 @@ bool HuffDicDecompressor::DecodeOne(uint32 code, str::Str<char>& dst)
     return true;
 }
 
+// returns the 32 bits at bitPos (padded with 0 bits at the end of the data)
+// same as BitReader::Peek(32) but without going through the data bit by bit
+static inline uint32 PeekBits32(const uint8 *src, size_t srcSize, size_t bitPos)
+{
+    size_t bytePos = bitPos / 8;
+    uint64 v = 0;
+    if (bytePos + 8 <= srcSize) {
+        memcpy(&v, src + bytePos, 8);
+        v = _byteswap_uint64(v);
+    } else {
+        for (size_t i = bytePos; i < bytePos + 8; i++) {
+            v = (v << 8) | (i < srcSize ? src[i] : 0);
+        }
+    }
+    return (uint32)((v << (bitPos % 8)) >> 32);
+}
+
 bool HuffDicDecompressor::Decompress(uint8 *src, size_t srcSize, str::Str<char>& dst)
 {
     uint32    bitsConsumed = 0;
     uint32    bits = 0;
 
-    BitReader br(src, srcSize);
+    size_t    bitPos = 0;
+    size_t    bitsCount = srcSize * 8;
 
     for (;;) {
-        if (bitsConsumed > br.BitsLeft()) {
+        if (bitsConsumed > bitsCount - bitPos) {
             lf("not enough data");
             return false;
         }
-        br.Eat(bitsConsumed);
-        if (0 == br.BitsLeft())
+        bitPos += bitsConsumed;
+        if (bitPos == bitsCount)
             break;
 
-        bits = br.Peek(32);
-        if (br.BitsLeft() < 8 && 0 == bits)
+        bits = PeekBits32(src, srcSize, bitPos);
+        if (bitsCount - bitPos < 8 && 0 == bits)
             break;
         uint32 v = cacheTable[bits >> 24];
         uint32 codeLen = v & 0x1f;
@@ -318,7 +422,7 @@ bool HuffDicDecompressor::Decompress(uint8 *src, size_t srcSize, str::Str<char>&
         bitsConsumed = codeLen;
     }
 
-    if (br.BitsLeft() > 0 && 0 != bits) {
+    if (bitPos < bitsCount && 0 != bits) {
         lf("compressed data left");
     }
     return true;
@@ -473,7 +577,7 @@ static bool IsValidCompression(int comprType)
 
 MobiDoc::MobiDoc(const WCHAR *filePath) :
     fileName(str::Dup(filePath)), pdbReader(NULL),
-    docType(Pdb_Unknown), docRecCount(0), compressionType(0), docUncompressedSize(0),
+    docType(Pdb_Unknown), docRecCount(0), compressionType(0), docUncompressedSize(0), docRecSize(0),
     doc(NULL), multibyte(false), trailersCount(0), imageFirstRec(0),
     imagesCount(0), images(NULL), huffDic(NULL), textEncoding(CP_UTF8)
 {
@@ -527,6 +631,7 @@ bool MobiDoc::ParseHeader()
     }
     docRecCount = palmDocHdr.recordsCount;
     docUncompressedSize = palmDocHdr.uncompressedDocSize;
+    docRecSize = palmDocHdr.maxRecSize;
 
     if (kPalmDocHeaderLen == recSize) {
         CrashIf(Pdb_Mobipocket == docType);
@@ -783,7 +888,7 @@ static size_t GetRealRecordSize(uint8 *recData, size_t recLen, size_t trailersCo
 
 // Load a given record of a document into strOut, uncompressing if necessary.
 // Returns false if error.
-bool MobiDoc::LoadDocRecordIntoBuffer(size_t recNo, str::Str<char>& strOut)
+bool MobiDoc::LoadDocRecordIntoBuffer(size_t recNo, str::Str<char>& strOut, HuffDicDecompressor *decompressor)
 {
     size_t recSize;
     const char *recData = pdbReader->GetRecord(recNo, &recSize);
@@ -804,7 +909,9 @@ bool MobiDoc::LoadDocRecordIntoBuffer(size_t recNo, str::Str<char>& strOut)
         return ok;
     }
     if (COMPRESSION_HUFF == compressionType && huffDic) {
-        bool ok = huffDic->Decompress((uint8*)recData, recSize, strOut);
+        if (!decompressor)
+            decompressor = huffDic;
+        bool ok = decompressor->Decompress((uint8*)recData, recSize, strOut);
         if (!ok)
             lf("HuffDic decompression failed");
         return ok;
@@ -814,16 +921,99 @@ bool MobiDoc::LoadDocRecordIntoBuffer(size_t recNo, str::Str<char>& strOut)
     return false;
 }
 
-bool MobiDoc::LoadDocument()
+// text records are compressed independently of each other, so they can
+// be decompressed concurrently (with one HuffDicDecompressor per thread)
+class DocRecordsThread : public ThreadBase {
+    MobiDoc *               mb;
+    HuffDicDecompressor *   huffDic;
+    str::Str<char> **       records;
+    LONG *                  nextRecord;
+    // shared by all threads, so that they all stop as soon as one
+    // record fails (only ever changes from false to true)
+    bool *                  failed;
+
+protected:
+    virtual ~DocRecordsThread() { delete huffDic; }
+
+public:
+    DocRecordsThread(MobiDoc *mb, str::Str<char> **records, LONG *nextRecord, bool *failed) :
+        ThreadBase("DocRecordsThread"), mb(mb), records(records),
+        nextRecord(nextRecord), failed(failed) {
+        huffDic = mb->huffDic ? mb->huffDic->Clone() : NULL;
+    }
+
+    virtual void Run() {
+        // without a clone, LoadDocRecordIntoBuffer would use the shared mb->huffDic
+        if (mb->huffDic && !huffDic)
+            *failed = true;
+        for (;;) {
+            LONG idx = InterlockedIncrement(nextRecord) - 1;
+            if (idx >= (LONG)mb->docRecCount || *failed)
+                return;
+            records[idx] = new str::Str<char>(mb->docRecSize);
+            if (!mb->LoadDocRecordIntoBuffer(idx + 1, *records[idx], huffDic))
+                *failed = true;
+        }
+    }
+};
+
+// decompresses the text records into separate buffers (the uncompressed size
+// of a record is only known after decompressing it) and then concatenates them
+bool MobiDoc::LoadDocRecordsConcurrently(int threadCount)
+{
+    str::Str<char> **records = AllocArray<str::Str<char> *>(docRecCount);
+    if (!records)
+        return false;
+    LONG nextRecord = 0;
+    bool failed = false;
+    Vec<DocRecordsThread *> threads;
+    for (int i = 0; i < threadCount; i++) {
+        DocRecordsThread *thread = new DocRecordsThread(this, records, &nextRecord, &failed);
+        threads.Append(thread);
+        thread->Start();
+    }
+    bool ok = true;
+    for (size_t i = 0; i < threads.Count(); i++) {
+        // Run() doesn't stop early unless decompression fails,
+        // so this just waits for the thread to finish
+        ok = threads.At(i)->RequestCancelAndWaitToStop() && ok;
+        threads.At(i)->Release();
+    }
+    ok = ok && !failed;
+    for (size_t i = 0; i < docRecCount; i++) {
+        if (ok && records[i])
+            doc->Append(records[i]->Get(), records[i]->Size());
+        ok = ok && records[i] != NULL;
+        delete records[i];
+    }
+    free(records);
+    return ok;
+}
+
+bool MobiDoc::LoadDocument(int threadCount)
 {
     if (!ParseHeader())
         return false;
 
     assert(!doc);
     doc = new str::Str<char>(docUncompressedSize);
-    for (size_t i = 1; i <= docRecCount; i++) {
-        if (!LoadDocRecordIntoBuffer(i, *doc))
+
+    if (threadCount <= 0) {
+        SYSTEM_INFO si;
+        GetSystemInfo(&si);
+        threadCount = (int)si.dwNumberOfProcessors;
+    }
+    // only use threads where there's enough work to be worth it
+    if ((size_t)threadCount > docRecCount / 8)
+        threadCount = (int)(docRecCount / 8);
+    if (threadCount >= 2 && compressionType != COMPRESSION_NONE) {
+        if (!LoadDocRecordsConcurrently(threadCount))
             return false;
+    } else {
+        for (size_t i = 1; i <= docRecCount; i++) {
+            if (!LoadDocRecordIntoBuffer(i, *doc))
+                return false;
+        }
     }
     if (textEncoding != CP_UTF8) {
         char *docUtf8 = str::ToMultiByte(doc->Get(), textEncoding, CP_UTF8);
@@ -856,10 +1046,10 @@ bool MobiDoc::IsSupportedFile(const WCHAR *fileName, bool sniff)
     return str::EndsWithI(fileName, L".mobi");
 }
 
-MobiDoc *MobiDoc::CreateFromFile(const WCHAR *fileName)
+MobiDoc *MobiDoc::CreateFromFile(const WCHAR *fileName, int threadCount)
 {
     MobiDoc *mb = new MobiDoc(fileName);
-    if (!mb->LoadDocument()) {
+    if (!mb->LoadDocument(threadCount)) {
         delete mb;
         return NULL;
     }
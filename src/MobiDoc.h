@@ -22,6 +22,7 @@ class MobiDoc
     size_t              docRecCount;
     int                 compressionType;
     size_t              docUncompressedSize;
+    size_t              docRecSize;     // uncompressed size of (most) records
     int                 textEncoding;
 
     bool                multibyte;
@@ -38,13 +39,16 @@ class MobiDoc
     };
     Vec<Metadata>       props;
 
+    friend class DocRecordsThread;
+
     MobiDoc(const WCHAR *filePath);
 
     bool    ParseHeader();
-    bool    LoadDocRecordIntoBuffer(size_t recNo, str::Str<char>& strOut);
+    bool    LoadDocRecordIntoBuffer(size_t recNo, str::Str<char>& strOut, HuffDicDecompressor *decompressor=NULL);
+    bool    LoadDocRecordsConcurrently(int threadCount);
     void    LoadImages();
     bool    LoadImage(size_t imageNo);
-    bool    LoadDocument();
+    bool    LoadDocument(int threadCount);
     bool    DecodeExthHeader(const char *data, size_t dataLen);
 
 public:
@@ -63,7 +67,9 @@ public:
     PdbDocType          GetDocType() const { return docType; }
 
     static bool         IsSupportedFile(const WCHAR *fileName, bool sniff=false);
-    static MobiDoc *    CreateFromFile(const WCHAR *fileName);
+    // threadCount is the number of threads used for decompressing
+    // the text records (0 for as many threads as there are processors)
+    static MobiDoc *    CreateFromFile(const WCHAR *fileName, int threadCount=0);
 };
 
 // for testing MobiFormatter
@@ -6,6 +6,7 @@
 
 #include "FileUtil.h"
 #include "PdfEngine.h"
+#include "ThreadUtil.h"
 
 #include "synctex_parser.h"
 
@@ -22,9 +23,12 @@
 
 #define SYNCTEX_EXTENSION       L".synctex"
 #define SYNCTEXGZ_EXTENSION     L".synctex.gz"
+// forward-search uses the first line with sync points within this range
+// after the requested one (cf. synctex_display_query)
+#define SYNCTEX_LINE_SEARCH_RANGE 1024
 
 struct PdfsyncFileIndex {
-    size_t start, end; // first and one-after-last index of lines associated with a file
+    size_t start, end; // first and one-after-last index of line references for a file
 };
 
 struct PdfsyncLine {
@@ -33,9 +37,21 @@ struct PdfsyncLine {
     UINT line, column;
 };
 
+struct PdfsyncLineRef {
+    size_t file; // index into srcfiles
+    UINT line;
+    size_t ix;   // index into lines
+};
+
 struct PdfsyncPoint {
     UINT record; // index for mapping point(s) to line(s)
     UINT page, x, y;
+    UINT order;  // position of the point in the sync file
+};
+
+struct PdfsyncRecordRef {
+    UINT record;
+    size_t ix;   // index into points
 };
 
 // Synchronizer based on .pdfsync file generated with the pdfsync tex package
@@ -57,10 +73,62 @@ private:
 
     PdfEngine *engine;          // needed for converting between coordinate systems
     WStrVec srcfiles;           // source file names
-    Vec<PdfsyncLine> lines;     // record-to-line mapping
-    Vec<PdfsyncPoint> points;   // record-to-point mapping
-    Vec<PdfsyncFileIndex> fileIndex; // start and end of entries for a file in <lines>
-    Vec<size_t> sheetIndex;     // start of entries for a sheet in <points>
+    Vec<PdfsyncLine> lines;     // record-to-line mapping (in sync file order)
+    Vec<PdfsyncLineRef> lineIndex; // lines sorted by file, line number and sync file order
+    Vec<PdfsyncFileIndex> fileIndex; // start and end of entries for a file in <lineIndex>
+    Vec<PdfsyncPoint> points;   // record-to-point mapping (sorted by page, y and sync file order)
+    Vec<size_t> pageIndex;      // start of entries for a page in <points>
+    Vec<PdfsyncRecordRef> recordIndex; // points sorted by record
+};
+
+// a node which synctex_display_query might return, reduced to what's needed for forward-search
+struct SyncTexNode {
+    int tag, line;
+    int page;
+    int order;      // position of the node in document order
+    int parentLast; // order of the last node within the node's parent box
+    int priority;   // boundaries are preferred over kerns, glues and math nodes over boxes
+    RectI rect;
+};
+
+// the parsed .synctex file (still needed for inverse-search) and all the nodes
+// which forward-search can return, sorted by tag, line and document order
+// (so that looking up a line doesn't have to walk the hash lists of synctex_display_query)
+class SyncTexIndex
+{
+    void IndexNodes(synctex_node_t node, int page, int& order);
+
+public:
+    synctex_scanner_t scanner;
+    Vec<SyncTexNode> nodes;
+
+    SyncTexIndex() : scanner(NULL) { }
+    ~SyncTexIndex() { synctex_scanner_free(scanner); }
+
+    bool Load(const char *syncfname, int pageCount);
+    void FindNodes(int tag, int line, Vec<SyncTexNode *>& found);
+};
+
+// parses and indexes a .synctex file in the background, as this
+// takes a while for larger documents
+class SyncTexIndexThread : public ThreadBase
+{
+    ScopedMem<WCHAR> syncfilepath;
+    int pageCount;
+
+public:
+    SyncTexIndex *index; // NULL if the file couldn't be parsed
+    // time stamp of the sync file before it was parsed
+    struct _stat syncfileTimestamp;
+
+    SyncTexIndexThread(const WCHAR *syncfilepath, int pageCount) :
+        ThreadBase("SyncTexIndexThread"), syncfilepath(str::Dup(syncfilepath)),
+        pageCount(pageCount), index(NULL) {
+        ZeroMemory(&syncfileTimestamp, sizeof(syncfileTimestamp));
+    }
+    virtual ~SyncTexIndexThread() { delete index; }
+
+    virtual void Run();
 };
 
 // Synchronizer based on .synctex file generated with SyncTex
@@ -68,23 +136,31 @@ class SyncTex : public Synchronizer
 {
 public:
     SyncTex(const WCHAR* syncfilename, PdfEngine *engine) :
-        Synchronizer(syncfilename), engine(engine), scanner(NULL)
+        Synchronizer(syncfilename), engine(engine), index(NULL), indexThread(NULL)
     {
         assert(str::EndsWithI(syncfilename, SYNCTEX_EXTENSION));
+        // start indexing right away, so that the first search doesn't have to wait as long
+        StartIndexing();
     }
     virtual ~SyncTex()
     {
-        synctex_scanner_free(scanner);
+        // don't wait for the index to be completed (it's no longer needed
+        // and the thread cleans up after itself)
+        if (indexThread)
+            indexThread->Release();
+        delete index;
     }
 
     virtual int DocToSource(UINT pageNo, PointI pt, ScopedMem<WCHAR>& filename, UINT *line, UINT *col);
     virtual int SourceToDoc(const WCHAR* srcfilename, UINT line, UINT col, UINT *page, Vec<RectI> &rects);
 
 private:
+    void StartIndexing();
     int RebuildIndex();
 
     PdfEngine *engine; // needed for converting between coordinate systems
-    synctex_scanner_t scanner;
+    SyncTexIndex *index;
+    SyncTexIndexThread *indexThread; // non-NULL while a new index is being built
 };
 
 Synchronizer::Synchronizer(const WCHAR* syncfilepath) :
@@ -111,11 +187,14 @@ bool Synchronizer::IsIndexDiscarded() const
     return false;
 }
 
-int Synchronizer::RebuildIndex()
+int Synchronizer::RebuildIndex(struct _stat *timestamp)
 {
     indexDiscarded = false;
     // save sync file timestamp
-    _wstat(syncfilepath, &syncfileTimestamp);
+    if (timestamp)
+        syncfileTimestamp = *timestamp;
+    else
+        _wstat(syncfilepath, &syncfileTimestamp);
     return PDFSYNCERR_SUCCESS;
 }
 
@@ -190,13 +269,64 @@ WCHAR * Synchronizer::PrepareCommandline(const WCHAR* pattern, const WCHAR* file
 
 // PDFSYNC synchronizer
 
-// move to the next line in a list of zero-terminated lines
-static char *Advance0Line(char *line, char *end)
+// zero-terminate the line starting at <line> and return the start of the next non-empty line
+static char *TerminateLine(char *line, char *end)
+{
+    for (; line < end && *line != '\r' && *line != '\n'; line++);
+    for (; line < end && ('\r' == *line || '\n' == *line); line++) {
+        *line = '\0';
+    }
+    return line;
+}
+
+// parse an unsigned decimal number preceded by optional blanks (this is considerably
+// faster than str::Parse for sync files with millions of lines); returns NULL for
+// invalid input (including s == NULL, so that calls can be chained)
+static const char *ParseUInt(const char *s, UINT *value)
+{
+    if (!s)
+        return NULL;
+    for (; ' ' == *s || '\t' == *s; s++);
+    if (!str::IsDigit(*s))
+        return NULL;
+    for (*value = 0; str::IsDigit(*s); s++) {
+        *value = *value * 10 + (*s - '0');
+    }
+    return s;
+}
+
+static int cmpLineRefs(const void *a, const void *b)
+{
+    const PdfsyncLineRef *la = (const PdfsyncLineRef *)a, *lb = (const PdfsyncLineRef *)b;
+    if (la->file != lb->file)
+        return la->file < lb->file ? -1 : 1;
+    if (la->line != lb->line)
+        return la->line < lb->line ? -1 : 1;
+    return la->ix < lb->ix ? -1 : la->ix > lb->ix ? 1 : 0;
+}
+
+static int cmpPointsByPos(const void *a, const void *b)
 {
-    line += str::Len(line);
-    // skip all zeroes until the next non-empty line
-    for (; line < end && !*line; line++);
-    return line < end ? line : NULL;
+    const PdfsyncPoint *pa = (const PdfsyncPoint *)a, *pb = (const PdfsyncPoint *)b;
+    if (pa->page != pb->page)
+        return pa->page < pb->page ? -1 : 1;
+    if (pa->y != pb->y)
+        return pa->y < pb->y ? -1 : 1;
+    return pa->order < pb->order ? -1 : pa->order > pb->order ? 1 : 0;
+}
+
+static int cmpPointsByOrder(const void *a, const void *b)
+{
+    const PdfsyncPoint *pa = (const PdfsyncPoint *)a, *pb = (const PdfsyncPoint *)b;
+    return pa->order < pb->order ? -1 : pa->order > pb->order ? 1 : 0;
+}
+
+static int cmpRecordRefs(const void *a, const void *b)
+{
+    const PdfsyncRecordRef *ra = (const PdfsyncRecordRef *)a, *rb = (const PdfsyncRecordRef *)b;
+    if (ra->record != rb->record)
+        return ra->record < rb->record ? -1 : 1;
+    return ra->ix < rb->ix ? -1 : ra->ix > rb->ix ? 1 : 0;
 }
 
 // see http://itexmac.sourceforge.net/pdfsync.html for the specification
@@ -206,12 +336,11 @@ int Pdfsync::RebuildIndex()
     ScopedMem<char> data(file::ReadAll(syncfilepath, &len));
     if (!data)
         return PDFSYNCERR_SYNCFILE_CANNOT_BE_OPENED;
-    // convert the file data into a list of zero-terminated strings
-    str::TransChars(data, "\r\n", "\0\0");
+    char *dataEnd = data + len;
 
     // parse preamble (jobname and version marker)
     char *line = data;
-    char *dataEnd = data + len;
+    char *next = TerminateLine(line, dataEnd);
 
     // replace star by spaces (TeX uses stars instead of spaces in filenames)
     str::TransChars(line, "*/", " \\");
@@ -219,61 +348,62 @@ int Pdfsync::RebuildIndex()
     jobName.Set(str::Join(jobName, L".tex"));
     jobName.Set(PrependDir(jobName));
 
-    line = Advance0Line(line, dataEnd);
+    line = next;
+    next = TerminateLine(line, dataEnd);
     UINT versionNumber = 0;
-    if (!line || !str::Parse(line, "version %u", &versionNumber) || versionNumber != 1)
+    if (!str::Parse(line, "version %u", &versionNumber) || versionNumber != 1)
         return PDFSYNCERR_SYNCFILE_CANNOT_BE_OPENED;
 
     // reset synchronizer database
     srcfiles.Reset();
     lines.Reset();
-    points.Reset();
+    lineIndex.Reset();
     fileIndex.Reset();
-    sheetIndex.Reset();
+    points.Reset();
+    pageIndex.Reset();
+    recordIndex.Reset();
 
     Vec<size_t> filestack;
     UINT page = 1;
-    sheetIndex.Append(0);
 
     // add the initial tex file to the source file stack
     filestack.Push(srcfiles.Count());
     srcfiles.Append(jobName.StealData());
-    PdfsyncFileIndex findex = { 0 };
-    fileIndex.Append(findex);
 
     PdfsyncLine psline;
     PdfsyncPoint pspoint;
+    const char *s;
 
     // parse data
     UINT maxPageNo = engine->PageCount();
-    while ((line = Advance0Line(line, dataEnd))) {
+    for (line = next; line < dataEnd; line = next) {
+        next = TerminateLine(line, dataEnd);
         switch (*line) {
         case 'l':
             psline.file = filestack.Last();
-            if (str::Parse(line, "l %u %u %u", &psline.record, &psline.line, &psline.column))
-                lines.Append(psline);
-            else if (str::Parse(line, "l %u %u", &psline.record, &psline.line)) {
-                psline.column = 0;
+            s = ParseUInt(ParseUInt(line + 1, &psline.record), &psline.line);
+            if (s) {
+                if (!ParseUInt(s, &psline.column))
+                    psline.column = 0;
                 lines.Append(psline);
             }
             // else dbg("Bad 'l' line in the pdfsync file");
             break;
 
         case 's':
-            if (str::Parse(line, "s %u", &page))
-                sheetIndex.Append(points.Count());
-            // else dbg("Bad 's' line in the pdfsync file");
+            ParseUInt(line + 1, &page);
+            // if (!ParseUInt(line + 1, &page)) dbg("Bad 's' line in the pdfsync file");
             // if (0 == page || page > maxPageNo)
             //     dbg("'s' line with invalid page number in the pdfsync file");
             break;
 
         case 'p':
             pspoint.page = page;
+            pspoint.order = (UINT)points.Count();
+            s = '*' == line[1] ? line + 2 : line + 1;
             if (0 == page || page > maxPageNo)
                 /* ignore point for invalid page number */;
-            else if (str::Parse(line, "p %u %u %u", &pspoint.record, &pspoint.x, &pspoint.y))
-                points.Append(pspoint);
-            else if (str::Parse(line, "p* %u %u %u", &pspoint.record, &pspoint.x, &pspoint.y))
+            else if (ParseUInt(ParseUInt(ParseUInt(s, &pspoint.record), &pspoint.x), &pspoint.y))
                 points.Append(pspoint);
             // else dbg("Bad 'p' line in the pdfsync file");
             break;
@@ -296,14 +426,12 @@ int Pdfsync::RebuildIndex()
 
                 filestack.Push(srcfiles.Count());
                 srcfiles.Append(filename.StealData());
-                findex.start = findex.end = lines.Count();
-                fileIndex.Append(findex);
             }
             break;
 
         case ')':
             if (filestack.Count() > 1)
-                fileIndex.At(filestack.Pop()).end = lines.Count();
+                filestack.Pop();
             // else dbg("Unbalanced ')' line in the pdfsync file");
             break;
 
@@ -313,9 +441,34 @@ int Pdfsync::RebuildIndex()
         }
     }
 
-    fileIndex.At(0).end = lines.Count();
     assert(filestack.Count() == 1);
 
+    // sort the lines by file and line number for forward-search
+    for (size_t i = 0; i < lines.Count(); i++) {
+        PdfsyncLineRef ref = { lines.At(i).file, lines.At(i).line, i };
+        lineIndex.Append(ref);
+    }
+    lineIndex.Sort(cmpLineRefs);
+    PdfsyncFileIndex findex = { 0, 0 };
+    for (size_t i = 0; i < srcfiles.Count(); i++) {
+        for (findex.start = findex.end; findex.end < lineIndex.Count() && lineIndex.At(findex.end).file == i; findex.end++);
+        fileIndex.Append(findex);
+    }
+
+    // sort the points by page and vertical position for inverse-search...
+    points.Sort(cmpPointsByPos);
+    size_t ix = 0;
+    for (UINT pageNo = 0; pageNo <= maxPageNo + 1; pageNo++) {
+        for (; ix < points.Count() && points.At(ix).page < pageNo; ix++);
+        pageIndex.Append(ix);
+    }
+    // ... and by record for forward-search
+    for (size_t i = 0; i < points.Count(); i++) {
+        PdfsyncRecordRef ref = { points.At(i).record, i };
+        recordIndex.Append(ref);
+    }
+    recordIndex.Sort(cmpRecordRefs);
+
     return Synchronizer::RebuildIndex();
 }
 
@@ -327,55 +480,80 @@ static int cmpLineRecords(const void *a, const void *b)
     return ((PdfsyncLine *)a)->record - ((PdfsyncLine *)b)->record;
 }
 
+// whether a point is close enough vertically to a hit-point for being selected
+// for inverse-search (i.e. whether there's any dx for which it would be)
+static bool IsCloseVertically(UINT dy)
+{
+    return dy < PDFSYNC_EPSILON_Y || (UINT64)dy * dy < PDFSYNC_EPSILON_SQUARE;
+}
+
 int Pdfsync::DocToSource(UINT pageNo, PointI pt, ScopedMem<WCHAR>& filename, UINT *line, UINT *col)
 {
     if (IsIndexDiscarded())
         if (RebuildIndex() != PDFSYNCERR_SUCCESS)
             return PDFSYNCERR_SYNCFILE_CANNOT_BE_OPENED;
 
-    // find the entry in the index corresponding to this page
-    if (pageNo <= 0 || pageNo >= sheetIndex.Count() || pageNo > (UINT)engine->PageCount())
+    // find the entries in the index corresponding to this page
+    if (pageNo <= 0 || pageNo + 1 >= pageIndex.Count() || pageNo > (UINT)engine->PageCount())
         return PDFSYNCERR_INVALID_PAGE_NUMBER;
 
     // PdfSync coordinates are y-inversed
     RectI mbox = engine->PageMediabox(pageNo).Round();
     pt.y = mbox.dy - pt.y;
 
+    // a page's points are sorted vertically, so skip all the ones too far above the hit-point
+    size_t lo = pageIndex.At(pageNo), end = pageIndex.At(pageNo + 1);
+    for (size_t hi = end; lo < hi; ) {
+        size_t mid = (lo + hi) / 2;
+        int y = (int)SYNC_TO_PDF_COORDINATE(points.At(mid).y);
+        if (y < pt.y && !IsCloseVertically(pt.y - y))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
     // distance to the closest pdf location (in the range <PDFSYNC_EPSILON_SQUARE)
     UINT closest_xydist = UINT_MAX;
-    UINT selected_record = UINT_MAX;
+    PdfsyncPoint *selected = NULL;
     // If no record is found within a distance^2 of PDFSYNC_EPSILON_SQUARE
-    // (selected_record == -1) then we pick up the record that is closest
+    // (selected == NULL) then we pick up the record that is closest
     // vertically to the hit-point.
     UINT closest_ydist = UINT_MAX; // vertical distance between the hit point and the vertically-closest record
     UINT closest_xdist = UINT_MAX; // horizontal distance between the hit point and the vertically-closest record
-    UINT closest_ydist_record = UINT_MAX; // vertically-closest record
-
-    // read all the sections of 'p' declarations for this pdf sheet
-    for (size_t i = sheetIndex.At(pageNo); i < points.Count() && points.At(i).page == pageNo; i++) {
+    PdfsyncPoint *closest_ydist_point = NULL; // vertically-closest record
+    // for points at the same distance, the one declared first in the sync file is used
+
+    for (size_t i = lo; i < end; i++) {
+        PdfsyncPoint *point = &points.At(i);
+        int y = (int)SYNC_TO_PDF_COORDINATE(point->y);
+        UINT dy = abs(pt.y - y);
+        if (y > pt.y && !IsCloseVertically(dy))
+            break;
         // check whether it is closer than the closest point found so far
-        UINT dx = abs(pt.x - (int)SYNC_TO_PDF_COORDINATE(points.At(i).x));
-        UINT dy = abs(pt.y - (int)SYNC_TO_PDF_COORDINATE(points.At(i).y));
+        UINT dx = abs(pt.x - (int)SYNC_TO_PDF_COORDINATE(point->x));
         UINT dist = dx * dx + dy * dy;
-        if (dist < PDFSYNC_EPSILON_SQUARE && dist < closest_xydist) {
-            selected_record = points.At(i).record;
-            closest_xydist = dist;
+        if (dist < PDFSYNC_EPSILON_SQUARE) {
+            if (dist < closest_xydist || (dist == closest_xydist && point->order < selected->order)) {
+                selected = point;
+                closest_xydist = dist;
+            }
         }
-        else if ((closest_xydist == UINT_MAX) && dy < PDFSYNC_EPSILON_Y &&
-                 (dy < closest_ydist || (dy == closest_ydist && dx < closest_xdist))) {
-            closest_ydist_record = points.At(i).record;
+        else if (dy < PDFSYNC_EPSILON_Y &&
+                 (dy < closest_ydist || (dy == closest_ydist && (dx < closest_xdist ||
+                  (dx == closest_xdist && point->order < closest_ydist_point->order))))) {
+            closest_ydist_point = point;
             closest_ydist = dy;
             closest_xdist = dx;
         }
     }
 
-    if (selected_record == UINT_MAX)
-        selected_record = closest_ydist_record;
-    if (selected_record == UINT_MAX)
+    if (!selected)
+        selected = closest_ydist_point;
+    if (!selected)
         return PDFSYNCERR_NO_SYNC_AT_LOCATION; // no record was found close enough to the hit point
 
     // We have a record number, we need to find its declaration ('l ...') in the syncfile
-    PdfsyncLine cmp; cmp.record = selected_record;
+    PdfsyncLine cmp; cmp.record = selected->record;
     PdfsyncLine *found = (PdfsyncLine *)bsearch(&cmp, lines.LendData(), lines.Count(), sizeof(PdfsyncLine), cmpLineRecords);
     assert(found);
     if (!found)
@@ -388,6 +566,19 @@ int Pdfsync::DocToSource(UINT pageNo, PointI pt, ScopedMem<WCHAR>& filename, UIN
     return PDFSYNCERR_SUCCESS;
 }
 
+// returns the first entry in lineIndex[lo..hi) for the given line (or the line after it)
+static size_t FindLineRef(Vec<PdfsyncLineRef>& lineIndex, size_t lo, size_t hi, UINT line)
+{
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (lineIndex.At(mid).line < line)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
 // Find a record corresponding to the given source file, line number and optionally column number.
 // (at the moment the column parameter is ignored)
 //
@@ -420,29 +611,25 @@ UINT Pdfsync::SourceToRecord(const WCHAR* srcfilename, UINT line, UINT col, Vec<
     if (isrc == srcfiles.Count())
         return PDFSYNCERR_UNKNOWN_SOURCEFILE;
 
-    if (fileIndex.At(isrc).start == fileIndex.At(isrc).end)
+    size_t start = fileIndex.At(isrc).start, end = fileIndex.At(isrc).end;
+    if (start == end)
         return PDFSYNCERR_NORECORD_IN_SOURCEFILE; // there is not any record declaration for that particular source file
 
-    // look for sections belonging to the specified file
-    // starting with the first section that is declared within the scope of the file.
-    UINT min_distance = EPSILON_LINE; // distance to the closest record
-    size_t lineIx = (size_t)-1; // closest record-line index
-
-    for (size_t isec = fileIndex.At(isrc).start; isec < fileIndex.At(isrc).end; isec++) {
-        // does this section belong to the desired file?
-        if (lines.At(isec).file != isrc)
-            continue;
-
-        UINT d = abs((int)lines.At(isec).line - (int)line);
-        if (d < min_distance) {
-            min_distance = d;
-            lineIx = isec;
-            if (0 == d)
-                break; // We have found a record for the requested line!
-        }
+    // the closest record is either the first one for the requested line (or the next line
+    // with records) or the first one for the previous line with records; for lines at the
+    // same distance the one declared first in the sync file is used
+    size_t next = FindLineRef(lineIndex, start, end, line);
+    size_t prev = next > start ? FindLineRef(lineIndex, start, next, lineIndex.At(next - 1).line) : end;
+    size_t closest = next < end ? next : prev;
+    if (next < end && prev < end) {
+        UINT dNext = lineIndex.At(next).line - line;
+        UINT dPrev = line - lineIndex.At(prev).line;
+        if (dPrev < dNext || (dPrev == dNext && lineIndex.At(prev).ix < lineIndex.At(next).ix))
+            closest = prev;
     }
-    if (lineIx == (size_t)-1)
+    if (closest == end || (UINT)abs((int)lineIndex.At(closest).line - (int)line) >= EPSILON_LINE)
         return PDFSYNCERR_NORECORD_FOR_THATLINE;
+    size_t lineIx = lineIndex.At(closest).ix; // closest record-line index
 
     // we read all the consecutive records until we reach a record belonging to another line
     for (size_t i = lineIx; i < lines.Count() && lines.At(i).line == lines.At(lineIx).line; i++)
@@ -462,65 +649,202 @@ int Pdfsync::SourceToDoc(const WCHAR* srcfilename, UINT line, UINT col, UINT *pa
     if (ret != PDFSYNCERR_SUCCESS || found_records.Count() == 0)
         return ret;
 
-    rects.Reset();
-
     // records have been found for the desired source position:
-    // we now find the page and positions in the PDF corresponding to these found records
-    UINT firstPage = UINT_MAX;
-    for (size_t i = 0; i < points.Count(); i++) {
-        if (found_records.Find(points.At(i).record) == -1)
-            continue;
-        if (firstPage != UINT_MAX && firstPage != points.At(i).page)
+    // we now find the positions in the PDF corresponding to these found records
+    Vec<PdfsyncPoint> found_points;
+    for (size_t i = 0; i < found_records.Count(); i++) {
+        UINT record = (UINT)found_records.At(i);
+        size_t lo = 0, hi = recordIndex.Count();
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            if (recordIndex.At(mid).record < record)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        for (; lo < recordIndex.Count() && recordIndex.At(lo).record == record; lo++) {
+            found_points.Append(points.At(recordIndex.At(lo).ix));
+        }
+    }
+    if (0 == found_points.Count())
+        return PDFSYNCERR_NOSYNCPOINT_FOR_LINERECORD; // the record does not correspond to any point in the PDF: this is possible...
+
+    // only highlight the points on the same page as the one declared first
+    found_points.Sort(cmpPointsByOrder);
+    *page = found_points.At(0).page;
+    RectD mbox = engine->PageMediabox(*page);
+
+    rects.Reset();
+    for (size_t i = 0; i < found_points.Count(); i++) {
+        PdfsyncPoint& point = found_points.At(i);
+        // the same record might have been found twice
+        if (point.page != *page || (i > 0 && point.order == found_points.At(i - 1).order))
             continue;
-        firstPage = *page = points.At(i).page;
-        RectD rc(SYNC_TO_PDF_COORDINATE(points.At(i).x),
-                 SYNC_TO_PDF_COORDINATE(points.At(i).y),
+        RectD rc(SYNC_TO_PDF_COORDINATE(point.x),
+                 SYNC_TO_PDF_COORDINATE(point.y),
                  MARK_SIZE, MARK_SIZE);
         // PdfSync coordinates are y-inversed
-        RectD mbox = engine->PageMediabox(firstPage);
         rc.y = mbox.dy - (rc.y + rc.dy);
         rects.Push(rc.Round());
     }
 
-    if (rects.Count() > 0)
-        return PDFSYNCERR_SUCCESS;
-    // the record does not correspond to any point in the PDF: this is possible...
-    return PDFSYNCERR_NOSYNCPOINT_FOR_LINERECORD;
+    return PDFSYNCERR_SUCCESS;
 }
 
 
 // SYNCTEX synchronizer
 
-int SyncTex::RebuildIndex() {
-    synctex_scanner_free(this->scanner);
-    this->scanner = NULL;
+static int cmpSyncTexNodes(const void *a, const void *b)
+{
+    const SyncTexNode *na = (const SyncTexNode *)a, *nb = (const SyncTexNode *)b;
+    if (na->tag != nb->tag)
+        return na->tag - nb->tag;
+    if (na->line != nb->line)
+        return na->line - nb->line;
+    return na->order - nb->order;
+}
 
-    ScopedMem<char> syncfname(str::conv::ToAnsi(syncfilepath));
-    if (!syncfname)
-        return PDFSYNCERR_OUTOFMEMORY;
+// collects the childless nodes of a box (and of all the boxes it contains)
+// in document order, as these are the ones synctex_display_query considers
+void SyncTexIndex::IndexNodes(synctex_node_t node, int page, int& order)
+{
+    size_t first = nodes.Count();
+    for (; node; node = synctex_node_sibling(node)) {
+        int nodeOrder = ++order;
+        synctex_node_t child = synctex_node_child(node);
+        if (child) {
+            IndexNodes(child, page, order);
+            continue;
+        }
+        SyncTexNode n;
+        n.tag = synctex_node_tag(node);
+        n.line = synctex_node_line(node);
+        n.page = page;
+        n.order = nodeOrder;
+        n.parentLast = -1;
+        synctex_node_type_t type = synctex_node_type(node);
+        n.priority = type >= synctex_node_type_boundary ? 2 : type >= synctex_node_type_kern ? 1 : 0;
+        RectD rc;
+        rc.x  = synctex_node_box_visible_h(node);
+        rc.y  = synctex_node_box_visible_v(node) - synctex_node_box_visible_height(node);
+        rc.dx = synctex_node_box_visible_width(node);
+        rc.dy = synctex_node_box_visible_height(node) + synctex_node_box_visible_depth(node);
+        n.rect = rc.Round();
+        nodes.Append(n);
+    }
+    // the nodes of nested boxes have already been updated
+    for (size_t i = first; i < nodes.Count(); i++) {
+        if (-1 == nodes.At(i).parentLast)
+            nodes.At(i).parentLast = order;
+    }
+}
 
+bool SyncTexIndex::Load(const char *syncfname, int pageCount)
+{
     scanner = synctex_scanner_new_with_output_file(syncfname, NULL, 1);
     if (!scanner)
+        return false;
+
+    int order = 0;
+    for (int pageNo = 1; pageNo <= pageCount; pageNo++) {
+        // the sheet itself counts as the parent box of its content
+        order++;
+        IndexNodes(synctex_sheet_content(scanner, pageNo), pageNo, order);
+    }
+    nodes.Sort(cmpSyncTexNodes);
+    return true;
+}
+
+// returns the same nodes in the same order as synctex_display_query
+// (with a binary search instead of a linear one per line)
+void SyncTexIndex::FindNodes(int tag, int line, Vec<SyncTexNode *>& found)
+{
+    size_t lo = 0, hi = nodes.Count();
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        SyncTexNode& n = nodes.At(mid);
+        if (n.tag < tag || (n.tag == tag && n.line < line))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo == nodes.Count() || nodes.At(lo).tag != tag || nodes.At(lo).line - line >= SYNCTEX_LINE_SEARCH_RANGE)
+        return;
+
+    // only consider the nodes of the most preferred kind
+    size_t end;
+    int priority = 0;
+    for (end = lo; end < nodes.Count() && nodes.At(end).tag == tag && nodes.At(end).line == nodes.At(lo).line; end++) {
+        priority = max(priority, nodes.At(end).priority);
+    }
+    SyncTexNode *last = NULL;
+    for (size_t i = lo; i < end; i++) {
+        SyncTexNode *n = &nodes.At(i);
+        if (n->priority != priority)
+            continue;
+        // skip nodes within the parent box of the previous node
+        if (last && n->order <= last->parentLast)
+            continue;
+        found.Append(n);
+        last = n;
+    }
+}
+
+void SyncTexIndexThread::Run()
+{
+    ScopedMem<char> syncfname(str::conv::ToAnsi(syncfilepath));
+    if (!syncfname)
+        return;
+    // if the file changes while it's being parsed, the index must
+    // be considered outdated as soon as it's been adopted
+    _wstat(syncfilepath, &syncfileTimestamp);
+    index = new SyncTexIndex();
+    if (!index->Load(syncfname, pageCount)) {
+        delete index;
+        index = NULL;
+    }
+}
+
+void SyncTex::StartIndexing()
+{
+    indexThread = new SyncTexIndexThread(syncfilepath, engine->PageCount());
+    indexThread->Start();
+}
+
+int SyncTex::RebuildIndex() {
+    if (!indexThread)
+        StartIndexing();
+    // Run() doesn't check for cancellation, so this just waits for the index
+    indexThread->RequestCancelAndWaitToStop();
+    delete index;
+    index = indexThread->index;
+    indexThread->index = NULL;
+    struct _stat timestamp = indexThread->syncfileTimestamp;
+    indexThread->Release();
+    indexThread = NULL;
+
+    if (!index)
         return PDFSYNCERR_SYNCFILE_NOTFOUND; // cannot rebuild the index
 
-    return Synchronizer::RebuildIndex();
+    return Synchronizer::RebuildIndex(&timestamp);
 }
 
 int SyncTex::DocToSource(UINT pageNo, PointI pt, ScopedMem<WCHAR>& filename, UINT *line, UINT *col)
 {
-    if (IsIndexDiscarded())
+    if (indexThread || IsIndexDiscarded())
         if (RebuildIndex() != PDFSYNCERR_SUCCESS)
             return PDFSYNCERR_SYNCFILE_CANNOT_BE_OPENED;
-    assert(this->scanner);
+    assert(index && index->scanner);
+    synctex_scanner_t scanner = index->scanner;
 
-    if (synctex_edit_query(this->scanner, pageNo, (float)pt.x, (float)pt.y) < 0)
+    if (synctex_edit_query(scanner, pageNo, (float)pt.x, (float)pt.y) < 0)
         return PDFSYNCERR_NO_SYNC_AT_LOCATION;
 
-    synctex_node_t node = synctex_next_result(this->scanner);
+    synctex_node_t node = synctex_next_result(scanner);
     if (!node)
         return PDFSYNCERR_NO_SYNC_AT_LOCATION;
 
-    const char *name = synctex_scanner_get_name(this->scanner, synctex_node_tag(node));
+    const char *name = synctex_scanner_get_name(scanner, synctex_node_tag(node));
     bool isUtf8 = true;
     filename.Set(str::conv::FromUtf8(name));
 TryAgainAnsi:
@@ -548,10 +872,10 @@ TryAgainAnsi:
 
 int SyncTex::SourceToDoc(const WCHAR* srcfilename, UINT line, UINT col, UINT *page, Vec<RectI> &rects)
 {
-    if (IsIndexDiscarded())
+    if (indexThread || IsIndexDiscarded())
         if (RebuildIndex() != PDFSYNCERR_SUCCESS)
             return PDFSYNCERR_SYNCFILE_CANNOT_BE_OPENED;
-    assert(this->scanner);
+    assert(index && index->scanner);
 
     ScopedMem<WCHAR> srcfilepath;
     // convert the source file to an absolute path
@@ -567,43 +891,30 @@ int SyncTex::SourceToDoc(const WCHAR* srcfilename, UINT line, UINT col, UINT *pa
 TryAgainAnsi:
     if (!mb_srcfilepath)
         return PDFSYNCERR_OUTOFMEMORY;
-    int ret = synctex_display_query(this->scanner, mb_srcfilepath, line, col);
+    int tag = synctex_scanner_get_tag(index->scanner, mb_srcfilepath);
     free(mb_srcfilepath);
     // recent SyncTeX versions encode in UTF-8 instead of ANSI
-    if (isUtf8 && -1 == ret) {
+    if (isUtf8 && 0 == tag) {
         isUtf8 = false;
         mb_srcfilepath = str::conv::ToAnsi(srcfilepath);
         goto TryAgainAnsi;
     }
 
-    if (-1 == ret)
+    if (0 == tag)
         return PDFSYNCERR_UNKNOWN_SOURCEFILE;
-    if (0 == ret)
+
+    Vec<SyncTexNode *> nodes;
+    index->FindNodes(tag, (int)line, nodes);
+    if (0 == nodes.Count())
         return PDFSYNCERR_NOSYNCPOINT_FOR_LINERECORD;
 
-    synctex_node_t node;
-    int firstpage = -1;
+    // only highlight the nodes on the same page as the first one
+    *page = (UINT)nodes.At(0)->page;
     rects.Reset();
-
-    while (node = synctex_next_result(this->scanner)) {
-        if (firstpage == -1) {
-            firstpage = synctex_node_page(node);
-            if (firstpage <= 0 || firstpage > engine->PageCount())
-                continue;
-            *page = (UINT)firstpage;
-        }
-        if (synctex_node_page(node) != firstpage)
-            continue;
-
-        RectD rc;
-        rc.x  = synctex_node_box_visible_h(node);
-        rc.y  = synctex_node_box_visible_v(node) - synctex_node_box_visible_height(node);
-        rc.dx = synctex_node_box_visible_width(node),
-        rc.dy = synctex_node_box_visible_height(node) + synctex_node_box_visible_depth(node);
-        rects.Push(rc.Round());
+    for (size_t i = 0; i < nodes.Count(); i++) {
+        if (nodes.At(i)->page == nodes.At(0)->page)
+            rects.Push(nodes.At(i)->rect);
     }
 
-    if (firstpage <= 0)
-        return PDFSYNCERR_NOSYNCPOINT_FOR_LINERECORD;
     return PDFSYNCERR_SUCCESS;
 }
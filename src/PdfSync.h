@@ -50,7 +50,9 @@ private:
 
 protected:
     bool IsIndexDiscarded() const;
-    int RebuildIndex();
+    // timestamp is the sync file's time stamp from before the index was
+    // built (if NULL, the sync file's current time stamp is used)
+    int RebuildIndex(struct _stat *timestamp=NULL);
     WCHAR * PrependDir(const WCHAR* filename) const;
 
     ScopedMem<WCHAR> syncfilepath;  // path to the synchronization file
@@ -8,10 +8,10 @@
 #include "AppTools.h"
 #include "FileHistory.h"
 #include "FileUtil.h"
-#include "ImagesEngine.h"
 #include "PdfEngine.h"
 #include "resource.h"
 #include "SumatraPDF.h"
+#include "ThumbnailCache.h"
 #include "Translations.h"
 #include "Version.h"
 #include "WindowInfo.h"
@@ -549,8 +549,6 @@ void DrawAboutPage(WindowInfo& win, HDC hdc)
 #define DOCLIST_MAX_THUMBNAILS_X    5
 #define DOCLIST_BOTTOM_BOX_DY      50
 
-static bool LoadThumbnail(DisplayState& state);
-
 void DrawStartPage(WindowInfo& win, HDC hdc, FileHistory& fileHistory, COLORREF colorRange[2])
 {
     HPEN penBorder = CreatePen(PS_SOLID, DOCLIST_SEPARATOR_DY, WIN_COL_BLACK);
@@ -610,6 +608,7 @@ void DrawStartPage(WindowInfo& win, HDC hdc, FileHistory& fileHistory, COLORREF
     SelectObject(hdc, GetStockBrush(NULL_BRUSH));
 
     win.staticLinks.Reset();
+    WStrVec missingThumbnails;
     for (int h = 0; h < height; h++) {
         for (int w = 0; w < width; w++) {
             if (h * width + w >= (int)list.Count()) {
@@ -624,10 +623,11 @@ void DrawStartPage(WindowInfo& win, HDC hdc, FileHistory& fileHistory, COLORREF
                        THUMBNAIL_DX, THUMBNAIL_DY);
             if (isRtl)
                 page.x = rc.dx - page.x - page.dx;
-            bool loadOk = true;
-            if (!state->thumbnail)
-                loadOk = LoadThumbnail(*state);
-            if (loadOk && state->thumbnail) {
+            // missing and outdated thumbnails are (re)rendered in the background
+            bool loadOk = HasThumbnail(*state);
+            if (!loadOk)
+                missingThumbnails.Append(str::Dup(state->filePath));
+            if (loadOk) {
                 SizeI thumbSize = state->thumbnail->Size();
                 if (thumbSize.dx != THUMBNAIL_DX || thumbSize.dy != THUMBNAIL_DY) {
                     page.dy = thumbSize.dy * THUMBNAIL_DX / thumbSize.dx;
@@ -659,6 +659,9 @@ void DrawStartPage(WindowInfo& win, HDC hdc, FileHistory& fileHistory, COLORREF
             win.staticLinks.Append(StaticLinkInfo(rect.Union(page), state->filePath, state->filePath));
         }
     }
+    // the start page is repainted as soon as a thumbnail is available
+    if (missingThumbnails.Count() > 0)
+        CreateThumbnailsInBackground(missingThumbnails);
 
     /* render bottom links */
     rc.y += DOCLIST_MARGIN_TOP + height * THUMBNAIL_DY + (height - 1) * DOCLIST_MARGIN_BETWEEN_Y + DOCLIST_MARGIN_BOTTOM;
@@ -697,123 +700,73 @@ void DrawStartPage(WindowInfo& win, HDC hdc, FileHistory& fileHistory, COLORREF
     DeleteObject(penLinkLine);
 }
 
-// TODO: create in TEMP directory instead?
-static WCHAR *GetThumbnailPath(const WCHAR *filePath)
-{
-    // create a fingerprint of a (normalized) path for the file name
-    // I'd have liked to also include the file's last modification time
-    // in the fingerprint (much quicker than hashing the entire file's
-    // content), but that's too expensive for files on slow drives
-    unsigned char digest[16];
-    ScopedMem<char> pathU(str::conv::ToUtf8(filePath));
-    if (path::HasVariableDriveLetter(filePath))
-        pathU[0] = '?'; // ignore the drive letter, if it might change
-    CalcMD5Digest((unsigned char *)pathU.Get(), str::Len(pathU), digest);
-    ScopedMem<char> fingerPrint(str::MemToHex(digest, 16));
-
-    ScopedMem<WCHAR> thumbsPath(AppGenDataFilename(THUMBNAILS_DIR_NAME));
-    if (!thumbsPath)
-        return NULL;
-    ScopedMem<WCHAR> fname(str::conv::FromAnsi(fingerPrint));
-
-    return str::Format(L"%s\\%s.png", thumbsPath, fname);
-}
+static ThumbnailCache gThumbnailCache;
 
 // removes thumbnails that don't belong to any frequently used item in file history
 void CleanUpThumbnailCache(FileHistory& fileHistory)
 {
+    Vec<DisplayState *> list;
+    fileHistory.GetFrequencyOrder(list);
+    WStrVec filePaths;
+    for (size_t i = 0; i < list.Count() && i < FILE_HISTORY_MAX_FREQUENT * 2; i++) {
+        filePaths.Append(str::Dup(list.At(i)->filePath));
+    }
+    // thumbnails used to be saved as one PNG file per document
+    bool removeLegacyFiles = 0 == gThumbnailCache.Count();
+    gThumbnailCache.RemoveAllExcept(filePaths);
+    gThumbnailCache.Flush();
+    if (!removeLegacyFiles)
+        return;
+
     ScopedMem<WCHAR> thumbsPath(AppGenDataFilename(THUMBNAILS_DIR_NAME));
     if (!thumbsPath)
         return;
     ScopedMem<WCHAR> pattern(path::Join(thumbsPath, L"*.png"));
 
-    WStrVec files;
     WIN32_FIND_DATA fdata;
-
     HANDLE hfind = FindFirstFile(pattern, &fdata);
     if (INVALID_HANDLE_VALUE == hfind)
         return;
     do {
-        if (!(fdata.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
-            files.Append(str::Dup(fdata.cFileName));
+        if (!(fdata.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
+            ScopedMem<WCHAR> bmpPath(path::Join(thumbsPath, fdata.cFileName));
+            file::Delete(bmpPath);
+        }
     } while (FindNextFile(hfind, &fdata));
     FindClose(hfind);
-
-    Vec<DisplayState *> list;
-    fileHistory.GetFrequencyOrder(list);
-    for (size_t i = 0; i < list.Count() && i < FILE_HISTORY_MAX_FREQUENT * 2; i++) {
-        ScopedMem<WCHAR> bmpPath(GetThumbnailPath(list.At(i)->filePath));
-        if (!bmpPath)
-            continue;
-        int idx = files.Find(path::GetBaseName(bmpPath));
-        if (idx != -1) {
-            CrashIf(idx < 0 || files.Count() <= (size_t)idx);
-            WCHAR *fileName = files.At(idx);
-            files.RemoveAt(idx);
-            free(fileName);
-        }
-    }
-
-    for (size_t i = 0; i < files.Count(); i++) {
-        ScopedMem<WCHAR> bmpPath(path::Join(thumbsPath, files.At(i)));
-        file::Delete(bmpPath);
-    }
-}
-
-static bool LoadThumbnail(DisplayState& ds)
-{
-    if (ds.thumbnail)
-        delete ds.thumbnail;
-    ds.thumbnail = NULL;
-
-    ScopedMem<WCHAR> bmpPath(GetThumbnailPath(ds.filePath));
-    if (!bmpPath)
-        return false;
-
-    ds.thumbnail = LoadRenderedBitmap(bmpPath);
-    return ds.thumbnail != NULL;
 }
 
 bool HasThumbnail(DisplayState& ds)
 {
-    if (!ds.thumbnail && !LoadThumbnail(ds))
-        return false;
-
-    ScopedMem<WCHAR> bmpPath(GetThumbnailPath(ds.filePath));
-    if (!bmpPath)
-        return true;
-    FILETIME bmpTime = file::GetModificationTime(bmpPath);
-    FILETIME fileTime = file::GetModificationTime(ds.filePath);
-    // delete the thumbnail if the file is newer than the thumbnail
-    if (FileTimeDiffInSecs(fileTime, bmpTime) > 0) {
+    // discard the thumbnail if the file has changed since
+    if (ds.thumbnail && !gThumbnailCache.IsUpToDate(ds.filePath)) {
         delete ds.thumbnail;
         ds.thumbnail = NULL;
+        return false;
     }
-
+    // the cache only returns thumbnails which are up-to-date
+    if (!ds.thumbnail)
+        ds.thumbnail = gThumbnailCache.Get(ds.filePath);
     return ds.thumbnail != NULL;
 }
 
+// the change isn't persisted until FlushThumbnailCache is called
 void SaveThumbnail(DisplayState& ds)
 {
-    if (!ds.thumbnail)
-        return;
-
-    ScopedMem<WCHAR> bmpPath(GetThumbnailPath(ds.filePath));
-    if (!bmpPath)
-        return;
-    ScopedMem<WCHAR> thumbsPath(path::GetDir(bmpPath));
-    if (dir::Create(thumbsPath))
-        SaveRenderedBitmap(ds.thumbnail, bmpPath);
+    if (ds.thumbnail)
+        gThumbnailCache.Set(ds.filePath, ds.thumbnail);
 }
 
 void RemoveThumbnail(DisplayState& ds)
 {
-    if (!HasThumbnail(ds))
-        return;
-
-    ScopedMem<WCHAR> bmpPath(GetThumbnailPath(ds.filePath));
-    if (bmpPath)
-        file::Delete(bmpPath);
+    // also removes outdated thumbnails (Flush is a no-op if there was none)
+    gThumbnailCache.Remove(ds.filePath);
+    gThumbnailCache.Flush();
     delete ds.thumbnail;
     ds.thumbnail = NULL;
 }
+
+void FlushThumbnailCache()
+{
+    gThumbnailCache.Flush();
+}
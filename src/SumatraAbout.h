@@ -28,5 +28,6 @@ void    CleanUpThumbnailCache(FileHistory& fileHistory);
 bool    HasThumbnail(DisplayState& ds);
 void    SaveThumbnail(DisplayState& ds);
 void    RemoveThumbnail(DisplayState& ds);
+void    FlushThumbnailCache();
 
 #endif
@@ -12,6 +12,7 @@
 #include "DirIter.h"
 #include "Doc.h"
 #include "EbookController.h"
+#include "EbookLayoutCache.h"
 #include "EbookWindow.h"
 #include "ExternalPdfViewer.h"
 #include "FileHistory.h"
@@ -41,6 +42,8 @@ using namespace Gdiplus;
 #include "SumatraWindow.h"
 #include "StressTesting.h"
 #include "TableOfContents.h"
+#include "ThreadUtil.h"
+#include "ThumbnailCache.h"
 #include "Timer.h"
 #include "Toolbar.h"
 #include "Touch.h"
@@ -661,7 +664,8 @@ static int GetPolicies(bool isRestricted)
     return Perm_RestrictedUse;
 }
 
-void SaveThumbnailForFile(const WCHAR *filePath, RenderedBitmap *bmp)
+// flush can be false when more thumbnails are about to be saved
+void SaveThumbnailForFile(const WCHAR *filePath, RenderedBitmap *bmp, bool flush)
 {
     DisplayState *ds = gFileHistory.Find(filePath);
     if (!ds || !bmp) {
@@ -671,6 +675,14 @@ void SaveThumbnailForFile(const WCHAR *filePath, RenderedBitmap *bmp)
     delete ds->thumbnail;
     ds->thumbnail = bmp;
     SaveThumbnail(*ds);
+    if (flush)
+        FlushThumbnailCache();
+
+    // thumbnails created in the background should appear on the start page right away
+    for (size_t i = 0; i < gWindows.Count(); i++) {
+        if (gWindows.At(i)->IsAboutWindow())
+            gWindows.At(i)->RedrawAll(true);
+    }
 }
 
 class ThumbnailRenderingTask : public UITask, public RenderingCallback
@@ -693,11 +705,112 @@ public:
     }
 
     virtual void Execute() {
-        SaveThumbnailForFile(filePath, bmp);
+        // the cache is saved once all background thumbnails are done
+        SaveThumbnailForFile(filePath, bmp, false);
         bmp = NULL;
     }
 };
 
+class ThumbnailFlushTask : public UITask
+{
+public:
+    virtual void Execute() {
+        FlushThumbnailCache();
+    }
+};
+
+// number of ThumbnailBatchThreads which haven't completed yet
+static LONG gThumbnailThreadsRunning = 0;
+
+// renders thumbnails for documents shown on the start page which don't
+// have one yet (e.g. because they were last opened by an older version)
+class ThumbnailBatchThread : public ThreadBase {
+public:
+    WStrVec filePaths;
+
+    ThumbnailBatchThread() : ThreadBase("ThumbnailBatchThread") { }
+
+    virtual void Run() {
+        for (size_t i = 0; i < filePaths.Count() && !WasCancelRequested(); i++) {
+            const WCHAR *filePath = filePaths.At(i);
+            // CHM documents can only be rendered on the UI thread
+            if (ChmEngine::IsSupportedFile(filePath) || ChmEngine::IsSupportedFile(filePath, true))
+                continue;
+            BaseEngine *engine = EngineManager::CreateEngine(false, filePath);
+            if (!engine)
+                continue;
+            RenderedBitmap *bmp = NULL;
+            // don't create thumbnails for password protected documents
+            if (!engine->IsPasswordProtected())
+                bmp = RenderThumbnail(engine);
+            delete engine;
+            if (bmp) {
+                RenderingCallback *callback = new ThumbnailRenderingTask(filePath);
+                callback->Callback(bmp);
+            }
+        }
+        // all ThumbnailRenderingTasks have been posted before this one, so
+        // the thumbnail cache is only saved once instead of per thumbnail
+        if (0 == InterlockedDecrement(&gThumbnailThreadsRunning) && !WasCancelRequested())
+            uitask::Post(new ThumbnailFlushTask());
+    }
+};
+
+static Vec<ThumbnailBatchThread *> gThumbnailThreads;
+// thumbnails are only attempted once per session (in case of failure)
+static WStrVec gThumbnailsRequested;
+
+void CreateThumbnailsInBackground(WStrVec& filePaths)
+{
+    if (!HasPermission(Perm_SavePreferences) || IsStressTesting())
+        return;
+
+    WStrVec todo;
+    for (size_t i = 0; i < filePaths.Count(); i++) {
+        if (gThumbnailsRequested.Find(filePaths.At(i)) == -1) {
+            gThumbnailsRequested.Append(str::Dup(filePaths.At(i)));
+            todo.Append(str::Dup(filePaths.At(i)));
+        }
+    }
+    if (0 == todo.Count())
+        return;
+
+    // distribute the documents over as many threads as there are processors
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    size_t threadCount = limitValue((size_t)si.dwNumberOfProcessors, (size_t)1, todo.Count());
+    for (size_t i = 0; i < threadCount; i++) {
+        ThumbnailBatchThread *thread = new ThumbnailBatchThread();
+        for (size_t j = i; j < todo.Count(); j += threadCount) {
+            thread->filePaths.Append(str::Dup(todo.At(j)));
+        }
+        gThumbnailThreads.Append(thread);
+        InterlockedIncrement(&gThumbnailThreadsRunning);
+        thread->Start();
+    }
+}
+
+// rendering a single thumbnail can take a while for complex documents,
+// so don't delay exiting for longer than this
+#define THUMBNAIL_THREADS_MAX_WAIT_MS 1000
+
+void CancelThumbnailsInBackground()
+{
+    for (size_t i = 0; i < gThumbnailThreads.Count(); i++) {
+        gThumbnailThreads.At(i)->RequestCancel();
+    }
+    DWORD start = GetTickCount();
+    for (size_t i = 0; i < gThumbnailThreads.Count(); i++) {
+        DWORD elapsed = GetTickCount() - start;
+        DWORD waitMs = elapsed < THUMBNAIL_THREADS_MAX_WAIT_MS ? THUMBNAIL_THREADS_MAX_WAIT_MS - elapsed : 0;
+        // threads still running keep their own reference and are
+        // terminated along with the process
+        gThumbnailThreads.At(i)->RequestCancelAndWaitToStop(waitMs);
+        gThumbnailThreads.At(i)->Release();
+    }
+    gThumbnailThreads.Reset();
+}
+
 // Create a thumbnail of chm document by loading it again and rendering
 // its first page to a hwnd specially created for it. An alternative
 // would be to reuse ChmEngine/HtmlWindow we already have but it has
@@ -762,16 +875,11 @@ static void CreateThumbnailForFile(WindowInfo& win, DisplayState& ds)
         return;
     }
 
-    RectD pageRect = win.dm->engine->PageMediabox(1);
-    if (pageRect.IsEmpty())
+    float zoom;
+    RectD pageRect;
+    if (!GetThumbnailRect(win.dm->engine, &zoom, &pageRect))
         return;
 
-    pageRect = win.dm->engine->Transform(pageRect, 1, 1.0f, 0);
-    float zoom = THUMBNAIL_DX / (float)pageRect.dx;
-    if (pageRect.dy > (float)THUMBNAIL_DY / zoom)
-        pageRect.dy = (float)THUMBNAIL_DY / zoom;
-    pageRect = win.dm->engine->Transform(pageRect, 1, 1.0f, 0, true);
-
     RenderingCallback *callback = new ThumbnailRenderingTask(win.loadedFilePath);
     gRenderCache.Render(win.dm, 1, 0, zoom, pageRect, *callback);
 }
@@ -3143,6 +3251,7 @@ void OnMenuSettings(HWND hwnd)
     if (!gGlobalPrefs.rememberOpenedFiles) {
         gFileHistory.Clear();
         CleanUpThumbnailCache(gFileHistory);
+        CleanUpLayoutCache(gFileHistory);
     }
     if (useSysColors != gGlobalPrefs.useSysColors)
         UpdateDocumentColors();
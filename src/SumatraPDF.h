@@ -122,7 +122,9 @@ void  CloseDocumentAndDeleteWindowInfo(WindowInfo *win);
 void  OnMenuAbout();
 void  QuitIfNoMoreWindows();
 bool  ShouldSaveThumbnail(DisplayState& ds);
-void  SaveThumbnailForFile(const WCHAR *filePath, RenderedBitmap *bmp);
+void  SaveThumbnailForFile(const WCHAR *filePath, RenderedBitmap *bmp, bool flush=true);
+void  CreateThumbnailsInBackground(WStrVec& filePaths);
+void  CancelThumbnailsInBackground();
 
 WindowInfo* FindWindowInfoByFile(const WCHAR *file);
 WindowInfo* FindWindowInfoByHwnd(HWND hwnd);
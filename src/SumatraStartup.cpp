@@ -454,7 +454,9 @@ int APIENTRY WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLi
 
     retCode = RunMessageLoop();
 
+    CancelThumbnailsInBackground();
     CleanUpThumbnailCache(gFileHistory);
+    CleanUpLayoutCache(gFileHistory);
 
 Exit:
     while (gWindows.Count() > 0) {
@@ -5,18 +5,39 @@
    executable and related makefile additions for each test, we have one test
    driver which dispatches desired test based on cmd-line arguments. */
 
+extern "C" {
+#include <fitz-internal.h>
+#include <mupdf-internal.h>
+}
+
 #include "BaseUtil.h"
+#include <malloc.h>
 
+#include "AppPrefs.h"
+#include "BencUtil.h"
+#include "ChmDoc.h"
 #include "CmdLineParser.h"
+#include "Dict.h"
 #include "DirIter.h"
+#include "DjVuEngine.h"
+#include "EbookDoc.h"
 #include "EbookFormatter.h"
+#include "EbookLayoutCache.h"
+#include "Favorites.h"
+#include "FileHistory.h"
 #include "FileUtil.h"
 using namespace Gdiplus;
 #include "GdiPlusUtil.h"
 #include "HtmlPrettyPrint.h"
+#include "HtmlPullParser.h"
+#include "ImagesEngine.h"
+#include "JsonParser.h"
 #include "MobiDoc.h"
 #include "Mui.h"
 #include "PdfEngine.h"
+#include "PdfSync.h"
+#include "ThreadUtil.h"
+#include "ThumbnailCache.h"
 #include "Timer.h"
 #include "WinUtil.h"
 #include "ZipUtil.h"
@@ -43,6 +64,30 @@ static int Usage()
     printf("  -save-images - will save images extracted from mobi files\n");
     printf("  -zip-create - creates a sample zip file that needs to be manually checked that it worked\n");
     printf("  -bench-md5 - compare Window's md5 vs. our code\n");
+    printf("  -test-crypt - check AES-CBC against known answers with and without AES-NI\n");
+    printf("  -bench-crypt - benchmark AES/RC4/SHA-2 used for encrypted PDF documents\n");
+    printf("  -bench-crypt-dir encryptedDir decryptedDir - load and render encrypted vs. decrypted PDF files\n");
+    printf("  -bench-pdf-save file.pdf - compare full, garbage collected and incremental saving of a modified PDF file\n");
+    printf("  -bench-fonts dir - load all PDF files in a directory with and without sharing embedded fonts\n");
+    printf("  -bench-render file.pdf [refDir] - render all pages of a PDF file at several zoom levels (and compare against the pages saved to refDir by a previous run)\n");
+    printf("  -bench-text dir - extract the text of all PDF files in a directory\n");
+    printf("  -bench-layout file.epub - lay out an EPUB document on 1 to N threads\n");
+    printf("  -bench-reopen file - compare reopening an ebook with and without a cached layout\n");
+    printf("  -bench-resize file - reformat an ebook for several page sizes with and without reusing measured words\n");
+    printf("  -bench-html-parse file - tokenize the html of an ebook (or of an html/xml file)\n");
+    printf("  -bench-mobi-open file.mobi - load a MOBI document on 1 and on N threads\n");
+    printf("  -bench-zip file - look up and read all files of a ZIP archive (e.g. .cbz or .epub)\n");
+    printf("  -bench-cbx file - page flip latency of a comic book (.cbz or .cbr)\n");
+    printf("  -bench-chm file - retrieve all html pages of a .chm file\n");
+    printf("  -bench-djvu dir - render all pages of all .djvu files in a directory on 1 to n threads\n");
+    printf("  -bench-djvu-scroll file - scroll through a .djvu file at fit width\n");
+    printf("  -bench-djvu-open file - time from opening a .djvu file to rendering its first page\n");
+    printf("  -bench-synctex file.pdf - inverse- and forward-search latency for a PDF file with a .synctex file\n");
+    printf("  -bench-pdfsync file.pdf - inverse- and forward-search latency for a large synthetic .pdfsync file\n");
+    printf("  -bench-prefs - save and load preferences with a file history of 10000 documents\n");
+    printf("  -bench-thumbnails dir - load the start page thumbnails for the PDF files in a directory from individual PNG files vs. from the thumbnail cache\n");
+    printf("  -bench-parsers - parse and encode bencoded and JSON data (MB/s and, in debug builds, allocations per MB)\n");
+    printf("  -bench-dict - insert and look up 500000 strings in a dict::MapWStrToInt and in the previous chained hash table (time and memory)\n");
     system("pause");
     return 1;
 }
@@ -106,6 +151,1482 @@ static void BenchMD5()
     free(data);
 }
 
+/* This benchmarks the decryption primitives for encrypted PDF documents.
+AES is timed both with the hardware accelerated code path (AES-NI, if
+available) and with the table based fallback. */
+static void BenchCryptSize(unsigned char *data, int dataSize, char *desc)
+{
+    unsigned char key[32] = { 0 }, iv[16] = { 0 }, digest[64];
+    printf("%s\n", desc);
+
+    fz_aes aes;
+    for (int keySize = 128; keySize <= 256; keySize += 128) {
+        aes_setkey_dec(&aes, key, keySize);
+        bool hw = aes.hw != 0;
+        Timer t1(true);
+        aes_crypt_cbc(&aes, AES_DECRYPT, dataSize, iv, data, data);
+        double dur1 = t1.GetTimeInMs();
+        aes.hw = 0;
+        Timer t2(true);
+        aes_crypt_cbc(&aes, AES_DECRYPT, dataSize, iv, data, data);
+        double dur2 = t2.GetTimeInMs();
+        printf("AES-%d (%s): %f ms\nAES-%d (tables): %f ms\n", keySize, hw ? "hw" : "tables", dur1, keySize, dur2);
+    }
+
+    fz_arc4 arc4;
+    fz_arc4_init(&arc4, key, 16);
+    Timer t3(true);
+    fz_arc4_encrypt(&arc4, data, data, dataSize);
+    printf("RC4    : %f ms\n", t3.GetTimeInMs());
+
+    fz_sha256 sha256;
+    Timer t4(true);
+    fz_sha256_init(&sha256);
+    fz_sha256_update(&sha256, data, dataSize);
+    fz_sha256_final(&sha256, digest);
+    printf("SHA-256: %f ms\n", t4.GetTimeInMs());
+
+    fz_sha512 sha512;
+    Timer t5(true);
+    fz_sha512_init(&sha512);
+    fz_sha512_update(&sha512, data, dataSize);
+    fz_sha512_final(&sha512, digest);
+    printf("SHA-512: %f ms\n", t5.GetTimeInMs());
+}
+
+// checks the table based AES code and (if the CPU supports it) the
+// hardware accelerated code against the NIST test vectors
+static void TestCrypt()
+{
+    int hwTested;
+    int failed = aes_self_test(&hwTested);
+    printf("AES-NI/ARMv8 %s\n", hwTested ? "available" : "not available");
+    printf("%s\n", failed ? "AES: FAILED" : "AES: ok");
+}
+
+static void BenchCrypt()
+{
+    int dataSize = 10*1024*1024;
+    unsigned char *data = (unsigned char *)calloc(dataSize, 1);
+    BenchCryptSize(data, dataSize, "10MB");
+    BenchCryptSize(data, dataSize / 10, "1MB");
+    // repeat to see if timings change drastically
+    BenchCryptSize(data, dataSize, "10MB");
+    BenchCryptSize(data, dataSize / 10, "1MB");
+    free(data);
+}
+
+// returns the time needed for loading and rendering all pages of a PDF document
+// (or a negative value if the document couldn't be loaded)
+static double BenchLoadRenderPdf(const WCHAR *filePath)
+{
+    Timer t(true);
+    PdfEngine *engine = PdfEngine::CreateFromFile(filePath);
+    if (!engine)
+        return -1;
+    for (int pageNo = 1; pageNo <= engine->PageCount(); pageNo++) {
+        delete engine->RenderBitmap(pageNo, 1.0, 0);
+    }
+    delete engine;
+    return t.GetTimeInMs();
+}
+
+// compares loading and rendering of encrypted PDF documents against
+// the same documents without encryption (files are matched by name)
+static void BenchCryptDir(const WCHAR *encryptedDir, const WCHAR *decryptedDir)
+{
+    DirIter di;
+    if (!di.Start(encryptedDir)) {
+        wprintf(L"Error: invalid directory '%s'\n", encryptedDir);
+        return;
+    }
+
+    double totalEncrypted = 0, totalDecrypted = 0;
+    for (const WCHAR *path = di.Next(); path; path = di.Next()) {
+        if (!str::EndsWithI(path, L".pdf"))
+            continue;
+        ScopedMem<WCHAR> decryptedPath(path::Join(decryptedDir, path::GetBaseName(path)));
+        double durEncrypted = BenchLoadRenderPdf(path);
+        double durDecrypted = BenchLoadRenderPdf(decryptedPath);
+        if (durEncrypted < 0 || durDecrypted < 0) {
+            wprintf(L"Error: failed to load '%s' or '%s'\n", path, decryptedPath.Get());
+            continue;
+        }
+        wprintf(L"%s\nencrypted: %f ms\ndecrypted: %f ms\n", path::GetBaseName(path), durEncrypted, durDecrypted);
+        totalEncrypted += durEncrypted;
+        totalDecrypted += durDecrypted;
+    }
+    printf("total\nencrypted: %f ms\ndecrypted: %f ms\ndiff: %f\n", totalEncrypted, totalDecrypted, totalEncrypted - totalDecrypted);
+}
+
+// saves a PDF document after changing a single value in its Info dictionary
+// (the way e.g. filling in a form field would) and returns the time needed
+static double BenchPdfSaveAs(const char *filePath, const char *savePath, int garbage, int incremental)
+{
+    fz_context *ctx = fz_new_context(NULL, NULL, FZ_STORE_DEFAULT);
+    if (!ctx)
+        return -1;
+    pdf_document *doc = NULL;
+    double dur = -1;
+    fz_var(doc);
+    fz_try(ctx) {
+        doc = pdf_open_document(ctx, (char *)filePath);
+        pdf_obj *info = pdf_dict_gets(doc->trailer, "Info");
+        if (pdf_is_dict(info))
+            pdf_dict_puts_drop(info, "Producer", pdf_new_string(ctx, "Tester", 6));
+
+        fz_write_options opts = { 0 };
+        opts.do_garbage = garbage;
+        opts.do_incremental = incremental;
+        Timer t(true);
+        pdf_write_document(doc, (char *)savePath, &opts);
+        dur = t.GetTimeInMs();
+    }
+    fz_always(ctx) {
+        pdf_close_document(doc);
+    }
+    fz_catch(ctx) {
+        dur = -1;
+    }
+    fz_free_context(ctx);
+    return dur;
+}
+
+static void BenchPdfSave(const WCHAR *filePath)
+{
+    ScopedMem<char> pathA(str::conv::ToAnsi(filePath));
+    ScopedMem<WCHAR> savePath(str::Join(filePath, L".saved.pdf"));
+    ScopedMem<char> savePathA(str::conv::ToAnsi(savePath));
+
+    struct {
+        const char *desc;
+        int garbage, incremental;
+    } modes[] = {
+        { "full", 0, 0 }, { "garbage (-g)", 1, 0 }, { "garbage (-ggg)", 3, 0 }, { "incremental", 0, 1 }
+    };
+    for (size_t i = 0; i < dimof(modes); i++) {
+        double dur = BenchPdfSaveAs(pathA, savePathA, modes[i].garbage, modes[i].incremental);
+        if (dur < 0) {
+            printf("%s: failed to save\n", modes[i].desc);
+            continue;
+        }
+        printf("%s: %f ms, %d bytes\n", modes[i].desc, dur, (int)file::GetSize(savePath));
+    }
+    file::Delete(savePath);
+}
+
+// counts the memory allocated by fitz (FreeType's own allocations aren't included)
+static size_t gFzMemCurrent = 0, gFzMemPeak = 0;
+
+static void *FzCountMalloc(void *user, unsigned int size)
+{
+    size_t *p = (size_t *)malloc(size + sizeof(size_t));
+    if (!p)
+        return NULL;
+    *p = size;
+    gFzMemCurrent += size;
+    gFzMemPeak = max(gFzMemPeak, gFzMemCurrent);
+    return p + 1;
+}
+
+static void FzCountFree(void *user, void *ptr)
+{
+    if (!ptr)
+        return;
+    size_t *p = (size_t *)ptr - 1;
+    gFzMemCurrent -= *p;
+    free(p);
+}
+
+static void *FzCountRealloc(void *user, void *ptr, unsigned int size)
+{
+    if (!ptr)
+        return FzCountMalloc(user, size);
+    size_t *p = (size_t *)ptr - 1;
+    size_t oldSize = *p;
+    p = (size_t *)realloc(p, size + sizeof(size_t));
+    if (!p)
+        return NULL;
+    *p = size;
+    gFzMemCurrent += size - oldSize;
+    gFzMemPeak = max(gFzMemPeak, gFzMemCurrent);
+    return p + 1;
+}
+
+// loads all pages of a PDF document (which loads all the fonts used)
+// and returns the number of pages or -1 on failure
+static int BenchLoadPdfFonts(fz_context *ctx, const char *filePath)
+{
+    pdf_document *doc = NULL;
+    pdf_page *page = NULL;
+    fz_device *dev = NULL;
+    int pageCount = -1;
+    fz_var(doc);
+    fz_var(page);
+    fz_var(dev);
+    fz_try(ctx) {
+        doc = pdf_open_document(ctx, (char *)filePath);
+        pageCount = pdf_count_pages(doc);
+        for (int i = 0; i < pageCount; i++) {
+            page = pdf_load_page(doc, i);
+            fz_bbox bbox;
+            dev = fz_new_bbox_device(ctx, &bbox);
+            pdf_run_page(doc, page, dev, fz_identity, NULL);
+            fz_free_device(dev);
+            dev = NULL;
+            pdf_free_page(doc, page);
+            page = NULL;
+        }
+    }
+    fz_always(ctx) {
+        fz_free_device(dev);
+        if (page)
+            pdf_free_page(doc, page);
+        pdf_close_document(doc);
+    }
+    fz_catch(ctx) {
+        pageCount = -1;
+    }
+    return pageCount;
+}
+
+// loads all PDF documents in a directory one after another with a single
+// fitz context, so that identical embedded fonts can be shared between them
+static void BenchFontsDir(const WCHAR *dir, bool shareFonts)
+{
+    DirIter di;
+    if (!di.Start(dir)) {
+        wprintf(L"Error: invalid directory '%s'\n", dir);
+        return;
+    }
+
+    fz_alloc_context allocCount = { NULL, FzCountMalloc, FzCountRealloc, FzCountFree };
+    gFzMemCurrent = gFzMemPeak = 0;
+    fz_context *ctx = fz_new_context(&allocCount, NULL, FZ_STORE_DEFAULT);
+    if (!ctx)
+        return;
+    if (!shareFonts)
+        fz_set_shared_font_cache_size(ctx, -1);
+
+    int fileCount = 0, pageCount = 0;
+    Timer t(true);
+    for (const WCHAR *path = di.Next(); path; path = di.Next()) {
+        if (!str::EndsWithI(path, L".pdf"))
+            continue;
+        ScopedMem<char> pathA(str::conv::ToAnsi(path));
+        int pages = BenchLoadPdfFonts(ctx, pathA);
+        if (pages < 0) {
+            wprintf(L"Error: failed to load '%s'\n", path);
+            continue;
+        }
+        fileCount++;
+        pageCount += pages;
+    }
+    double dur = t.GetTimeInMs();
+
+    printf("%s fonts: %d files, %d pages\ntime: %f ms\npeak memory: %d kB\n",
+           shareFonts ? "shared" : "separate", fileCount, pageCount, dur, (int)(gFzMemPeak / 1024));
+    fz_free_context(ctx);
+}
+
+static void BenchFonts(const WCHAR *dir)
+{
+    BenchFontsDir(dir, false);
+    BenchFontsDir(dir, true);
+}
+
+// renders all pages at several zoom levels (e.g. for pages with mesh shadings,
+// where the amount of work depends on the zoom level). If refDir is given,
+// the pages are compared against the ones saved there by a previous run
+// (e.g. of an older build) or saved there, if they aren't there yet
+static void BenchRender(const WCHAR *filePath, const WCHAR *refDir)
+{
+    PdfEngine *engine = PdfEngine::CreateFromFile(filePath);
+    if (!engine) {
+        wprintf(L"Error: failed to load '%s'\n", filePath);
+        return;
+    }
+    if (refDir && !dir::Exists(refDir) && !dir::CreateAll(refDir)) {
+        wprintf(L"Error: failed to create '%s'\n", refDir);
+        refDir = NULL;
+    }
+    float zooms[] = { 0.25f, 0.5f, 1.0f, 2.0f, 4.0f };
+    for (size_t i = 0; i < dimof(zooms); i++) {
+        double ms = 0;
+        int maxDiff = 0, compared = 0, saved = 0;
+        size_t diffBytes = 0, totalBytes = 0;
+        for (int pageNo = 1; pageNo <= engine->PageCount(); pageNo++) {
+            Timer t(true);
+            RenderedBitmap *bmp = engine->RenderBitmap(pageNo, zooms[i], 0);
+            ms += t.GetTimeInMs();
+            if (!bmp || !refDir) {
+                delete bmp;
+                continue;
+            }
+            size_t len, refLen;
+            ScopedMem<unsigned char> data(SerializeBitmap(bmp->GetBitmap(), &len));
+            delete bmp;
+            ScopedMem<WCHAR> refName(str::Format(L"%s-%d-%d.bmp", path::GetBaseName(filePath), (int)(zooms[i] * 100), pageNo));
+            ScopedMem<WCHAR> refPath(path::Join(refDir, refName));
+            ScopedMem<unsigned char> ref((unsigned char *)file::ReadAll(refPath, &refLen));
+            if (!ref) {
+                if (data && file::WriteAll(refPath, data, len))
+                    saved++;
+                continue;
+            }
+            if (!data || len != refLen) {
+                wprintf(L"page %d: size differs from '%s'\n", pageNo, refPath.Get());
+                continue;
+            }
+            for (size_t j = 0; j < len; j++) {
+                int diff = abs((int)data[j] - (int)ref[j]);
+                maxDiff = max(maxDiff, diff);
+                if (diff > 8)
+                    diffBytes++;
+            }
+            totalBytes += len;
+            compared++;
+        }
+        printf("zoom %3d%%: %f ms", (int)(zooms[i] * 100), ms);
+        if (compared > 0)
+            printf(", %d pages compared: max. difference %d, %.3f%% of bytes differ by more than 8",
+                   compared, maxDiff, 100.0 * diffBytes / totalBytes);
+        if (saved > 0)
+            printf(", %d pages saved as reference", saved);
+        printf("\n");
+    }
+    delete engine;
+}
+
+struct DjVuRenderJob {
+    Vec<BaseEngine *>   engines;
+    // (engine index, page number) for all pages to render
+    Vec<PointI>         pages;
+    LONG                nextPage;
+};
+
+class DjVuRenderThread : public ThreadBase {
+    DjVuRenderJob *job;
+
+public:
+    DjVuRenderThread(DjVuRenderJob *job) : ThreadBase("DjVuRenderThread"), job(job) { }
+
+    virtual void Run() {
+        for (;;) {
+            LONG idx = InterlockedIncrement(&job->nextPage) - 1;
+            if ((size_t)idx >= job->pages.Count())
+                break;
+            PointI page = job->pages.At(idx);
+            delete job->engines.At(page.x)->RenderBitmap(page.y, 0.5f, 0);
+        }
+    }
+};
+
+// renders all pages of all DjVu documents in a directory, with all documents
+// open at once and an increasing number of threads rendering pages of both
+// the same and different documents concurrently
+static void BenchDjVu(const WCHAR *dir)
+{
+    DirIter di;
+    if (!di.Start(dir)) {
+        wprintf(L"Error: invalid directory '%s'\n", dir);
+        return;
+    }
+
+    DjVuRenderJob job;
+    for (const WCHAR *path = di.Next(); path; path = di.Next()) {
+        if (!DjVuEngine::IsSupportedFile(path))
+            continue;
+        DjVuEngine *engine = DjVuEngine::CreateFromFile(path);
+        if (!engine) {
+            wprintf(L"Error: failed to load '%s'\n", path);
+            continue;
+        }
+        for (int pageNo = 1; pageNo <= engine->PageCount(); pageNo++) {
+            job.pages.Append(PointI((int)job.engines.Count(), pageNo));
+        }
+        job.engines.Append(engine);
+    }
+    if (0 == job.pages.Count()) {
+        wprintf(L"Error: no DjVu pages found in '%s'\n", dir);
+        return;
+    }
+
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    int maxThreads = max((int)si.dwNumberOfProcessors, 1);
+    for (int threadCount = 1; threadCount <= maxThreads; threadCount *= 2) {
+        job.nextPage = 0;
+        Timer t(true);
+        Vec<DjVuRenderThread *> threads;
+        for (int i = 0; i < threadCount; i++) {
+            DjVuRenderThread *thread = new DjVuRenderThread(&job);
+            threads.Append(thread);
+            thread->Start();
+        }
+        for (size_t i = 0; i < threads.Count(); i++) {
+            // Run() doesn't check for cancellation, so this waits for it to finish
+            threads.At(i)->RequestCancelAndWaitToStop();
+            threads.At(i)->Release();
+        }
+        double ms = t.GetTimeInMs();
+        printf("%d threads: %d documents, %d pages in %f ms (%f ms per page)\n", threadCount,
+            (int)job.engines.Count(), (int)job.pages.Count(), ms, ms / job.pages.Count());
+    }
+
+    DeleteVecMembers(job.engines);
+}
+
+// scrolls through a DjVu document at fit width (for a 1200 px wide window),
+// rendering every page in two tiles (as the render cache does for large
+// pages) and as a thumbnail, so that all but the first rendering of a page
+// can reuse the already decoded page
+static void BenchDjVuScroll(const WCHAR *filePath)
+{
+    DjVuEngine *engine = DjVuEngine::CreateFromFile(filePath);
+    if (!engine) {
+        wprintf(L"Error: failed to load '%s'\n", filePath);
+        return;
+    }
+
+    double firstMs = 0, otherMs = 0;
+    Timer total(true);
+    for (int pageNo = 1; pageNo <= engine->PageCount(); pageNo++) {
+        RectD mediabox = engine->PageMediabox(pageNo);
+        float zoom = (float)(1200 / mediabox.dx);
+        RectD top(mediabox.x, mediabox.y, mediabox.dx, mediabox.dy / 2);
+        RectD bottom(mediabox.x, mediabox.y + top.dy, mediabox.dx, mediabox.dy - top.dy);
+
+        Timer t(true);
+        delete engine->RenderBitmap(pageNo, zoom, 0, &top);
+        firstMs += t.GetTimeInMs();
+        t.Start();
+        delete engine->RenderBitmap(pageNo, zoom, 0, &bottom);
+        delete engine->RenderBitmap(pageNo, (float)(200 / mediabox.dx), 0);
+        otherMs += t.GetTimeInMs();
+    }
+    int pageCount = engine->PageCount();
+    printf("scrolled through %d pages in %f ms\n", pageCount, total.GetTimeInMs());
+    printf("first tile: %f ms per page, second tile and thumbnail: %f ms per page\n",
+        firstMs / pageCount, otherMs / pageCount);
+
+    delete engine;
+}
+
+// measures how long it takes until the first page of a DjVu document has
+// been rendered and until the sizes of all pages are known (as needed for
+// the layout of all pages)
+static void BenchDjVuOpen(const WCHAR *filePath)
+{
+    Timer t(true);
+    DjVuEngine *engine = DjVuEngine::CreateFromFile(filePath);
+    if (!engine) {
+        wprintf(L"Error: failed to load '%s'\n", filePath);
+        return;
+    }
+    printf("opened document with %d pages after %f ms\n", engine->PageCount(), t.GetTimeInMs());
+    float zoom = (float)(1200 / engine->PageMediabox(1).dx);
+    delete engine->RenderBitmap(1, zoom, 0);
+    printf("rendered first page after %f ms\n", t.GetTimeInMs());
+    for (int pageNo = 1; pageNo <= engine->PageCount(); pageNo++) {
+        engine->PageMediabox(pageNo);
+    }
+    printf("determined all page sizes after %f ms\n", t.GetTimeInMs());
+    delete engine;
+}
+
+// inverse-search at a few points on every page, then forward-search
+// for every line of all source files found that way
+static void BenchSyncTex(const WCHAR *filePath)
+{
+    PdfEngine *engine = PdfEngine::CreateFromFile(filePath);
+    if (!engine) {
+        wprintf(L"Error: failed to load '%s'\n", filePath);
+        return;
+    }
+    Timer t(true);
+    Synchronizer *sync;
+    if (Synchronizer::Create(filePath, engine, &sync) != PDFSYNCERR_SUCCESS) {
+        wprintf(L"Error: no synchronization file found for '%s'\n", filePath);
+        delete engine;
+        return;
+    }
+    printf("created synchronizer in %f ms\n", t.GetTimeInMs());
+
+    WStrVec srcFiles;
+    Vec<UINT> lineCounts;
+    int searches = 0, found = 0;
+    for (int pageNo = 1; pageNo <= engine->PageCount(); pageNo++) {
+        RectD mediabox = engine->PageMediabox(pageNo);
+        for (int i = 1; i < 10; i++) {
+            PointI pt((int)(mediabox.x + mediabox.dx / 2), (int)(mediabox.y + mediabox.dy * i / 10));
+            ScopedMem<WCHAR> srcFile;
+            UINT line, col;
+            int err = sync->DocToSource(pageNo, pt, srcFile, &line, &col);
+            if (0 == searches++)
+                printf("first inverse-search after %f ms\n", t.GetTimeInMs());
+            if (err != PDFSYNCERR_SUCCESS)
+                continue;
+            found++;
+            int idx = srcFiles.Find(srcFile);
+            if (-1 == idx) {
+                srcFiles.Append(srcFile.StealData());
+                lineCounts.Append(line);
+            } else if (line > lineCounts.At(idx))
+                lineCounts.At(idx) = line;
+        }
+    }
+    double dur = t.GetTimeInMs();
+    printf("%d inverse-searches (%d successful) in %f ms\n", searches, found, dur);
+
+    searches = found = 0;
+    t.Start();
+    for (size_t i = 0; i < srcFiles.Count(); i++) {
+        for (UINT line = 1; line <= lineCounts.At(i); line++) {
+            UINT page;
+            Vec<RectI> rects;
+            if (sync->SourceToDoc(srcFiles.At(i), line, 0, &page, rects) == PDFSYNCERR_SUCCESS)
+                found++;
+            searches++;
+        }
+    }
+    dur = t.GetTimeInMs();
+    printf("%d forward-searches (%d successful) in %f ms (%f ms per search)\n", searches, found, dur, searches ? dur / searches : 0);
+
+    delete sync;
+    delete engine;
+}
+
+#define BENCH_PDFSYNC_FILES          10
+#define BENCH_PDFSYNC_COLUMNS        40
+#define BENCH_PDFSYNC_ROWS           50
+
+static void BenchPdfsyncSearches(Synchronizer *sync, PdfEngine *engine, UINT recordCount, UINT *lineCounts)
+{
+    int searches = 0, found = 0;
+    Timer t(true);
+    for (int pageNo = 1; pageNo <= engine->PageCount(); pageNo++) {
+        RectD mediabox = engine->PageMediabox(pageNo);
+        for (int i = 1; i < 10; i++) {
+            PointI pt((int)(mediabox.dx * i / 10), (int)(mediabox.dy * i / 10));
+            ScopedMem<WCHAR> srcFile;
+            UINT line, col;
+            int err = sync->DocToSource(pageNo, pt, srcFile, &line, &col);
+            if (0 == searches++)
+                printf("parsed %u records in %f ms\n", recordCount, t.GetTimeInMs());
+            if (PDFSYNCERR_SUCCESS == err)
+                found++;
+        }
+    }
+    double dur = t.GetTimeInMs();
+    printf("%d inverse-searches (%d successful) in %f ms\n", searches, found, dur);
+
+    searches = found = 0;
+    t.Start();
+    for (int fileNo = 0; fileNo < BENCH_PDFSYNC_FILES; fileNo++) {
+        ScopedMem<WCHAR> srcFile(str::Format(L"bench%d.tex", fileNo));
+        for (UINT line = 1; line <= lineCounts[fileNo]; line++) {
+            UINT page;
+            Vec<RectI> rects;
+            if (sync->SourceToDoc(srcFile, line, 0, &page, rects) == PDFSYNCERR_SUCCESS)
+                found++;
+            searches++;
+        }
+    }
+    dur = t.GetTimeInMs();
+    printf("%d forward-searches (%d successful) in %f ms (%f ms per search)\n", searches, found, dur, searches ? dur / searches : 0);
+}
+
+// writes a .pdfsync file with BENCH_PDFSYNC_COLUMNS * BENCH_PDFSYNC_ROWS records per page
+// (pages alternating between BENCH_PDFSYNC_FILES source files) for a temporary copy of
+// a PDF file, then measures parsing it, inverse-search at a few points on every page
+// and forward-search for every line of all source files
+static void BenchPdfsync(const WCHAR *filePath)
+{
+    PdfEngine *engine = PdfEngine::CreateFromFile(filePath);
+    if (!engine) {
+        wprintf(L"Error: failed to load '%s'\n", filePath);
+        return;
+    }
+    ScopedMem<WCHAR> tmpPath(path::GetTempPath(L"Syn"));
+    if (!tmpPath) {
+        delete engine;
+        return;
+    }
+    ScopedMem<WCHAR> pdfPath(str::Join(tmpPath, L".pdf"));
+    ScopedMem<WCHAR> syncPath(str::Join(tmpPath, L".pdfsync"));
+
+    str::Str<char> data;
+    data.Append("bench\nversion 1\n");
+    UINT record = 1;
+    UINT lineCounts[BENCH_PDFSYNC_FILES] = { 0 };
+    for (int pageNo = 1; pageNo <= engine->PageCount(); pageNo++) {
+        int fileNo = pageNo % BENCH_PDFSYNC_FILES;
+        RectD mediabox = engine->PageMediabox(pageNo);
+        data.AppendFmt("(bench%d.tex\ns %d\n", fileNo, pageNo);
+        for (int row = 0; row < BENCH_PDFSYNC_ROWS; row++) {
+            // one line per row with a record for every column
+            UINT line = ++lineCounts[fileNo];
+            for (int col = 0; col < BENCH_PDFSYNC_COLUMNS; col++, record++) {
+                data.AppendFmt("l %u %u\np %u %u %u\n", record, line, record,
+                               (UINT)(mediabox.dx * col / BENCH_PDFSYNC_COLUMNS * 65781.76),
+                               (UINT)(mediabox.dy * (row + 1) / (BENCH_PDFSYNC_ROWS + 1) * 65781.76));
+            }
+        }
+        data.Append(")\n");
+    }
+    Synchronizer *sync = NULL;
+    if (CopyFile(filePath, pdfPath, FALSE) && file::WriteAll(syncPath, data.Get(), data.Size()) &&
+        Synchronizer::Create(pdfPath, engine, &sync) == PDFSYNCERR_SUCCESS) {
+        BenchPdfsyncSearches(sync, engine, record - 1, lineCounts);
+    } else {
+        wprintf(L"Error: failed to create '%s'\n", syncPath);
+    }
+
+    delete sync;
+    delete engine;
+    file::Delete(syncPath);
+    file::Delete(pdfPath);
+    file::Delete(tmpPath);
+}
+
+#define BENCH_PREFS_FILE_COUNT       10000
+
+// saves and reloads preferences with a large file history and compares this
+// to decoding and encoding the same data as a tree of BencObjs
+static void BenchPrefs()
+{
+    FileHistory fileHistory;
+    for (int i = 0; i < BENCH_PREFS_FILE_COUNT; i++) {
+        DisplayState *ds = new DisplayState();
+        ds->filePath = str::Format(L"C:\\Documents\\Folder %d\\Document %d.pdf", i % 100, i);
+        ds->openCount = i % 50;
+        // pinned documents are never dropped from the history when saving
+        ds->isPinned = true;
+        ds->pageNo = i % 300 + 1;
+        ds->scrollPos = PointI(i % 17, i % 1000);
+        ds->windowPos = RectI(10, 10, 800, 600);
+        ds->tocState = new Vec<int>();
+        for (int j = 0; j < i % 64; j++) {
+            ds->tocState->Append(j * 3);
+        }
+        fileHistory.Append(ds);
+    }
+
+    // don't modify (or free) any of the global preferences' strings
+    SerializableGlobalPrefs prefs = gGlobalPrefs;
+    prefs.inverseSearchCmdLine = NULL;
+    prefs.versionToSkip = NULL;
+    prefs.lastUpdateTime = NULL;
+
+    ScopedMem<WCHAR> prefsPath(path::GetTempPath(L"Prf"));
+    if (!prefsPath)
+        return;
+    Favorites favs;
+    Timer t(true);
+    if (!Prefs::Save(prefsPath, prefs, fileHistory, &favs)) {
+        wprintf(L"Error: failed to save '%s'\n", prefsPath);
+        return;
+    }
+    printf("saving: %f ms (%d bytes)\n", t.GetTimeInMs(), (int)file::GetSize(prefsPath));
+
+    FileHistory loadedHistory;
+    Favorites *loadedFavs = NULL;
+    t.Start();
+    Prefs::Load(prefsPath, prefs, loadedHistory, &loadedFavs);
+    double ms = t.GetTimeInMs();
+    size_t count = 0;
+    for (; loadedHistory.Get(count); count++);
+    printf("loading: %f ms (%d documents)\n", ms, (int)count);
+
+    ScopedMem<char> data(file::ReadAll(prefsPath, NULL));
+    t.Start();
+    BencObj *obj = data ? BencObj::Decode(data) : NULL;
+    ms = t.GetTimeInMs();
+    t.Start();
+    ScopedMem<char> encoded(obj ? obj->Encode() : NULL);
+    printf("BencObj tree: decoding %f ms, encoding %f ms\n", ms, t.GetTimeInMs());
+
+    delete obj;
+    delete loadedFavs;
+    free(prefs.inverseSearchCmdLine);
+    free(prefs.versionToSkip);
+    free(prefs.lastUpdateTime);
+    file::Delete(prefsPath);
+}
+
+// as many thumbnails as are kept for a full file history
+#define BENCH_THUMBNAIL_COUNT        20
+
+// renders thumbnails for (up to BENCH_THUMBNAIL_COUNT) PDF documents
+// in a directory and compares the time it takes to load them all for the
+// start page from one PNG file per document vs. from the thumbnail cache
+static void BenchThumbnails(const WCHAR *dir)
+{
+    DirIter di;
+    if (!di.Start(dir)) {
+        wprintf(L"Error: invalid directory '%s'\n", dir);
+        return;
+    }
+
+    WStrVec filePaths;
+    Vec<RenderedBitmap *> thumbnails;
+    Timer t(true);
+    for (const WCHAR *path = di.Next(); path && filePaths.Count() < BENCH_THUMBNAIL_COUNT; path = di.Next()) {
+        if (!PdfEngine::IsSupportedFile(path))
+            continue;
+        PdfEngine *engine = PdfEngine::CreateFromFile(path);
+        RenderedBitmap *bmp = engine ? RenderThumbnail(engine) : NULL;
+        delete engine;
+        if (!bmp) {
+            wprintf(L"Error: failed to render '%s'\n", path);
+            continue;
+        }
+        filePaths.Append(str::Dup(path));
+        thumbnails.Append(bmp);
+    }
+    if (0 == thumbnails.Count()) {
+        wprintf(L"Error: no PDF files found in '%s'\n", dir);
+        return;
+    }
+    printf("rendered %d thumbnails in %f ms\n", (int)thumbnails.Count(), t.GetTimeInMs());
+
+    ScopedMem<WCHAR> tmpPath(path::GetTempPath(L"Thm"));
+    if (!tmpPath) {
+        DeleteVecMembers(thumbnails);
+        return;
+    }
+
+    WStrVec pngPaths;
+    for (size_t i = 0; i < thumbnails.Count(); i++) {
+        pngPaths.Append(str::Format(L"%s-%d.png", tmpPath, (int)i));
+        SaveRenderedBitmap(thumbnails.At(i), pngPaths.At(i));
+    }
+    t.Start();
+    for (size_t i = 0; i < pngPaths.Count(); i++) {
+        delete LoadRenderedBitmap(pngPaths.At(i));
+    }
+    printf("individual PNG files: %f ms\n", t.GetTimeInMs());
+
+    ScopedMem<WCHAR> cachePath(str::Join(tmpPath, L".dat"));
+    {
+        ThumbnailCache cache(cachePath);
+        for (size_t i = 0; i < thumbnails.Count(); i++) {
+            cache.Set(filePaths.At(i), thumbnails.At(i));
+        }
+        cache.Flush();
+    }
+    t.Start();
+    ThumbnailCache cache(cachePath);
+    for (size_t i = 0; i < filePaths.Count(); i++) {
+        delete cache.Get(filePaths.At(i));
+    }
+    printf("thumbnail cache:      %f ms (%d bytes)\n", t.GetTimeInMs(), (int)file::GetSize(cachePath));
+
+    for (size_t i = 0; i < pngPaths.Count(); i++) {
+        file::Delete(pngPaths.At(i));
+    }
+    file::Delete(cachePath);
+    file::Delete(tmpPath);
+    DeleteVecMembers(thumbnails);
+}
+
+// counts all heap allocations (only possible with the debug CRT)
+static long gAllocCount = 0;
+
+#ifdef _DEBUG
+static int CountAllocsHook(int allocType, void *userData, size_t size, int blockType,
+                           long requestNumber, const unsigned char *filename, int lineNumber)
+{
+    if (_HOOK_ALLOC == allocType || _HOOK_REALLOC == allocType)
+        gAllocCount++;
+    return TRUE;
+}
+#endif
+
+// times a benchmark step (and in debug builds counts its allocations)
+// and prints the results relative to the amount of work done, e.g.
+//   BenchStats stats; ...; stats.Print("step", mb, "MB");
+// prints the throughput in MB/s and the allocations per MB
+class BenchStats {
+    Timer t;
+    long allocCount;
+#ifdef _DEBUG
+    _CRT_ALLOC_HOOK prevHook;
+#endif
+
+public:
+    BenchStats() {
+#ifdef _DEBUG
+        prevHook = _CrtSetAllocHook(CountAllocsHook);
+#endif
+        Restart();
+    }
+    ~BenchStats() {
+#ifdef _DEBUG
+        _CrtSetAllocHook(prevHook);
+#endif
+    }
+
+    void Restart() {
+        allocCount = gAllocCount;
+        t.Start();
+    }
+
+    // prints the stats since the last (re)start
+    void Print(const char *desc, double units, const char *unitName) {
+        double ms = t.GetTimeInMs();
+        printf("%-26s %10.1f %s/s", desc, units * 1000 / ms, unitName);
+#ifdef _DEBUG
+        printf(", %8.2f allocations per %s", (gAllocCount - allocCount) / units, unitName);
+#endif
+        printf("\n");
+    }
+};
+
+#define BENCH_PARSERS_RECORDS        20000
+#define BENCH_PARSERS_ROUNDS         10
+
+class BenchBencVisitor : public benc::ValueVisitor {
+public:
+    size_t count;
+    BenchBencVisitor() : count(0) { }
+    virtual bool Visit(const char *path, const char *value, size_t len, BencType type) {
+        count++;
+        return true;
+    }
+};
+
+class BenchJsonVisitor : public json::ValueVisitor {
+public:
+    size_t count;
+    BenchJsonVisitor() : count(0) { }
+    virtual bool Visit(const char *path, const char *value, json::DataType type) {
+        count++;
+        return true;
+    }
+};
+
+// parses and encodes the same synthetic data (similar to a file history)
+// in bencoding and in JSON with all available parsers and encoders
+static void BenchParsers()
+{
+    str::Str<char> bencData, jsonData;
+    bencData.Append('l');
+    jsonData.Append('[');
+    for (int i = 0; i < BENCH_PARSERS_RECORDS; i++) {
+        ScopedMem<char> path(str::Format("C:\\Documents\\Folder %d\\Document %d.pdf", i % 100, i));
+        bencData.Append('d');
+        benc::AppendString(bencData, "Page");
+        benc::AppendInt(bencData, i % 500);
+        benc::AppendString(bencData, "Path");
+        benc::AppendString(bencData, path);
+        benc::AppendString(bencData, "Toc");
+        bencData.Append('l');
+        benc::AppendInt(bencData, 1);
+        benc::AppendInt(bencData, 5);
+        benc::AppendInt(bencData, 9);
+        bencData.Append('e');
+        benc::AppendString(bencData, "Zoom");
+        benc::AppendString(bencData, "fit page");
+        bencData.Append('e');
+
+        ScopedMem<char> jsonPath(str::Replace(path, "\\", "\\\\"));
+        jsonData.AppendFmt("%s{ \"Path\": \"%s\", \"Page\": %d, \"Toc\": [1, 5, 9], \"Zoom\": \"fit page\" }",
+                           i > 0 ? ",\n" : "", jsonPath.Get(), i % 500);
+    }
+    bencData.Append('e');
+    jsonData.Append(']');
+    printf("bencoded: %d bytes, JSON: %d bytes, %d rounds\n", (int)bencData.Size(), (int)jsonData.Size(), BENCH_PARSERS_ROUNDS);
+    double bencMb = BENCH_PARSERS_ROUNDS * bencData.Size() / (1024.0 * 1024.0);
+    double jsonMb = BENCH_PARSERS_ROUNDS * jsonData.Size() / (1024.0 * 1024.0);
+
+    BenchStats stats;
+    for (int i = 0; i < BENCH_PARSERS_ROUNDS; i++) {
+        delete BencObj::Decode(bencData.Get());
+    }
+    stats.Print("BencObj::Decode", bencMb, "MB");
+
+    BenchBencVisitor bencVisitor;
+    stats.Restart();
+    for (int i = 0; i < BENCH_PARSERS_ROUNDS; i++) {
+        benc::Parse(bencData.Get(), &bencVisitor);
+    }
+    stats.Print("benc::Parse", bencMb, "MB");
+
+    stats.Restart();
+    for (int i = 0; i < BENCH_PARSERS_ROUNDS; i++) {
+        PoolAllocator allocator;
+        allocator.SetMinBlockSize(256 * 1024);
+        benc::ParseTree(bencData.Get(), &allocator);
+    }
+    stats.Print("benc::ParseTree", bencMb, "MB");
+
+    BenchJsonVisitor jsonVisitor;
+    stats.Restart();
+    for (int i = 0; i < BENCH_PARSERS_ROUNDS; i++) {
+        json::Parse(jsonData.Get(), &jsonVisitor);
+    }
+    stats.Print("json::Parse", jsonMb, "MB");
+
+    BencObj *obj = BencObj::Decode(bencData.Get());
+    stats.Restart();
+    for (int i = 0; i < BENCH_PARSERS_ROUNDS; i++) {
+        free(obj->Encode());
+    }
+    stats.Print("BencObj::Encode", bencMb, "MB");
+
+    str::Str<char> bytes(bencData.Size());
+    stats.Restart();
+    for (int i = 0; i < BENCH_PARSERS_ROUNDS; i++) {
+        bytes.RemoveAt(0, bytes.Size());
+        obj->EncodeTo(bytes);
+    }
+    stats.Print("BencObj::EncodeTo (reused)", bencMb, "MB");
+    delete obj;
+}
+
+#define BENCH_DICT_KEYS              500000
+
+// returns the number of bytes allocated on the CRT heap
+static size_t GetHeapUsage()
+{
+    _HEAPINFO hinfo = { 0 };
+    size_t used = 0;
+    while (_HEAPOK == _heapwalk(&hinfo)) {
+        if (_USEDENTRY == hinfo._useflag)
+            used += hinfo._size;
+    }
+    return used;
+}
+
+// the previous implementation of dict::MapWStrToInt (a chained hash table
+// starting with 16k buckets, with entries and keys allocated from a
+// PoolAllocator), kept as the baseline for BenchDict
+class ChainedMapWStrToInt {
+    struct Entry {
+        const WCHAR *   key;
+        int             val;
+        Entry *         next;
+    };
+
+    PoolAllocator   allocator;
+    Entry **        entries;
+    size_t          nEntries;
+    size_t          nUsed;
+
+    static size_t Hash(const WCHAR *key) {
+        return murmur_hash2(key, str::Len(key) * sizeof(WCHAR));
+    }
+
+    void Resize() {
+        size_t newSize = roundToPowerOf2(nEntries + 1);
+        Entry **newEntries = AllocArray<Entry *>(newSize);
+        for (size_t i = 0; i < nEntries; i++) {
+            Entry *next;
+            for (Entry *e = entries[i]; e; e = next) {
+                next = e->next;
+                size_t pos = Hash(e->key) % newSize;
+                e->next = newEntries[pos];
+                newEntries[pos] = e;
+            }
+        }
+        free(entries);
+        entries = newEntries;
+        nEntries = newSize;
+    }
+
+public:
+    ChainedMapWStrToInt() : nEntries(16 * 1024), nUsed(0) {
+        allocator.SetAllocRounding(4);
+        entries = AllocArray<Entry *>(nEntries);
+    }
+    ~ChainedMapWStrToInt() { free(entries); }
+
+    bool Insert(const WCHAR *key, int val, int *prevValOut) {
+        size_t pos = Hash(key) % nEntries;
+        for (Entry *e = entries[pos]; e; e = e->next) {
+            if (str::Eq(key, e->key)) {
+                if (prevValOut)
+                    *prevValOut = e->val;
+                return false;
+            }
+        }
+        Entry *e = (Entry *)Allocator::AllocZero(&allocator, sizeof(Entry));
+        e->key = (const WCHAR *)Allocator::Dup(&allocator, (void *)key, (str::Len(key) + 1) * sizeof(WCHAR));
+        e->val = val;
+        e->next = entries[pos];
+        entries[pos] = e;
+        // when using collision chaining, the load factor can be 150%
+        if (++nUsed >= (nEntries * 3) / 2)
+            Resize();
+        return true;
+    }
+
+    bool Get(const WCHAR *key, int *valOut) {
+        for (Entry *e = entries[Hash(key) % nEntries]; e; e = e->next) {
+            if (str::Eq(key, e->key)) {
+                *valOut = e->val;
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+template <class Map>
+static void BenchDictMap(const char *name, WStrVec& keys, WStrVec& missingKeys)
+{
+    double mkeys = BENCH_DICT_KEYS / 1000000.0;
+    size_t heapUsage = GetHeapUsage();
+
+    Map *d = new Map();
+    BenchStats stats;
+    for (int i = 0; i < BENCH_DICT_KEYS; i++) {
+        d->Insert(keys.At(i), i, NULL);
+    }
+    stats.Print(ScopedMem<char>(str::Format("%s insert:", name)), mkeys, "M keys");
+
+    int val, found = 0;
+    stats.Restart();
+    for (int i = 0; i < BENCH_DICT_KEYS; i++) {
+        if (d->Get(keys.At(i), &val))
+            found++;
+    }
+    stats.Print(ScopedMem<char>(str::Format("%s hits:", name)), mkeys, "M keys");
+
+    stats.Restart();
+    for (int i = 0; i < BENCH_DICT_KEYS; i++) {
+        if (d->Get(missingKeys.At(i), &val))
+            found++;
+    }
+    stats.Print(ScopedMem<char>(str::Format("%s misses:", name)), mkeys, "M keys");
+
+    printf("%-26s %10d kB, %d of %d keys found\n", ScopedMem<char>(str::Format("%s memory:", name)).Get(),
+           (int)((GetHeapUsage() - heapUsage) / 1024), found, BENCH_DICT_KEYS);
+    delete d;
+}
+
+// inserts and looks up many short strings (similar to the measured words
+// of an ebook) in a dict growing from the default size, compared to the
+// previous chained hash table
+static void BenchDict()
+{
+    WStrVec keys, missingKeys;
+    for (int i = 0; i < BENCH_DICT_KEYS; i++) {
+        keys.Append(str::Format(L"word%dx%d", (i * 7919) % 100003, i));
+        // (almost) none of the keys shortened by a character is a key itself
+        missingKeys.Append(str::DupN(keys.Last(), str::Len(keys.Last()) - 1));
+    }
+
+    BenchDictMap<ChainedMapWStrToInt>("chained", keys, missingKeys);
+    BenchDictMap<dict::MapWStrToInt>("dict", keys, missingKeys);
+}
+
+// extracts the text of all pages of all PDF files in a directory
+// (as done for searching, copying and indexing)
+static void BenchExtractText(const WCHAR *dir)
+{
+    DirIter di;
+    if (!di.Start(dir)) {
+        wprintf(L"Error: invalid directory '%s'\n", dir);
+        return;
+    }
+
+    int fileCount = 0, pageCount = 0;
+    double total = 0;
+    for (const WCHAR *path = di.Next(); path; path = di.Next()) {
+        if (!str::EndsWithI(path, L".pdf"))
+            continue;
+        PdfEngine *engine = PdfEngine::CreateFromFile(path);
+        if (!engine) {
+            wprintf(L"Error: failed to load '%s'\n", path);
+            continue;
+        }
+        Timer t(true);
+        for (int pageNo = 1; pageNo <= engine->PageCount(); pageNo++) {
+            free(engine->ExtractPageText(pageNo, L"\n"));
+        }
+        double dur = t.GetTimeInMs();
+        wprintf(L"%s: %d pages in %f ms\n", path::GetBaseName(path), engine->PageCount(), dur);
+        fileCount++;
+        pageCount += engine->PageCount();
+        total += dur;
+        delete engine;
+    }
+    printf("total: %d files, %d pages in %f ms (%.1f pages/s)\n", fileCount, pageCount, total,
+           total > 0 ? pageCount * 1000 / total : 0);
+}
+
+// lays out all chapters of an EPUB document with an increasing number
+// of threads (up to the number of processors)
+static void BenchLayout(const WCHAR *filePath)
+{
+    Timer t(true);
+    EpubDoc *epubDoc = EpubDoc::CreateFromFile(filePath);
+    double loadMs = t.GetTimeInMs();
+    if (!epubDoc) {
+        wprintf(L"Error: failed to load '%s'\n", filePath);
+        return;
+    }
+    Doc doc(epubDoc);
+    PoolAllocator textAllocator;
+    HtmlFormatterArgs *args = CreateFormatterArgsDoc(doc, 640, 480, &textAllocator);
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    int maxThreads = (int)si.dwNumberOfProcessors;
+    printf("%d chapters loaded in %f ms, %d processors\n", (int)epubDoc->GetChapterCount(), loadMs, maxThreads);
+
+    // the first run also decompresses all chapters and fills the word
+    // measurement cache, so that all further runs are comparable
+    t.Start();
+    ChapterFormatter *formatter = new ChapterFormatter(doc, args);
+    delete formatter->Next();
+    printf("cold: first page after %f ms\n", t.GetTimeInMs());
+    Vec<HtmlPage *> *pages = formatter->FormatAllPages();
+    DeleteVecMembers(*pages);
+    delete pages;
+    delete formatter;
+
+    for (int threads = 1; ; threads = min(threads * 2, maxThreads)) {
+        t.Start();
+        ChapterFormatter formatter(doc, args, true, threads);
+        HtmlPage *pd = formatter.Next();
+        double firstPageMs = t.GetTimeInMs();
+        int pageCount = 0;
+        for (; pd; pd = formatter.Next()) {
+            pageCount++;
+            delete pd;
+        }
+        printf("%2d thread(s): %d pages in %f ms (first page after %f ms)\n", threads, pageCount, t.GetTimeInMs(), firstPageMs);
+        if (threads == maxThreads)
+            break;
+    }
+    delete args;
+    doc.Delete();
+}
+
+// measures how long it takes until the page count is known and the
+// last page can be shown, with and without the layout cache
+static void BenchReopen(const WCHAR *filePath)
+{
+    Doc doc = Doc::CreateFromFile(filePath);
+    if (!doc.IsEbook()) {
+        wprintf(L"Error: failed to load '%s'\n", filePath);
+        doc.Delete();
+        return;
+    }
+    PoolAllocator textAllocator;
+    HtmlFormatterArgs *args = CreateFormatterArgsDoc(doc, 640, 480, &textAllocator);
+
+    Timer t(true);
+    ChapterFormatter *formatter = new ChapterFormatter(doc, args);
+    Vec<HtmlPage *> *pages = formatter->FormatAllPages();
+    delete formatter;
+    printf("without cache: %d pages known after %f ms\n", (int)pages->Count(), t.GetTimeInMs());
+
+    t.Start();
+    bool ok = SaveLayoutCache(doc.GetFilePath(), args, pages);
+    printf("saving the layout %s after %f ms\n", ok ? "succeeded" : "failed", t.GetTimeInMs());
+    DeleteVecMembers(*pages);
+    delete pages;
+
+    t.Start();
+    Vec<HtmlPage *> *cached = LoadLayoutCache(doc.GetFilePath(), args);
+    double loadMs = t.GetTimeInMs();
+    if (cached) {
+        HtmlFormatterArgs lastPageArgs = *args;
+        lastPageArgs.reparseIdx = cached->Last()->reparseIdx;
+        lastPageArgs.reparseState = cached->Last();
+        ChapterFormatter lastPage(doc, &lastPageArgs, true, 1);
+        delete lastPage.Next();
+        printf("with cache: %d pages known after %f ms, last page after %f ms\n", (int)cached->Count(), loadMs, t.GetTimeInMs());
+        DeleteVecMembers(*cached);
+        delete cached;
+    } else {
+        printf("Error: failed to load the cached layout\n");
+    }
+
+    delete args;
+    doc.Delete();
+}
+
+static int FormatAllPagesForBench(Doc doc, HtmlFormatterArgs *args)
+{
+    ChapterFormatter formatter(doc, args);
+    Vec<HtmlPage *> *pages = formatter.FormatAllPages();
+    int pageCount = (int)pages->Count();
+    DeleteVecMembers(*pages);
+    delete pages;
+    return pageCount;
+}
+
+// simulates resizing the window: measures how long it takes until the page
+// count is known again, with and without reusing the measured words
+static void BenchResize(const WCHAR *filePath)
+{
+    Doc doc = Doc::CreateFromFile(filePath);
+    if (!doc.IsEbook()) {
+        wprintf(L"Error: failed to load '%s'\n", filePath);
+        doc.Delete();
+        return;
+    }
+    PoolAllocator textAllocator;
+    WordBoxCache *wordBoxes = new WordBoxCache();
+    HtmlFormatterArgs *args = CreateFormatterArgsDoc(doc, 640, 480, &textAllocator);
+
+    // the first run also fills the word measurement cache
+    Timer t(true);
+    args->wordBoxes = wordBoxes;
+    int pageCount = FormatAllPagesForBench(doc, args);
+    printf("640x480: %d pages after %f ms (cold)\n", pageCount, t.GetTimeInMs());
+
+    int sizes[][2] = { { 600, 480 }, { 720, 540 }, { 800, 600 }, { 1024, 768 }, { 560, 420 } };
+    for (size_t i = 0; i < dimof(sizes); i++) {
+        args->pageDx = (REAL)sizes[i][0];
+        args->pageDy = (REAL)sizes[i][1];
+        args->wordBoxes = NULL;
+        t.Start();
+        pageCount = FormatAllPagesForBench(doc, args);
+        double withoutMs = t.GetTimeInMs();
+        args->wordBoxes = wordBoxes;
+        t.Start();
+        FormatAllPagesForBench(doc, args);
+        printf("%dx%d: %d pages after %f ms (%f ms reusing measured words)\n", sizes[i][0], sizes[i][1], pageCount, withoutMs, t.GetTimeInMs());
+    }
+
+    delete args;
+    delete wordBoxes;
+    doc.Delete();
+}
+
+// measures the throughput of HtmlPullParser (including attribute parsing)
+static void BenchHtmlParse(const WCHAR *filePath)
+{
+    Doc doc = Doc::CreateFromFile(filePath);
+    ScopedMem<char> fileData;
+    const char *html;
+    size_t len;
+    if (doc.IsEbook()) {
+        // EPUB chapters are only decompressed when they're needed
+        EpubDoc *epubDoc = doc.AsEpub();
+        for (size_t i = 0; epubDoc && i < epubDoc->GetChapterCount(); i++) {
+            epubDoc->LoadChapterAt(epubDoc->GetChapterStart(i));
+        }
+        html = doc.GetHtmlData(len);
+    } else {
+        fileData.Set(file::ReadAll(filePath, &len));
+        html = fileData;
+    }
+    if (!html) {
+        wprintf(L"Error: failed to load '%s'\n", filePath);
+        doc.Delete();
+        return;
+    }
+
+    const int ITERATIONS = 20;
+    size_t tokenCount = 0, attrCount = 0;
+    Timer t(true);
+    for (int i = 0; i < ITERATIONS; i++) {
+        HtmlPullParser parser(html, len);
+        HtmlToken *tok;
+        while ((tok = parser.Next()) != NULL && !tok->IsError()) {
+            tokenCount++;
+            if (!tok->IsTag())
+                continue;
+            for (AttrInfo *attr = tok->NextAttr(); attr; attr = tok->NextAttr()) {
+                attrCount++;
+            }
+        }
+    }
+    double ms = t.GetTimeInMs();
+    printf("%d tokens and %d attributes in %d bytes: %f ms per pass, %f MB/s\n",
+        (int)(tokenCount / ITERATIONS), (int)(attrCount / ITERATIONS), (int)len,
+        ms / ITERATIONS, len * ITERATIONS / (ms * 1000.0));
+    doc.Delete();
+}
+
+// measures how long it takes to load (i.e. mostly decompress) a MOBI document
+static void BenchMobiOpen(const WCHAR *filePath)
+{
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    int threadCounts[] = { 1, (int)si.dwNumberOfProcessors };
+    size_t htmlLen[2] = { 0 };
+
+    const int ITERATIONS = 5;
+    for (int i = 0; i < 2; i++) {
+        double minMs = -1;
+        for (int j = 0; j < ITERATIONS; j++) {
+            Timer t(true);
+            MobiDoc *mobiDoc = MobiDoc::CreateFromFile(filePath, threadCounts[i]);
+            double ms = t.GetTimeInMs();
+            if (!mobiDoc) {
+                wprintf(L"Error: failed to load '%s'\n", filePath);
+                return;
+            }
+            htmlLen[i] = mobiDoc->GetBookHtmlSize();
+            delete mobiDoc;
+            if (minMs < 0 || ms < minMs)
+                minMs = ms;
+        }
+        printf("%d thread(s): %d bytes of html after %f ms\n", threadCounts[i], (int)htmlLen[i], minMs);
+    }
+    if (htmlLen[0] != htmlLen[1])
+        printf("Error: the html differs depending on the number of threads\n");
+}
+
+// measures opening a ZIP archive, looking up all files by name and
+// reading them one by one (as when flipping through the pages of a comic
+// book) vs. reading them all at once
+static void BenchZip(const WCHAR *filePath)
+{
+    Timer t(true);
+    ZipFile *zip = new ZipFile(filePath);
+    size_t count = zip->GetFileCount();
+    printf("opened archive with %d files after %f ms\n", (int)count, t.GetTimeInMs());
+    if (0 == count) {
+        wprintf(L"Error: failed to open '%s'\n", filePath);
+        delete zip;
+        return;
+    }
+
+    t.Start();
+    size_t found = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (zip->GetFileIndex(zip->GetFileName(i)) < count)
+            found++;
+    }
+    printf("looked up %d file names after %f ms\n", (int)found, t.GetTimeInMs());
+
+    size_t totalLen = 0;
+    double maxMs = 0;
+    t.Start();
+    for (size_t i = 0; i < count; i++) {
+        Timer tFile(true);
+        size_t len;
+        char *data = zip->GetFileData(i, &len);
+        maxMs = max(maxMs, tFile.GetTimeInMs());
+        if (data)
+            totalLen += len;
+        free(data);
+    }
+    double ms = t.GetTimeInMs();
+    printf("read %d bytes one by one after %f ms (%f ms per file, at most %f ms)\n",
+        (int)totalLen, ms, ms / count, maxMs);
+
+    ScopedMem<size_t> indices(AllocArray<size_t>(count));
+    ScopedMem<char *> data(AllocArray<char *>(count));
+    ScopedMem<size_t> lens(AllocArray<size_t>(count));
+    for (size_t i = 0; i < count; i++) {
+        indices[i] = i;
+    }
+    t.Start();
+    zip->GetFilesData(indices, count, data, lens);
+    ms = t.GetTimeInMs();
+    totalLen = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (data[i])
+            totalLen += lens[i];
+        free(data[i]);
+    }
+    printf("read %d bytes at once after %f ms\n", (int)totalLen, ms);
+
+    delete zip;
+}
+
+static int cmpDouble(const void *a, const void *b)
+{
+    double d = *(const double *)a - *(const double *)b;
+    return d < 0 ? -1 : d > 0 ? 1 : 0;
+}
+
+// flips through all pages of a comic book, once with time for decoding
+// the next pages in the background (as when reading) and once without
+static void BenchCbx(const WCHAR *filePath)
+{
+    const DWORD READING_TIME_MS = 200;
+    DWORD readingTimes[] = { READING_TIME_MS, 0 };
+    for (size_t i = 0; i < dimof(readingTimes); i++) {
+        CbxEngine *engine = CbxEngine::CreateFromFile(filePath);
+        if (!engine) {
+            wprintf(L"Error: failed to load '%s'\n", filePath);
+            return;
+        }
+        Vec<double> times;
+        for (int pageNo = 1; pageNo <= engine->PageCount(); pageNo++) {
+            Timer t(true);
+            engine->BenchLoadPage(pageNo);
+            times.Append(t.GetTimeInMs());
+            Sleep(readingTimes[i]);
+        }
+        delete engine;
+
+        times.Sort(cmpDouble);
+        size_t n = times.Count();
+        printf("%d pages with %d ms between flips: median %f ms, 90%% %f ms, 99%% %f ms, max %f ms\n",
+            (int)n, (int)readingTimes[i], times.At(n / 2), times.At(n * 9 / 10),
+            times.At(n * 99 / 100), times.Last());
+    }
+}
+
+// retrieves all html pages of a CHM document (as when collecting the html
+// for the ebook UI) one by one with CHMLib's default cache size and then
+// all at once with a larger cache on several threads
+static void BenchChm(const WCHAR *filePath)
+{
+    Timer t(true);
+    ChmDoc *doc = ChmDoc::CreateFromFile(filePath);
+    if (!doc) {
+        wprintf(L"Error: failed to open '%s'\n", filePath);
+        return;
+    }
+    printf("opened document after %f ms\n", t.GetTimeInMs());
+
+    Vec<char *> paths;
+    Vec<char *> *allPaths = doc->GetAllPaths();
+    for (size_t i = 0; i < allPaths->Count(); i++) {
+        char *path = allPaths->At(i);
+        if (str::EndsWithI(path, ".htm") || str::EndsWithI(path, ".html"))
+            paths.Append(str::Dup(path));
+    }
+    FreeVecMembers(*allPaths);
+    delete allPaths;
+    size_t count = paths.Count();
+
+    int cacheBlocks[] = { 5, 64 };
+    for (size_t i = 0; i < dimof(cacheBlocks); i++) {
+        doc->SetCacheBlocks(cacheBlocks[i]);
+        size_t totalLen = 0;
+        t.Start();
+        for (size_t j = 0; j < count; j++) {
+            size_t len;
+            unsigned char *data = doc->GetData(paths.At(j), &len);
+            if (data)
+                totalLen += len;
+            free(data);
+        }
+        printf("read %d pages (%d bytes) one by one with %d cached blocks after %f ms\n",
+            (int)count, (int)totalLen, cacheBlocks[i], t.GetTimeInMs());
+    }
+
+    ScopedMem<unsigned char *> data(AllocArray<unsigned char *>(count));
+    ScopedMem<size_t> lens(AllocArray<size_t>(count));
+    t.Start();
+    doc->GetDataBatch((const char **)paths.LendData(), count, data, lens);
+    double ms = t.GetTimeInMs();
+    size_t totalLen = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (data[i])
+            totalLen += lens[i];
+        free(data[i]);
+    }
+    printf("read %d pages (%d bytes) at once after %f ms\n", (int)count, (int)totalLen, ms);
+
+    FreeVecMembers(paths);
+    delete doc;
+}
+
 static void MobiSaveHtml(const WCHAR *filePathBase, MobiDoc *mb)
 {
     CrashAlwaysIf(!gSaveHtml);
@@ -293,6 +1814,118 @@ int TesterMain()
         } else if (str::Eq(argv[i], L"-bench-md5")) {
             BenchMD5();
             ++i;
+        } else if (str::Eq(argv[i], L"-test-crypt")) {
+            TestCrypt();
+            ++i;
+        } else if (str::Eq(argv[i], L"-bench-crypt")) {
+            BenchCrypt();
+            ++i;
+        } else if (str::Eq(argv[i], L"-bench-crypt-dir")) {
+            if (i + 2 >= argv.Count())
+                return Usage();
+            BenchCryptDir(argv[i + 1], argv[i + 2]);
+            i += 3;
+        } else if (str::Eq(argv[i], L"-bench-pdf-save")) {
+            if (i + 1 >= argv.Count())
+                return Usage();
+            BenchPdfSave(argv[i + 1]);
+            i += 2;
+        } else if (str::Eq(argv[i], L"-bench-fonts")) {
+            if (i + 1 >= argv.Count())
+                return Usage();
+            BenchFonts(argv[i + 1]);
+            i += 2;
+        } else if (str::Eq(argv[i], L"-bench-render")) {
+            if (i + 1 >= argv.Count())
+                return Usage();
+            // the reference directory is optional
+            const WCHAR *refDir = i + 2 < argv.Count() && *argv[i + 2] != L'-' ? argv[i + 2] : NULL;
+            BenchRender(argv[i + 1], refDir);
+            i += refDir ? 3 : 2;
+        } else if (str::Eq(argv[i], L"-bench-text")) {
+            if (i + 1 >= argv.Count())
+                return Usage();
+            BenchExtractText(argv[i + 1]);
+            i += 2;
+        } else if (str::Eq(argv[i], L"-bench-layout")) {
+            if (i + 1 >= argv.Count())
+                return Usage();
+            BenchLayout(argv[i + 1]);
+            i += 2;
+        } else if (str::Eq(argv[i], L"-bench-reopen")) {
+            if (i + 1 >= argv.Count())
+                return Usage();
+            BenchReopen(argv[i + 1]);
+            i += 2;
+        } else if (str::Eq(argv[i], L"-bench-resize")) {
+            if (i + 1 >= argv.Count())
+                return Usage();
+            BenchResize(argv[i + 1]);
+            i += 2;
+        } else if (str::Eq(argv[i], L"-bench-html-parse")) {
+            if (i + 1 >= argv.Count())
+                return Usage();
+            BenchHtmlParse(argv[i + 1]);
+            i += 2;
+        } else if (str::Eq(argv[i], L"-bench-mobi-open")) {
+            if (i + 1 >= argv.Count())
+                return Usage();
+            BenchMobiOpen(argv[i + 1]);
+            i += 2;
+        } else if (str::Eq(argv[i], L"-bench-zip")) {
+            if (i + 1 >= argv.Count())
+                return Usage();
+            BenchZip(argv[i + 1]);
+            i += 2;
+        } else if (str::Eq(argv[i], L"-bench-cbx")) {
+            if (i + 1 >= argv.Count())
+                return Usage();
+            BenchCbx(argv[i + 1]);
+            i += 2;
+        } else if (str::Eq(argv[i], L"-bench-chm")) {
+            if (i + 1 >= argv.Count())
+                return Usage();
+            BenchChm(argv[i + 1]);
+            i += 2;
+        } else if (str::Eq(argv[i], L"-bench-djvu")) {
+            if (i + 1 >= argv.Count())
+                return Usage();
+            BenchDjVu(argv[i + 1]);
+            i += 2;
+        } else if (str::Eq(argv[i], L"-bench-djvu-scroll")) {
+            if (i + 1 >= argv.Count())
+                return Usage();
+            BenchDjVuScroll(argv[i + 1]);
+            i += 2;
+        } else if (str::Eq(argv[i], L"-bench-djvu-open")) {
+            if (i + 1 >= argv.Count())
+                return Usage();
+            BenchDjVuOpen(argv[i + 1]);
+            i += 2;
+        } else if (str::Eq(argv[i], L"-bench-synctex")) {
+            if (i + 1 >= argv.Count())
+                return Usage();
+            BenchSyncTex(argv[i + 1]);
+            i += 2;
+        } else if (str::Eq(argv[i], L"-bench-pdfsync")) {
+            if (i + 1 >= argv.Count())
+                return Usage();
+            BenchPdfsync(argv[i + 1]);
+            i += 2;
+        } else if (str::Eq(argv[i], L"-bench-prefs")) {
+            BenchPrefs();
+            ++i;
+        } else if (str::Eq(argv[i], L"-bench-thumbnails")) {
+            if (i + 1 >= argv.Count())
+                return Usage();
+            BenchThumbnails(argv[i + 1]);
+            i += 2;
+        } else if (str::Eq(argv[i], L"-bench-parsers")) {
+            BenchParsers();
+            ++i;
+        } else if (str::Eq(argv[i], L"-bench-dict")) {
+            BenchDict();
+            ++i;
         } else {
             // unknown argument
             return Usage();
@@ -0,0 +1,347 @@
+/* Copyright 2012 the SumatraPDF project authors (see AUTHORS file).
+   License: GPLv3 */
+
+#include "BaseUtil.h"
+#include "ThumbnailCache.h"
+#include <zlib.h>
+
+#include "AppTools.h"
+#include "BaseEngine.h"
+#include "ByteReader.h"
+#include "FileUtil.h"
+#include "PdfEngine.h"
+#include "SumatraAbout.h"
+
+/* The cache file consists of little-endian DWORDs:
+   header:  "STC" magic, THUMBNAIL_CACHE_VERSION, number of thumbnails
+   entries: MD5 digest of the document's path (16 bytes), document size and
+            modification time, thumbnail dx/dy and the size of the data that
+            follows: the zlib compressed 24-bit pixels (bottom-up DIB rows) */
+
+#define THUMBNAIL_CACHE_MAGIC       "STC"
+// must be increased whenever the file format changes
+#define THUMBNAIL_CACHE_VERSION     1
+#define THUMBNAIL_CACHE_FILE_NAME   L"thumbnails.dat"
+
+#define THUMBNAIL_HEADER_SIZE       12
+#define THUMBNAIL_ENTRY_SIZE        40
+// guards against allocating arbitrarily large bitmaps for broken cache files
+#define THUMBNAIL_MAX_SIZE          (4 * THUMBNAIL_DX)
+
+struct ThumbnailEntry {
+    unsigned char digest[16];
+    uint32_t fileSize;
+    FILETIME modTime;
+    SizeI size;
+    char *data;
+    size_t len;
+
+    ThumbnailEntry() : fileSize(0), data(NULL), len(0) {
+        ZeroMemory(digest, sizeof(digest));
+        ZeroMemory(&modTime, sizeof(modTime));
+    }
+    ~ThumbnailEntry() { free(data); }
+};
+
+// returns false if the document has changed since the thumbnail was added
+static bool IsEntryUpToDate(ThumbnailEntry *entry, const WCHAR *filePath)
+{
+    size_t fileSize = file::GetSize(filePath);
+    FILETIME modTime = file::GetModificationTime(filePath);
+    return entry->fileSize == (uint32_t)fileSize &&
+           CompareFileTime(&entry->modTime, &modTime) == 0;
+}
+
+static void AppendDWord(str::Str<char>& data, uint32_t value)
+{
+    // all supported platforms are little-endian
+    data.Append((char *)&value, sizeof(value));
+}
+
+// create a fingerprint of a (normalized) path, ignoring the drive letter
+// if it might change (this is also used by the layout cache)
+static void CalcPathDigest(const WCHAR *filePath, unsigned char digest[16])
+{
+    ScopedMem<char> pathU(str::conv::ToUtf8(filePath));
+    if (path::HasVariableDriveLetter(filePath))
+        pathU[0] = '?';
+    CalcMD5Digest((unsigned char *)pathU.Get(), str::Len(pathU), digest);
+}
+
+static size_t GetDIBStride(int dx)
+{
+    return ((dx * 3 + 3) / 4) * 4;
+}
+
+static void InitDIBHeader(BITMAPINFO& bmi, SizeI size)
+{
+    ZeroMemory(&bmi, sizeof(bmi));
+    bmi.bmiHeader.biSize = sizeof(bmi.bmiHeader);
+    bmi.bmiHeader.biWidth = size.dx;
+    bmi.bmiHeader.biHeight = size.dy;
+    bmi.bmiHeader.biPlanes = 1;
+    bmi.bmiHeader.biBitCount = 24;
+    bmi.bmiHeader.biCompression = BI_RGB;
+}
+
+static char *CompressBitmap(RenderedBitmap *bmp, size_t *lenOut)
+{
+    SizeI size = bmp->Size();
+    BITMAPINFO bmi;
+    InitDIBHeader(bmi, size);
+    uLong bitsLen = (uLong)(GetDIBStride(size.dx) * size.dy);
+    ScopedMem<unsigned char> bits(AllocArray<unsigned char>(bitsLen));
+    if (!bits)
+        return NULL;
+
+    HDC hdc = GetDC(NULL);
+    int lines = GetDIBits(hdc, bmp->GetBitmap(), 0, size.dy, bits, &bmi, DIB_RGB_COLORS);
+    ReleaseDC(NULL, hdc);
+    if (lines != size.dy)
+        return NULL;
+
+    uLongf len = compressBound(bitsLen);
+    char *data = AllocArray<char>(len);
+    if (!data)
+        return NULL;
+    if (compress2((Bytef *)data, &len, bits, bitsLen, Z_BEST_SPEED) != Z_OK) {
+        free(data);
+        return NULL;
+    }
+    *lenOut = len;
+    return data;
+}
+
+static RenderedBitmap *DecompressBitmap(ThumbnailEntry *entry)
+{
+    BITMAPINFO bmi;
+    InitDIBHeader(bmi, entry->size);
+    void *bits = NULL;
+    HBITMAP hbmp = CreateDIBSection(NULL, &bmi, DIB_RGB_COLORS, &bits, NULL, 0);
+    if (!hbmp)
+        return NULL;
+
+    uLongf bitsLen = (uLongf)(GetDIBStride(entry->size.dx) * entry->size.dy);
+    uLongf len = bitsLen;
+    int res = uncompress((Bytef *)bits, &len, (Bytef *)entry->data, (uLong)entry->len);
+    if (res != Z_OK || len != bitsLen) {
+        DeleteObject(hbmp);
+        return NULL;
+    }
+    return new RenderedBitmap(hbmp, entry->size);
+}
+
+ThumbnailCache::ThumbnailCache(const WCHAR *cachePath) :
+    cachePath(str::Dup(cachePath)), loaded(false), modified(false)
+{
+}
+
+ThumbnailCache::~ThumbnailCache()
+{
+    DeleteVecMembers(entries);
+}
+
+void ThumbnailCache::Load()
+{
+    if (loaded)
+        return;
+    loaded = true;
+
+    if (!cachePath) {
+        ScopedMem<WCHAR> cacheDir(AppGenDataFilename(THUMBNAILS_DIR_NAME));
+        if (!cacheDir)
+            return;
+        cachePath.Set(path::Join(cacheDir, THUMBNAIL_CACHE_FILE_NAME));
+    }
+
+    // all thumbnails are read at once (they're all needed for the start page)
+    size_t len;
+    ScopedMem<char> data(file::ReadAll(cachePath, &len));
+    if (!data || len < THUMBNAIL_HEADER_SIZE || memcmp(data, THUMBNAIL_CACHE_MAGIC, 4) != 0)
+        return;
+    ByteReader r(data, len);
+    if (r.DWordLE(4) != THUMBNAIL_CACHE_VERSION)
+        return;
+
+    uint32_t count = r.DWordLE(8);
+    size_t off = THUMBNAIL_HEADER_SIZE;
+    for (uint32_t i = 0; i < count && off + THUMBNAIL_ENTRY_SIZE <= len; i++) {
+        ThumbnailEntry *entry = new ThumbnailEntry();
+        memcpy(entry->digest, data + off, 16);
+        entry->fileSize = r.DWordLE(off + 16);
+        entry->modTime.dwLowDateTime = r.DWordLE(off + 20);
+        entry->modTime.dwHighDateTime = r.DWordLE(off + 24);
+        entry->size.dx = (int)r.DWordLE(off + 28);
+        entry->size.dy = (int)r.DWordLE(off + 32);
+        entry->len = r.DWordLE(off + 36);
+        off += THUMBNAIL_ENTRY_SIZE;
+        if (entry->size.dx <= 0 || entry->size.dx > THUMBNAIL_MAX_SIZE ||
+            entry->size.dy <= 0 || entry->size.dy > THUMBNAIL_MAX_SIZE ||
+            entry->len > len - off) {
+            delete entry;
+            break;
+        }
+        entry->data = (char *)memdup(data + off, entry->len);
+        off += entry->len;
+        if (!entry->data) {
+            delete entry;
+            break;
+        }
+        entries.Append(entry);
+    }
+}
+
+bool ThumbnailCache::Save()
+{
+    if (!cachePath)
+        return false;
+
+    str::Str<char> data;
+    data.Append(THUMBNAIL_CACHE_MAGIC, 4);
+    AppendDWord(data, THUMBNAIL_CACHE_VERSION);
+    AppendDWord(data, (uint32_t)entries.Count());
+    for (size_t i = 0; i < entries.Count(); i++) {
+        ThumbnailEntry *entry = entries.At(i);
+        data.Append((char *)entry->digest, sizeof(entry->digest));
+        AppendDWord(data, entry->fileSize);
+        AppendDWord(data, entry->modTime.dwLowDateTime);
+        AppendDWord(data, entry->modTime.dwHighDateTime);
+        AppendDWord(data, (uint32_t)entry->size.dx);
+        AppendDWord(data, (uint32_t)entry->size.dy);
+        AppendDWord(data, (uint32_t)entry->len);
+        data.Append(entry->data, entry->len);
+    }
+
+    ScopedMem<WCHAR> cacheDir(path::GetDir(cachePath));
+    if (!dir::Create(cacheDir))
+        return false;
+    return file::WriteAll(cachePath, data.Get(), data.Size());
+}
+
+int ThumbnailCache::Find(const WCHAR *filePath)
+{
+    Load();
+    unsigned char digest[16];
+    CalcPathDigest(filePath, digest);
+    // there are never more than a few dozen thumbnails
+    for (size_t i = 0; i < entries.Count(); i++) {
+        if (memeq(entries.At(i)->digest, digest, sizeof(digest)))
+            return (int)i;
+    }
+    return -1;
+}
+
+size_t ThumbnailCache::Count()
+{
+    Load();
+    return entries.Count();
+}
+
+RenderedBitmap *ThumbnailCache::Get(const WCHAR *filePath)
+{
+    int idx = Find(filePath);
+    // outdated thumbnails are treated as missing, so that they're re-rendered
+    if (-1 == idx || !IsEntryUpToDate(entries.At(idx), filePath))
+        return NULL;
+    return DecompressBitmap(entries.At(idx));
+}
+
+bool ThumbnailCache::IsUpToDate(const WCHAR *filePath)
+{
+    int idx = Find(filePath);
+    if (-1 == idx)
+        return false;
+    return IsEntryUpToDate(entries.At(idx), filePath);
+}
+
+bool ThumbnailCache::Set(const WCHAR *filePath, RenderedBitmap *bmp)
+{
+    size_t fileSize = file::GetSize(filePath);
+    if (INVALID_FILE_SIZE == fileSize)
+        return false;
+    size_t len;
+    char *data = CompressBitmap(bmp, &len);
+    if (!data)
+        return false;
+
+    ThumbnailEntry *entry;
+    int idx = Find(filePath);
+    if (idx != -1) {
+        entry = entries.At(idx);
+        free(entry->data);
+    }
+    else {
+        entry = new ThumbnailEntry();
+        CalcPathDigest(filePath, entry->digest);
+        entries.Append(entry);
+    }
+    entry->fileSize = (uint32_t)fileSize;
+    entry->modTime = file::GetModificationTime(filePath);
+    entry->size = bmp->Size();
+    entry->data = data;
+    entry->len = len;
+    modified = true;
+
+    return true;
+}
+
+void ThumbnailCache::Remove(const WCHAR *filePath)
+{
+    int idx = Find(filePath);
+    if (-1 == idx)
+        return;
+    delete entries.At(idx);
+    entries.RemoveAt(idx);
+    modified = true;
+}
+
+void ThumbnailCache::RemoveAllExcept(WStrVec& filePaths)
+{
+    Load();
+    Vec<ThumbnailEntry *> keep;
+    for (size_t i = 0; i < filePaths.Count(); i++) {
+        int idx = Find(filePaths.At(i));
+        if (idx != -1) {
+            keep.Append(entries.At(idx));
+            entries.RemoveAt(idx);
+        }
+    }
+    bool changed = entries.Count() > 0;
+    DeleteVecMembers(entries);
+    entries.Append(keep.LendData(), keep.Count());
+    if (changed)
+        modified = true;
+}
+
+bool ThumbnailCache::Flush()
+{
+    if (!modified)
+        return true;
+    if (!Save())
+        return false;
+    modified = false;
+    return true;
+}
+
+bool GetThumbnailRect(BaseEngine *engine, float *zoom, RectD *pageRect)
+{
+    RectD rect = engine->PageMediabox(1);
+    if (rect.IsEmpty())
+        return false;
+
+    rect = engine->Transform(rect, 1, 1.0f, 0);
+    *zoom = THUMBNAIL_DX / (float)rect.dx;
+    if (rect.dy > (float)THUMBNAIL_DY / *zoom)
+        rect.dy = (float)THUMBNAIL_DY / *zoom;
+    *pageRect = engine->Transform(rect, 1, 1.0f, 0, true);
+    return true;
+}
+
+RenderedBitmap *RenderThumbnail(BaseEngine *engine)
+{
+    float zoom;
+    RectD pageRect;
+    if (!GetThumbnailRect(engine, &zoom, &pageRect))
+        return NULL;
+    return engine->RenderBitmap(1, zoom, 0, &pageRect);
+}
@@ -0,0 +1,56 @@
+/* Copyright 2012 the SumatraPDF project authors (see AUTHORS file).
+   License: GPLv3 */
+
+#ifndef ThumbnailCache_h
+#define ThumbnailCache_h
+
+class BaseEngine;
+class RenderedBitmap;
+struct ThumbnailEntry;
+
+// The thumbnail cache keeps the thumbnails of all documents on the start page
+// in a single file, so that displaying the start page takes a single read
+// instead of loading (and decoding through GDI+) one image file per document.
+//
+// Thumbnails are keyed by the same path fingerprint as the layout cache and
+// also record the document's size and modification time, so that thumbnails
+// of modified documents can be recognized as outdated.
+
+class ThumbnailCache {
+    ScopedMem<WCHAR>        cachePath;
+    Vec<ThumbnailEntry *>   entries;
+    bool                    loaded;
+    // true if entries have changed since they were last saved
+    bool                    modified;
+
+    void Load();
+    bool Save();
+    int  Find(const WCHAR *filePath);
+
+public:
+    // cachePath defaults to a file in the application's cache directory
+    explicit ThumbnailCache(const WCHAR *cachePath=NULL);
+    ~ThumbnailCache();
+
+    size_t Count();
+    // returns NULL if there's no thumbnail for this document or if the
+    // document has changed since its thumbnail was added
+    RenderedBitmap *Get(const WCHAR *filePath);
+    // returns false if the document has changed since its thumbnail was added
+    bool IsUpToDate(const WCHAR *filePath);
+    // adds/replaces/removes a thumbnail (call Flush to persist the changes,
+    // as every save rewrites the whole cache file)
+    bool Set(const WCHAR *filePath, RenderedBitmap *bmp);
+    void Remove(const WCHAR *filePath);
+    void RemoveAllExcept(WStrVec& filePaths);
+    // saves the cache file, if it has been modified
+    bool Flush();
+};
+
+// determines the zoom and the part of the first page to render
+// for a thumbnail of THUMBNAIL_DX x THUMBNAIL_DY pixels
+bool GetThumbnailRect(BaseEngine *engine, float *zoom, RectD *pageRect);
+// renders a thumbnail synchronously (e.g. on a background thread)
+RenderedBitmap *RenderThumbnail(BaseEngine *engine);
+
+#endif
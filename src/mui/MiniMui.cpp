@@ -8,6 +8,26 @@
 
 namespace mui {
 
+class MuiCritSec {
+public:
+    CRITICAL_SECTION cs;
+
+    MuiCritSec() { InitializeCriticalSection(&cs); }
+    ~MuiCritSec() { DeleteCriticalSection(&cs); }
+};
+
+static MuiCritSec gMuiCs;
+
+void EnterMuiCriticalSection()
+{
+    EnterCriticalSection(&gMuiCs.cs);
+}
+
+void LeaveMuiCriticalSection()
+{
+    LeaveCriticalSection(&gMuiCs.cs);
+}
+
 class FontCache {
     struct Entry{
         WCHAR *     name;
@@ -22,17 +42,20 @@ class FontCache {
 
     ScopedGdiPlus scope;
     Vec<Entry> cache;
+    CRITICAL_SECTION cs;
 
 public:
-    FontCache() { }
+    FontCache() { InitializeCriticalSection(&cs); }
     ~FontCache() {
         for (Entry *e = cache.IterStart(); e; e = cache.IterNext()) {
             free(e->name);
             ::delete e->font;
         }
+        DeleteCriticalSection(&cs);
     }
 
     Font *GetFont(const WCHAR *name, float size, FontStyle style) {
+        ScopedCritSec scopeCs(&cs);
         Entry f = { (WCHAR *)name, size, style, NULL };
         for (Entry *e = cache.IterStart(); e; e = cache.IterNext()) {
             if (f == *e)
@@ -62,6 +85,7 @@ Font *GetCachedFont(const WCHAR *name, float size, FontStyle style)
     return gFontCache.GetFont(name, size, style);
 }
 
+// cf. EbookEngine::RenderPage
 static void InitGraphicsMode(Graphics *g)
 {
     g->SetCompositingQuality(CompositingQualityHighQuality);
@@ -76,23 +100,68 @@ class GlobalGraphicsHack {
     Bitmap bmp;
 public:
     Graphics gfx;
+    DWORD threadId;
 
-    GlobalGraphicsHack() : bmp(1, 1, PixelFormat32bppARGB), gfx(&bmp) {
-        // cf. EbookEngine::RenderPage
-        gfx.SetCompositingQuality(CompositingQualityHighQuality);
-        gfx.SetSmoothingMode(SmoothingModeAntiAlias);
-        gfx.SetTextRenderingHint(TextRenderingHintClearTypeGridFit);
-        gfx.SetPageUnit(UnitPixel);
+    GlobalGraphicsHack() : bmp(1, 1, PixelFormat32bppARGB), gfx(&bmp), threadId(GetCurrentThreadId()) {
+        InitGraphicsMode(&gfx);
     }
 };
 
 static GlobalGraphicsHack gGH;
 
+// Graphics objects cannot be used across threads, so
+// other threads (e.g. for formatting chapters) get their own
+class ThreadGraphicsCache {
+    struct Entry {
+        Bitmap *    bmp;
+        Graphics *  gfx;
+    };
+
+    Vec<Entry> entries;
+    CRITICAL_SECTION cs;
+
+public:
+    ThreadGraphicsCache() { InitializeCriticalSection(&cs); }
+    ~ThreadGraphicsCache() { DeleteCriticalSection(&cs); }
+
+    Graphics *Alloc() {
+        Entry e;
+        e.bmp = ::new Bitmap(1, 1, PixelFormat32bppARGB);
+        e.gfx = ::new Graphics((Image *)e.bmp);
+        InitGraphicsMode(e.gfx);
+        ScopedCritSec scope(&cs);
+        entries.Append(e);
+        return e.gfx;
+    }
+
+    void Free(Graphics *g) {
+        ScopedCritSec scope(&cs);
+        for (size_t i = 0; i < entries.Count(); i++) {
+            Entry e = entries.At(i);
+            if (e.gfx == g) {
+                ::delete e.gfx;
+                ::delete e.bmp;
+                entries.RemoveAt(i);
+                return;
+            }
+        }
+        CrashIf(true);
+    }
+};
+
+static ThreadGraphicsCache gThreadGraphicsCache;
+
 Graphics *AllocGraphicsForMeasureText()
 {
-    return &gGH.gfx;
+    if (GetCurrentThreadId() == gGH.threadId)
+        return &gGH.gfx;
+    return gThreadGraphicsCache.Alloc();
 }
 
-void FreeGraphicsForMeasureText(Graphics *g) { }
+void FreeGraphicsForMeasureText(Graphics *g)
+{
+    if (g != &gGH.gfx)
+        gThreadGraphicsCache.Free(g);
+}
 
 }
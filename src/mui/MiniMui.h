@@ -10,6 +10,17 @@ using namespace Gdiplus;
 
 namespace mui {
 
+void EnterMuiCriticalSection();
+void LeaveMuiCriticalSection();
+
+class ScopedMuiCritSec {
+public:
+    ScopedMuiCritSec() { EnterMuiCriticalSection(); }
+    ~ScopedMuiCritSec() { LeaveMuiCriticalSection(); }
+};
+
+// cached fonts are shared by all threads but GDI+ objects may not be used
+// by several threads at once, so hold ScopedMuiCritSec while using them
 Font *GetCachedFont(const WCHAR *name, float size, FontStyle style);
 Graphics *AllocGraphicsForMeasureText();
 void FreeGraphicsForMeasureText(Graphics *g);
@@ -28,6 +28,8 @@ public:
 };
 
 void        InitGraphicsMode(Graphics *g);
+// cached fonts are shared by all threads but GDI+ objects may not be used
+// by several threads at once, so hold ScopedMuiCritSec while using them
 Font *      GetCachedFont(const WCHAR *name, float size, FontStyle style);
 Graphics *  AllocGraphicsForMeasureText();
 void        FreeGraphicsForMeasureText(Graphics *gfx);
@@ -27,6 +27,13 @@ BencObj *BencObj::Decode(const char *bytes, size_t *lenOut)
     return result;
 }
 
+char *BencObj::Encode() const
+{
+    str::Str<char> bytes(256);
+    EncodeTo(bytes);
+    return bytes.StealData();
+}
+
 static const char *ParseBencInt(const char *bytes, int64_t& value)
 {
     bool negative = *bytes == '-';
@@ -66,47 +73,38 @@ WCHAR *BencString::Value() const
     return str::conv::FromUtf8(value);
 }
 
-char *BencString::Encode() const
+void BencString::EncodeTo(str::Str<char>& bytes) const
 {
-    return str::Format("%" PRIuPTR ":%s", str::Len(value), value);
+    benc::AppendString(bytes, value);
 }
 
 BencString *BencString::Decode(const char *bytes, size_t *lenOut)
 {
-    if (!bytes || !str::IsDigit(*bytes))
-        return NULL;
-
-    int64_t len;
-    const char *start = ParseBencInt(bytes, len);
-    if (!start || *start != ':' || len < 0)
-        return NULL;
-
-    start++;
-    if (memchr(start, '\0', (size_t)len))
+    const char *value;
+    size_t len;
+    const char *end = benc::ParseString(bytes, &value, &len);
+    if (!end)
         return NULL;
 
     if (lenOut)
-        *lenOut = (start - bytes) + (size_t)len;
-    return new BencString(start, (size_t)len);
+        *lenOut = end - bytes;
+    return new BencString(value, len);
 }
 
-char *BencInt::Encode() const
+void BencInt::EncodeTo(str::Str<char>& bytes) const
 {
-    return str::Format("i%" PRId64 "e", value);
+    benc::AppendInt(bytes, value);
 }
 
 BencInt *BencInt::Decode(const char *bytes, size_t *lenOut)
 {
-    if (!bytes || *bytes != 'i')
-        return NULL;
-
     int64_t value;
-    const char *end = ParseBencInt(bytes + 1, value);
-    if (!end || *end != 'e')
+    const char *end = benc::ParseInt(bytes, &value);
+    if (!end)
         return NULL;
 
     if (lenOut)
-        *lenOut = (end - bytes) + 1;
+        *lenOut = end - bytes;
     return new BencInt(value);
 }
 
@@ -116,16 +114,13 @@ BencDict *BencArray::GetDict(size_t index) const {
     return NULL;
 }
 
-char *BencArray::Encode() const
+void BencArray::EncodeTo(str::Str<char>& bytes) const
 {
-    str::Str<char> bytes(256);
     bytes.Append('l');
     for (size_t i = 0; i < Length(); i++) {
-        ScopedMem<char> objBytes(value.At(i)->Encode());
-        bytes.Append(objBytes.Get());
+        value.At(i)->EncodeTo(bytes);
     }
     bytes.Append('e');
-    return bytes.StealData();
 }
 
 BencArray *BencArray::Decode(const char *bytes, size_t *lenOut)
@@ -194,20 +189,18 @@ void BencDict::Add(const char *key, BencObj *obj)
     }
 }
 
-char *BencDict::Encode() const
+void BencDict::EncodeTo(str::Str<char>& bytes) const
 {
-    str::Str<char> bytes(256);
     bytes.Append('d');
     for (size_t i = 0; i < Length(); i++) {
         char *key = keys.At(i);
         BencObj *val = values.At(i);
         if (key && val) {
-            bytes.AppendFmt("%" PRIuPTR ":%s", str::Len(key), key);
-            bytes.AppendAndFree(val->Encode());
+            benc::AppendString(bytes, key);
+            val->EncodeTo(bytes);
         }
     }
     bytes.Append('e');
-    return bytes.StealData();
 }
 
 BencDict *BencDict::Decode(const char *bytes, size_t *lenOut)
@@ -241,3 +234,294 @@ BencDict *BencDict::Decode(const char *bytes, size_t *lenOut)
         *lenOut = ix + 1;
     return dict;
 }
+
+namespace benc {
+
+const char *ParseInt(const char *bytes, int64_t *value)
+{
+    if (!bytes || *bytes != 'i')
+        return NULL;
+
+    const char *end = ParseBencInt(bytes + 1, *value);
+    if (!end || *end != 'e')
+        return NULL;
+    return end + 1;
+}
+
+const char *ParseString(const char *bytes, const char **value, size_t *len)
+{
+    if (!bytes || !str::IsDigit(*bytes))
+        return NULL;
+
+    int64_t strLen;
+    const char *start = ParseBencInt(bytes, strLen);
+    if (!start || *start != ':' || strLen < 0)
+        return NULL;
+
+    start++;
+    if (memchr(start, '\0', (size_t)strLen))
+        return NULL;
+
+    *value = start;
+    *len = (size_t)strLen;
+    return start + *len;
+}
+
+const char *Skip(const char *bytes)
+{
+    if (!bytes)
+        return NULL;
+
+    const char *value;
+    size_t len;
+    int64_t num;
+    switch (*bytes) {
+    case 'i':
+        return ParseInt(bytes, &num);
+    case 'l':
+        for (bytes++; bytes && *bytes != 'e'; ) {
+            bytes = Skip(bytes);
+        }
+        return bytes ? bytes + 1 : NULL;
+    case 'd':
+        for (bytes++; bytes && *bytes != 'e'; ) {
+            bytes = ParseString(bytes, &value, &len);
+            bytes = Skip(bytes);
+        }
+        return bytes ? bytes + 1 : NULL;
+    default:
+        return ParseString(bytes, &value, &len);
+    }
+}
+
+// note: AppendFmt would allocate a temporary string for every number
+static void AppendNumber(str::Str<char>& data, int64_t value)
+{
+    char buf[24];
+    char *s = buf + dimof(buf);
+    uint64_t num = value < 0 ? 0 - (uint64_t)value : (uint64_t)value;
+    do {
+        *--s = '0' + (char)(num % 10);
+        num /= 10;
+    } while (num > 0);
+    if (value < 0)
+        *--s = '-';
+    data.Append(s, buf + dimof(buf) - s);
+}
+
+void AppendInt(str::Str<char>& data, int64_t value)
+{
+    data.Append('i');
+    AppendNumber(data, value);
+    data.Append('e');
+}
+
+void AppendString(str::Str<char>& data, const char *value, size_t len)
+{
+    if (len == (size_t)-1)
+        len = str::Len(value);
+    AppendNumber(data, (int64_t)len);
+    data.Append(':');
+    data.Append(value, len);
+}
+
+class VisitArgs {
+public:
+    str::Str<char> path;
+    bool canceled;
+    ValueVisitor *visitor;
+
+    VisitArgs(ValueVisitor *visitor) : path(256), canceled(false), visitor(visitor) { }
+};
+
+static const char *VisitValue(VisitArgs& args, const char *bytes)
+{
+    const char *value, *end;
+    size_t len, pathIdx = args.path.Size();
+    int64_t num;
+    switch (*bytes) {
+    case 'i':
+        end = ParseInt(bytes, &num);
+        if (end)
+            args.canceled = !args.visitor->Visit(args.path.Get(), bytes + 1, (size_t)(end - bytes - 2), BT_INT);
+        return end;
+    case 'l':
+        bytes++;
+        for (int64_t idx = 0; *bytes != 'e'; idx++) {
+            args.path.Append('[');
+            AppendNumber(args.path, idx);
+            args.path.Append(']');
+            bytes = VisitValue(args, bytes);
+            if (args.canceled || !bytes)
+                return bytes;
+            args.path.RemoveAt(pathIdx, args.path.Size() - pathIdx);
+        }
+        return bytes + 1;
+    case 'd':
+        bytes++;
+        while (*bytes != 'e') {
+            bytes = ParseString(bytes, &value, &len);
+            if (!bytes)
+                return NULL;
+            args.path.Append('/');
+            args.path.Append(value, len);
+            bytes = VisitValue(args, bytes);
+            if (args.canceled || !bytes)
+                return bytes;
+            args.path.RemoveAt(pathIdx, args.path.Size() - pathIdx);
+        }
+        return bytes + 1;
+    default:
+        end = ParseString(bytes, &value, &len);
+        if (end)
+            args.canceled = !args.visitor->Visit(args.path.Get(), value, len, BT_STRING);
+        return end;
+    }
+}
+
+bool Parse(const char *bytes, ValueVisitor *visitor)
+{
+    if (!bytes)
+        return false;
+    VisitArgs args(visitor);
+    const char *end = VisitValue(args, bytes);
+    if (!end)
+        return false;
+    return args.canceled || !*end;
+}
+
+Node *Node::GetItem(size_t idx) const
+{
+    if (type != BT_ARRAY || idx >= len)
+        return NULL;
+    return items[idx];
+}
+
+static int NodeKeyCmp(const void *a, const void *b)
+{
+    return strcmp((*(Node **)a)->value, (*(Node **)b)->value);
+}
+
+Node *Node::GetValue(const char *key) const
+{
+    if (type != BT_DICT)
+        return NULL;
+    Node keyNode = { BT_STRING, key };
+    Node *keyPtr = &keyNode;
+    Node **found = (Node **)bsearch(&keyPtr, items, len, 2 * sizeof(Node *), NodeKeyCmp);
+    return found ? found[1] : NULL;
+}
+
+class TreeArgs {
+public:
+    PoolAllocator *allocator;
+    // the items of all arrays and dictionaries currently being parsed
+    // (allocated only once for the whole tree)
+    Vec<Node *> stack;
+
+    TreeArgs(PoolAllocator *allocator) : allocator(allocator), stack(256) { }
+
+    Node *NewNode(BencType type) {
+        Node *node = allocator->AllocStruct<Node>();
+        ZeroMemory(node, sizeof(Node));
+        node->type = type;
+        return node;
+    }
+};
+
+static const char *ParseNode(TreeArgs& args, const char *bytes, Node **nodeOut);
+
+static const char *ParseStringNode(TreeArgs& args, const char *bytes, Node **nodeOut)
+{
+    const char *value;
+    size_t len;
+    bytes = ParseString(bytes, &value, &len);
+    if (!bytes)
+        return NULL;
+    Node *node = args.NewNode(BT_STRING);
+    char *copy = (char *)args.allocator->Alloc(len + 1);
+    memcpy(copy, value, len);
+    copy[len] = '\0';
+    node->value = copy;
+    node->len = len;
+    *nodeOut = node;
+    return bytes;
+}
+
+// moves the items parsed since stackIdx from the stack to the allocator
+static void PopItems(TreeArgs& args, Node *node, size_t stackIdx)
+{
+    size_t count = args.stack.Count() - stackIdx;
+    if (0 == count)
+        return;
+    node->items = (Node **)args.allocator->Alloc(count * sizeof(Node *));
+    memcpy(node->items, args.stack.AtPtr(stackIdx), count * sizeof(Node *));
+    args.stack.RemoveAt(stackIdx, count);
+}
+
+static const char *ParseNode(TreeArgs& args, const char *bytes, Node **nodeOut)
+{
+    Node *node, *item = NULL;
+    size_t stackIdx = args.stack.Count();
+    switch (*bytes) {
+    case 'i':
+        node = args.NewNode(BT_INT);
+        bytes = ParseInt(bytes, &node->num);
+        break;
+    case 'l':
+        node = args.NewNode(BT_ARRAY);
+        for (bytes++; bytes && *bytes != 'e'; ) {
+            bytes = ParseNode(args, bytes, &item);
+            if (bytes)
+                args.stack.Append(item);
+        }
+        if (bytes) {
+            bytes++;
+            node->len = args.stack.Count() - stackIdx;
+            PopItems(args, node, stackIdx);
+        }
+        break;
+    case 'd':
+        node = args.NewNode(BT_DICT);
+        for (bytes++; bytes && *bytes != 'e'; ) {
+            bytes = ParseStringNode(args, bytes, &item);
+            if (!bytes)
+                break;
+            args.stack.Append(item);
+            bytes = ParseNode(args, bytes, &item);
+            if (bytes)
+                args.stack.Append(item);
+        }
+        if (bytes) {
+            bytes++;
+            node->len = (args.stack.Count() - stackIdx) / 2;
+            PopItems(args, node, stackIdx);
+            // keys should already be sorted (as required by the specification)
+            for (size_t i = 1; i < node->len; i++) {
+                if (NodeKeyCmp(&node->items[2 * i - 2], &node->items[2 * i]) > 0) {
+                    qsort(node->items, node->len, 2 * sizeof(Node *), NodeKeyCmp);
+                    break;
+                }
+            }
+        }
+        break;
+    default:
+        return ParseStringNode(args, bytes, nodeOut);
+    }
+    *nodeOut = node;
+    return bytes;
+}
+
+Node *ParseTree(const char *bytes, PoolAllocator *allocator)
+{
+    if (!bytes)
+        return NULL;
+    TreeArgs args(allocator);
+    Node *root;
+    const char *end = ParseNode(args, bytes, &root);
+    if (!end || *end)
+        return NULL;
+    return root;
+}
+
+}
@@ -28,7 +28,10 @@ public:
     virtual ~BencObj() { }
     BencType Type() const { return type; }
 
-    virtual char *Encode() const = 0;
+    char *Encode() const;
+    // appends the encoded value to bytes (which callers can reuse for
+    // encoding several values without allocating a new buffer for each)
+    virtual void EncodeTo(str::Str<char>& bytes) const = 0;
     static BencObj *Decode(const char *bytes, size_t *lenOut=NULL);
 };
 
@@ -51,7 +54,7 @@ public:
     WCHAR *Value() const;
     const char *RawValue() const { return value; }
 
-    virtual char *Encode() const;
+    virtual void EncodeTo(str::Str<char>& bytes) const;
     static BencString *Decode(const char *bytes, size_t *lenOut);
 };
 
@@ -62,7 +65,7 @@ public:
     BencInt(int64_t value) : BencObj(BT_INT), value(value) { }
     int64_t Value() const { return value; }
 
-    virtual char *Encode() const;
+    virtual void EncodeTo(str::Str<char>& bytes) const;
     static BencInt *Decode(const char *bytes, size_t *lenOut);
 };
 
@@ -110,7 +113,7 @@ public:
     }
     BencDict *GetDict(size_t index) const;
 
-    virtual char *Encode() const;
+    virtual void EncodeTo(str::Str<char>& bytes) const;
     static BencArray *Decode(const char *bytes, size_t *lenOut);
 };
 
@@ -168,8 +171,70 @@ public:
         return NULL;
     }
 
-    virtual char *Encode() const;
+    virtual void EncodeTo(str::Str<char>& bytes) const;
     static BencDict *Decode(const char *bytes, size_t *lenOut);
 };
 
+/* Functions for reading and writing bencoded data in place, i.e. without
+   building up a tree of BencObjs (e.g. for arrays with thousands of elements).
+   The Parse functions return a pointer right behind the parsed value (or NULL,
+   if bytes doesn't start with a valid value of the expected type). Arrays and
+   dictionaries are read by skipping the leading 'l' resp. 'd' and then reading
+   values resp. key/value pairs until reaching the terminating 'e'. When
+   writing a dictionary, its keys must be appended in sorted order. */
+
+namespace benc {
+
+const char *ParseInt(const char *bytes, int64_t *value);
+// note: *value points into bytes (and isn't zero-terminated)
+const char *ParseString(const char *bytes, const char **value, size_t *len);
+// skips a value of any type (including all its nested values)
+const char *Skip(const char *bytes);
+
+void AppendInt(str::Str<char>& data, int64_t value);
+void AppendString(str::Str<char>& data, const char *value, size_t len=-1);
+
+// parsing bencoded data will call the ValueVisitor for every string and
+// integer value with a path to it (in the same format as json::Parse),
+// e.g. the following data will lead to two calls:
+// d3:keyli42ed4:name5:valueeee
+// 1. "/key[0]", "42", BT_INT
+// 2. "/key[1]/name", "value", BT_STRING
+// value points into the parsed data and isn't zero-terminated
+
+class ValueVisitor {
+public:
+    // return false to stop parsing
+    virtual bool Visit(const char *path, const char *value, size_t len, BencType type) = 0;
+};
+
+// parses data without any allocations beyond those for the path
+// returns false on error
+bool Parse(const char *bytes, ValueVisitor *visitor);
+
+// for callers which need random access: a tree of Nodes which are (together
+// with copies of all strings) allocated from a PoolAllocator, so that the
+// whole tree is freed at once with the allocator
+struct Node {
+    BencType type;
+    // BT_STRING: zero-terminated copy of the value
+    const char *value;
+    // BT_STRING: length of value, BT_ARRAY: number of elements,
+    // BT_DICT: number of key/value pairs
+    size_t len;
+    // BT_INT: the value
+    int64_t num;
+    // BT_ARRAY: the elements, BT_DICT: the keys (as BT_STRING Nodes)
+    // alternating with their values, sorted by key
+    Node **items;
+
+    Node *GetItem(size_t idx) const;
+    Node *GetValue(const char *key) const;
+};
+
+// returns NULL on error
+Node *ParseTree(const char *bytes, PoolAllocator *allocator);
+
+}
+
 #endif
@@ -199,6 +199,162 @@ static void BencTestParseDicts()
     BencTestParseDict("d1:Zi-23e2:able3:keyi35ee", 3);
 }
 
+static void BencTestInPlace()
+{
+    const char *invalid[] = { NULL, "", "e", "i12", "3:ab", "l", "li12e", "d", "di12ei1ee", "d1:ae" };
+    for (int i = 0; i < dimof(invalid); i++) {
+        assert(!benc::Skip(invalid[i]));
+    }
+    const char *valid[] = { "i0e", "0:", "le", "de", "llleee", "li42e2:teldeedee", "d1:Zi-23e2:able3:keyi35ee" };
+    for (int i = 0; i < dimof(valid); i++) {
+        const char *end = benc::Skip(valid[i]);
+        assert(end && !*end);
+    }
+
+    const char *data = "d1:ai-5e1:bli2ei3ee1:c3:xyze";
+    const char *key, *value;
+    size_t keyLen, len;
+    int64_t num;
+    assert(!benc::ParseInt(data, &num) && !benc::ParseString(data, &key, &keyLen));
+    data = benc::ParseString(data + 1, &key, &keyLen);
+    assert(data && keyLen == 1 && *key == 'a');
+    data = benc::ParseInt(data, &num);
+    assert(data && num == -5);
+    data = benc::ParseString(data, &key, &keyLen);
+    assert(data && keyLen == 1 && *key == 'b' && *data == 'l');
+    data = benc::Skip(data);
+    data = benc::ParseString(data, &key, &keyLen);
+    assert(data && keyLen == 1 && *key == 'c');
+    data = benc::ParseString(data, &value, &len);
+    assert(data && len == 3 && str::EqN(value, "xyz", 3) && str::Eq(data, "e"));
+
+    str::Str<char> bytes;
+    bytes.Append('d');
+    benc::AppendString(bytes, "a");
+    benc::AppendInt(bytes, -5);
+    benc::AppendString(bytes, "b");
+    bytes.Append('l');
+    benc::AppendInt(bytes, 2);
+    benc::AppendInt(bytes, 3);
+    bytes.Append('e');
+    benc::AppendString(bytes, "c");
+    benc::AppendString(bytes, "xyzw", 3);
+    bytes.Append('e');
+    assert(str::Eq(bytes.Get(), "d1:ai-5e1:bli2ei3ee1:c3:xyze"));
+    BencObj *obj = BencObj::Decode(bytes.Get());
+    assert(obj && obj->Type() == BT_DICT);
+    BencTestSerialization(obj, bytes.Get());
+    delete obj;
+}
+
+struct BencValue {
+    const char *path;
+    const char *value;
+    BencType type;
+};
+
+class BencVerifier : public benc::ValueVisitor {
+    BencValue *data;
+    size_t dataLen;
+    size_t stopAt;
+
+public:
+    size_t idx;
+
+    BencVerifier(BencValue *data, size_t dataLen, size_t stopAt=-1) :
+        data(data), dataLen(dataLen), stopAt(stopAt), idx(0) { }
+
+    virtual bool Visit(const char *path, const char *value, size_t len, BencType type) {
+        assert(idx < dataLen);
+        assert(type == data[idx].type);
+        assert(str::Eq(path, data[idx].path));
+        assert(len == str::Len(data[idx].value) && str::EqN(value, data[idx].value, len));
+
+        return ++idx != stopAt;
+    }
+};
+
+static void BencTestVisitor()
+{
+    BencVerifier verifyError(NULL, 0);
+    const char *invalid[] = { NULL, "", "e", "i12", "3:ab", "le ", "d", "di12ei1ee", "d1:ae" };
+    for (int i = 0; i < dimof(invalid); i++) {
+        assert(!benc::Parse(invalid[i], &verifyError));
+    }
+    assert(benc::Parse("le", &verifyError));
+    assert(benc::Parse("llleee", &verifyError));
+
+    BencValue testData[] = {
+        { "/File History[0]/FilePath", "C:\\a.pdf", BT_STRING },
+        { "/File History[0]/PageNo", "-5", BT_INT },
+        { "/File History[0]/TocToggles[0]", "2", BT_INT },
+        { "/File History[1]/FilePath", "", BT_STRING },
+        { "/Version", "2.2", BT_STRING },
+    };
+    const char *data = "d12:File Historyld8:FilePath8:C:\\a.pdf6:PageNoi-5e10:TocTogglesli2eeed8:FilePath0:ee7:Version3:2.2e";
+    BencVerifier verifier(testData, dimof(testData));
+    assert(benc::Parse(data, &verifier) && verifier.idx == dimof(testData));
+
+    // parsing stops as soon as the visitor returns false
+    BencVerifier stopper(testData, dimof(testData), 2);
+    assert(benc::Parse(data, &stopper) && stopper.idx == 2);
+}
+
+static void BencTestTree()
+{
+    PoolAllocator allocator;
+    const char *invalid[] = { NULL, "", "i12", "l", "li12e", "d1:ae", "d1:ai1ee " };
+    for (int i = 0; i < dimof(invalid); i++) {
+        assert(!benc::ParseTree(invalid[i], &allocator));
+    }
+
+    // keys are sorted, even if they weren't in the data
+    benc::Node *root = benc::ParseTree("d1:bli2ei3ee1:ai-5e1:c3:xyz0:dee", &allocator);
+    assert(root && root->type == BT_DICT && root->len == 4);
+    benc::Node *node = root->GetValue("a");
+    assert(node && node->type == BT_INT && node->num == -5);
+    node = root->GetValue("b");
+    assert(node && node->type == BT_ARRAY && node->len == 2);
+    assert(node->GetItem(1) && node->GetItem(1)->num == 3 && !node->GetItem(2));
+    assert(!node->GetValue("a"));
+    node = root->GetValue("c");
+    assert(node && node->type == BT_STRING && node->len == 3 && str::Eq(node->value, "xyz"));
+    node = root->GetValue("");
+    assert(node && node->type == BT_DICT && node->len == 0 && !node->GetValue(""));
+    assert(!root->GetValue("d") && !root->GetItem(0));
+    assert(str::Eq(root->items[0]->value, "") && str::Eq(root->items[6]->value, "c"));
+
+    node = benc::ParseTree("0:", &allocator);
+    assert(node && node->type == BT_STRING && str::Eq(node->value, ""));
+}
+
+static void BencTestEncodeTo()
+{
+    BencDict *dict = new BencDict();
+    dict->Add("key", L"value");
+    dict->Add("int", -23);
+    BencArray *array = new BencArray();
+    array->Add(_I64_MAX);
+    array->Add(new BencDict());
+    dict->Add("array", array);
+
+    // encoding into a (reused) buffer appends to it
+    str::Str<char> bytes;
+    dict->EncodeTo(bytes);
+    assert(str::Eq(bytes.Get(), "d5:arrayli9223372036854775807edee3:inti-23e3:key5:valuee"));
+    bytes.RemoveAt(0, bytes.Size());
+    array->EncodeTo(bytes);
+    array->EncodeTo(bytes);
+    assert(str::Eq(bytes.Get(), "li9223372036854775807edeeli9223372036854775807edee"));
+    BencTestRoundtrip(dict);
+    delete dict;
+
+    bytes.RemoveAt(0, bytes.Size());
+    benc::AppendInt(bytes, _I64_MIN);
+    benc::AppendInt(bytes, 0);
+    assert(str::Eq(bytes.Get(), "i-9223372036854775808ei0e"));
+}
+
 #define ITERATION_COUNT 128
 
 static void BencTestArrayAppend()
@@ -380,6 +536,10 @@ static void BencTest()
     BencTestParseRawStrings();
     BencTestParseArrays();
     BencTestParseDicts();
+    BencTestInPlace();
+    BencTestVisitor();
+    BencTestTree();
+    BencTestEncodeTo();
     BencTestArrayAppend();
     BencTestDictAppend();
     BencTestStress();
@@ -10,21 +10,29 @@ just as well be a tree of some kind.
 Usually those things are done as a templated hash table class,
 but I want to avoid code bloat and awful syntax.
 
-The classes are based on a generic, untyped uintptr => uintptr
-hash table. The actual dict class is a wrapper that provides
-a type-safe API and handles policy decisions like allocations
-(if they are necessary).
-
-Our hash table uses the same parameters as the one in redis
-(but without complexity of incremental hashing):
-- we use chaining on collisions
-- size of the hash table is power of two
+The classes are based on a generic, untyped hash table mapping
+binary strings to uintptr values. The actual dict class is a
+wrapper that provides a type-safe API and handles policy decisions
+like allocations (if they are necessary).
+
+Our hash table uses open addressing:
+- all entries live in a single array (the size of which is a power
+  of two), so that a lookup usually touches a single cache line
+  instead of following a chain of separately allocated nodes
+- collisions are resolved through linear probing with Robin Hood
+  hashing, i.e. an entry being inserted displaces entries which
+  are closer to their home position. This keeps probe sequences
+  short even at high load factors and allows a lookup to stop
+  as soon as it's further from the home position than the entry
+  it's looking at
+- entries remember the full hash value and the length of their key,
+  so that keys are only compared if those match and so that resizing
+  never has to rehash a key
+- removal shifts the following entries back instead of leaving
+  tombstones behind
 
 TODO:
 - add iterator for keys/values
-- would hash function be faster if we got bytes one at a time
-  but only with a single pass vs. getting 4 at a time but
-  doing 2 passes (the first to calculate the length)?
 */
 
 #include "BaseUtil.h"
@@ -32,46 +40,17 @@ TODO:
 
 namespace dict {
 
-class HasherComparator {
-public:
-    virtual size_t Hash(uintptr_t key) = 0;
-    virtual bool Equal(uintptr_t k1, uintptr_t k2) = 0;
-};
-
-class StrKeyHasherComparator : public HasherComparator {
-    virtual size_t Hash(uintptr_t key) { return murmur_hash2((const void*)key, str::Len((const char*)key)); }
-    virtual bool Equal(uintptr_t k1, uintptr_t k2) {
-        const char *s1 = (const char *)k1;
-        const char *s2 = (const char *)k2;
-        return str::Eq(s1, s2);
-    }
-};
-
-class WStrKeyHasherComparator : public HasherComparator {
-    virtual size_t Hash(uintptr_t key) {
-        size_t cbLen = str::Len((const WCHAR*)key) * sizeof(WCHAR);
-        return murmur_hash2((const void*)key, cbLen);
-    }
-    virtual bool Equal(uintptr_t k1, uintptr_t k2) {
-        const WCHAR *s1 = (const WCHAR *)k1;
-        const WCHAR *s2 = (const WCHAR *)k2;
-        return str::Eq(s1, s2);
-    }
-};
-
-static StrKeyHasherComparator gStrKeyHasherComparator;
-static WStrKeyHasherComparator gWStrKeyHasherComparator;
-
 struct HashTableEntry {
-    uintptr_t key;
+    // 0 for unused entries
+    uint32_t hash;
+    uint32_t keyLen;
+    const void *key;
     uintptr_t val;
-    struct HashTableEntry *next;
 };
 
 // not a class so that it can be allocated with an allocator
 struct HashTable {
-    HashTableEntry **entries;
-    HashTableEntry *freeList;
+    HashTableEntry *entries;
 
     size_t nEntries;
     size_t nUsed; // total number of inserted entries
@@ -81,16 +60,27 @@ struct HashTable {
     size_t nCollisions;
 };
 
+// the maximum load factor is 7/8 (Robin Hood hashing keeps the
+// average probe length below 3 even when the table is this full)
+static inline bool IsOverloaded(size_t nUsed, size_t nEntries)
+{
+    return nUsed > nEntries - nEntries / 8;
+}
+
 static HashTable *NewHashTable(size_t size, Allocator *allocator)
 {
     CrashIf(!allocator); // we'll leak otherwise
     HashTable *h = (HashTable*)Allocator::AllocZero(allocator, sizeof(HashTable));
     // number of hash table entries should be power of 2
-    size = roundToPowerOf2(size);
+    // (and large enough for size entries)
+    size_t nEntries = roundToPowerOf2(max(size, (size_t)8));
+    if (IsOverloaded(size, nEntries))
+        nEntries *= 2;
     // entries are not allocated with allocator since those are large blocks
-    // and we don't want to waste their memory after 
-    h->entries = AllocArray<HashTableEntry*>(size);
-    h->nEntries = size;
+    // and we don't want to waste their memory after resizing
+    h->entries = AllocArray<HashTableEntry>(nEntries);
+    CrashAlwaysIf(!h->entries);
+    h->nEntries = nEntries;
     return h;
 }
 
@@ -100,100 +90,121 @@ static void DeleteHashTable(HashTable *h)
     // the rest is freed by allocator
 }
 
-static void HashTableResize(HashTable *h, HasherComparator *hc)
+static inline uint32_t HashKey(const void *key, size_t keyLen)
 {
-    size_t newSize = roundToPowerOf2(h->nEntries + 1);
-    CrashIf(newSize <= h->nEntries);
-    HashTableEntry **newEntries = AllocArray<HashTableEntry*>(newSize);
-    HashTableEntry *e, *next;
-    size_t hash, pos;
-    for (size_t i = 0; i < h->nEntries; i++) {
-        e = h->entries[i];
-        while (e) {
-            next = e->next;
-            hash = hc->Hash(e->key);
-            pos = hash % newSize;
-            e->next = newEntries[pos];
-            newEntries[pos] = e;
-            e = next;
-        }
+    uint32_t hash = murmur_hash2(key, keyLen);
+    // 0 marks unused entries
+    return hash ? hash : 1;
+}
+
+// distance of an entry from the position it would ideally be at
+static inline size_t ProbeDistance(HashTable *h, size_t pos, uint32_t hash)
+{
+    return (pos - hash) & (h->nEntries - 1);
+}
+
+// returns the position of the entry for key or -1
+static int FindEntry(HashTable *h, uint32_t hash, const void *key, size_t keyLen)
+{
+    size_t mask = h->nEntries - 1;
+    size_t pos = hash & mask;
+    for (size_t dist = 0; ; dist++, pos = (pos + 1) & mask) {
+        HashTableEntry *e = &h->entries[pos];
+        // Robin Hood invariant: key would have displaced an entry closer to its home
+        if (0 == e->hash || ProbeDistance(h, pos, e->hash) < dist)
+            return -1;
+        if (e->hash == hash && e->keyLen == keyLen && memeq(e->key, key, keyLen))
+            return (int)pos;
     }
-    free(h->entries);
-    h->entries = newEntries;
-    h->nEntries = newSize;
-    h->nResizes += 1;
+}
 
-    CrashIf(h->nUsed >= (h->nEntries * 3) / 2);
+// inserts an entry for a key which isn't in the hash table yet
+// and returns the position the entry ends up at
+static size_t InsertEntry(HashTable *h, HashTableEntry newEntry)
+{
+    size_t mask = h->nEntries - 1;
+    size_t pos = newEntry.hash & mask;
+    size_t insertedAt = (size_t)-1;
+    if (h->entries[pos].hash != 0)
+        h->nCollisions++;
+    for (size_t dist = 0; ; dist++, pos = (pos + 1) & mask) {
+        HashTableEntry *e = &h->entries[pos];
+        if (0 == e->hash) {
+            *e = newEntry;
+            return insertedAt != (size_t)-1 ? insertedAt : pos;
+        }
+        size_t entryDist = ProbeDistance(h, pos, e->hash);
+        if (entryDist < dist) {
+            // continue with inserting the displaced entry
+            swap(*e, newEntry);
+            dist = entryDist;
+            if ((size_t)-1 == insertedAt)
+                insertedAt = pos;
+        }
+    }
 }
 
-// micro optimization: this is called often, so we want this check inlined. Resizing logic
-// is called rarely, so doesn't need to be inlined
-static inline void HashTableResizeIfNeeded(HashTable *h, HasherComparator *hc)
+static void HashTableResize(HashTable *h)
 {
-    // per http://stackoverflow.com/questions/1603712/when-should-i-do-rehashing-of-entire-hash-table/1604428#1604428
-    // when using collision chaining, load factor can be 150%
-    if (h->nUsed < (h->nEntries * 3) / 2)
-        return;
-    HashTableResize(h, hc);
+    HashTableEntry *oldEntries = h->entries;
+    size_t oldSize = h->nEntries;
+    h->nEntries = oldSize * 2;
+    CrashAlwaysIf(h->nEntries <= oldSize);
+    h->entries = AllocArray<HashTableEntry>(h->nEntries);
+    CrashAlwaysIf(!h->entries);
+    for (size_t i = 0; i < oldSize; i++) {
+        if (oldEntries[i].hash != 0)
+            InsertEntry(h, oldEntries[i]);
+    }
+    free(oldEntries);
+    h->nResizes += 1;
 }
 
 // note: allocator must be NULL for get, non-NULL for create
-static HashTableEntry *GetOrCreateEntry(HashTable *h, HasherComparator *hc, uintptr_t key, Allocator *allocator, bool& newEntry)
+// keyTermLen is the size of the zero-terminator to add to copies of the key
+static HashTableEntry *GetOrCreateEntry(HashTable *h, const void *key, size_t keyLen, size_t keyTermLen, Allocator *allocator, bool& newEntry)
 {
-    bool shouldCreate = (allocator != NULL);
-    size_t hash = hc->Hash(key);
-    size_t pos = hash % h->nEntries;
-    HashTableEntry *e = h->entries[pos];
+    uint32_t hash = HashKey(key, keyLen);
+    int pos = FindEntry(h, hash, key, keyLen);
     newEntry = false;
-    while (e) {
-        if (hc->Equal(key, e->key))
-            return e;
-        e = e->next;
-    }
-    if (!shouldCreate)
+    if (pos != -1)
+        return &h->entries[pos];
+    if (!allocator)
         return NULL;
 
-    if (h->freeList) {
-        e = h->freeList;
-        h->freeList = h->freeList->next;
-    } else {
-        e = (HashTableEntry*)Allocator::AllocZero(allocator, sizeof(HashTableEntry));
-    }
-    e->next = h->entries[pos];
-    h->entries[pos] = e;
+    // micro optimization: resizing is rare, so it's done before the insertion
+    // (which then doesn't have to care about growing the hash table)
+    if (IsOverloaded(h->nUsed + 1, h->nEntries))
+        HashTableResize(h);
+
+    char *keyCopy = (char *)Allocator::Alloc(allocator, keyLen + keyTermLen);
+    memcpy(keyCopy, key, keyLen);
+    memset(keyCopy + keyLen, 0, keyTermLen);
+    HashTableEntry e = { hash, (uint32_t)keyLen, keyCopy, 0 };
     h->nUsed++;
-    if (e->next != NULL)
-        h->nCollisions++;
     newEntry = true;
-    return e;
+    return &h->entries[InsertEntry(h, e)];
 }
 
-static bool RemoveEntry(HashTable *h, HasherComparator *hc, uintptr_t key, uintptr_t *removedValOut)
+static bool RemoveEntry(HashTable *h, const void *key, size_t keyLen, uintptr_t *removedValOut)
 {
-    size_t hash = hc->Hash(key);
-    size_t pos = hash % h->nEntries;
-    HashTableEntry *e = h->entries[pos];
-    while (e) {
-        if (hc->Equal(key, e->key))
+    int found = FindEntry(h, HashKey(key, keyLen), key, keyLen);
+    if (-1 == found)
+        return false;
+    *removedValOut = h->entries[found].val;
+
+    // shift back the following entries which aren't at their home position
+    // (the key's memory is freed by allocator)
+    size_t mask = h->nEntries - 1;
+    size_t pos = (size_t)found;
+    for (size_t next = (pos + 1) & mask; ; pos = next, next = (next + 1) & mask) {
+        HashTableEntry *e = &h->entries[next];
+        if (0 == e->hash || 0 == ProbeDistance(h, next, e->hash))
             break;
-        e = e->next;
+        h->entries[pos] = *e;
     }
-    if (!e)
-        return false;
+    ZeroMemory(&h->entries[pos], sizeof(HashTableEntry));
 
-    // remove the the entry from the list
-    HashTableEntry *e2 = h->entries[pos];
-    if (e2 == e) {
-        h->entries[pos] = e->next;
-    } else {
-        while (e2->next != e) {
-            e2 = e2->next;
-        }
-        e2->next = e->next;
-    }
-    e->next = h->freeList;
-    h->freeList = e;
-    *removedValOut = e->val;
     CrashIf(0 == h->nUsed);
     h->nUsed -= 1;
     return true;
@@ -201,7 +212,7 @@ static bool RemoveEntry(HashTable *h, HasherComparator *hc, uintptr_t key, uintp
 
 MapStrToInt::MapStrToInt(size_t initialSize)
 {
-    // we use PoolAllocator to allocate HashTableEntry entries
+    // we use PoolAllocator to allocate the hash table
     // and copies of string keys
     allocator = new PoolAllocator();
     allocator->SetAllocRounding(4);
@@ -222,33 +233,29 @@ size_t MapStrToInt::Count() const
 bool MapStrToInt::Insert(const char *key, int val, int *prevVal)
 {
     bool newEntry;
-    HashTableEntry *e = GetOrCreateEntry(h, &gStrKeyHasherComparator, (uintptr_t)key, allocator, newEntry);
+    HashTableEntry *e = GetOrCreateEntry(h, key, str::Len(key), sizeof(char), allocator, newEntry);
     if (!newEntry) {
         if (prevVal)
-            *prevVal = e->val;
+            *prevVal = (int)e->val;
         return false;
     }
-    e->key = (intptr_t)Allocator::Dup(allocator, (void*)key, str::Len(key) + 1);
     e->val = (intptr_t)val;
-
-    HashTableResizeIfNeeded(h, &gStrKeyHasherComparator);
     return true;
 }
 
 bool MapStrToInt::Remove(const char *key, int *removedValOut)
 {
     uintptr_t removedVal;
-    bool removed = RemoveEntry(h, &gStrKeyHasherComparator, (uintptr_t)key, &removedVal);
+    bool removed = RemoveEntry(h, key, str::Len(key), &removedVal);
     if (removed && removedValOut)
-        *removedValOut = removedVal;
+        *removedValOut = (int)removedVal;
     return removed;
 }
 
 bool MapStrToInt::Get(const char *key, int* valOut)
 {
-    StrKeyHasherComparator hc;
     bool newEntry;
-    HashTableEntry *e = GetOrCreateEntry(h, &hc, (uintptr_t)key, NULL, newEntry);
+    HashTableEntry *e = GetOrCreateEntry(h, key, str::Len(key), sizeof(char), NULL, newEntry);
     if (!e)
         return false;
     *valOut = (int)e->val;
@@ -257,7 +264,7 @@ bool MapStrToInt::Get(const char *key, int* valOut)
 
 MapWStrToInt::MapWStrToInt(size_t initialSize)
 {
-    // we use PoolAllocator to allocate HashTableEntry entries
+    // we use PoolAllocator to allocate the hash table
     // and copies of string keys
     allocator = new PoolAllocator();
     allocator->SetAllocRounding(4);
@@ -276,36 +283,41 @@ size_t MapWStrToInt::Count() const
 }
 
 bool MapWStrToInt::Insert(const WCHAR *key, int val, int *prevVal)
+{
+    return Insert(key, str::Len(key), val, prevVal);
+}
+
+bool MapWStrToInt::Insert(const WCHAR *key, size_t len, int val, int *prevVal)
 {
     bool newEntry;
-    HashTableEntry *e = GetOrCreateEntry(h, &gWStrKeyHasherComparator, (uintptr_t)key, allocator, newEntry);
+    HashTableEntry *e = GetOrCreateEntry(h, key, len * sizeof(WCHAR), sizeof(WCHAR), allocator, newEntry);
     if (!newEntry) {
         if (prevVal)
-            *prevVal = e->val;
+            *prevVal = (int)e->val;
         return false;
     }
-    size_t keyCbLen = (str::Len(key) + 1) * sizeof(WCHAR);
-    e->key = (intptr_t)Allocator::Dup(allocator, (void*)key, keyCbLen);
     e->val = (intptr_t)val;
-
-    HashTableResizeIfNeeded(h, &gWStrKeyHasherComparator);
     return true;
 }
 
 bool MapWStrToInt::Remove(const WCHAR *key, int *removedValOut)
 {
     uintptr_t removedVal;
-    bool removed = RemoveEntry(h, &gStrKeyHasherComparator, (uintptr_t)key, &removedVal);
+    bool removed = RemoveEntry(h, key, str::Len(key) * sizeof(WCHAR), &removedVal);
     if (removed && removedValOut)
-        *removedValOut = removedVal;
+        *removedValOut = (int)removedVal;
     return removed;
 }
 
 bool MapWStrToInt::Get(const WCHAR *key, int* valOut)
 {
-    WStrKeyHasherComparator hc;
+    return Get(key, str::Len(key), valOut);
+}
+
+bool MapWStrToInt::Get(const WCHAR *key, size_t len, int* valOut)
+{
     bool newEntry;
-    HashTableEntry *e = GetOrCreateEntry(h, &hc, (uintptr_t)key, NULL, newEntry);
+    HashTableEntry *e = GetOrCreateEntry(h, key, len * sizeof(WCHAR), sizeof(WCHAR), NULL, newEntry);
     if (!e)
         return false;
     *valOut = (int)e->val;
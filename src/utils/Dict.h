@@ -8,14 +8,12 @@ namespace dict {
 
 struct HashTable;
 
-// we are very generous with default initial size. It's a trade-off
-// between memory used by hash table and how often we need to resize it.
-// We allocate size*sizeof(ptr) which is 64k on 32-bit for 16k entries.
-// 64k is very little on today's machines, especially for short-lived
-// hash tables.
-// Should use smaller values for long-lived hash tables, especially
-// if there are many of them.
-enum { DEFAULT_HASH_TABLE_INITIAL_SIZE = 16*1024 };
+// default initial size. It's a trade-off between memory used by hash table
+// and how often we need to resize it. We allocate 16 bytes per entry on
+// 32-bit (i.e. 4k for 256 entries) and double the size whenever the table
+// is 7/8 full. Resizing doesn't have to rehash the keys, so it's cheap.
+// Should use the expected number of entries if it's known in advance.
+enum { DEFAULT_HASH_TABLE_INITIAL_SIZE = 256 };
 
 // a dictionary whose keys are char * strings and the values are integers
 // note: StrToInt would be more natural name but it's re-#define'd in <shlwapi.h>
@@ -51,6 +49,10 @@ public:
     bool Insert(const WCHAR *key, int val, int *prevValOut);
     bool Remove(const WCHAR *key, int *removedValOut);
     bool Get(const WCHAR *key, int *valOut);
+
+    // same as above for keys which aren't zero-terminated
+    bool Insert(const WCHAR *key, size_t len, int val, int *prevValOut);
+    bool Get(const WCHAR *key, size_t len, int *valOut);
 };
 
 }
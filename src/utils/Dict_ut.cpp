@@ -75,8 +75,58 @@ void DictTestMapStrToInt()
     FreeVecMembers(toRemove);
 }
 
+void DictTestMapWStrToInt()
+{
+    dict::MapWStrToInt d(4);
+    bool ok;
+    int val;
+
+    ok = d.Insert(L"foo", 5, NULL);
+    assert(ok && 1 == d.Count());
+    ok = d.Get(L"foo", &val);
+    assert(ok && val == 5);
+    // keys which aren't zero-terminated
+    ok = d.Get(L"foobar", 3, &val);
+    assert(ok && val == 5);
+    ok = d.Get(L"foobar", 2, &val);
+    assert(!ok);
+    ok = d.Insert(L"foobar", 6, -1, NULL);
+    assert(ok && 2 == d.Count());
+    ok = d.Get(L"foobar", &val);
+    assert(ok && val == -1);
+    ok = d.Insert(L"", 0, 7, NULL);
+    assert(ok);
+    ok = d.Get(L"", &val);
+    assert(ok && val == 7);
+    ok = d.Remove(L"foo", &val);
+    assert(ok && val == 5 && 2 == d.Count());
+    ok = d.Get(L"foo", &val);
+    assert(!ok);
+
+    // entries must remain findable while others are removed
+    // (removal shifts entries and insertion displaces them)
+    for (int i = 0; i < 4096; i++) {
+        ScopedMem<WCHAR> key(str::Format(L"%d", i));
+        ok = d.Insert(key, i, NULL);
+        assert(ok);
+    }
+    for (int i = 0; i < 4096; i += 3) {
+        ScopedMem<WCHAR> key(str::Format(L"%d", i));
+        ok = d.Remove(key, &val);
+        assert(ok && val == i);
+    }
+    for (int i = 0; i < 4096; i++) {
+        ScopedMem<WCHAR> key(str::Format(L"%d", i));
+        ok = d.Get(key, &val);
+        assert(ok == (i % 3 != 0));
+        assert(!ok || val == i);
+    }
+    assert(d.Count() == 2 + 4096 - 1366);
+}
+
 void DictTest()
 {
     DictTestMapStrToInt();
+    DictTestMapWStrToInt();
 }
 
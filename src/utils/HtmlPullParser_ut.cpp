@@ -108,6 +108,68 @@ static void Test02()
     assert(t && t->IsText() && str::Eq(t->s, "Last paragraph"));
 }
 
+struct TokenInfo {
+    HtmlToken::TokenType type;
+    const char *s;
+    size_t sLen;
+};
+
+static void ParseAll(const char *s, size_t len, Vec<TokenInfo>& tokens)
+{
+    HtmlPullParser parser(s, len);
+    HtmlToken *t;
+    while ((t = parser.Next()) != NULL) {
+        TokenInfo info = { t->type, t->s, t->IsError() ? 0 : t->sLen };
+        tokens.Append(info);
+        if (t->IsError())
+            break;
+        if (!t->IsTag())
+            continue;
+        for (AttrInfo *a = t->NextAttr(); a; a = t->NextAttr()) {
+            TokenInfo attr = { HtmlToken::Text, a->val, a->valLen };
+            tokens.Append(attr);
+        }
+    }
+}
+
+// compares the results of the vectorized and the scalar scanning code
+// for random snippets made up of characters the parser looks out for
+static void Test03()
+{
+    const char chars[] = "<>/'\"=- \t\nap!";
+    char buf[256];
+    srand(1);
+    for (int i = 0; i < 2000; i++) {
+        size_t len = rand() % (dimof(buf) - 1);
+        for (size_t j = 0; j < len; j++) {
+            // mostly letters, so that there are long runs to scan
+            buf[j] = rand() % 4 ? 'a' + rand() % 26 : chars[rand() % (dimof(chars) - 1)];
+        }
+        buf[len] = '\0';
+
+        for (size_t j = 0; j <= len; j++) {
+            gUseSse2 = true;
+            const char *fast = FindChar(buf + j, buf + len, '<');
+            const char *fast3 = FindChar(buf + j, buf + len, '>', '\'', '"');
+            gUseSse2 = false;
+            assert(fast == FindChar(buf + j, buf + len, '<'));
+            assert(fast3 == FindChar(buf + j, buf + len, '>', '\'', '"'));
+        }
+
+        Vec<TokenInfo> fast, slow;
+        gUseSse2 = true;
+        ParseAll(buf, len, fast);
+        gUseSse2 = false;
+        ParseAll(buf, len, slow);
+        assert(fast.Count() == slow.Count());
+        for (size_t j = 0; j < fast.Count() && j < slow.Count(); j++) {
+            assert(fast.At(j).type == slow.At(j).type);
+            assert(fast.At(j).s == slow.At(j).s && fast.At(j).sLen == slow.At(j).sLen);
+        }
+    }
+    gUseSse2 = CanUseSse2();
+}
+
 }
 
 void HtmlPullParser_UnitTests()
@@ -120,4 +182,6 @@ void HtmlPullParser_UnitTests()
     unittests::HtmlEntities();
     unittests::Test01();
     unittests::Test02();
+    if (CanUseSse2())
+        unittests::Test03();
 }
@@ -23,10 +23,17 @@ static inline const char *SkipDigits(const char *s)
 class ParseArgs {
 public:
     str::Str<char> path;
+    // buffer for the current value (reused for all values)
+    str::Str<char> value;
     bool canceled;
     ValueVisitor *visitor;
 
-    ParseArgs(ValueVisitor *visitor) : canceled(false), visitor(visitor) { }
+    ParseArgs(ValueVisitor *visitor) : path(256), value(256), canceled(false), visitor(visitor) { }
+
+    void VisitValue(DataType type) {
+        canceled = !visitor->Visit(path.Get(), value.Get(), type);
+        value.RemoveAt(0, value.Size());
+    }
 };
 
 static const char *ParseValue(ParseArgs& args, const char *data);
@@ -70,10 +77,9 @@ static const char *ExtractString(str::Str<char>& string, const char *data)
 
 static const char *ParseString(ParseArgs& args, const char *data)
 {
-    str::Str<char> string;
-    data = ExtractString(string, data);
+    data = ExtractString(args.value, data);
     if (data)
-        args.canceled = !args.visitor->Visit(args.path.Get(), string.Get(), Type_String);
+        args.VisitValue(Type_String);
     return data;
 }
 
@@ -97,15 +103,14 @@ static const char *ParseNumber(ParseArgs& args, const char *data)
         data++;
         if ('+' == *data || '-' == *data)
             data++;
-        data = SkipDigits(data + 1);
+        data = SkipDigits(data);
     }
     // validity check
     if (!str::IsDigit(*(data - 1)) || str::IsDigit(*data))
         return NULL;
 
-    char *number = str::DupN(start, data - start);
-    args.canceled = !args.visitor->Visit(args.path.Get(), number, Type_Number);
-    free(number);
+    args.value.Append(start, data - start);
+    args.VisitValue(Type_Number);
     return data;
 }
 
@@ -150,7 +155,10 @@ static const char *ParseArray(ParseArgs& args, const char *data)
 
     size_t pathIdx = args.path.Size();
     for (int idx = 0; ; idx++) {
-        args.path.AppendFmt("[%d]", idx);
+        // note: AppendFmt would allocate a temporary string for every element
+        char buf[16];
+        _snprintf_s(buf, dimof(buf), _TRUNCATE, "[%d]", idx);
+        args.path.Append(buf);
         data = ParseValue(args, data);
         if (args.canceled || !data)
             return data;
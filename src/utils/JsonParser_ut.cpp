@@ -80,6 +80,23 @@ static void JsonTest()
     assert(json::Parse("{\"key\":[{\"name\":-987}]}",
         &JsonVerifier(&JsonValue("/key[0]/name", "-987", json::Type_Number))));
 
+    // values are extracted into a reused buffer
+    JsonValue reuseData[] = {
+        JsonValue("[0]", "long value"),
+        JsonValue("[1]", "12", json::Type_Number),
+        JsonValue("[2]", ""),
+        JsonValue("[3]", "true", json::Type_Bool),
+        JsonValue("[4]", "x"),
+        JsonValue("[5]", "x"),
+        JsonValue("[6]", "x"),
+        JsonValue("[7]", "x"),
+        JsonValue("[8]", "x"),
+        JsonValue("[9]", "x"),
+        JsonValue("[10]", "x"),
+    };
+    assert(json::Parse("[\"long value\", 12, \"\", true, \"x\", \"x\", \"x\", \"x\", \"x\", \"x\", \"x\"]",
+        &JsonVerifier(reuseData, dimof(reuseData))));
+
     JsonValue testData[] = {
         JsonValue("/ComicBookInfo/1.0/title", "Meta data demo"),
         JsonValue("/ComicBookInfo/1.0/publicationMonth", "4", json::Type_Number),
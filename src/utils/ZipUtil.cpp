@@ -4,7 +4,9 @@
 #include "BaseUtil.h"
 #include "ZipUtil.h"
 
+#include "Dict.h"
 #include "FileUtil.h"
+#include "ThreadUtil.h"
 
 // mini(un)zip
 #include <ioapi.h>
@@ -14,19 +16,26 @@
 
 ZipFile::ZipFile(const WCHAR *path, Allocator *allocator) :
     filenames(0, allocator), fileinfo(0, allocator), filepos(0, allocator),
-    allocator(allocator), commentLen(0)
+    allocator(allocator), commentLen(0), nameIndex(NULL),
+    path(str::Dup(path)), stream(NULL), hFile(INVALID_HANDLE_VALUE)
 {
     zlib_filefunc64_def ffunc;
     fill_win32_filefunc64(&ffunc);
     uf = unzOpen2_64(path, &ffunc);
-    if (uf)
+    if (uf) {
         ExtractFilenames();
+        hFile = CreateFile(path, GENERIC_READ, FILE_SHARE_READ, NULL,
+                           OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    }
 }
 
 ZipFile::ZipFile(IStream *stream, Allocator *allocator) :
     filenames(0, allocator), fileinfo(0, allocator), filepos(0, allocator),
-    allocator(allocator), commentLen(0)
+    allocator(allocator), commentLen(0), nameIndex(NULL),
+    path(NULL), stream(stream), hFile(INVALID_HANDLE_VALUE)
 {
+    if (stream)
+        stream->AddRef();
     zlib_filefunc64_def ffunc;
     fill_win32s_filefunc64(&ffunc);
     uf = unzOpen2_64(stream, &ffunc);
@@ -36,11 +45,35 @@ ZipFile::ZipFile(IStream *stream, Allocator *allocator) :
 
 ZipFile::~ZipFile()
 {
+    delete nameIndex;
+    free(path);
+    if (stream)
+        stream->Release();
+    if (hFile != INVALID_HANDLE_VALUE)
+        CloseHandle(hFile);
     if (!uf)
         return;
     unzClose(uf);
 }
 
+// opens the archive once more, so that files can be read concurrently
+unzFile ZipFile::OpenAnotherUnzFile()
+{
+    zlib_filefunc64_def ffunc;
+    if (path) {
+        fill_win32_filefunc64(&ffunc);
+        return unzOpen2_64(path, &ffunc);
+    }
+    // a cloned stream has its own seek pointer
+    IStream *clone;
+    if (!stream || FAILED(stream->Clone(&clone)))
+        return NULL;
+    fill_win32s_filefunc64(&ffunc);
+    unzFile uf2 = unzOpen2_64(clone, &ffunc);
+    clone->Release();
+    return uf2;
+}
+
 // cf. http://www.pkware.com/documents/casestudies/APPNOTE.TXT Appendix D
 #define CP_ZIP 437
 
@@ -57,6 +90,7 @@ void ZipFile::ExtractFilenames()
         return;
     unzGoToFirstFile(uf);
 
+    nameIndex = new dict::MapWStrToInt(max((size_t)ginfo.number_entry, (size_t)16));
     for (int i = 0; i < ginfo.number_entry && UNZ_OK == err; i++) {
         unz_file_info64 finfo;
         char fileName[MAX_PATH];
@@ -67,6 +101,9 @@ void ZipFile::ExtractFilenames()
             str::conv::FromCodePageBuf(fileNameT, dimof(fileNameT), fileName, cp);
             filenames.Append((WCHAR *)Allocator::Dup(allocator, fileNameT,
                 (str::Len(fileNameT) + 1) * sizeof(WCHAR)));
+            // for duplicate names, the first file wins (as for a linear search)
+            str::ToLower(fileNameT);
+            nameIndex->Insert(fileNameT, (int)filenames.Count() - 1, NULL);
             fileinfo.Append(finfo);
 
             unz64_file_pos fpos;
@@ -82,7 +119,14 @@ void ZipFile::ExtractFilenames()
 
 size_t ZipFile::GetFileIndex(const WCHAR *filename)
 {
-    return filenames.FindI(filename);
+    if (!nameIndex || !filename)
+        return (size_t)-1;
+    ScopedMem<WCHAR> key(str::Dup(filename));
+    str::ToLower(key);
+    int idx;
+    if (!nameIndex->Get(key, &idx))
+        return (size_t)-1;
+    return (size_t)idx;
 }
 
 size_t ZipFile::GetFileCount() const
@@ -110,6 +154,71 @@ char *ZipFile::GetFileData(size_t fileindex, size_t *len)
     if (fileindex >= filenames.Count())
         return NULL;
 
+    size_t len2 = (size_t)fileinfo.At(fileindex).uncompressed_size;
+    // overflow check
+    if (len2 != fileinfo.At(fileindex).uncompressed_size ||
+        len2 + sizeof(WCHAR) < sizeof(WCHAR)) {
+        return NULL;
+    }
+
+    char *result = (char *)Allocator::Alloc(allocator, len2 + sizeof(WCHAR));
+    if (!result)
+        return NULL;
+    if (!ReadFileData(fileindex, result, len2)) {
+        Allocator::Free(allocator, result);
+        return NULL;
+    }
+    // zero-terminate for convenience
+    result[len2] = result[len2 + 1] = '\0';
+    if (len)
+        *len = len2;
+    return result;
+}
+
+size_t ZipFile::GetFileSize(size_t fileindex)
+{
+    if (fileindex >= fileinfo.Count())
+        return 0;
+    size_t len = (size_t)fileinfo.At(fileindex).uncompressed_size;
+    if (len != fileinfo.At(fileindex).uncompressed_size)
+        return 0;
+    return len;
+}
+
+bool ZipFile::ReadFileData(size_t fileindex, char *buf, size_t len)
+{
+    return ReadFileData(uf, fileindex, buf, len);
+}
+
+// reads uncompressed files straight into the buffer (instead of through
+// unzip's read buffer) and only uses unzip for locating the data
+bool ZipFile::ReadStoredFileData(unzFile uf, size_t fileindex, char *buf, size_t len)
+{
+    ZPOS64_T offset = unzGetCurrentFileZStreamPos64(uf);
+    if (0 == offset)
+        return false;
+    size_t readTotal = 0;
+    while (readTotal < len) {
+        DWORD toRead = (DWORD)min(len - readTotal, 1 << 30);
+        // an explicit offset allows concurrent reads through the same handle
+        OVERLAPPED ov = { 0 };
+        ov.Offset = (DWORD)(offset + readTotal);
+        ov.OffsetHigh = (DWORD)((offset + readTotal) >> 32);
+        DWORD read;
+        if (!ReadFile(hFile, buf + readTotal, toRead, &read, &ov) || 0 == read)
+            return false;
+        readTotal += read;
+    }
+    return crc32(crc32(0, NULL, 0), (const Bytef *)buf, (uInt)len) == fileinfo.At(fileindex).crc;
+}
+
+bool ZipFile::ReadFileData(unzFile uf, size_t fileindex, char *buf, size_t len)
+{
+    if (!uf)
+        return false;
+    if (fileindex >= filenames.Count() || len != GetFileSize(fileindex))
+        return false;
+
     int err = -1;
     if (filepos.At(fileindex).num_of_file != INVALID_ZIP_FILE_POS)
         err = unzGoToFilePos64(uf, &filepos.At(fileindex));
@@ -120,41 +229,127 @@ char *ZipFile::GetFileData(size_t fileindex, size_t *len)
         err = unzLocateFile(uf, fileNameA, 0);
     }
     if (err != UNZ_OK)
-        return NULL;
+        return false;
     err = unzOpenCurrentFilePassword(uf, NULL);
     if (err != UNZ_OK)
-        return NULL;
+        return false;
 
-    size_t len2 = (size_t)fileinfo.At(fileindex).uncompressed_size;
-    // overflow check
-    if (len2 != fileinfo.At(fileindex).uncompressed_size ||
-        len2 + sizeof(WCHAR) < sizeof(WCHAR)) {
+    unz_file_info64 *finfo = &fileinfo.At(fileindex);
+    if (0 == finfo->compression_method && !(finfo->flag & 1) &&
+        hFile != INVALID_HANDLE_VALUE && len == (uInt)len) {
+        bool ok = ReadStoredFileData(uf, fileindex, buf, len);
+        // no data has been read through unzip, so this doesn't check the CRC
         unzCloseCurrentFile(uf);
-        return NULL;
+        return ok;
     }
 
-    char *result = (char *)Allocator::Alloc(allocator, len2 + sizeof(WCHAR));
-    if (result) {
-        unsigned int readBytes = unzReadCurrentFile(uf, result, (unsigned int)len2);
-        // zero-terminate for convenience
-        result[len2] = result[len2 + 1] = '\0';
-        if (readBytes != len2) {
-            Allocator::Free(allocator, result);
-            result = NULL;
-        }
-        else if (len) {
-            *len = len2;
-        }
-    }
+    int readBytes = unzReadCurrentFile(uf, buf, (unsigned int)len);
+    bool ok = (size_t)readBytes == len;
 
     err = unzCloseCurrentFile(uf);
     if (err != UNZ_OK) {
         // CRC mismatch, file content is likely damaged
-        Allocator::Free(allocator, result);
-        result = NULL;
+        ok = false;
     }
 
-    return result;
+    return ok;
+}
+
+struct ZipReadBatch {
+    const size_t *  fileindices;
+    size_t          count;
+    char **         data;
+    size_t *        lens;
+    bool *          ok;
+    LONG            next;
+};
+
+// called concurrently by the calling thread and all ZipReadThreads
+// (each with its own unzFile, as they're not thread-safe)
+void ZipFile::ReadBatch(unzFile uf, ZipReadBatch *batch)
+{
+    for (;;) {
+        LONG i = InterlockedIncrement(&batch->next) - 1;
+        if (i >= (LONG)batch->count)
+            return;
+        if (batch->data[i])
+            batch->ok[i] = ReadFileData(uf, batch->fileindices[i], batch->data[i], batch->lens[i]);
+    }
+}
+
+class ZipReadThread : public ThreadBase {
+    ZipFile *       zip;
+    ZipReadBatch *  batch;
+
+public:
+    ZipReadThread(ZipFile *zip, ZipReadBatch *batch) :
+        ThreadBase("ZipReadThread"), zip(zip), batch(batch) { }
+
+    virtual void Run() {
+        // if the archive can't be opened again, the other threads read all files
+        unzFile uf = zip->OpenAnotherUnzFile();
+        if (!uf)
+            return;
+        zip->ReadBatch(uf, batch);
+        unzClose(uf);
+    }
+};
+
+void ZipFile::GetFilesData(const size_t *fileindices, size_t count, char **data, size_t *lens, int threadCount)
+{
+    // allocate all buffers upfront, as the allocator isn't necessarily thread-safe
+    for (size_t i = 0; i < count; i++) {
+        data[i] = NULL;
+        lens[i] = GetFileSize(fileindices[i]);
+        if (!uf || fileindices[i] >= filenames.Count() || lens[i] + sizeof(WCHAR) < sizeof(WCHAR))
+            continue;
+        if (0 == lens[i] && fileinfo.At(fileindices[i]).uncompressed_size != 0)
+            continue;
+        data[i] = (char *)Allocator::Alloc(allocator, lens[i] + sizeof(WCHAR));
+    }
+
+    ScopedMem<bool> ok(AllocArray<bool>(count));
+    if (!ok) {
+        for (size_t i = 0; i < count; i++) {
+            Allocator::Free(allocator, data[i]);
+            data[i] = NULL;
+        }
+        return;
+    }
+    ZipReadBatch batch = { fileindices, count, data, lens, ok, 0 };
+
+    if (threadCount <= 0) {
+        SYSTEM_INFO si;
+        GetSystemInfo(&si);
+        threadCount = (int)si.dwNumberOfProcessors;
+    }
+    if ((size_t)threadCount > count)
+        threadCount = (int)count;
+    Vec<ZipReadThread *> threads;
+    for (int i = 1; i < threadCount; i++) {
+        ZipReadThread *thread = new ZipReadThread(this, &batch);
+        threads.Append(thread);
+        thread->Start();
+    }
+    // the calling thread reads as well (through the main unzFile)
+    ReadBatch(uf, &batch);
+    for (size_t i = 0; i < threads.Count(); i++) {
+        // Run() doesn't check for cancellation, so this waits for it to finish
+        threads.At(i)->RequestCancelAndWaitToStop();
+        threads.At(i)->Release();
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        if (!data[i])
+            continue;
+        if (!ok[i]) {
+            Allocator::Free(allocator, data[i]);
+            data[i] = NULL;
+            continue;
+        }
+        // zero-terminate for convenience
+        data[i][lens[i]] = data[i][lens[i] + 1] = '\0';
+    }
 }
 
 FILETIME ZipFile::GetFileTime(const WCHAR *filename)
@@ -6,6 +6,12 @@
 
 #include <unzip.h>
 
+namespace dict {
+class MapWStrToInt;
+}
+
+struct ZipReadBatch;
+
 class ZipFile {
     unzFile uf;
     Allocator *allocator;
@@ -13,6 +19,13 @@ class ZipFile {
     Vec<unz_file_info64> fileinfo;
     Vec<unz64_file_pos> filepos;
     uLong commentLen;
+    // maps lower-cased file names to file indices
+    dict::MapWStrToInt *nameIndex;
+    // for opening the archive once per reading thread
+    WCHAR *path;
+    IStream *stream;
+    // for reading stored files directly (only if opened from a path)
+    HANDLE hFile;
 
 public:
     ZipFile(const WCHAR *path, Allocator *allocator=NULL);
@@ -28,6 +41,14 @@ public:
     // caller must free() the result (or rather Allocator::Free it)
     char *GetFileData(const WCHAR *filename, size_t *len=NULL);
     char *GetFileData(size_t fileindex, size_t *len=NULL);
+    // size of the uncompressed data (0 for invalid indices)
+    size_t GetFileSize(size_t fileindex);
+    // reads exactly GetFileSize(fileindex) bytes into a buffer of that size
+    bool ReadFileData(size_t fileindex, char *buf, size_t len);
+    // reads several files at once on up to threadCount threads (0 for as
+    // many threads as there are processors). data[i] and lens[i] are set
+    // the same way GetFileData(fileindices[i], &lens[i]) would set them
+    void GetFilesData(const size_t *fileindices, size_t count, char **data, size_t *lens, int threadCount=0);
 
     FILETIME GetFileTime(const WCHAR *filename);
     FILETIME GetFileTime(size_t fileindex);
@@ -39,6 +60,12 @@ public:
 
 protected:
     void ExtractFilenames();
+    unzFile OpenAnotherUnzFile();
+    bool ReadFileData(unzFile uf, size_t fileindex, char *buf, size_t len);
+    bool ReadStoredFileData(unzFile uf, size_t fileindex, char *buf, size_t len);
+    void ReadBatch(unzFile uf, ZipReadBatch *batch);
+
+    friend class ZipReadThread;
 };
 
 class ZipCreatorData;